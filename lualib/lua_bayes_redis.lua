@@ -24,7 +24,7 @@ local ucl = require "ucl"
 
 local N = "bayes"
 
-local function gen_classify_functor(redis_params, classify_script_id)
+local function gen_classify_functor(redis_params, classify_script_id, batch_size)
   return function(task, expanded_key, id, is_spam, stat_tokens, callback)
 
     local function classify_redis_cb(err, data)
@@ -36,9 +36,59 @@ local function gen_classify_functor(redis_params, classify_script_id)
       end
     end
 
-    lua_redis.exec_redis_script(classify_script_id,
-        { task = task, is_write = false, key = expanded_key },
-        classify_redis_cb, { expanded_key, stat_tokens })
+    if type(stat_tokens) ~= 'table' then
+      lua_redis.exec_redis_script(classify_script_id,
+          { task = task, is_write = false, key = expanded_key },
+          classify_redis_cb, { expanded_key, stat_tokens })
+      return
+    end
+
+    -- Tokens are split into batches: send them all at once without a key,
+    -- so read servers are selected in round-robin, and merge results.
+    -- Token indexes in replies are local to a batch.
+    local pending = #stat_tokens
+    local failed = false
+    local learned_ham, learned_spam = 0, 0
+    local output_ham, output_spam = {}, {}
+
+    local function merge_output(output, reply, offset)
+      for i = 1, #reply, 2 do
+        output[#output + 1] = reply[i] + offset
+        output[#output + 1] = reply[i + 1]
+      end
+    end
+
+    local function gen_batch_cb(offset)
+      return function(err, data)
+        lua_util.debugm(N, task, 'classify batch redis cb (offset %s): %s', offset, err)
+        if failed then
+          return
+        end
+        if err then
+          failed = true
+          callback(task, false, err)
+          return
+        end
+
+        -- Learns counters are the same for all batches unless replicas lag
+        learned_ham = math.max(learned_ham, data[1])
+        learned_spam = math.max(learned_spam, data[2])
+        merge_output(output_ham, data[3], offset)
+        merge_output(output_spam, data[4], offset)
+        pending = pending - 1
+
+        if pending == 0 then
+          callback(task, true, learned_ham, learned_spam, output_ham, output_spam)
+        end
+      end
+    end
+
+    -- All batches but the last one have exactly `batch_size` tokens
+    for i, batch in ipairs(stat_tokens) do
+      lua_redis.exec_redis_script(classify_script_id,
+          { task = task, is_write = false },
+          gen_batch_cb((i - 1) * batch_size), { expanded_key, batch })
+    end
   end
 end
 
@@ -172,7 +222,8 @@ exports.lua_bayes_init_statfile = function(classifier_ucl, statfile_ucl, symbol,
     end)
   end
 
-  return gen_classify_functor(redis_params, classify_script_id), gen_learn_functor(redis_params, learn_script_id)
+  return gen_classify_functor(redis_params, classify_script_id, classifier_ucl.token_batch or 0),
+  gen_learn_functor(redis_params, learn_script_id)
 end
 
 local function gen_cache_check_functor(redis_params, check_script_id, conf)
@@ -70,7 +70,7 @@ local function init()
   end
 end
 
-exports.maybe_process_mime_part = function(part, task)
+local function find_module(part)
   if not modules_by_mime_type then
     init()
   end
@@ -88,6 +88,17 @@ exports.maybe_process_mime_part = function(part, task)
     end
   end
 
+  return pair, mt
+end
+
+-- Returns true if the content of a part is going to be processed
+exports.has_content_module = function(part)
+  return find_module(part) ~= nil
+end
+
+exports.maybe_process_mime_part = function(part, task)
+  local pair, mt = find_module(part)
+
   if pair then
     lua_util.debugm(N, task, "found known content of type %s: %s",
         mt, pair[1])
@@ -399,7 +399,7 @@ exports.mime_part_heuristic = function(part, log_obj, _)
   return nil
 end
 
-exports.text_part_heuristic = function(part, log_obj, _)
+exports.text_part_heuristic = function(part, log_obj, prefix)
   -- We get some span of data and check it
   local function is_span_text(span)
     -- We examine 8 bit content, and we assume it might be localized text
@@ -481,7 +481,7 @@ exports.text_part_heuristic = function(part, log_obj, _)
     end
   end
 
-  local content = part:get_content()
+  local content = prefix or part:get_content()
   local mtype, msubtype = part:get_type()
   local clen = #content
   local is_text
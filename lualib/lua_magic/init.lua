@@ -292,11 +292,13 @@ local function process_detected(res)
   return nil
 end
 
-exports.detect = function(part, log_obj)
+-- If `prefix` is specified, it is used instead of the whole part content
+-- (e.g. when the part is too large to be decoded)
+exports.detect = function(part, log_obj, prefix)
   if not log_obj then
     log_obj = rspamd_config
   end
-  local input = part:get_content()
+  local input = prefix or part:get_content()
 
   local res = {}
 
@@ -308,8 +310,8 @@ exports.detect = function(part, log_obj)
   if type(input) == 'userdata' then
     local inplen = #input
 
-    -- Check tail matches
-    if inplen > min_tail_offset then
+    -- Check tail matches, a prefix has no tail
+    if not prefix and inplen > min_tail_offset then
       local tail = input:span(inplen - min_tail_offset, min_tail_offset)
       match_chunk(tail, input, inplen, inplen - min_tail_offset,
           compiled_tail_patterns, tail_patterns, log_obj, res, part)
@@ -329,7 +331,11 @@ exports.detect = function(part, log_obj)
     end
 
     -- No way, let's check data in chunks or just the whole input if it is small enough
-    if #input > exports.chunk_size * 3 then
+    if prefix then
+      -- Match the first chunks only
+      match_chunk(input:span(1, math.min(exports.chunk_size * 2, inplen)), input, inplen,
+          0, compiled_patterns, processed_patterns, log_obj, res, part)
+    elseif #input > exports.chunk_size * 3 then
       -- Chunked version as input is too long
       local chunk1, chunk2 = input:span(1, exports.chunk_size * 2),
       input:span(inplen - exports.chunk_size, exports.chunk_size)
@@ -359,21 +365,21 @@ exports.detect = function(part, log_obj)
   return nil
 end
 
-exports.detect_mime_part = function(part, log_obj)
+exports.detect_mime_part = function(part, log_obj, prefix)
   local ext, weight = heuristics.mime_part_heuristic(part, log_obj)
 
   if ext and weight and weight > 20 then
     return ext, types[ext]
   end
 
-  ext = exports.detect(part, log_obj)
+  ext = exports.detect(part, log_obj, prefix)
 
   if ext then
     return ext, types[ext]
   end
 
   -- Text/html and other parts
-  ext, weight = heuristics.text_part_heuristic(part, log_obj)
+  ext, weight = heuristics.text_part_heuristic(part, log_obj, prefix)
   if ext and weight and weight > 20 then
     return ext, types[ext]
   end
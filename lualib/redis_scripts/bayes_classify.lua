@@ -10,12 +10,14 @@ local output_ham = {}
 local learned_ham = tonumber(redis.call('HGET', prefix, 'learns_ham')) or 0
 local learned_spam = tonumber(redis.call('HGET', prefix, 'learns_spam')) or 0
 
--- Output is a set of pairs (token_index, token_count), tokens that are not
+-- Output is a flat array of (token_index, token_count) pairs, tokens that are not
 -- found are not filled.
 -- This optimisation will save a lot of space for sparse tokens, and in Bayes that assumption is normally held
+-- Flat arrays are used to avoid creating a nested reply for each token found
 
 if learned_ham > 0 and learned_spam > 0 then
   local input_tokens = cmsgpack.unpack(KEYS[2])
+  local nham, nspam = 0, 0
   for i, token in ipairs(input_tokens) do
     local token_data = redis.call('HMGET', token, 'H', 'S')
 
@@ -24,11 +26,15 @@ if learned_ham > 0 and learned_spam > 0 then
       local spam_count = token_data[2]
 
       if ham_count then
-        table.insert(output_ham, { i, tonumber(ham_count) })
+        output_ham[nham + 1] = i
+        output_ham[nham + 2] = tonumber(ham_count)
+        nham = nham + 2
       end
 
       if spam_count then
-        table.insert(output_spam, { i, tonumber(spam_count) })
+        output_spam[nspam + 1] = i
+        output_spam[nspam + 2] = tonumber(spam_count)
+        nspam = nspam + 2
       end
     end
   end
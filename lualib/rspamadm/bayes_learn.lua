@@ -0,0 +1,476 @@
+--[[
+Copyright (c) 2024, Vsevolod Stakhov <vsevolod@rspamd.com>
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+]]--
+
+-- Offline bulk learning of Redis Bayes classifiers from mbox files and
+-- maildirs: tokens of many messages are merged in memory and written as
+-- a single increment per token instead of a script call per message
+
+local lua_redis = require "lua_redis"
+local rspamd_logger = require "rspamd_logger"
+local rspamd_task = require "rspamd_task"
+local rspamd_util = require "rspamd_util"
+local argparse = require "argparse"
+
+local N = "bayes_learn"
+local E = {}
+local classifiers = {}
+
+local parser = argparse()
+    :name "rspamadm bayes_learn"
+    :description "Learn Redis Bayes classifiers from mbox files or maildirs"
+    :help_description_margin(30)
+
+parser:option "-c --config"
+      :description "Path to config file"
+      :argname("<cfg>")
+      :default(rspamd_paths["CONFDIR"] .. "/" .. "rspamd.conf")
+parser:option "-S --spam"
+      :description "Spam mbox file or maildir"
+      :argname("<path>")
+      :count "*"
+parser:option "-H --ham"
+      :description "Ham mbox file or maildir"
+      :argname("<path>")
+      :count "*"
+parser:option "-b --batch-size"
+      :description "Number of distinct tokens to keep in memory before writing them"
+      :argname("<elts>")
+      :convert(tonumber)
+      :default(100000)
+parser:flag "-n --no-operation"
+      :description "Only tokenize messages and show statistics"
+
+local function load_config(opts)
+  local _r, err = rspamd_config:load_ucl(opts['config'])
+
+  if not _r then
+    rspamd_logger.errx('cannot parse %s: %s', opts['config'], err)
+    os.exit(1)
+  end
+
+  _r, err = rspamd_config:parse_rcl({ 'logging', 'worker' })
+  if not _r then
+    rspamd_logger.errx('cannot process %s: %s', opts['config'], err)
+    os.exit(1)
+  end
+end
+
+-- Expands statfile prefix in the same way as the Redis backend does for
+-- the non per-user classifiers, prefixes with recipients or users are
+-- rejected
+local function expand_prefix(pattern, label)
+  local per_user = false
+  local expanded = pattern:gsub('%%(.?)(d?)', function(c, mod)
+    if c == 'r' or c == 'u' then
+      per_user = true
+      return ''
+    elseif c == 's' then
+      return 'RS'
+    elseif c == 'l' then
+      return label or ''
+    end
+    -- `%%` and unknown modifiers produce the character itself
+    return c .. mod
+  end)
+
+  if per_user then
+    return nil
+  end
+
+  return expanded
+end
+
+local function check_redis_classifier(cls, cfg)
+  if cls.per_user or cls.users_enabled then
+    rspamd_logger.errx('per-user classifiers are not supported, skip classifier')
+    return
+  end
+
+  local cl = {
+    min_tokens = cls.min_tokens or 0,
+    max_tokens = cls.max_tokens or 0,
+  }
+
+  local function check_statfile_table(tbl, def_sym)
+    local symbol = tbl.symbol or def_sym
+    local spam
+
+    if tbl.spam ~= nil then
+      spam = tbl.spam
+    else
+      spam = string.match(symbol:upper(), 'SPAM') ~= nil
+    end
+
+    local prefix = expand_prefix(cls.prefix or '%s%l', tbl.label)
+
+    if not prefix then
+      rspamd_logger.errx('prefix %s of %s depends on recipients or users, skip it',
+          cls.prefix, symbol)
+      return
+    end
+
+    if spam then
+      cl.spam = { symbol = symbol, prefix = prefix }
+    else
+      cl.ham = { symbol = symbol, prefix = prefix }
+    end
+  end
+
+  local statfiles = cls.statfile or E
+  if statfiles[1] then
+    for _, stf in ipairs(statfiles) do
+      if not stf.symbol then
+        for k, v in pairs(stf) do
+          check_statfile_table(v, k)
+        end
+      else
+        check_statfile_table(stf, 'undefined')
+      end
+    end
+  else
+    for stn, stf in pairs(statfiles) do
+      check_statfile_table(stf, stn)
+    end
+  end
+
+  if not cl.spam or not cl.ham then
+    rspamd_logger.errx('classifier must have both spam and ham statfiles, skip it')
+    return
+  end
+
+  cl.redis_params = lua_redis.try_load_redis_servers(cls, rspamd_config, false, 'bayes')
+  if not cl.redis_params then
+    cl.redis_params = lua_redis.try_load_redis_servers(cfg.redis or E, rspamd_config, true)
+  end
+
+  if not cl.redis_params then
+    rspamd_logger.errx('cannot load Redis parameters for the classifier')
+    return
+  end
+
+  table.insert(classifiers, cl)
+end
+
+-- Accumulated deltas: classifier index -> statfile -> { learns, tokens = { token -> count } }
+local pending = {}
+local pending_tokens = 0
+local stats = {
+  messages = 0,
+  skipped = 0,
+  tokens = 0,
+  writes = 0,
+}
+
+local function flush_class(cl, class_data, st, opts)
+  local nlearns = class_data.learns
+  local hash_key = st == cl.spam and 'S' or 'H'
+  local learned_key = st == cl.spam and 'learns_spam' or 'learns_ham'
+
+  if nlearns == 0 then
+    return
+  end
+
+  if opts.no_operation then
+    for _ in pairs(class_data.tokens) do
+      stats.writes = stats.writes + 1
+    end
+    return
+  end
+
+  -- Use the same server as the backend does for the statfile prefix
+  local res, conn = lua_redis.redis_connect_sync(cl.redis_params, true, st.prefix)
+
+  if not res then
+    rspamd_logger.errx('cannot connect to redis server: %s', cl.redis_params)
+    os.exit(1)
+  end
+
+  local ncmds = 0
+  local function exec_cmds()
+    local results = { conn:exec() }
+
+    for i = 1, #results, 2 do
+      if not results[i] then
+        rspamd_logger.errx('cannot learn %s: %s', st.prefix, results[i + 1])
+        os.exit(1)
+      end
+    end
+
+    ncmds = 0
+  end
+
+  local function add_cmd(cmd, args)
+    local is_ok, err = conn:add_cmd(cmd, args)
+
+    if not is_ok then
+      rspamd_logger.errx('cannot add command: %s with args: %s: %s', cmd, args, err)
+      os.exit(1)
+    end
+
+    ncmds = ncmds + 1
+
+    if ncmds >= opts.batch_size then
+      exec_cmds()
+    end
+  end
+
+  add_cmd('SADD', { st.symbol .. '_keys', st.prefix })
+  add_cmd('HSET', { st.prefix, 'version', '2' })
+
+  for tok, cnt in pairs(class_data.tokens) do
+    add_cmd('HINCRBY', { st.prefix .. '_' .. tok, hash_key, tostring(cnt) })
+    stats.writes = stats.writes + 1
+  end
+
+  -- Learns are counted only when all tokens have been written
+  add_cmd('HINCRBY', { st.prefix, learned_key, tostring(nlearns) })
+
+  if ncmds > 0 then
+    exec_cmds()
+  end
+end
+
+local function flush_pending(opts)
+  for i, cl in ipairs(classifiers) do
+    local cl_pending = pending[i]
+
+    if cl_pending then
+      for _, st in ipairs({ cl.spam, cl.ham }) do
+        if cl_pending[st] then
+          flush_class(cl, cl_pending[st], st, opts)
+        end
+      end
+    end
+  end
+
+  pending = {}
+  pending_tokens = 0
+end
+
+local function learn_message(content, is_spam, opts)
+  local res, task = rspamd_task.load_from_string(content, rspamd_config)
+
+  if not res then
+    stats.skipped = stats.skipped + 1
+    return
+  end
+
+  if not task:process_message() then
+    stats.skipped = stats.skipped + 1
+    task:destroy()
+    return
+  end
+
+  local tokens = task:get_stat_tokens() or E
+  local ntokens = #tokens
+
+  for i, cl in ipairs(classifiers) do
+    if (cl.min_tokens == 0 or ntokens >= cl.min_tokens) and
+        (cl.max_tokens == 0 or ntokens <= cl.max_tokens) then
+      local st = is_spam and cl.spam or cl.ham
+      local cl_pending = pending[i]
+
+      if not cl_pending then
+        cl_pending = {}
+        pending[i] = cl_pending
+      end
+
+      local class_data = cl_pending[st]
+
+      if not class_data then
+        class_data = { learns = 0, tokens = {} }
+        cl_pending[st] = class_data
+      end
+
+      class_data.learns = class_data.learns + 1
+
+      local acc = class_data.tokens
+      for _, tok in ipairs(tokens) do
+        local data = tok.data
+        local cur = acc[data]
+
+        if cur then
+          acc[data] = cur + 1
+        else
+          acc[data] = 1
+          pending_tokens = pending_tokens + 1
+        end
+      end
+    end
+  end
+
+  stats.messages = stats.messages + 1
+  stats.tokens = stats.tokens + ntokens
+  task:destroy() -- No automatic dtor
+
+  if pending_tokens >= opts.batch_size then
+    flush_pending(opts)
+  end
+end
+
+local function learn_mbox(fname, is_spam, opts)
+  local fd = io.open(fname, 'r')
+
+  if not fd then
+    rspamd_logger.errx('cannot open %s', fname)
+    return
+  end
+
+  local lines = {}
+  local prev_empty = true
+
+  for line in fd:lines() do
+    if prev_empty and line:sub(1, 5) == 'From ' then
+      if #lines > 0 then
+        learn_message(table.concat(lines, '\n'), is_spam, opts)
+        lines = {}
+      end
+    else
+      -- Unescape mboxrd `>From ` lines
+      if line:match('^>+From ') then
+        line = line:sub(2)
+      end
+      table.insert(lines, line)
+    end
+
+    prev_empty = (#line == 0)
+  end
+
+  if #lines > 0 then
+    learn_message(table.concat(lines, '\n'), is_spam, opts)
+  end
+
+  fd:close()
+end
+
+local function learn_file(fname, is_spam, opts)
+  local fd = io.open(fname, 'rb')
+
+  if not fd then
+    rspamd_logger.errx('cannot open %s', fname)
+    return
+  end
+
+  local content = fd:read('*a')
+  fd:close()
+
+  if content and #content > 0 then
+    learn_message(content, is_spam, opts)
+  end
+end
+
+local function learn_path(path, is_spam, opts)
+  local err, st = rspamd_util.stat(path)
+
+  if err then
+    rspamd_logger.errx('cannot stat %s: %s', path, err)
+    return
+  end
+
+  if st.type == 'directory' then
+    local files = {}
+
+    -- Maildir has messages in cur and new, otherwise take all files
+    for _, sub in ipairs({ '/cur/*', '/new/*' }) do
+      for _, f in ipairs(rspamd_util.glob(path .. sub)) do
+        table.insert(files, f)
+      end
+    end
+
+    if #files == 0 then
+      files = rspamd_util.glob(path .. '/*')
+    end
+
+    for _, f in ipairs(files) do
+      local ferr, fst = rspamd_util.stat(f)
+
+      if not ferr and fst.type == 'regular' then
+        learn_file(f, is_spam, opts)
+      end
+    end
+  else
+    learn_mbox(path, is_spam, opts)
+  end
+end
+
+local function handler(args)
+  local opts = parser:parse(args)
+  opts.spam = opts.spam or {}
+  opts.ham = opts.ham or {}
+
+  if #opts.spam == 0 and #opts.ham == 0 then
+    parser:error('no spam or ham sources specified')
+  end
+
+  load_config(opts)
+  rspamd_config:init_subsystem('stat')
+
+  local obj = rspamd_config:get_ucl()
+  local classifier = obj.classifier
+
+  if classifier then
+    if classifier[1] then
+      for _, cls in ipairs(classifier) do
+        if cls.bayes then
+          cls = cls.bayes
+        end
+        if cls.backend and cls.backend == 'redis' then
+          check_redis_classifier(cls, obj)
+        end
+      end
+    else
+      if classifier.bayes then
+        classifier = classifier.bayes
+        if classifier[1] then
+          for _, cls in ipairs(classifier) do
+            if cls.backend and cls.backend == 'redis' then
+              check_redis_classifier(cls, obj)
+            end
+          end
+        else
+          if classifier.backend and classifier.backend == 'redis' then
+            check_redis_classifier(classifier, obj)
+          end
+        end
+      end
+    end
+  end
+
+  if #classifiers == 0 then
+    rspamd_logger.errx('no suitable Redis Bayes classifiers found')
+    os.exit(1)
+  end
+
+  for _, path in ipairs(opts.spam) do
+    learn_path(path, true, opts)
+  end
+
+  for _, path in ipairs(opts.ham) do
+    learn_path(path, false, opts)
+  end
+
+  flush_pending(opts)
+
+  rspamd_logger.messagex('%s: learned %s messages (%s skipped), %s tokens, %s token writes',
+      N, stats.messages, stats.skipped, stats.tokens, stats.writes)
+end
+
+return {
+  name = 'bayes_learn',
+  aliases = { 'bulk_learn' },
+  handler = handler,
+  description = parser._description
+}
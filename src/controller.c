@@ -67,6 +67,8 @@
 #define PATH_NEIGHBOURS "/neighbours"
 #define PATH_PLUGINS "/plugins"
 #define PATH_PING "/ping"
+#define PATH_TRACE "/trace"
+#define PATH_MEMPOOL "/mempool"
 
 #define msg_err_session(...) rspamd_default_log_function(G_LOG_LEVEL_CRITICAL,                               \
 														 session->pool->tag.tagname, session->pool->tag.uid, \
@@ -1723,6 +1725,56 @@ rspamd_controller_handle_errors(struct rspamd_http_connection_entry *conn_ent,
 	return 0;
 }
 
+static void
+rspamd_controller_mempool_ucl_cb(const struct rspamd_mempool_accounting_stat *st,
+								 gpointer ud)
+{
+	ucl_object_t *top = (ucl_object_t *) ud, *obj;
+
+	obj = ucl_object_typed_new(UCL_OBJECT);
+	ucl_object_insert_key(obj,
+						  ucl_object_fromstring(rspamd_mempool_accounting_type_str(st->type)),
+						  "type", 0, false);
+	ucl_object_insert_key(obj, ucl_object_fromstring(st->name), "name", 0, false);
+	ucl_object_insert_key(obj, ucl_object_fromint(st->count), "count", 0, false);
+	ucl_object_insert_key(obj, ucl_object_fromint(st->bytes), "bytes", 0, false);
+	ucl_object_insert_key(obj,
+						  ucl_object_fromint(st->count > 0 ? st->bytes / st->count : 0),
+						  "avg", 0, false);
+	ucl_object_insert_key(obj, ucl_object_fromint(st->p50), "p50", 0, false);
+	ucl_object_insert_key(obj, ucl_object_fromint(st->p99), "p99", 0, false);
+	ucl_array_append(top, obj);
+}
+
+/*
+ * Mempool command handler:
+ * request: /mempool
+ * headers: Password
+ * reply: json [
+ *      { type: pool, name: "task.c:75", count: 100, bytes: 1000500, avg: 10005, p50: 8192, p99: 65536 },
+ *      { type: stage, name: filters, ... },
+ *      {...}
+ * ]
+ */
+static int
+rspamd_controller_handle_mempool(struct rspamd_http_connection_entry *conn_ent,
+								 struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	ucl_object_t *top;
+
+	if (!rspamd_controller_check_password(conn_ent, session, msg, FALSE)) {
+		return 0;
+	}
+
+	top = ucl_object_typed_new(UCL_ARRAY);
+	rspamd_mempool_accounting_foreach(rspamd_controller_mempool_ucl_cb, top);
+	rspamd_controller_send_ucl(conn_ent, top);
+	ucl_object_unref(top);
+
+	return 0;
+}
+
 /*
  * Neighbours command handler:
  * request: /neighbours
@@ -2017,10 +2069,46 @@ rspamd_controller_scan_reply(struct rspamd_task *task)
 	conn_ent->is_reply = TRUE;
 }
 
+static void
+rspamd_controller_trace_reply(struct rspamd_task *task)
+{
+	struct rspamd_http_message *msg;
+	struct rspamd_http_connection_entry *conn_ent;
+	enum rspamd_symcache_trace_format fmt = RSPAMD_SYMCACHE_TRACE_CHROME;
+	rspamd_ftok_t *hdr;
+	GString *trace;
+
+	conn_ent = task->fin_arg;
+	hdr = rspamd_task_get_request_header(task, "Format");
+
+	if (hdr && rspamd_ftok_cstr_equal(hdr, "folded", TRUE)) {
+		fmt = RSPAMD_SYMCACHE_TRACE_FOLDED;
+	}
+
+	trace = rspamd_symcache_trace_export(task, fmt);
+
+	if (trace == NULL) {
+		rspamd_controller_send_error(conn_ent, 500, "Trace is not available");
+		return;
+	}
+
+	msg = rspamd_http_new_message(HTTP_RESPONSE);
+	msg->date = time(NULL);
+	msg->code = 200;
+	rspamd_http_message_set_body(msg, trace->str, trace->len);
+	g_string_free(trace, TRUE);
+	rspamd_http_connection_reset(conn_ent->conn);
+	rspamd_http_router_insert_headers(conn_ent->rt, msg);
+	rspamd_http_connection_write_message(conn_ent->conn, msg, NULL,
+										 fmt == RSPAMD_SYMCACHE_TRACE_FOLDED ? "text/plain" : "application/json",
+										 conn_ent, conn_ent->rt->timeout);
+	conn_ent->is_reply = TRUE;
+}
+
 static gboolean
-rspamd_controller_check_fin_task(void *ud)
+rspamd_controller_check_fin_task_common(struct rspamd_task *task,
+										void (*reply_func)(struct rspamd_task *))
 {
-	struct rspamd_task *task = ud;
 	struct rspamd_http_connection_entry *conn_ent;
 
 	msg_debug_task("finish task");
@@ -2035,17 +2123,17 @@ rspamd_controller_check_fin_task(void *ud)
 	}
 
 	if (RSPAMD_TASK_IS_PROCESSED(task)) {
-		rspamd_controller_scan_reply(task);
+		reply_func(task);
 		return TRUE;
 	}
 
 	if (!rspamd_task_process(task, RSPAMD_TASK_PROCESS_ALL)) {
-		rspamd_controller_scan_reply(task);
+		reply_func(task);
 		return TRUE;
 	}
 
 	if (RSPAMD_TASK_IS_PROCESSED(task)) {
-		rspamd_controller_scan_reply(task);
+		reply_func(task);
 		return TRUE;
 	}
 
@@ -2053,6 +2141,20 @@ rspamd_controller_check_fin_task(void *ud)
 	return FALSE;
 }
 
+static gboolean
+rspamd_controller_check_fin_task(void *ud)
+{
+	return rspamd_controller_check_fin_task_common((struct rspamd_task *) ud,
+												   rspamd_controller_scan_reply);
+}
+
+static gboolean
+rspamd_controller_trace_fin_task(void *ud)
+{
+	return rspamd_controller_check_fin_task_common((struct rspamd_task *) ud,
+												   rspamd_controller_trace_reply);
+}
+
 static int
 rspamd_controller_handle_learn_common(
 	struct rspamd_http_connection_entry *conn_ent,
@@ -2148,16 +2250,11 @@ rspamd_controller_handle_learnham(
 	return rspamd_controller_handle_learn_common(conn_ent, msg, FALSE);
 }
 
-/*
- * Scan command handler:
- * request: /scan
- * headers: Password
- * input: plaintext data
- * reply: json {scan data} or {"error":"error message"}
- */
 static int
-rspamd_controller_handle_scan(struct rspamd_http_connection_entry *conn_ent,
-							  struct rspamd_http_message *msg)
+rspamd_controller_handle_scan_common(struct rspamd_http_connection_entry *conn_ent,
+									 struct rspamd_http_message *msg,
+									 session_finalizer_t fin,
+									 guint task_flags)
 {
 	struct rspamd_controller_session *session = conn_ent->ud;
 	struct rspamd_controller_worker_ctx *ctx;
@@ -2174,14 +2271,14 @@ rspamd_controller_handle_scan(struct rspamd_http_connection_entry *conn_ent,
 
 	task->resolver = ctx->resolver;
 	task->s = rspamd_session_create(session->pool,
-									rspamd_controller_check_fin_task,
+									fin,
 									NULL,
 									(event_finalizer_t) rspamd_task_free,
 									task);
 	task->fin_arg = conn_ent;
 	task->http_conn = rspamd_http_connection_ref(conn_ent->conn);
 	task->sock = conn_ent->conn->fd;
-	task->flags |= RSPAMD_TASK_FLAG_MIME;
+	task->flags |= RSPAMD_TASK_FLAG_MIME | task_flags;
 	task->resolver = ctx->resolver;
 
 	if (!rspamd_protocol_handle_request(task, msg)) {
@@ -2212,6 +2309,37 @@ end:
 	return 0;
 }
 
+/*
+ * Scan command handler:
+ * request: /scan
+ * headers: Password
+ * input: plaintext data
+ * reply: json {scan data} or {"error":"error message"}
+ */
+static int
+rspamd_controller_handle_scan(struct rspamd_http_connection_entry *conn_ent,
+							  struct rspamd_http_message *msg)
+{
+	return rspamd_controller_handle_scan_common(conn_ent, msg,
+												rspamd_controller_check_fin_task, 0);
+}
+
+/*
+ * Trace command handler:
+ * request: /trace
+ * headers: Password, Format (chrome or folded)
+ * input: plaintext data
+ * reply: trace of symbols execution in Chrome trace-event json or as folded stacks
+ */
+static int
+rspamd_controller_handle_trace(struct rspamd_http_connection_entry *conn_ent,
+							   struct rspamd_http_message *msg)
+{
+	return rspamd_controller_handle_scan_common(conn_ent, msg,
+												rspamd_controller_trace_fin_task,
+												RSPAMD_TASK_FLAG_TRACE);
+}
+
 /*
  * Save actions command handler:
  * request: /saveactions
@@ -2823,6 +2951,31 @@ rspamd_controller_metrics_add_integer(rspamd_fstring_t **output,
  * headers: Password
  * reply: OpenMetrics
  */
+struct rspamd_controller_mempool_metrics {
+	rspamd_fstring_t *bytes;
+	rspamd_fstring_t *size;
+};
+
+static void
+rspamd_controller_mempool_metrics_cb(const struct rspamd_mempool_accounting_stat *st,
+									 gpointer ud)
+{
+	struct rspamd_controller_mempool_metrics *m =
+		(struct rspamd_controller_mempool_metrics *) ud;
+	const gchar *type = rspamd_mempool_accounting_type_str(st->type);
+
+	rspamd_printf_fstring(&m->bytes, "rspamd_mempool_bytes_total{type=\"%s\",name=\"%s\"} %uL\n",
+						  type, st->name, st->bytes);
+	rspamd_printf_fstring(&m->size, "rspamd_mempool_size{type=\"%s\",name=\"%s\",quantile=\"0.5\"} %uz\n",
+						  type, st->name, st->p50);
+	rspamd_printf_fstring(&m->size, "rspamd_mempool_size{type=\"%s\",name=\"%s\",quantile=\"0.99\"} %uz\n",
+						  type, st->name, st->p99);
+	rspamd_printf_fstring(&m->size, "rspamd_mempool_size_sum{type=\"%s\",name=\"%s\"} %uL\n",
+						  type, st->name, st->bytes);
+	rspamd_printf_fstring(&m->size, "rspamd_mempool_size_count{type=\"%s\",name=\"%s\"} %uL\n",
+						  type, st->name, st->count);
+}
+
 static gboolean
 rspamd_controller_metrics_fin_task(void *ud)
 {
@@ -3072,6 +3225,29 @@ rspamd_controller_metrics_fin_task(void *ud)
 		}
 	}
 
+	struct rspamd_controller_mempool_metrics mp_metrics = {
+		.bytes = rspamd_fstring_sized_new(1024),
+		.size = rspamd_fstring_sized_new(1024),
+	};
+
+	rspamd_mempool_accounting_foreach(rspamd_controller_mempool_metrics_cb, &mp_metrics);
+
+	if (RSPAMD_FSTRING_LEN(mp_metrics.bytes) > 0) {
+		rspamd_printf_fstring(&output, "# HELP rspamd_mempool_bytes_total Memory allocated from pools labelled by call site or task stage.\n");
+		rspamd_printf_fstring(&output, "# TYPE rspamd_mempool_bytes_total counter\n");
+		output = rspamd_fstring_append(output,
+									   RSPAMD_FSTRING_DATA(mp_metrics.bytes),
+									   RSPAMD_FSTRING_LEN(mp_metrics.bytes));
+		rspamd_printf_fstring(&output, "# HELP rspamd_mempool_size Memory allocated from a single pool or task stage.\n");
+		rspamd_printf_fstring(&output, "# TYPE rspamd_mempool_size summary\n");
+		output = rspamd_fstring_append(output,
+									   RSPAMD_FSTRING_DATA(mp_metrics.size),
+									   RSPAMD_FSTRING_LEN(mp_metrics.size));
+	}
+
+	rspamd_fstring_free(mp_metrics.bytes);
+	rspamd_fstring_free(mp_metrics.size);
+
 	rspamd_printf_fstring(&output, "# EOF\n");
 
 	rspamd_controller_send_openmetrics(conn_ent, output);
@@ -4193,6 +4369,12 @@ start_controller_worker(struct rspamd_worker *worker)
 	rspamd_http_router_add_path(ctx->http,
 								PATH_PING,
 								rspamd_controller_handle_ping);
+	rspamd_http_router_add_path(ctx->http,
+								PATH_TRACE,
+								rspamd_controller_handle_trace);
+	rspamd_http_router_add_path(ctx->http,
+								PATH_MEMPOOL,
+								rspamd_controller_handle_mempool);
 	rspamd_controller_register_plugins_paths(ctx);
 
 #if 0
@@ -48,6 +48,8 @@
 #define DEFAULT_MAX_BUCKETS 2000
 #define DEFAULT_BUCKET_TTL 3600
 #define DEFAULT_BUCKET_MASK 24
+#define DEFAULT_IO_BATCH 16
+#define MAX_IO_BATCH 1024
 /* Update stats on keys each 1 hour */
 #define KEY_STAT_INTERVAL 3600.0
 
@@ -140,6 +142,8 @@ KHASH_INIT(rspamd_fuzzy_keys_hash,
 		   const unsigned char *, struct fuzzy_key *, 1,
 		   fuzzy_kp_hash, fuzzy_kp_equal);
 
+struct fuzzy_io_batch;
+
 struct rspamd_fuzzy_storage_ctx {
 	guint64 magic;
 	/* Events base */
@@ -191,6 +195,13 @@ struct rspamd_fuzzy_storage_ctx {
 	/* Used to send data between workers */
 	gint peer_fd;
 
+	/* Batched UDP IO */
+	guint io_batch_size;
+	struct fuzzy_io_batch *io_batch;
+	GPtrArray *pending_replies;
+	GPtrArray *pending_checks;
+	ev_prepare flush_ev;
+
 	/* Ratelimits */
 	guint leaky_bucket_ttl;
 	guint leaky_bucket_mask;
@@ -251,6 +262,7 @@ struct rspamd_updates_cbdata {
 
 
 static void rspamd_fuzzy_write_reply(struct fuzzy_session *session);
+static void rspamd_fuzzy_flush_replies(struct rspamd_fuzzy_storage_ctx *ctx);
 static gboolean rspamd_fuzzy_process_updates_queue(struct rspamd_fuzzy_storage_ctx *ctx,
 												   const gchar *source, gboolean final);
 static gboolean rspamd_fuzzy_check_client(struct rspamd_fuzzy_storage_ctx *ctx,
@@ -835,10 +847,9 @@ rspamd_fuzzy_reply_io(EV_P_ ev_io *w, int revents)
 	REF_RELEASE(session);
 }
 
-static void
-rspamd_fuzzy_write_reply(struct fuzzy_session *session)
+static gconstpointer
+rspamd_fuzzy_reply_data(struct fuzzy_session *session, gsize *plen)
 {
-	gssize r;
 	gsize len;
 	gconstpointer data;
 
@@ -865,6 +876,19 @@ rspamd_fuzzy_write_reply(struct fuzzy_session *session)
 		}
 	}
 
+	*plen = len;
+
+	return data;
+}
+
+static void
+rspamd_fuzzy_write_reply(struct fuzzy_session *session)
+{
+	gssize r;
+	gsize len;
+	gconstpointer data;
+
+	data = rspamd_fuzzy_reply_data(session, &len);
 	r = rspamd_inet_address_sendto(session->fd, data, len, 0,
 								   session->addr);
 
@@ -883,6 +907,35 @@ rspamd_fuzzy_write_reply(struct fuzzy_session *session)
 	}
 }
 
+/*
+ * Replies are collected and sent by rspamd_fuzzy_flush_replies either when
+ * a batch is full or before the event loop polls for new events, so both
+ * synchronous and asynchronous backend replies share sendmmsg calls
+ */
+static void
+rspamd_fuzzy_queue_reply(struct fuzzy_session *session)
+{
+#ifdef HAVE_SENDMMSG
+	struct rspamd_fuzzy_storage_ctx *ctx = session->ctx;
+
+	if (ctx->io_batch && ctx->io_batch->len > 1 && session->addr) {
+		REF_RETAIN(session);
+		g_ptr_array_add(ctx->pending_replies, session);
+
+		if (ctx->pending_replies->len >= ctx->io_batch->len) {
+			rspamd_fuzzy_flush_replies(ctx);
+		}
+		else if (!ev_is_active(&ctx->flush_ev)) {
+			ev_prepare_start(ctx->event_loop, &ctx->flush_ev);
+		}
+
+		return;
+	}
+#endif
+
+	rspamd_fuzzy_write_reply(session);
+}
+
 static void
 rspamd_fuzzy_update_key_stat(gboolean matched,
 							 struct fuzzy_key_stat *key_stat,
@@ -1114,7 +1167,7 @@ rspamd_fuzzy_make_reply(struct rspamd_fuzzy_cmd *cmd,
 		}
 	}
 
-	rspamd_fuzzy_write_reply(session);
+	rspamd_fuzzy_queue_reply(session);
 }
 
 static gboolean
@@ -1500,9 +1553,9 @@ rspamd_fuzzy_process_command(struct fuzzy_session *session)
 		}
 
 		if (can_continue) {
+			/* Checks are sent to the backend by rspamd_fuzzy_flush_checks */
 			REF_RETAIN(session);
-			rspamd_fuzzy_backend_check(session->ctx->backend, cmd,
-									   rspamd_fuzzy_check_callback, session);
+			g_ptr_array_add(session->ctx->pending_checks, session);
 		}
 		else {
 			result.v1.value = 403;
@@ -1957,11 +2010,6 @@ fuzzy_session_destroy(gpointer d)
 }
 
 #define FUZZY_INPUT_BUFLEN 1024
-#ifdef HAVE_RECVMMSG
-#define MSGVEC_LEN 16
-#else
-#define MSGVEC_LEN 1
-#endif
 
 union sa_union {
 	struct sockaddr sa;
@@ -1970,6 +2018,172 @@ union sa_union {
 	struct sockaddr_un su;
 	struct sockaddr_storage ss;
 };
+
+struct fuzzy_io_batch {
+	guint len;
+	guint8 *bufs;
+	struct iovec *iovs;
+	union sa_union *peer_sa;
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr *msg;
+#else
+	struct msghdr *msg;
+#endif
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr *out_msg;
+	struct iovec *out_iovs;
+#endif
+};
+
+static struct fuzzy_io_batch *
+fuzzy_io_batch_new(guint len)
+{
+	struct fuzzy_io_batch *batch;
+
+#ifndef HAVE_RECVMMSG
+	/* Input is read by recvmsg, one datagram per call */
+	len = 1;
+#endif
+
+	batch = g_malloc0(sizeof(*batch));
+	batch->len = len;
+	batch->bufs = g_malloc(len * FUZZY_INPUT_BUFLEN);
+	batch->iovs = g_malloc0(len * sizeof(*batch->iovs));
+	batch->peer_sa = g_malloc0(len * sizeof(*batch->peer_sa));
+	batch->msg = g_malloc0(len * sizeof(*batch->msg));
+#ifdef HAVE_SENDMMSG
+	batch->out_msg = g_malloc0(len * sizeof(*batch->out_msg));
+	batch->out_iovs = g_malloc0(len * sizeof(*batch->out_iovs));
+#endif
+
+	return batch;
+}
+
+static void
+fuzzy_io_batch_free(struct fuzzy_io_batch *batch)
+{
+	if (batch) {
+		g_free(batch->bufs);
+		g_free(batch->iovs);
+		g_free(batch->peer_sa);
+		g_free(batch->msg);
+#ifdef HAVE_SENDMMSG
+		g_free(batch->out_msg);
+		g_free(batch->out_iovs);
+#endif
+		g_free(batch);
+	}
+}
+
+static void
+rspamd_fuzzy_flush_replies(struct rspamd_fuzzy_storage_ctx *ctx)
+{
+#ifdef HAVE_SENDMMSG
+	struct fuzzy_io_batch *batch = ctx->io_batch;
+	GPtrArray *pending = ctx->pending_replies;
+	struct fuzzy_session *session;
+	struct msghdr *hdr;
+	guint i, start, n, sent;
+	gint fd, r;
+
+	if (ev_is_active(&ctx->flush_ev)) {
+		ev_prepare_stop(ctx->event_loop, &ctx->flush_ev);
+	}
+
+	for (start = 0; start < pending->len; start += n) {
+		session = g_ptr_array_index(pending, start);
+		fd = session->fd;
+
+		/* One sendmmsg call per socket and batch */
+		for (n = 0; start + n < pending->len && n < batch->len; n++) {
+			session = g_ptr_array_index(pending, start + n);
+
+			if (session->fd != fd) {
+				break;
+			}
+
+			batch->out_iovs[n].iov_base = (void *) rspamd_fuzzy_reply_data(session,
+																		   &batch->out_iovs[n].iov_len);
+			hdr = &batch->out_msg[n].msg_hdr;
+			memset(hdr, 0, sizeof(*hdr));
+			hdr->msg_name = rspamd_inet_address_get_sa(session->addr,
+													   &hdr->msg_namelen);
+			hdr->msg_iov = &batch->out_iovs[n];
+			hdr->msg_iovlen = 1;
+		}
+
+		sent = 0;
+
+		while (sent < n) {
+			r = sendmmsg(fd, &batch->out_msg[sent], n - sent, 0);
+
+			if (r == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+
+				break;
+			}
+
+			sent += r;
+		}
+
+		/* Send the rest one by one, it handles EAGAIN and reports errors */
+		for (i = sent; i < n; i++) {
+			rspamd_fuzzy_write_reply(g_ptr_array_index(pending, start + i));
+		}
+	}
+
+	for (i = 0; i < pending->len; i++) {
+		session = g_ptr_array_index(pending, i);
+		REF_RELEASE(session);
+	}
+
+	g_ptr_array_set_size(pending, 0);
+#endif
+}
+
+/*
+ * Sends all check commands received from a socket read to the backend at once
+ */
+static void
+rspamd_fuzzy_flush_checks(struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	GPtrArray *pending = ctx->pending_checks;
+	const struct rspamd_fuzzy_cmd **cmds;
+	struct fuzzy_session *session;
+	void **uds;
+	guint i, ncmds;
+
+	ncmds = pending->len;
+
+	if (ncmds == 0) {
+		return;
+	}
+
+	cmds = g_alloca(sizeof(*cmds) * ncmds);
+	uds = g_alloca(sizeof(*uds) * ncmds);
+
+	for (i = 0; i < ncmds; i++) {
+		session = g_ptr_array_index(pending, i);
+		cmds[i] = &session->cmd.basic;
+		uds[i] = session;
+	}
+
+	/* Sessions references are now owned by the backend callbacks */
+	g_ptr_array_set_size(pending, 0);
+	rspamd_fuzzy_backend_check_batch(ctx->backend, cmds, ncmds,
+									 rspamd_fuzzy_check_callback, uds);
+}
+
+static void
+rspamd_fuzzy_flush_replies_cb(EV_P_ ev_prepare *w, int revents)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = (struct rspamd_fuzzy_storage_ctx *) w->data;
+
+	rspamd_fuzzy_flush_replies(ctx);
+}
+
 /*
  * Accept new connection and construct task
  */
@@ -1981,28 +2195,29 @@ accept_fuzzy_socket(EV_P_ ev_io *w, int revents)
 	struct fuzzy_session *session;
 	gssize r, msg_len;
 	guint64 *nerrors;
-	struct iovec iovs[MSGVEC_LEN];
-	guint8 bufs[MSGVEC_LEN][FUZZY_INPUT_BUFLEN];
-	union sa_union peer_sa[MSGVEC_LEN];
-	socklen_t salen = sizeof(peer_sa[0]);
+	struct fuzzy_io_batch *batch;
+	struct iovec *iovs;
 #ifdef HAVE_RECVMMSG
 #define MSG_FIELD(msg, field) msg.msg_hdr.field
-	struct mmsghdr msg[MSGVEC_LEN];
+	struct mmsghdr *msg;
 #else
 #define MSG_FIELD(msg, field) msg.field
-	struct msghdr msg[MSGVEC_LEN];
+	struct msghdr *msg;
 #endif
 
-	memset(msg, 0, sizeof(*msg) * MSGVEC_LEN);
 	ctx = (struct rspamd_fuzzy_storage_ctx *) worker->ctx;
+	batch = ctx->io_batch;
+	iovs = batch->iovs;
+	msg = batch->msg;
+	memset(msg, 0, sizeof(*msg) * batch->len);
 
 	/* Prepare messages to receive */
-	for (int i = 0; i < MSGVEC_LEN; i++) {
+	for (int i = 0; i < batch->len; i++) {
 		/* Prepare msghdr structs */
-		iovs[i].iov_base = bufs[i];
-		iovs[i].iov_len = sizeof(bufs[i]);
-		MSG_FIELD(msg[i], msg_name) = (void *) &peer_sa[i];
-		MSG_FIELD(msg[i], msg_namelen) = salen;
+		iovs[i].iov_base = batch->bufs + i * FUZZY_INPUT_BUFLEN;
+		iovs[i].iov_len = FUZZY_INPUT_BUFLEN;
+		MSG_FIELD(msg[i], msg_name) = (void *) &batch->peer_sa[i];
+		MSG_FIELD(msg[i], msg_namelen) = sizeof(batch->peer_sa[i]);
 		MSG_FIELD(msg[i], msg_iov) = &iovs[i];
 		MSG_FIELD(msg[i], msg_iovlen) = 1;
 	}
@@ -2012,7 +2227,7 @@ accept_fuzzy_socket(EV_P_ ev_io *w, int revents)
 		ev_now_update_if_cheap(ctx->event_loop);
 		for (;;) {
 #ifdef HAVE_RECVMMSG
-			r = recvmmsg(w->fd, msg, MSGVEC_LEN, 0, NULL);
+			r = recvmmsg(w->fd, msg, batch->len, 0, NULL);
 #else
 			r = recvmsg(w->fd, msg, 0);
 #endif
@@ -2096,6 +2311,8 @@ accept_fuzzy_socket(EV_P_ ev_io *w, int revents)
 
 				REF_RELEASE(session);
 			}
+
+			rspamd_fuzzy_flush_checks(ctx);
 #ifdef HAVE_RECVMMSG
 			/* Stop reading as we are using recvmmsg instead of recvmsg */
 			break;
@@ -2920,6 +3137,7 @@ init_fuzzy(struct rspamd_config *cfg)
 	ctx->leaky_bucket_mask = DEFAULT_BUCKET_MASK;
 	ctx->leaky_bucket_ttl = DEFAULT_BUCKET_TTL;
 	ctx->max_buckets = DEFAULT_MAX_BUCKETS;
+	ctx->io_batch_size = DEFAULT_IO_BATCH;
 	ctx->leaky_bucket_burst = NAN;
 	ctx->leaky_bucket_rate = NAN;
 	ctx->delay = NAN;
@@ -3029,6 +3247,16 @@ init_fuzzy(struct rspamd_config *cfg)
 									  RSPAMD_CL_FLAG_UINT,
 									  "Size of keypairs cache, default: " G_STRINGIFY(DEFAULT_KEYPAIR_CACHE_SIZE));
 
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "io_batch",
+									  rspamd_rcl_parse_struct_integer,
+									  ctx,
+									  G_STRUCT_OFFSET(struct rspamd_fuzzy_storage_ctx,
+													  io_batch_size),
+									  RSPAMD_CL_FLAG_UINT,
+									  "Maximum number of datagrams received and replies sent per system call, default: " G_STRINGIFY(DEFAULT_IO_BATCH));
+
 	rspamd_rcl_register_worker_option(cfg,
 									  type,
 									  "encrypted_only",
@@ -3267,6 +3495,21 @@ start_fuzzy(struct rspamd_worker *worker)
 		ctx->keypair_cache = rspamd_keypair_cache_new(ctx->keypair_cache_size);
 	}
 
+	if (ctx->io_batch_size == 0) {
+		ctx->io_batch_size = 1;
+	}
+	else if (ctx->io_batch_size > MAX_IO_BATCH) {
+		msg_warn_config("io_batch %ud is too large, use %d",
+						ctx->io_batch_size, MAX_IO_BATCH);
+		ctx->io_batch_size = MAX_IO_BATCH;
+	}
+
+	ctx->io_batch = fuzzy_io_batch_new(ctx->io_batch_size);
+	ctx->pending_replies = g_ptr_array_sized_new(ctx->io_batch_size);
+	ctx->pending_checks = g_ptr_array_sized_new(ctx->io_batch_size);
+	ctx->flush_ev.data = ctx;
+	ev_prepare_init(&ctx->flush_ev, rspamd_fuzzy_flush_replies_cb);
+
 
 	if ((ctx->backend = rspamd_fuzzy_backend_create(ctx->event_loop,
 													worker->cf->options, cfg, &err)) == NULL) {
@@ -3475,6 +3718,7 @@ start_fuzzy(struct rspamd_worker *worker)
 
 	ev_loop(ctx->event_loop, 0);
 	rspamd_worker_block_signals();
+	rspamd_fuzzy_flush_replies(ctx);
 
 	if (ctx->peer_fd != -1) {
 		if (worker->index == 0) {
@@ -3497,6 +3741,12 @@ start_fuzzy(struct rspamd_worker *worker)
 	}
 
 	rspamd_fuzzy_backend_close(ctx->backend);
+	rspamd_fuzzy_flush_replies(ctx);
+	g_ptr_array_free(ctx->pending_replies, TRUE);
+	ctx->pending_replies = NULL;
+	g_ptr_array_free(ctx->pending_checks, TRUE);
+	ctx->pending_checks = NULL;
+	fuzzy_io_batch_free(ctx->io_batch);
 
 	if (worker->index == 0) {
 		g_array_free(ctx->updates_pending, TRUE);
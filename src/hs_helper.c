@@ -57,6 +57,7 @@ struct hs_helper_ctx {
 	gboolean loaded;
 	gdouble max_time;
 	gdouble recompile_time;
+	guint compile_threads;
 	ev_timer recompile_timer;
 };
 
@@ -74,6 +75,7 @@ init_hs_helper(struct rspamd_config *cfg)
 	ctx->hs_dir = NULL;
 	ctx->max_time = default_max_time;
 	ctx->recompile_time = default_recompile_time;
+	ctx->compile_threads = 1;
 
 	rspamd_rcl_register_worker_option(cfg,
 									  type,
@@ -99,6 +101,14 @@ init_hs_helper(struct rspamd_config *cfg)
 									  G_STRUCT_OFFSET(struct hs_helper_ctx, recompile_time),
 									  RSPAMD_CL_FLAG_TIME_FLOAT,
 									  "Time between recompilation checks");
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "compile_threads",
+									  rspamd_rcl_parse_struct_integer,
+									  ctx,
+									  G_STRUCT_OFFSET(struct hs_helper_ctx, compile_threads),
+									  RSPAMD_CL_FLAG_UINT,
+									  "Number of threads used to compile hyperscan classes in parallel");
 	rspamd_rcl_register_worker_option(cfg,
 									  type,
 									  "timeout",
@@ -334,6 +344,7 @@ rspamd_rs_compile(struct hs_helper_ctx *ctx, struct rspamd_worker *worker,
 	hack_global_forced = forced; /* killmeplease */
 	rspamd_re_cache_compile_hyperscan(ctx->cfg->re_cache,
 									  ctx->hs_dir, ctx->max_time, !forced,
+									  ctx->compile_threads,
 									  ctx->event_loop,
 									  rspamd_rs_compile_cb,
 									  (void *) worker);
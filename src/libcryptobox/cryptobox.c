@@ -25,6 +25,7 @@
 #include "chacha20/chacha.h"
 #include "catena/catena.h"
 #include "base64/base64.h"
+#include "siphash/siphash.h"
 #include "ottery.h"
 #include "printf.h"
 #define XXH_INLINE_ALL
@@ -306,6 +307,7 @@ rspamd_cryptobox_init(void)
 
 	ctx->chacha20_impl = chacha_load();
 	ctx->base64_impl = base64_load();
+	ctx->siphash_impl = siphash_load();
 #if defined(HAVE_USABLE_OPENSSL) && (OPENSSL_VERSION_NUMBER < 0x10100000L || defined(LIBRESSL_VERSION_NUMBER))
 	/* Needed for old openssl api, not sure about LibreSSL */
 	ERR_load_EC_strings();
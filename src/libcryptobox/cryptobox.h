@@ -76,6 +76,7 @@ struct rspamd_cryptobox_library_ctx {
 	gchar *cpu_extensions;
 	const gchar *chacha20_impl;
 	const gchar *base64_impl;
+	const gchar *siphash_impl;
 	unsigned long cpu_config;
 };
 
@@ -250,6 +251,19 @@ void rspamd_cryptobox_siphash(unsigned char *out, const unsigned char *in,
 							  unsigned long long inlen,
 							  const rspamd_sipkey_t k);
 
+/**
+ * Calculates siphash-2-4 of the same input under several keys at once
+ * @param out output array of `nkeys` hashes, each one is equal to the
+ * output of `rspamd_cryptobox_siphash` with the corresponding key
+ * @param in input data
+ * @param inlen input length
+ * @param keys `nkeys` siphash keys stored one after another
+ * @param nkeys number of keys
+ */
+void rspamd_cryptobox_siphash_multi(guint64 *out, const unsigned char *in,
+									gsize inlen,
+									const unsigned char *keys, gsize nkeys);
+
 enum rspamd_cryptobox_pbkdf_type {
 	RSPAMD_CRYPTOBOX_PBKDF2 = 0,
 	RSPAMD_CRYPTOBOX_CATENA
@@ -0,0 +1,165 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * AVX2 siphash-2-4 of a single input under several keys: each 256 bit
+ * register holds the same state word for 4 keys, two register sets are
+ * interleaved, so 8 keys are processed per pass
+ */
+
+#include "config.h"
+#include "siphash.h"
+
+#ifdef RSPAMD_HAS_TARGET_ATTR
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+#ifndef __SSE2__
+#define __SSE2__
+#endif
+#ifndef __SSE__
+#define __SSE__
+#endif
+#ifndef __AVX__
+#define __AVX__
+#endif
+#ifndef __AVX2__
+#define __AVX2__
+#endif
+
+#include <immintrin.h>
+
+void siphash_multi_ref(guint64 *out, const unsigned char *in, gsize inlen,
+					   const unsigned char *keys, gsize nkeys);
+
+#define SIPHASH_AVX2_LANES 8
+
+#define ROTL256(x, b) _mm256_or_si256(_mm256_slli_epi64((x), (b)), \
+									  _mm256_srli_epi64((x), 64 - (b)))
+#define ROTL256_32(x) _mm256_shuffle_epi32((x), _MM_SHUFFLE(2, 3, 0, 1))
+
+#define SIPROUND_AVX2(v0, v1, v2, v3)  \
+	do {                               \
+		v0 = _mm256_add_epi64(v0, v1); \
+		v1 = ROTL256(v1, 13);          \
+		v1 = _mm256_xor_si256(v1, v0); \
+		v0 = ROTL256_32(v0);           \
+		v2 = _mm256_add_epi64(v2, v3); \
+		v3 = ROTL256(v3, 16);          \
+		v3 = _mm256_xor_si256(v3, v2); \
+		v0 = _mm256_add_epi64(v0, v3); \
+		v3 = ROTL256(v3, 21);          \
+		v3 = _mm256_xor_si256(v3, v0); \
+		v2 = _mm256_add_epi64(v2, v1); \
+		v1 = ROTL256(v1, 17);          \
+		v1 = _mm256_xor_si256(v1, v2); \
+		v2 = ROTL256_32(v2);           \
+	} while (0)
+
+#define SIPROUND_AVX2_X2()                 \
+	do {                                   \
+		SIPROUND_AVX2(a0, a1, a2, a3);     \
+		SIPROUND_AVX2(b0, b1, b2, b3);     \
+	} while (0)
+
+#define SIPCOMPRESS_AVX2_X2(m)             \
+	do {                                   \
+		a3 = _mm256_xor_si256(a3, (m));    \
+		b3 = _mm256_xor_si256(b3, (m));    \
+		SIPROUND_AVX2_X2();                \
+		SIPROUND_AVX2_X2();                \
+		a0 = _mm256_xor_si256(a0, (m));    \
+		b0 = _mm256_xor_si256(b0, (m));    \
+	} while (0)
+
+static inline void
+siphash_load_keys_avx2(const unsigned char *keys, __m256i *k0, __m256i *k1)
+    __attribute__((__target__("avx2")));
+
+static inline void
+siphash_load_keys_avx2(const unsigned char *keys, __m256i *k0, __m256i *k1)
+{
+	*k0 = _mm256_set_epi64x(siphash_load64_le(keys + 48),
+							siphash_load64_le(keys + 32),
+							siphash_load64_le(keys + 16),
+							siphash_load64_le(keys));
+	*k1 = _mm256_set_epi64x(siphash_load64_le(keys + 56),
+							siphash_load64_le(keys + 40),
+							siphash_load64_le(keys + 24),
+							siphash_load64_le(keys + 8));
+}
+
+void siphash_multi_avx2(guint64 *out, const unsigned char *in, gsize inlen,
+						const unsigned char *keys, gsize nkeys)
+	__attribute__((__target__("avx2")));
+
+void siphash_multi_avx2(guint64 *out, const unsigned char *in, gsize inlen,
+						const unsigned char *keys, gsize nkeys)
+{
+	const __m256i c0 = _mm256_set1_epi64x(SIPHASH_C0),
+				  c1 = _mm256_set1_epi64x(SIPHASH_C1),
+				  c2 = _mm256_set1_epi64x(SIPHASH_C2),
+				  c3 = _mm256_set1_epi64x(SIPHASH_C3),
+				  ff = _mm256_set1_epi64x(0xff);
+	__m256i a0, a1, a2, a3, b0, b1, b2, b3, k0, k1, m;
+	gsize i, b, nblocks = inlen / 8;
+
+	for (i = 0; i + SIPHASH_AVX2_LANES <= nkeys; i += SIPHASH_AVX2_LANES) {
+		siphash_load_keys_avx2(keys + i * 16, &k0, &k1);
+		a0 = _mm256_xor_si256(k0, c0);
+		a1 = _mm256_xor_si256(k1, c1);
+		a2 = _mm256_xor_si256(k0, c2);
+		a3 = _mm256_xor_si256(k1, c3);
+		siphash_load_keys_avx2(keys + (i + 4) * 16, &k0, &k1);
+		b0 = _mm256_xor_si256(k0, c0);
+		b1 = _mm256_xor_si256(k1, c1);
+		b2 = _mm256_xor_si256(k0, c2);
+		b3 = _mm256_xor_si256(k1, c3);
+
+		for (b = 0; b < nblocks; b++) {
+			m = _mm256_set1_epi64x(siphash_load64_le(in + b * 8));
+			SIPCOMPRESS_AVX2_X2(m);
+		}
+
+		m = _mm256_set1_epi64x(siphash_last_block(in, inlen));
+		SIPCOMPRESS_AVX2_X2(m);
+
+		a2 = _mm256_xor_si256(a2, ff);
+		b2 = _mm256_xor_si256(b2, ff);
+		SIPROUND_AVX2_X2();
+		SIPROUND_AVX2_X2();
+		SIPROUND_AVX2_X2();
+		SIPROUND_AVX2_X2();
+
+		/* x86 is little endian, so no byte swap is needed here */
+		a0 = _mm256_xor_si256(_mm256_xor_si256(a0, a1),
+							  _mm256_xor_si256(a2, a3));
+		b0 = _mm256_xor_si256(_mm256_xor_si256(b0, b1),
+							  _mm256_xor_si256(b2, b3));
+		_mm256_storeu_si256((__m256i *) (out + i), a0);
+		_mm256_storeu_si256((__m256i *) (out + i + 4), b0);
+	}
+
+	if (i < nkeys) {
+		siphash_multi_ref(out + i, in, inlen, keys + i * 16, nkeys - i);
+	}
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC pop_options
+#endif
+#endif
@@ -0,0 +1,112 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Portable siphash-2-4 of a single input under several keys: state of
+ * SIPHASH_REF_LANES keys is advanced together, so the compiler can vectorize
+ * lanes even without explicit SIMD code
+ */
+
+#include "config.h"
+#include "siphash.h"
+
+#define SIPHASH_REF_LANES 8
+#define ROTL64(x, b) (guint64)(((x) << (b)) | ((x) >> (64 - (b))))
+
+static inline void
+siphash_round_lanes(guint64 *v0, guint64 *v1, guint64 *v2, guint64 *v3,
+					gsize nlanes)
+{
+	gsize l;
+
+	for (l = 0; l < nlanes; l++) {
+		v0[l] += v1[l];
+		v1[l] = ROTL64(v1[l], 13);
+		v1[l] ^= v0[l];
+		v0[l] = ROTL64(v0[l], 32);
+		v2[l] += v3[l];
+		v3[l] = ROTL64(v3[l], 16);
+		v3[l] ^= v2[l];
+		v0[l] += v3[l];
+		v3[l] = ROTL64(v3[l], 21);
+		v3[l] ^= v0[l];
+		v2[l] += v1[l];
+		v1[l] = ROTL64(v1[l], 17);
+		v1[l] ^= v2[l];
+		v2[l] = ROTL64(v2[l], 32);
+	}
+}
+
+static inline void
+siphash_compress_lanes(guint64 *v0, guint64 *v1, guint64 *v2, guint64 *v3,
+					   guint64 m, gsize nlanes)
+{
+	gsize l;
+
+	for (l = 0; l < nlanes; l++) {
+		v3[l] ^= m;
+	}
+
+	siphash_round_lanes(v0, v1, v2, v3, nlanes);
+	siphash_round_lanes(v0, v1, v2, v3, nlanes);
+
+	for (l = 0; l < nlanes; l++) {
+		v0[l] ^= m;
+	}
+}
+
+void siphash_multi_ref(guint64 *out, const unsigned char *in, gsize inlen,
+					   const unsigned char *keys, gsize nkeys)
+{
+	guint64 v0[SIPHASH_REF_LANES], v1[SIPHASH_REF_LANES],
+		v2[SIPHASH_REF_LANES], v3[SIPHASH_REF_LANES], k0, k1;
+	gsize i, l, b, nlanes, nblocks = inlen / 8;
+	gint r;
+
+	for (i = 0; i < nkeys; i += nlanes) {
+		nlanes = MIN(nkeys - i, SIPHASH_REF_LANES);
+
+		for (l = 0; l < nlanes; l++) {
+			k0 = siphash_load64_le(keys + (i + l) * 16);
+			k1 = siphash_load64_le(keys + (i + l) * 16 + 8);
+			v0[l] = k0 ^ SIPHASH_C0;
+			v1[l] = k1 ^ SIPHASH_C1;
+			v2[l] = k0 ^ SIPHASH_C2;
+			v3[l] = k1 ^ SIPHASH_C3;
+		}
+
+		for (b = 0; b < nblocks; b++) {
+			siphash_compress_lanes(v0, v1, v2, v3,
+								   siphash_load64_le(in + b * 8), nlanes);
+		}
+
+		siphash_compress_lanes(v0, v1, v2, v3,
+							   siphash_last_block(in, inlen), nlanes);
+
+		for (l = 0; l < nlanes; l++) {
+			v2[l] ^= 0xff;
+		}
+
+		for (r = 0; r < 4; r++) {
+			siphash_round_lanes(v0, v1, v2, v3, nlanes);
+		}
+
+		for (l = 0; l < nlanes; l++) {
+			/* Match the byte order of rspamd_cryptobox_siphash output */
+			out[i + l] = GUINT64_TO_LE(v0[l] ^ v1[l] ^ v2[l] ^ v3[l]);
+		}
+	}
+}
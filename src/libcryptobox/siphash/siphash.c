@@ -0,0 +1,78 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "cryptobox.h"
+#include "siphash.h"
+#include "platform_config.h"
+
+extern unsigned cpu_config;
+
+typedef struct siphash_impl {
+	unsigned int cpu_flags;
+	const char *desc;
+	void (*multi)(guint64 *out, const unsigned char *in, gsize inlen,
+				  const unsigned char *keys, gsize nkeys);
+} siphash_impl_t;
+
+#define SIPHASH_DECLARE(ext) \
+	void siphash_multi_##ext(guint64 *out, const unsigned char *in, gsize inlen, const unsigned char *keys, gsize nkeys);
+#define SIPHASH_IMPL(cpuflags, desc, ext) \
+	{                                     \
+		(cpuflags), desc, siphash_multi_##ext}
+
+SIPHASH_DECLARE(ref);
+#define SIPHASH_REF SIPHASH_IMPL(0, "ref", ref)
+
+#ifdef RSPAMD_HAS_TARGET_ATTR
+#if defined(HAVE_AVX2) && defined(__x86_64__)
+void siphash_multi_avx2(guint64 *out, const unsigned char *in, gsize inlen,
+						const unsigned char *keys, gsize nkeys) __attribute__((__target__("avx2")));
+
+#define SIPHASH_AVX2 SIPHASH_IMPL(CPUID_AVX2, "avx2", avx2)
+#endif
+#endif
+
+static const siphash_impl_t siphash_list[] = {
+	SIPHASH_REF,
+#ifdef SIPHASH_AVX2
+	SIPHASH_AVX2,
+#endif
+};
+
+static const siphash_impl_t *siphash_opt = &siphash_list[0];
+
+const char *
+siphash_load(void)
+{
+	guint i;
+
+	if (cpu_config != 0) {
+		for (i = 1; i < G_N_ELEMENTS(siphash_list); i++) {
+			if (siphash_list[i].cpu_flags & cpu_config) {
+				siphash_opt = &siphash_list[i];
+			}
+		}
+	}
+
+	return siphash_opt->desc;
+}
+
+void rspamd_cryptobox_siphash_multi(guint64 *out, const unsigned char *in,
+									gsize inlen,
+									const unsigned char *keys, gsize nkeys)
+{
+	siphash_opt->multi(out, in, inlen, keys, nkeys);
+}
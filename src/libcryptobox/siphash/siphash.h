@@ -0,0 +1,84 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBCRYPTOBOX_SIPHASH_SIPHASH_H_
+#define SRC_LIBCRYPTOBOX_SIPHASH_SIPHASH_H_
+
+#include "config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SIPHASH_C0 0x736f6d6570736575ULL
+#define SIPHASH_C1 0x646f72616e646f6dULL
+#define SIPHASH_C2 0x6c7967656e657261ULL
+#define SIPHASH_C3 0x7465646279746573ULL
+
+static inline guint64
+siphash_load64_le(const unsigned char *p)
+{
+	guint64 r;
+
+	memcpy(&r, p, sizeof(r));
+
+	return GUINT64_FROM_LE(r);
+}
+
+/*
+ * Returns the final message word: the tail of input and its length
+ */
+static inline guint64
+siphash_last_block(const unsigned char *in, gsize inlen)
+{
+	const unsigned char *p = in + (inlen & ~(gsize) 7);
+	guint64 b = ((guint64) inlen) << 56;
+
+	switch (inlen & 7) {
+	case 7:
+		b |= ((guint64) p[6]) << 48;
+		/* FALLTHRU */
+	case 6:
+		b |= ((guint64) p[5]) << 40;
+		/* FALLTHRU */
+	case 5:
+		b |= ((guint64) p[4]) << 32;
+		/* FALLTHRU */
+	case 4:
+		b |= ((guint64) p[3]) << 24;
+		/* FALLTHRU */
+	case 3:
+		b |= ((guint64) p[2]) << 16;
+		/* FALLTHRU */
+	case 2:
+		b |= ((guint64) p[1]) << 8;
+		/* FALLTHRU */
+	case 1:
+		b |= ((guint64) p[0]);
+		break;
+	case 0:
+		break;
+	}
+
+	return b;
+}
+
+const char *siphash_load(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SRC_LIBCRYPTOBOX_SIPHASH_SIPHASH_H_ */
@@ -18,6 +18,7 @@
 #include "message.h"
 #include "task.h"
 #include "archives.h"
+#include "mime_parser.h"
 #include "libmime/mime_encoding.h"
 #include <unicode/uchar.h>
 #include <unicode/utf8.h>
@@ -179,6 +180,7 @@ rspamd_archive_process_zip(struct rspamd_task *task,
 	struct rspamd_archive *arch;
 	struct rspamd_archive_file *f = NULL;
 
+	rspamd_mime_part_maybe_decode(part);
 	/* Zip files have interesting data at the end of archive */
 	p = part->parsed_data.begin + part->parsed_data.len - 1;
 	start = part->parsed_data.begin;
@@ -582,6 +584,7 @@ rspamd_archive_process_rar(struct rspamd_task *task,
 	struct rspamd_archive_file *f;
 	gint r;
 
+	rspamd_mime_part_maybe_decode(part);
 	p = part->parsed_data.begin;
 	end = p + part->parsed_data.len;
 
@@ -1698,6 +1701,7 @@ rspamd_archive_process_7zip(struct rspamd_task *task,
 	const guchar sz_magic[] = {'7', 'z', 0xBC, 0xAF, 0x27, 0x1C};
 	guint64 section_offset = 0, section_length = 0;
 
+	rspamd_mime_part_maybe_decode(part);
 	start = part->parsed_data.begin;
 	p = start;
 	end = p + part->parsed_data.len;
@@ -1759,6 +1763,7 @@ rspamd_archive_process_gzip(struct rspamd_task *task,
 	const guchar gz_magic[] = {0x1F, 0x8B};
 	guchar flags;
 
+	rspamd_mime_part_maybe_decode(part);
 	start = part->parsed_data.begin;
 	p = start;
 	end = p + part->parsed_data.len;
@@ -1919,6 +1924,12 @@ rspamd_archive_cheat_detect(struct rspamd_mime_part *part, const gchar *str,
 	struct rspamd_content_type *ct;
 	const gchar *p;
 	rspamd_ftok_t srch, *fname;
+	const rspamd_ftok_t *data = &part->parsed_data;
+
+	if (part->flags & RSPAMD_MIME_PART_DELAYED_DECODE) {
+		/* Magic of a part with delayed decoding is checked in its decoded prefix */
+		data = &part->decoded_prefix;
+	}
 
 	ct = part->ct;
 	RSPAMD_FTOK_ASSIGN(&srch, "application");
@@ -1928,8 +1939,8 @@ rspamd_archive_cheat_detect(struct rspamd_mime_part *part, const gchar *str,
 											 str, strlen(str)) != -1) {
 			/* We still need to check magic, see #1848 */
 			if (magic_start != NULL) {
-				if (part->parsed_data.len > magic_len &&
-					memcmp(part->parsed_data.begin,
+				if (data->len > magic_len &&
+					memcmp(data->begin,
 						   magic_start, magic_len) == 0) {
 					return TRUE;
 				}
@@ -1951,8 +1962,8 @@ rspamd_archive_cheat_detect(struct rspamd_mime_part *part, const gchar *str,
 			if (rspamd_lc_cmp(p, str, strlen(str)) == 0) {
 				if (*(p - 1) == '.') {
 					if (magic_start != NULL) {
-						if (part->parsed_data.len > magic_len &&
-							memcmp(part->parsed_data.begin,
+						if (data->len > magic_len &&
+							memcmp(data->begin,
 								   magic_start, magic_len) == 0) {
 							return TRUE;
 						}
@@ -1966,16 +1977,16 @@ rspamd_archive_cheat_detect(struct rspamd_mime_part *part, const gchar *str,
 		}
 
 		if (magic_start != NULL) {
-			if (part->parsed_data.len > magic_len &&
-				memcmp(part->parsed_data.begin, magic_start, magic_len) == 0) {
+			if (data->len > magic_len &&
+				memcmp(data->begin, magic_start, magic_len) == 0) {
 				return TRUE;
 			}
 		}
 	}
 	else {
 		if (magic_start != NULL) {
-			if (part->parsed_data.len > magic_len &&
-				memcmp(part->parsed_data.begin, magic_start, magic_len) == 0) {
+			if (data->len > magic_len &&
+				memcmp(data->begin, magic_start, magic_len) == 0) {
 				return TRUE;
 			}
 		}
@@ -1984,34 +1995,75 @@ rspamd_archive_cheat_detect(struct rspamd_mime_part *part, const gchar *str,
 	return FALSE;
 }
 
-void rspamd_archives_process(struct rspamd_task *task)
+/*
+ * Detects archive type of a part by its name and magic
+ */
+static gboolean
+rspamd_archive_detect_type(struct rspamd_mime_part *part,
+						   enum rspamd_archive_type *type)
 {
-	guint i;
-	struct rspamd_mime_part *part;
 	const guchar rar_magic[] = {0x52, 0x61, 0x72, 0x21, 0x1A, 0x07};
 	const guchar zip_magic[] = {0x50, 0x4b, 0x03, 0x04};
 	const guchar sz_magic[] = {'7', 'z', 0xBC, 0xAF, 0x27, 0x1C};
 	const guchar gz_magic[] = {0x1F, 0x8B, 0x08};
 
+	if (rspamd_archive_cheat_detect(part, "zip",
+									zip_magic, sizeof(zip_magic))) {
+		*type = RSPAMD_ARCHIVE_ZIP;
+	}
+	else if (rspamd_archive_cheat_detect(part, "rar",
+										 rar_magic, sizeof(rar_magic))) {
+		*type = RSPAMD_ARCHIVE_RAR;
+	}
+	else if (rspamd_archive_cheat_detect(part, "7z",
+										 sz_magic, sizeof(sz_magic))) {
+		*type = RSPAMD_ARCHIVE_7ZIP;
+	}
+	else if (rspamd_archive_cheat_detect(part, "gz",
+										 gz_magic, sizeof(gz_magic))) {
+		*type = RSPAMD_ARCHIVE_GZIP;
+	}
+	else {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+gboolean rspamd_archives_part_is_archive(struct rspamd_mime_part *part)
+{
+	enum rspamd_archive_type type;
+
+	return part->part_type == RSPAMD_MIME_PART_UNDEFINED &&
+		   rspamd_archive_detect_type(part, &type);
+}
+
+void rspamd_archives_process(struct rspamd_task *task)
+{
+	guint i;
+	struct rspamd_mime_part *part;
+	enum rspamd_archive_type type;
+
 	PTR_ARRAY_FOREACH(MESSAGE_FIELD(task, parts), i, part)
 	{
 		if (part->part_type == RSPAMD_MIME_PART_UNDEFINED) {
-			if (part->parsed_data.len > 0) {
-				if (rspamd_archive_cheat_detect(part, "zip",
-												zip_magic, sizeof(zip_magic))) {
-					rspamd_archive_process_zip(task, part);
-				}
-				else if (rspamd_archive_cheat_detect(part, "rar",
-													 rar_magic, sizeof(rar_magic))) {
-					rspamd_archive_process_rar(task, part);
-				}
-				else if (rspamd_archive_cheat_detect(part, "7z",
-													 sz_magic, sizeof(sz_magic))) {
-					rspamd_archive_process_7zip(task, part);
-				}
-				else if (rspamd_archive_cheat_detect(part, "gz",
-													 gz_magic, sizeof(gz_magic))) {
-					rspamd_archive_process_gzip(task, part);
+			if (part->parsed_data.len > 0 ||
+				(part->flags & RSPAMD_MIME_PART_DELAYED_DECODE)) {
+				if (rspamd_archive_detect_type(part, &type)) {
+					switch (type) {
+					case RSPAMD_ARCHIVE_ZIP:
+						rspamd_archive_process_zip(task, part);
+						break;
+					case RSPAMD_ARCHIVE_RAR:
+						rspamd_archive_process_rar(task, part);
+						break;
+					case RSPAMD_ARCHIVE_7ZIP:
+						rspamd_archive_process_7zip(task, part);
+						break;
+					case RSPAMD_ARCHIVE_GZIP:
+						rspamd_archive_process_gzip(task, part);
+						break;
+					}
 				}
 
 				if (part->ct && (part->ct->flags & RSPAMD_CONTENT_TYPE_TEXT) &&
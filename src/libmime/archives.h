@@ -60,6 +60,13 @@ struct rspamd_archive {
  */
 void rspamd_archives_process(struct rspamd_task *task);
 
+struct rspamd_mime_part;
+
+/**
+ * Checks if a part is going to be processed as an archive
+ */
+gboolean rspamd_archives_part_is_archive(struct rspamd_mime_part *part);
+
 /**
  * Get textual representation of an archive's type
  */
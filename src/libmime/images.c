@@ -17,6 +17,7 @@
 #include "images.h"
 #include "task.h"
 #include "message.h"
+#include "mime_parser.h"
 #include "libserver/html/html.h"
 
 #define msg_debug_images(...) rspamd_conditional_debug_fast(NULL, NULL,                                               \
@@ -52,7 +53,9 @@ bool rspamd_images_process_mime_part_maybe(struct rspamd_task *task,
 	if (part->part_type == RSPAMD_MIME_PART_UNDEFINED) {
 		if (part->detected_type &&
 			strcmp(part->detected_type, "image") == 0 &&
-			part->parsed_data.len > 0) {
+			(part->parsed_data.len > 0 ||
+			 (part->flags & RSPAMD_MIME_PART_DELAYED_DECODE))) {
+			rspamd_mime_part_maybe_decode(part);
 
 			return process_image(task, part);
 		}
@@ -853,6 +853,7 @@ rspamd_message_process_text_part_maybe(struct rspamd_task *task,
 		flags |= RSPAMD_MIME_TEXT_PART_ATTACHMENT;
 	}
 
+	rspamd_mime_part_maybe_decode(mime_part);
 	text_part = rspamd_mempool_alloc0(task->task_pool,
 									  sizeof(struct rspamd_mime_text_part));
 	text_part->mime_part = mime_part;
@@ -1143,6 +1144,188 @@ rspamd_message_new(struct rspamd_task *task)
 	return msg;
 }
 
+/*
+ * Detects type of a part by lua_magic, parts with delayed decoding are
+ * checked by their decoded prefix
+ */
+static void
+rspamd_message_detect_part_type(struct rspamd_task *task,
+								struct rspamd_mime_part *part,
+								lua_State *L, gint magic_func_pos)
+{
+	struct rspamd_mime_part **pmime;
+	struct rspamd_task **ptask;
+	gint old_top = lua_gettop(L), err_idx, nargs = 2;
+
+	lua_pushcfunction(L, &rspamd_lua_traceback);
+	err_idx = lua_gettop(L);
+	lua_pushvalue(L, magic_func_pos);
+	pmime = lua_newuserdata(L, sizeof(struct rspamd_mime_part *));
+	rspamd_lua_setclass(L, "rspamd{mimepart}", -1);
+	*pmime = part;
+	ptask = lua_newuserdata(L, sizeof(struct rspamd_task *));
+	rspamd_lua_setclass(L, "rspamd{task}", -1);
+	*ptask = task;
+
+	if (part->flags & RSPAMD_MIME_PART_DELAYED_DECODE) {
+		lua_new_text(L, part->decoded_prefix.begin,
+					 part->decoded_prefix.len, FALSE);
+		nargs++;
+	}
+
+	if (lua_pcall(L, nargs, 2, err_idx) != 0) {
+		msg_err_task("cannot detect type: %s", lua_tostring(L, -1));
+	}
+	else {
+		if (lua_istable(L, -1)) {
+			const gchar *mb;
+
+			/* First returned value */
+			part->detected_ext = rspamd_mempool_strdup(task->task_pool,
+													   lua_tostring(L, -2));
+
+			lua_pushstring(L, "ct");
+			lua_gettable(L, -2);
+
+			if (lua_isstring(L, -1)) {
+				mb = lua_tostring(L, -1);
+
+				if (mb) {
+					rspamd_ftok_t srch;
+
+					srch.begin = mb;
+					srch.len = strlen(mb);
+					part->detected_ct = rspamd_content_type_parse(srch.begin,
+																  srch.len,
+																  task->task_pool);
+				}
+			}
+
+			lua_pop(L, 1);
+
+			lua_pushstring(L, "type");
+			lua_gettable(L, -2);
+
+			if (lua_isstring(L, -1)) {
+				part->detected_type = rspamd_mempool_strdup(task->task_pool,
+															lua_tostring(L, -1));
+			}
+
+			lua_pop(L, 1);
+
+			lua_pushstring(L, "no_text");
+			lua_gettable(L, -2);
+
+			if (lua_isboolean(L, -1)) {
+				if (!!lua_toboolean(L, -1)) {
+					part->flags |= RSPAMD_MIME_PART_NO_TEXT_EXTRACTION;
+				}
+			}
+
+			lua_pop(L, 1);
+		}
+	}
+
+	lua_settop(L, old_top);
+}
+
+/*
+ * Parts with delayed decoding have no digest after parsing. Their types are
+ * detected by their decoded prefixes, so the parts that are processed as
+ * archives, images or by lua_content are decoded once here, and other parts
+ * are hashed by chunks and stay encoded
+ */
+static void
+rspamd_message_process_delayed_parts(struct rspamd_task *task)
+{
+	struct rspamd_mime_part *part;
+	struct rspamd_mime_part **pmime;
+	lua_State *L = NULL;
+	gint magic_func_pos = -1, content_func_pos = -1, old_top = -1, err_idx;
+	gboolean need_decode, has_delayed = FALSE;
+	guint i;
+
+	PTR_ARRAY_FOREACH(MESSAGE_FIELD(task, parts), i, part)
+	{
+		if (part->flags & RSPAMD_MIME_PART_DELAYED_DECODE) {
+			has_delayed = TRUE;
+			break;
+		}
+	}
+
+	if (!has_delayed) {
+		return;
+	}
+
+	if (task->cfg) {
+		L = task->cfg->lua_state;
+	}
+
+	if (L) {
+		old_top = lua_gettop(L);
+
+		if (rspamd_lua_require_function(L,
+										"lua_magic", "detect_mime_part")) {
+			magic_func_pos = lua_gettop(L);
+		}
+		else {
+			msg_err_task("cannot require lua_magic.detect_mime_part");
+		}
+
+		if (rspamd_lua_require_function(L,
+										"lua_content", "has_content_module")) {
+			content_func_pos = lua_gettop(L);
+		}
+		else {
+			msg_err_task("cannot require lua_content.has_content_module");
+		}
+	}
+
+	PTR_ARRAY_FOREACH(MESSAGE_FIELD(task, parts), i, part)
+	{
+		if (!(part->flags & RSPAMD_MIME_PART_DELAYED_DECODE)) {
+			continue;
+		}
+
+		if (magic_func_pos != -1 && part->decoded_prefix.len > 0) {
+			rspamd_message_detect_part_type(task, part, L, magic_func_pos);
+		}
+
+		/* The same checks as in archives, images and lua_content processing */
+		need_decode = rspamd_archives_part_is_archive(part) ||
+					  (part->detected_type &&
+					   strcmp(part->detected_type, "image") == 0);
+
+		if (!need_decode && content_func_pos != -1) {
+			lua_pushcfunction(L, &rspamd_lua_traceback);
+			err_idx = lua_gettop(L);
+			lua_pushvalue(L, content_func_pos);
+			pmime = lua_newuserdata(L, sizeof(struct rspamd_mime_part *));
+			rspamd_lua_setclass(L, "rspamd{mimepart}", -1);
+			*pmime = part;
+
+			if (lua_pcall(L, 1, 1, err_idx) != 0) {
+				msg_err_task("cannot check content: %s", lua_tostring(L, -1));
+			}
+			else {
+				need_decode = lua_toboolean(L, -1);
+			}
+
+			lua_settop(L, err_idx - 1);
+		}
+
+		if (need_decode) {
+			rspamd_mime_part_maybe_decode(part);
+		}
+
+		rspamd_mime_parser_calc_digest(part);
+	}
+
+	if (L) {
+		lua_settop(L, old_top);
+	}
+}
+
 gboolean
 rspamd_message_parse(struct rspamd_task *task)
 {
@@ -1253,6 +1436,7 @@ rspamd_message_parse(struct rspamd_task *task)
 	}
 
 	rspamd_received_maybe_fix_task(task);
+	rspamd_message_process_delayed_parts(task);
 
 	struct rspamd_mime_part *part;
 
@@ -1436,78 +1620,15 @@ void rspamd_message_process(struct rspamd_task *task)
 
 	PTR_ARRAY_FOREACH(MESSAGE_FIELD(task, parts), i, part)
 	{
-		if (magic_func_pos != -1 && part->parsed_data.len > 0) {
-			struct rspamd_mime_part **pmime;
-			struct rspamd_task **ptask;
-
-			lua_pushcfunction(L, &rspamd_lua_traceback);
-			gint err_idx = lua_gettop(L);
-			lua_pushvalue(L, magic_func_pos);
-			pmime = lua_newuserdata(L, sizeof(struct rspamd_mime_part *));
-			rspamd_lua_setclass(L, "rspamd{mimepart}", -1);
-			*pmime = part;
-			ptask = lua_newuserdata(L, sizeof(struct rspamd_task *));
-			rspamd_lua_setclass(L, "rspamd{task}", -1);
-			*ptask = task;
-
-			if (lua_pcall(L, 2, 2, err_idx) != 0) {
-				msg_err_task("cannot detect type: %s", lua_tostring(L, -1));
-			}
-			else {
-				if (lua_istable(L, -1)) {
-					const gchar *mb;
-
-					/* First returned value */
-					part->detected_ext = rspamd_mempool_strdup(task->task_pool,
-															   lua_tostring(L, -2));
-
-					lua_pushstring(L, "ct");
-					lua_gettable(L, -2);
-
-					if (lua_isstring(L, -1)) {
-						mb = lua_tostring(L, -1);
-
-						if (mb) {
-							rspamd_ftok_t srch;
-
-							srch.begin = mb;
-							srch.len = strlen(mb);
-							part->detected_ct = rspamd_content_type_parse(srch.begin,
-																		  srch.len,
-																		  task->task_pool);
-						}
-					}
-
-					lua_pop(L, 1);
-
-					lua_pushstring(L, "type");
-					lua_gettable(L, -2);
-
-					if (lua_isstring(L, -1)) {
-						part->detected_type = rspamd_mempool_strdup(task->task_pool,
-																	lua_tostring(L, -1));
-					}
-
-					lua_pop(L, 1);
-
-					lua_pushstring(L, "no_text");
-					lua_gettable(L, -2);
-
-					if (lua_isboolean(L, -1)) {
-						if (!!lua_toboolean(L, -1)) {
-							part->flags |= RSPAMD_MIME_PART_NO_TEXT_EXTRACTION;
-						}
-					}
-
-					lua_pop(L, 1);
-				}
-			}
-
-			lua_settop(L, funcs_top);
+		/* Parts with delayed decoding are detected when the message is parsed */
+		if (magic_func_pos != -1 && part->parsed_data.len > 0 &&
+			part->decode_pool == NULL) {
+			rspamd_message_detect_part_type(task, part, L, magic_func_pos);
 		}
 
 		/* Now detect content */
-		if (content_func_pos != -1 && part->parsed_data.len > 0 &&
+		if (content_func_pos != -1 && (part->parsed_data.len > 0 ||
+									   (part->flags & RSPAMD_MIME_PART_DELAYED_DECODE)) &&
 			part->part_type == RSPAMD_MIME_PART_UNDEFINED) {
 			struct rspamd_mime_part **pmime;
 			struct rspamd_task **ptask;
@@ -34,6 +34,7 @@ enum rspamd_mime_part_flags {
 	RSPAMD_MIME_PART_BAD_CTE = (1u << 4u),
 	RSPAMD_MIME_PART_MISSING_CTE = (1u << 5u),
 	RSPAMD_MIME_PART_NO_TEXT_EXTRACTION = (1u << 6u),
+	RSPAMD_MIME_PART_DELAYED_DECODE = (1u << 7u),
 };
 
 enum rspamd_mime_part_type {
@@ -100,6 +101,10 @@ struct rspamd_mime_part {
 	guint flags;
 	enum rspamd_mime_part_type part_type;
 	guint part_number;
+	/* Pool to decode a part with RSPAMD_MIME_PART_DELAYED_DECODE flag */
+	rspamd_mempool_t *decode_pool;
+	/* Decoded prefix of a part with RSPAMD_MIME_PART_DELAYED_DECODE flag */
+	rspamd_ftok_t decoded_prefix;
 
 	union {
 		struct rspamd_mime_multipart *mp;
@@ -20,6 +20,7 @@
 #include "rspamd.h"
 #include "message.h"
 #include "mime_expressions.h"
+#include "mime_parser.h"
 #include "libserver/html/html.h"
 #include "lua/lua_common.h"
 #include "utlist.h"
@@ -2126,6 +2127,8 @@ compare_len(struct rspamd_mime_part *part, guint min, guint max)
 		return TRUE;
 	}
 
+	rspamd_mime_part_maybe_decode(part);
+
 	if (min == 0) {
 		return part->parsed_data.len <= max;
 	}
@@ -2278,7 +2281,8 @@ rspamd_is_empty_body(struct rspamd_task *task,
 
 	PTR_ARRAY_FOREACH(MESSAGE_FIELD(task, parts), i, part)
 	{
-		if (part->parsed_data.len > 0) {
+		if (part->parsed_data.len > 0 ||
+			(part->flags & RSPAMD_MIME_PART_DELAYED_DECODE)) {
 			return FALSE;
 		}
 	}
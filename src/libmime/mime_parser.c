@@ -20,15 +20,17 @@
 #include "mime_parser.h"
 #include "mime_headers.h"
 #include "message.h"
-#include "multipattern.h"
 #include "contrib/libottery/ottery.h"
 #include "contrib/uthash/utlist.h"
 #include <openssl/cms.h>
 #include <openssl/pkcs7.h>
 #include "contrib/fastutf8/fastutf8.h"
 
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
 struct rspamd_mime_parser_lib_ctx {
-	struct rspamd_multipattern *mp_boundary;
 	guchar hkey[rspamd_cryptobox_SIPKEYBYTES]; /* Key for hashing */
 	guint key_usages;
 };
@@ -37,6 +39,12 @@ struct rspamd_mime_parser_lib_ctx *lib_ctx = NULL;
 
 static const guint max_nested = 64;
 static const guint max_key_usages = 10000;
+/* Minimal size of a buffer for decoded data */
+#define RSPAMD_MIME_MIN_DECODED_LEN 16
+/* Encoded data of parts with delayed decoding is hashed by chunks of this size */
+#define RSPAMD_MIME_DELAYED_CHUNK_LEN 16384
+/* Decoded prefix kept for parts with delayed decoding (e.g. for lua_magic) */
+#define RSPAMD_MIME_DELAYED_PREFIX_LEN 65536
 
 #define msg_debug_mime(...) rspamd_conditional_debug_fast(NULL, task->from_addr,                                \
 														  rspamd_mime_log_id, "mime", task->task_pool->tag.uid, \
@@ -163,17 +171,6 @@ static void
 rspamd_mime_parser_init_lib(void)
 {
 	lib_ctx = g_malloc0(sizeof(*lib_ctx));
-	lib_ctx->mp_boundary = rspamd_multipattern_create(RSPAMD_MULTIPATTERN_DEFAULT);
-	g_assert(lib_ctx->mp_boundary != NULL);
-	rspamd_multipattern_add_pattern(lib_ctx->mp_boundary, "\r--", 0);
-	rspamd_multipattern_add_pattern(lib_ctx->mp_boundary, "\n--", 0);
-
-	GError *err = NULL;
-	if (!rspamd_multipattern_compile(lib_ctx->mp_boundary, RSPAMD_MULTIPATTERN_COMPILE_NO_FS, &err)) {
-		msg_err("fatal error: cannot compile multipattern for mime parser boundaries: %e", err);
-		g_error_free(err);
-		g_abort();
-	}
 	ottery_rand_bytes(lib_ctx->hkey, sizeof(lib_ctx->hkey));
 }
 
@@ -568,6 +565,148 @@ rspamd_mime_part_get_cd(struct rspamd_task *task, struct rspamd_mime_part *part)
 	part->cd = cd;
 }
 
+/*
+ * Returns the end of the next chunk of an encoded part that can be decoded
+ * independently: quoted-printable escapes never span lines, and base64 is cut
+ * on a quantum boundary while no padding has been seen
+ */
+static const gchar *
+rspamd_mime_part_next_chunk(struct rspamd_mime_part *part, const gchar *p)
+{
+	const gchar *end = part->raw_data.begin + part->raw_data.len, *c;
+	guint nalpha = 0;
+
+	if ((gsize) (end - p) <= RSPAMD_MIME_DELAYED_CHUNK_LEN) {
+		return end;
+	}
+
+	if (part->cte == RSPAMD_CTE_QP) {
+		c = memchr(p + RSPAMD_MIME_DELAYED_CHUNK_LEN, '\n',
+				   end - p - RSPAMD_MIME_DELAYED_CHUNK_LEN);
+
+		return c ? c + 1 : end;
+	}
+
+	for (c = p; c < end; c++) {
+		if (*c == '=') {
+			/* Padding is decoded along with the rest of the part */
+			return end;
+		}
+
+		if (g_ascii_isalnum(*c) || *c == '+' || *c == '/') {
+			nalpha++;
+
+			if ((nalpha & 3) == 0 && c - p >= RSPAMD_MIME_DELAYED_CHUNK_LEN) {
+				return c + 1;
+			}
+		}
+	}
+
+	return end;
+}
+
+/*
+ * Decodes a chunk of a part with delayed decoding to the `out` buffer that
+ * is grown if needed, returns length of the decoded data or -1 on error
+ */
+static gssize
+rspamd_mime_part_decode_chunk(struct rspamd_mime_part *part,
+							  const gchar *p, const gchar *c,
+							  gchar **out, gsize *out_size)
+{
+	gsize dlen;
+
+	if (*out_size < (gsize) (c - p) + 12) {
+		*out_size = (c - p) + 12;
+		*out = g_realloc(*out, *out_size);
+	}
+
+	if (part->cte == RSPAMD_CTE_QP) {
+		return rspamd_decode_qp_buf(p, c - p, *out, *out_size);
+	}
+
+	dlen = *out_size;
+	rspamd_cryptobox_base64_decode(p, c - p, (guchar *) *out, &dlen);
+
+	return dlen;
+}
+
+/*
+ * Decodes the beginning of a part with delayed decoding, so its type can be
+ * detected before it is decided whether the whole part is decoded
+ */
+static void
+rspamd_mime_part_decode_prefix(struct rspamd_mime_part *part)
+{
+	const gchar *p, *c, *end;
+	gchar *out = NULL, *prefix;
+	gsize out_size = 0, prefix_size;
+	gssize r;
+
+	/* Decoded data is never larger than the encoded one */
+	prefix_size = MIN(part->raw_data.len, RSPAMD_MIME_DELAYED_PREFIX_LEN);
+	prefix = rspamd_mempool_alloc_buffer(part->decode_pool, prefix_size);
+	part->decoded_prefix.begin = prefix;
+	part->decoded_prefix.len = 0;
+	p = part->raw_data.begin;
+	end = p + part->raw_data.len;
+
+	while (p < end && part->decoded_prefix.len < prefix_size) {
+		c = rspamd_mime_part_next_chunk(part, p);
+		r = rspamd_mime_part_decode_chunk(part, p, c, &out, &out_size);
+
+		if (r == -1) {
+			break;
+		}
+
+		r = MIN((gsize) r, prefix_size - part->decoded_prefix.len);
+		memcpy(prefix + part->decoded_prefix.len, out, r);
+		part->decoded_prefix.len += r;
+		p = c;
+	}
+
+	g_free(out);
+}
+
+/*
+ * Calculates digest of a part with delayed decoding by decoding it chunk by
+ * chunk, so the decoded content is not kept in memory; returns FALSE if a
+ * part cannot be decoded this way
+ */
+static gboolean
+rspamd_mime_part_delayed_digest(struct rspamd_mime_part *part,
+								const guchar *key, gsize keylen)
+{
+	rspamd_cryptobox_hash_state_t st;
+	const gchar *p, *c, *end;
+	gchar *out = NULL;
+	gsize out_size = 0;
+	gssize r;
+
+	rspamd_cryptobox_hash_init(&st, key, keylen);
+	p = part->raw_data.begin;
+	end = p + part->raw_data.len;
+
+	while (p < end) {
+		c = rspamd_mime_part_next_chunk(part, p);
+		r = rspamd_mime_part_decode_chunk(part, p, c, &out, &out_size);
+
+		if (r == -1) {
+			g_free(out);
+
+			return FALSE;
+		}
+
+		rspamd_cryptobox_hash_update(&st, (const guchar *) out, r);
+		p = c;
+	}
+
+	g_free(out);
+	rspamd_cryptobox_hash_final(&st, part->digest);
+
+	return TRUE;
+}
+
 void rspamd_mime_parser_calc_digest(struct rspamd_mime_part *part)
 {
 	/* Blake2b applied to string 'rspamd' */
@@ -638,6 +777,15 @@ void rspamd_mime_parser_calc_digest(struct rspamd_mime_part *part)
 		0xfe,
 	};
 
+	if (part->flags & RSPAMD_MIME_PART_DELAYED_DECODE) {
+		if (rspamd_mime_part_delayed_digest(part, hash_key, sizeof(hash_key))) {
+			return;
+		}
+
+		/* Cannot decode by chunks, so decode the whole part */
+		rspamd_mime_part_maybe_decode(part);
+	}
+
 	if (part->parsed_data.len > 0) {
 		rspamd_cryptobox_hash(part->digest,
 							  part->parsed_data.begin, part->parsed_data.len,
@@ -645,6 +793,133 @@ void rspamd_mime_parser_calc_digest(struct rspamd_mime_part *part)
 	}
 }
 
+/*
+ * Decodes content transfer encoding of a part once into a pool buffer
+ * sized from the encoded length
+ */
+static void
+rspamd_mime_part_decode_cte(rspamd_mempool_t *pool,
+							struct rspamd_mime_part *part)
+{
+	gchar *parsed;
+	gsize parsed_len;
+	gssize r;
+
+	switch (part->cte) {
+	case RSPAMD_CTE_7BIT:
+	case RSPAMD_CTE_8BIT:
+	case RSPAMD_CTE_UNKNOWN:
+		if (part->ct && (part->ct->flags & RSPAMD_CONTENT_TYPE_TEXT)) {
+			/* Need to copy text as we have couple of in-place change functions */
+			parsed = rspamd_mempool_alloc_buffer(pool,
+												 MAX(part->raw_data.len, RSPAMD_MIME_MIN_DECODED_LEN));
+			memcpy(parsed, part->raw_data.begin, part->raw_data.len);
+			part->parsed_data.begin = parsed;
+			part->parsed_data.len = part->raw_data.len;
+		}
+		else {
+			part->parsed_data.begin = part->raw_data.begin;
+			part->parsed_data.len = part->raw_data.len;
+		}
+		break;
+	case RSPAMD_CTE_QP:
+		/* Decoded data is never larger than the encoded one */
+		parsed_len = MAX(part->raw_data.len, RSPAMD_MIME_MIN_DECODED_LEN);
+		parsed = rspamd_mempool_alloc_buffer(pool, parsed_len);
+		r = rspamd_decode_qp_buf(part->raw_data.begin, part->raw_data.len,
+								 parsed, parsed_len);
+		if (r != -1) {
+			part->parsed_data.begin = parsed;
+			part->parsed_data.len = r;
+		}
+		else {
+			msg_err_pool("invalid quoted-printable encoded part, assume 8bit");
+			if (part->ct) {
+				part->ct->flags |= RSPAMD_CONTENT_TYPE_BROKEN;
+			}
+			part->cte = RSPAMD_CTE_8BIT;
+			memcpy(parsed, part->raw_data.begin, part->raw_data.len);
+			part->parsed_data.begin = parsed;
+			part->parsed_data.len = part->raw_data.len;
+		}
+		break;
+	case RSPAMD_CTE_B64:
+		parsed_len = part->raw_data.len / 4 * 3 + 12;
+		parsed = rspamd_mempool_alloc_buffer(pool, parsed_len);
+		/* Selects the best SIMD implementation available for this length */
+		rspamd_cryptobox_base64_decode(part->raw_data.begin,
+									   part->raw_data.len,
+									   (guchar *) parsed, &parsed_len);
+		part->parsed_data.begin = parsed;
+		part->parsed_data.len = parsed_len;
+		break;
+	case RSPAMD_CTE_UUE:
+		parsed_len = MAX(part->raw_data.len / 4 * 3 + 12, RSPAMD_MIME_MIN_DECODED_LEN);
+		parsed = rspamd_mempool_alloc_buffer(pool, parsed_len);
+		r = rspamd_decode_uue_buf(part->raw_data.begin, part->raw_data.len,
+								  parsed, parsed_len);
+		if (r != -1) {
+			part->parsed_data.begin = parsed;
+			part->parsed_data.len = r;
+		}
+		else {
+			msg_err_pool("invalid uuencoding in encoded part, assume 8bit");
+			if (part->ct) {
+				part->ct->flags |= RSPAMD_CONTENT_TYPE_BROKEN;
+			}
+			part->cte = RSPAMD_CTE_8BIT;
+			parsed_len = MIN(part->raw_data.len, parsed_len);
+			memcpy(parsed, part->raw_data.begin, parsed_len);
+			part->parsed_data.begin = parsed;
+			part->parsed_data.len = parsed_len;
+		}
+		break;
+	default:
+		g_assert_not_reached();
+	}
+}
+
+void rspamd_mime_part_maybe_decode(struct rspamd_mime_part *part)
+{
+	if (part->flags & RSPAMD_MIME_PART_DELAYED_DECODE) {
+		part->flags &= ~RSPAMD_MIME_PART_DELAYED_DECODE;
+		rspamd_mime_part_decode_cte(part->decode_pool, part);
+	}
+}
+
+/*
+ * Checks if decoding of a part can be delayed until it is accessed:
+ * only large encoded parts that are not processed as text, messages or
+ * signatures are delayed
+ */
+static gboolean
+rspamd_mime_part_can_delay_decode(struct rspamd_task *task,
+								  struct rspamd_mime_part *part,
+								  struct rspamd_content_type *ct)
+{
+	if (task->cfg == NULL || task->cfg->max_decode_size == 0 ||
+		part->raw_data.len <= task->cfg->max_decode_size) {
+		return FALSE;
+	}
+
+	/* Only these encodings can be decoded by chunks */
+	if (part->cte != RSPAMD_CTE_QP && part->cte != RSPAMD_CTE_B64) {
+		return FALSE;
+	}
+
+	if (part->ct == NULL ||
+		(part->ct->flags & (RSPAMD_CONTENT_TYPE_TEXT | RSPAMD_CONTENT_TYPE_MESSAGE |
+							RSPAMD_CONTENT_TYPE_MISSING))) {
+		return FALSE;
+	}
+
+	if (ct && (ct->flags & RSPAMD_CONTENT_TYPE_SMIME)) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 static enum rspamd_mime_parse_error
 rspamd_mime_parse_normal_part(struct rspamd_task *task,
 							  struct rspamd_mime_part *part,
@@ -652,9 +927,6 @@ rspamd_mime_parse_normal_part(struct rspamd_task *task,
 							  struct rspamd_content_type *ct,
 							  GError **err)
 {
-	rspamd_fstring_t *parsed;
-	gssize r;
-
 	g_assert(part != NULL);
 
 	rspamd_mime_part_get_cte(task, part->raw_headers, part,
@@ -690,96 +962,39 @@ rspamd_mime_parse_normal_part(struct rspamd_task *task,
 			}
 		}
 
-		if (part->ct && (part->ct->flags & RSPAMD_CONTENT_TYPE_TEXT)) {
-			/* Need to copy text as we have couple of in-place change functions */
-			parsed = rspamd_fstring_sized_new(part->raw_data.len);
-			parsed->len = part->raw_data.len;
-			memcpy(parsed->str, part->raw_data.begin, parsed->len);
-			part->parsed_data.begin = parsed->str;
-			part->parsed_data.len = parsed->len;
-			rspamd_mempool_notify_alloc(task->task_pool, parsed->len);
-			rspamd_mempool_add_destructor(task->task_pool,
-										  (rspamd_mempool_destruct_t) rspamd_fstring_free, parsed);
-		}
-		else {
-			part->parsed_data.begin = part->raw_data.begin;
-			part->parsed_data.len = part->raw_data.len;
-		}
 		break;
 	case RSPAMD_CTE_QP:
-		parsed = rspamd_fstring_sized_new(part->raw_data.len);
-		r = rspamd_decode_qp_buf(part->raw_data.begin, part->raw_data.len,
-								 parsed->str, parsed->allocated);
-		if (r != -1) {
-			parsed->len = r;
-			part->parsed_data.begin = parsed->str;
-			part->parsed_data.len = parsed->len;
-			rspamd_mempool_notify_alloc(task->task_pool, parsed->len);
-			rspamd_mempool_add_destructor(task->task_pool,
-										  (rspamd_mempool_destruct_t) rspamd_fstring_free, parsed);
-		}
-		else {
-			msg_err_task("invalid quoted-printable encoded part, assume 8bit");
-			if (part->ct) {
-				part->ct->flags |= RSPAMD_CONTENT_TYPE_BROKEN;
-			}
-			part->cte = RSPAMD_CTE_8BIT;
-			memcpy(parsed->str, part->raw_data.begin, part->raw_data.len);
-			parsed->len = part->raw_data.len;
-			part->parsed_data.begin = parsed->str;
-			part->parsed_data.len = parsed->len;
-			rspamd_mempool_notify_alloc(task->task_pool, parsed->len);
-			rspamd_mempool_add_destructor(task->task_pool,
-										  (rspamd_mempool_destruct_t) rspamd_fstring_free, parsed);
-		}
-		break;
 	case RSPAMD_CTE_B64:
-		parsed = rspamd_fstring_sized_new(part->raw_data.len / 4 * 3 + 12);
-		rspamd_cryptobox_base64_decode(part->raw_data.begin,
-									   part->raw_data.len,
-									   parsed->str, &parsed->len);
-		part->parsed_data.begin = parsed->str;
-		part->parsed_data.len = parsed->len;
-		rspamd_mempool_notify_alloc(task->task_pool, parsed->len);
-		rspamd_mempool_add_destructor(task->task_pool,
-									  (rspamd_mempool_destruct_t) rspamd_fstring_free, parsed);
-		break;
 	case RSPAMD_CTE_UUE:
-		parsed = rspamd_fstring_sized_new(part->raw_data.len / 4 * 3 + 12);
-		r = rspamd_decode_uue_buf(part->raw_data.begin, part->raw_data.len,
-								  parsed->str, parsed->allocated);
-		rspamd_mempool_notify_alloc(task->task_pool, parsed->len);
-		rspamd_mempool_add_destructor(task->task_pool,
-									  (rspamd_mempool_destruct_t) rspamd_fstring_free, parsed);
-		if (r != -1) {
-			parsed->len = r;
-			part->parsed_data.begin = parsed->str;
-			part->parsed_data.len = parsed->len;
-		}
-		else {
-			msg_err_task("invalid uuencoding in encoded part, assume 8bit");
-			if (part->ct) {
-				part->ct->flags |= RSPAMD_CONTENT_TYPE_BROKEN;
-			}
-			part->cte = RSPAMD_CTE_8BIT;
-			parsed->len = MIN(part->raw_data.len, parsed->allocated);
-			memcpy(parsed->str, part->raw_data.begin, parsed->len);
-			rspamd_mempool_notify_alloc(task->task_pool, parsed->len);
-			part->parsed_data.begin = parsed->str;
-			part->parsed_data.len = parsed->len;
-		}
 		break;
 	default:
 		g_assert_not_reached();
 	}
 
+	if (rspamd_mime_part_can_delay_decode(task, part, ct)) {
+		/* Parts processors decode a part when they need its content */
+		part->flags |= RSPAMD_MIME_PART_DELAYED_DECODE;
+		part->decode_pool = task->task_pool;
+		part->parsed_data.begin = NULL;
+		part->parsed_data.len = 0;
+		rspamd_mime_part_decode_prefix(part);
+		msg_debug_mime("delay decoding of part of length %z", part->raw_data.len);
+	}
+	else {
+		rspamd_mime_part_decode_cte(task->task_pool, part);
+	}
+
 	part->part_number = MESSAGE_FIELD(task, parts)->len;
 	part->urls = g_ptr_array_new();
 	g_ptr_array_add(MESSAGE_FIELD(task, parts), part);
 	msg_debug_mime("parsed data part %T/%T of length %z (%z orig), %s cte",
 				   &part->ct->type, &part->ct->subtype, part->parsed_data.len,
 				   part->raw_data.len, rspamd_cte_to_string(part->cte));
-	rspamd_mime_parser_calc_digest(part);
+
+	if (!(part->flags & RSPAMD_MIME_PART_DELAYED_DECODE)) {
+		/* Delayed parts are hashed when their types are detected */
+		rspamd_mime_parser_calc_digest(part);
+	}
 
 	if (ct && (ct->flags & RSPAMD_CONTENT_TYPE_SMIME)) {
 		CMS_ContentInfo *cms;
@@ -1202,21 +1417,21 @@ rspamd_mime_parse_multipart_part(struct rspamd_task *task,
 	return ret;
 }
 
-/* Process boundary like structures in a message */
-static gint
-rspamd_mime_preprocess_cb(struct rspamd_multipattern *mp,
-						  guint strnum,
-						  gint match_start,
-						  gint match_pos,
-						  const gchar *text,
-						  gsize len,
-						  void *context)
+/*
+ * Process boundary like structure in a message, match_pos points after
+ * the leading `--`
+ */
+static void
+rspamd_mime_preprocess_boundary(const gchar *text,
+								gsize len,
+								gsize match_pos,
+								void *ud)
 {
 	const gchar *end = text + len, *p = text + match_pos, *bend;
 	gsize blen;
 	gboolean closing = FALSE;
 	struct rspamd_mime_boundary b;
-	struct rspamd_mime_parser_ctx *st = context;
+	struct rspamd_mime_parser_ctx *st = ud;
 	struct rspamd_task *task;
 
 	task = st->task;
@@ -1326,8 +1541,65 @@ rspamd_mime_preprocess_cb(struct rspamd_multipattern *mp,
 			g_array_append_val(st->boundaries, b);
 		}
 	}
+}
+
+/*
+ * Most of the message body (e.g. base64 attachments) has no dashes at all,
+ * so we check 16 positions at once and call the boundary handler for exact
+ * matches only
+ */
+void rspamd_mime_scan_boundaries(const gchar *text,
+								 gsize len,
+								 rspamd_mime_boundary_cb cb,
+								 void *ud)
+{
+	/* Position of the first dash, the previous character must be a newline */
+	gsize i = 1;
+
+	if (len < 3) {
+		return;
+	}
+
+#if defined(__x86_64__)
+	const __m128i dash = _mm_set1_epi8('-'), cr = _mm_set1_epi8('\r'),
+				  lf = _mm_set1_epi8('\n');
+
+	/* We read text[i - 1] .. text[i + 16] on each step */
+	while (i + 17 <= len) {
+		__m128i prev = _mm_loadu_si128((const __m128i *) (text + i - 1));
+		__m128i cur = _mm_loadu_si128((const __m128i *) (text + i));
+		__m128i next = _mm_loadu_si128((const __m128i *) (text + i + 1));
+		__m128i m = _mm_and_si128(
+			_mm_and_si128(_mm_cmpeq_epi8(cur, dash), _mm_cmpeq_epi8(next, dash)),
+			_mm_or_si128(_mm_cmpeq_epi8(prev, cr), _mm_cmpeq_epi8(prev, lf)));
+		guint mask = _mm_movemask_epi8(m);
+
+		while (mask) {
+			cb(text, len, i + __builtin_ctz(mask) + 2, ud);
+			mask &= mask - 1;
+		}
+
+		i += 16;
+	}
+#endif
+
+	while (i + 1 < len) {
+		const gchar *p = memchr(text + i, '-', len - 1 - i);
+
+		if (p == NULL) {
+			break;
+		}
+
+		i = p - text;
 
-	return 0;
+		if (text[i + 1] == '-' && (text[i - 1] == '\r' || text[i - 1] == '\n')) {
+			cb(text, len, i + 2, ud);
+			i += 2;
+		}
+		else {
+			i++;
+		}
+	}
 }
 
 static goffset
@@ -1403,16 +1675,13 @@ rspamd_mime_preprocess_message(struct rspamd_task *task,
 {
 
 	if (top->raw_data.begin >= st->pos) {
-		rspamd_multipattern_lookup(lib_ctx->mp_boundary,
-								   top->raw_data.begin - 1,
-								   top->raw_data.len + 1,
-								   rspamd_mime_preprocess_cb, st, NULL);
+		rspamd_mime_scan_boundaries(top->raw_data.begin - 1,
+									top->raw_data.len + 1,
+									rspamd_mime_preprocess_boundary, st);
 	}
 	else {
-		rspamd_multipattern_lookup(lib_ctx->mp_boundary,
-								   st->pos,
-								   st->end - st->pos,
-								   rspamd_mime_preprocess_cb, st, NULL);
+		rspamd_mime_scan_boundaries(st->pos, st->end - st->pos,
+									rspamd_mime_preprocess_boundary, st);
 	}
 }
 
@@ -38,6 +38,31 @@ enum rspamd_mime_parse_error rspamd_mime_parse_task(struct rspamd_task *task,
 
 void rspamd_mime_parser_calc_digest(struct rspamd_mime_part *part);
 
+/**
+ * Decodes a part if its decoding has been delayed by the parser (see
+ * `max_decode` option), does nothing otherwise
+ * @param part
+ */
+void rspamd_mime_part_maybe_decode(struct rspamd_mime_part *part);
+
+typedef void (*rspamd_mime_boundary_cb)(const gchar *text,
+										gsize len,
+										gsize match_pos,
+										void *ud);
+
+/**
+ * Finds all `--` sequences that follow `\r` or `\n` and calls `cb` for each
+ * of them in order, `match_pos` points after the dashes
+ * @param text
+ * @param len
+ * @param cb
+ * @param ud
+ */
+void rspamd_mime_scan_boundaries(const gchar *text,
+								 gsize len,
+								 rspamd_mime_boundary_cb cb,
+								 void *ud);
+
 
 #ifdef __cplusplus
 }
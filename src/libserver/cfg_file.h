@@ -355,7 +355,8 @@ struct rspamd_config {
 	gboolean check_all_filters;                              /**< check all filters									*/
 	gboolean allow_raw_input;                                /**< scan messages with invalid mime					*/
 	gboolean disable_hyperscan;                              /**< disable hyperscan usage							*/
-	gboolean vectorized_hyperscan;                           /**< use vectorized hyperscan matching					*/
+	gboolean vectorized_hyperscan;                           /**< use streaming hyperscan for multi-input classes	*/
+	gboolean eager_hyperscan;                                /**< scan all hyperscan classes after parsing			*/
 	gboolean enable_shutdown_workaround;                     /**< enable workaround for legacy SA clients (exim)		*/
 	gboolean ignore_received;                                /**< Ignore data from the first received header			*/
 	gboolean enable_sessions_cache;                          /**< Enable session cache for debug						*/
@@ -372,7 +373,9 @@ struct rspamd_config {
 	gchar *cores_dir;           /**< directory for core files							*/
 	gsize max_message;          /**< maximum size for messages							*/
 	gsize max_pic_size;         /**< maximum size for a picture to process				*/
+	gsize max_decode_size;      /**< larger non-text parts are decoded on access		*/
 	gsize images_cache_size;    /**< size of LRU cache for DCT data from images			*/
+	gsize css_cache_size;       /**< size of LRU cache for parsed stylesheets			*/
 	gdouble task_timeout;       /**< maximum message processing time					*/
 	gint default_max_shots;     /**< default maximum count of symbols hits permitted (-1 for unlimited) */
 	gint32 heartbeats_loss_max; /**< number of heartbeats lost to consider worker's termination */
@@ -420,6 +423,7 @@ struct rspamd_config {
 	gdouble map_timeout;               /**< maps watch timeout									*/
 	gdouble map_file_watch_multiplier; /**< multiplier for watch timeout when maps are files	*/
 	gchar *maps_cache_dir;             /**< where to save HTTP cached data						*/
+	gboolean maps_shared_index;        /**< share kv maps indexes built by the cache owner		*/
 
 	gdouble monitored_interval; /**< interval between monitored checks					*/
 	gboolean disable_monitored; /**< disable monitoring completely						*/
@@ -428,10 +432,15 @@ struct rspamd_config {
 	struct rspamd_symcache *cache; /**< symbols cache object								*/
 	gchar *cache_filename;         /**< filename of cache file								*/
 	gdouble cache_reload_time;     /**< how often cache reload should be performed			*/
+	gboolean cache_adaptive_order; /**< order filters by observed cost and hit rate			*/
 	gchar *checksum;               /**< real checksum of config file						*/
 	gpointer lua_state;            /**< pointer to lua state								*/
 	gpointer lua_thread_pool;      /**< pointer to lua thread (coroutine) pool				*/
 
+	gdouble cache_trace_probability; /**< probability to trace symbols execution for a task	*/
+	gchar *cache_trace_dir;          /**< where to save symbols execution traces				*/
+	gchar *cache_trace_format;       /**< format of saved traces: chrome or folded			*/
+
 	gchar *rrd_file;       /**< rrd file to store statistics						*/
 	gchar *history_file;   /**< file to save rolling history						*/
 	gchar *stats_file;     /**< file to save stats 						*/
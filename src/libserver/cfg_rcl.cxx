@@ -1760,6 +1760,30 @@ rspamd_rcl_config_init(struct rspamd_config *cfg, GHashTable *skip_sections)
 									   G_STRUCT_OFFSET(struct rspamd_config, cache_reload_time),
 									   RSPAMD_CL_FLAG_TIME_FLOAT,
 									   "How often cache reload should be performed");
+		rspamd_rcl_add_default_handler(sub,
+									   "cache_adaptive_order",
+									   rspamd_rcl_parse_struct_boolean,
+									   G_STRUCT_OFFSET(struct rspamd_config, cache_adaptive_order),
+									   0,
+									   "Order filters by their observed cost and hit rate (default: true)");
+		rspamd_rcl_add_default_handler(sub,
+									   "cache_trace_probability",
+									   rspamd_rcl_parse_struct_double,
+									   G_STRUCT_OFFSET(struct rspamd_config, cache_trace_probability),
+									   0,
+									   "Probability to trace symbols execution for a task (default: 0)");
+		rspamd_rcl_add_default_handler(sub,
+									   "cache_trace_dir",
+									   rspamd_rcl_parse_struct_string,
+									   G_STRUCT_OFFSET(struct rspamd_config, cache_trace_dir),
+									   RSPAMD_CL_FLAG_STRING_PATH,
+									   "Directory to save symbols execution traces");
+		rspamd_rcl_add_default_handler(sub,
+									   "cache_trace_format",
+									   rspamd_rcl_parse_struct_string,
+									   G_STRUCT_OFFSET(struct rspamd_config, cache_trace_format),
+									   0,
+									   "Format of saved traces: chrome (default) or folded");
 
 		/* Old DNS configuration */
 		rspamd_rcl_add_default_handler(sub,
@@ -1858,6 +1882,12 @@ rspamd_rcl_config_init(struct rspamd_config *cfg, GHashTable *skip_sections)
 									   G_STRUCT_OFFSET(struct rspamd_config, maps_cache_dir),
 									   0,
 									   "Directory to save maps cached data (default: $DBDIR)");
+		rspamd_rcl_add_default_handler(sub,
+									   "maps_shared_index",
+									   rspamd_rcl_parse_struct_boolean,
+									   G_STRUCT_OFFSET(struct rspamd_config, maps_shared_index),
+									   0,
+									   "Build kv maps indexes once in the map owner and share them with other workers");
 		rspamd_rcl_add_default_handler(sub,
 									   "monitoring_watch_interval",
 									   rspamd_rcl_parse_struct_time,
@@ -1989,7 +2019,13 @@ rspamd_rcl_config_init(struct rspamd_config *cfg, GHashTable *skip_sections)
 									   rspamd_rcl_parse_struct_boolean,
 									   G_STRUCT_OFFSET(struct rspamd_config, vectorized_hyperscan),
 									   0,
-									   "Use hyperscan in vectorized mode (obsoleted, do not use)");
+									   "Scan multi-input regexp classes (headers, urls, emails, words, selectors) as a single hyperscan stream");
+		rspamd_rcl_add_default_handler(sub,
+									   "eager_hyperscan",
+									   rspamd_rcl_parse_struct_boolean,
+									   G_STRUCT_OFFSET(struct rspamd_config, eager_hyperscan),
+									   0,
+									   "Scan all hyperscan regexp classes once after message parsing");
 		rspamd_rcl_add_default_handler(sub,
 									   "cores_dir",
 									   rspamd_rcl_parse_struct_string,
@@ -2062,12 +2098,24 @@ rspamd_rcl_config_init(struct rspamd_config *cfg, GHashTable *skip_sections)
 									   G_STRUCT_OFFSET(struct rspamd_config, max_pic_size),
 									   RSPAMD_CL_FLAG_INT_SIZE,
 									   "Maximum size of the picture to be normalized (1Mb by default)");
+		rspamd_rcl_add_default_handler(sub,
+									   "max_decode",
+									   rspamd_rcl_parse_struct_integer,
+									   G_STRUCT_OFFSET(struct rspamd_config, max_decode_size),
+									   RSPAMD_CL_FLAG_INT_SIZE,
+									   "Decode larger non-text parts only when they are accessed (0 to decode all parts, default)");
 		rspamd_rcl_add_default_handler(sub,
 									   "images_cache",
 									   rspamd_rcl_parse_struct_integer,
 									   G_STRUCT_OFFSET(struct rspamd_config, max_pic_size),
 									   RSPAMD_CL_FLAG_INT_SIZE,
 									   "Size of DCT data cache for images (256 elements by default)");
+		rspamd_rcl_add_default_handler(sub,
+									   "css_cache",
+									   rspamd_rcl_parse_struct_integer,
+									   G_STRUCT_OFFSET(struct rspamd_config, css_cache_size),
+									   RSPAMD_CL_FLAG_INT_SIZE,
+									   "Size of parsed stylesheets cache (128 elements by default, 0 to disable)");
 		rspamd_rcl_add_default_handler(sub,
 									   "zstd_input_dictionary",
 									   rspamd_rcl_parse_struct_string,
@@ -281,6 +281,7 @@ rspamd_config_new(enum rspamd_config_init_flags flags)
 	cfg->log_error_elt_maxlen = 1000;
 	cfg->log_task_max_elts = 7;
 	cfg->cache_reload_time = 30.0;
+	cfg->cache_adaptive_order = TRUE;
 	cfg->max_lua_urls = 1024;
 	cfg->max_urls = cfg->max_lua_urls * 10;
 	cfg->max_recipients = 1024;
@@ -330,6 +331,7 @@ rspamd_config_new(enum rspamd_config_init_flags flags)
 	cfg->max_message = DEFAULT_MAX_MESSAGE;
 	cfg->max_pic_size = DEFAULT_MAX_PIC;
 	cfg->images_cache_size = 256;
+	cfg->css_cache_size = 128;
 	cfg->monitored_ctx = rspamd_monitored_ctx_init();
 	cfg->neighbours = ucl_object_typed_new(UCL_OBJECT);
 	cfg->redis_pool = rspamd_redis_pool_init();
@@ -19,6 +19,10 @@
 #include "css_parser.hxx"
 #include "libserver/html/html_tag.hxx"
 #include "libserver/html/html_block.hxx"
+#include "libutil/hash.h"
+#include "libcryptobox/cryptobox.h"
+
+#include <array>
 
 /* Keep unit tests implementation here (it'll possibly be moved outside one day) */
 #define DOCTEST_CONFIG_IMPLEMENTATION_IN_DLL
@@ -41,8 +45,74 @@ public:
 	selectors_hash class_selectors;
 	selectors_hash id_selectors;
 	std::optional<universal_selector_t> universal_selector;
+
+	/*
+	 * Declarations compiled to html blocks, so matching a tag does not need
+	 * to compile anything; blocks are allocated in the stylesheet pool
+	 */
+	struct compiled_selectors {
+		using blocks_hash = ankerl::unordered_dense::map<std::string_view, const html::html_block *>;
+		blocks_hash ids;
+		blocks_hash classes;
+		std::array<const html::html_block *, Tag_MAX> tags{};
+		/* Tag blocks with universal selector applied (or just universal block) */
+		std::array<const html::html_block *, Tag_MAX> tags_merged{};
+		const html::html_block *universal = nullptr;
+	};
+	/* Built on the first check, reset if a stylesheet is modified after that */
+	std::optional<compiled_selectors> compiled;
+
+	auto compile(rspamd_mempool_t *pool) -> const compiled_selectors &;
 };
 
+auto css_style_sheet::impl::compile(rspamd_mempool_t *pool) -> const compiled_selectors &
+{
+	if (compiled) {
+		return compiled.value();
+	}
+
+	auto &res = compiled.emplace();
+
+	for (const auto &[sel, decl]: id_selectors) {
+		res.ids.emplace(std::get<std::string_view>(sel->value), decl->compile_to_block(pool));
+	}
+
+	for (const auto &[sel, decl]: class_selectors) {
+		res.classes.emplace(std::get<std::string_view>(sel->value), decl->compile_to_block(pool));
+	}
+
+	if (universal_selector) {
+		res.universal = universal_selector->second->compile_to_block(pool);
+	}
+
+	for (const auto &[sel, decl]: tags_selector) {
+		auto id = static_cast<int>(std::get<tag_id_t>(sel->value));
+
+		if (id > Tag_UNKNOWN && id < Tag_MAX) {
+			res.tags[id] = decl->compile_to_block(pool);
+		}
+	}
+
+	for (auto i = 0; i < Tag_MAX; i++) {
+		if (res.tags[i]) {
+			if (res.universal) {
+				auto *merged = rspamd_mempool_alloc_type(pool, html::html_block);
+				*merged = *res.tags[i];
+				merged->propagate_block(*res.universal);
+				res.tags_merged[i] = merged;
+			}
+			else {
+				res.tags_merged[i] = res.tags[i];
+			}
+		}
+		else {
+			res.tags_merged[i] = res.universal;
+		}
+	}
+
+	return res;
+}
+
 css_style_sheet::css_style_sheet(rspamd_mempool_t *pool)
 	: pool(pool), pimpl(new impl)
 {
@@ -56,6 +126,8 @@ auto css_style_sheet::add_selector_rule(std::unique_ptr<css_selector> &&selector
 {
 	impl::selectors_hash *target_hash = nullptr;
 
+	pimpl->compiled.reset();
+
 	switch (selector->type) {
 	case css_selector::selector_type::SELECTOR_ALL:
 		if (pimpl->universal_selector) {
@@ -105,105 +177,92 @@ auto css_style_sheet::add_selector_rule(std::unique_ptr<css_selector> &&selector
 	}
 }
 
-auto css_style_sheet::check_tag_block(const rspamd::html::html_tag *tag) -> rspamd::html::html_block *
+auto css_style_sheet::check_tag_block(const rspamd::html::html_tag *tag,
+									  rspamd_mempool_t *pool) const -> rspamd::html::html_block *
 {
 	std::optional<std::string_view> id_comp, class_comp;
 	rspamd::html::html_block *res = nullptr;
 
-	if (!tag) {
+	if (!tag || tag->id <= Tag_UNKNOWN || tag->id >= Tag_MAX) {
 		return nullptr;
 	}
 
-	/* First, find id in a tag and a class */
-	for (const auto &param: tag->components) {
-		if (param.type == html::html_component_type::RSPAMD_HTML_COMPONENT_ID) {
-			id_comp = param.value;
+	/* Compiled blocks are allocated in the stylesheet pool and can be shared */
+	const auto &compiled = pimpl->compile(this->pool);
+	/* Resulting block is modified by a caller, so it is always copied */
+	auto merge_block = [&](const rspamd::html::html_block *blk) {
+		if (res == nullptr) {
+			res = rspamd_mempool_alloc_type(pool, rspamd::html::html_block);
+			*res = *blk;
+		}
+		else {
+			res->propagate_block(*blk);
 		}
-		else if (param.type == html::html_component_type::RSPAMD_HTML_COMPONENT_CLASS) {
-			class_comp = param.value;
+	};
+
+	/* First, find id in a tag and a class */
+	if (!compiled.ids.empty() || !compiled.classes.empty()) {
+		for (const auto &param: tag->components) {
+			if (param.type == html::html_component_type::RSPAMD_HTML_COMPONENT_ID) {
+				id_comp = param.value;
+			}
+			else if (param.type == html::html_component_type::RSPAMD_HTML_COMPONENT_CLASS) {
+				class_comp = param.value;
+			}
 		}
 	}
 
 	/* ID part */
-	if (id_comp && !pimpl->id_selectors.empty()) {
-		auto found_id_sel = pimpl->id_selectors.find(css_selector{id_comp.value()});
+	if (id_comp && !compiled.ids.empty()) {
+		auto found_id = compiled.ids.find(id_comp.value());
 
-		if (found_id_sel != pimpl->id_selectors.end()) {
-			const auto &decl = *(found_id_sel->second);
-			res = decl.compile_to_block(pool);
+		if (found_id != compiled.ids.end()) {
+			merge_block(found_id->second);
 		}
 	}
 
 	/* Class part */
-	if (class_comp && !pimpl->class_selectors.empty()) {
-		auto sv_split = [](auto strv, std::string_view delims = " ") -> std::vector<std::string_view> {
-			std::vector<decltype(strv)> ret;
-			std::size_t start = 0;
-
-			while (start < strv.size()) {
-				const auto last = strv.find_first_of(delims, start);
-				if (start != last) {
-					ret.emplace_back(strv.substr(start, last - start));
-				}
-
-				if (last == std::string_view::npos) {
-					break;
-				}
-
-				start = last + 1;
-			}
-
-			return ret;
-		};
+	if (class_comp && !compiled.classes.empty()) {
+		auto classes = class_comp.value();
+		std::size_t start = 0;
 
-		auto elts = sv_split(class_comp.value());
+		while (start < classes.size()) {
+			const auto last = classes.find(' ', start);
+			const auto cls = classes.substr(start, last - start);
 
-		for (const auto &e: elts) {
-			auto found_class_sel = pimpl->class_selectors.find(
-				css_selector{e, css_selector::selector_type::SELECTOR_CLASS});
+			if (!cls.empty()) {
+				auto found_class = compiled.classes.find(cls);
 
-			if (found_class_sel != pimpl->class_selectors.end()) {
-				const auto &decl = *(found_class_sel->second);
-				auto *tmp = decl.compile_to_block(pool);
-
-				if (res == nullptr) {
-					res = tmp;
-				}
-				else {
-					res->propagate_block(*tmp);
+				if (found_class != compiled.classes.end()) {
+					merge_block(found_class->second);
 				}
 			}
+
+			if (last == std::string_view::npos) {
+				break;
+			}
+
+			start = last + 1;
 		}
 	}
 
-	/* Tags part */
-	if (!pimpl->tags_selector.empty()) {
-		auto found_tag_sel = pimpl->tags_selector.find(
-			css_selector{static_cast<tag_id_t>(tag->id)});
+	if (res == nullptr) {
+		/* Common case: tag and universal selectors are precomputed */
+		if (compiled.tags_merged[tag->id]) {
+			merge_block(compiled.tags_merged[tag->id]);
+		}
 
-		if (found_tag_sel != pimpl->tags_selector.end()) {
-			const auto &decl = *(found_tag_sel->second);
-			auto *tmp = decl.compile_to_block(pool);
+		return res;
+	}
 
-			if (res == nullptr) {
-				res = tmp;
-			}
-			else {
-				res->propagate_block(*tmp);
-			}
-		}
+	/* Tags part */
+	if (compiled.tags[tag->id]) {
+		merge_block(compiled.tags[tag->id]);
 	}
 
 	/* Finally, universal selector */
-	if (pimpl->universal_selector) {
-		auto *tmp = pimpl->universal_selector->second->compile_to_block(pool);
-
-		if (res == nullptr) {
-			res = tmp;
-		}
-		else {
-			res->propagate_block(*tmp);
-		}
+	if (compiled.universal) {
+		merge_block(compiled.universal);
 	}
 
 	return res;
@@ -224,4 +283,143 @@ auto css_parse_style(rspamd_mempool_t *pool,
 	return std::make_pair(nullptr, parse_res.error());
 }
 
+/*
+ * Cached stylesheets are shared between tasks, so we store them in a
+ * per-process LRU; each of them owns a memory pool used for parsing
+ */
+struct css_cache_entry {
+	guchar digest[rspamd_cryptobox_HASHBYTES];
+	std::shared_ptr<css_style_sheet> sheet;
+};
+
+static rspamd_lru_hash_t *css_cache = nullptr;
+
+static void
+css_cache_entry_dtor(gpointer p)
+{
+	delete reinterpret_cast<css_cache_entry *>(p);
+}
+
+static guint32
+css_cache_digest_hash(gconstpointer p)
+{
+	return rspamd_cryptobox_fast_hash(p, rspamd_cryptobox_HASHBYTES,
+									  rspamd_hash_seed());
+}
+
+static gboolean
+css_cache_digest_equal(gconstpointer a, gconstpointer b)
+{
+	return memcmp(a, b, rspamd_cryptobox_HASHBYTES) == 0;
+}
+
+static auto
+css_parse_styles_uncached(rspamd_mempool_t *pool,
+						  const std::vector<std::string_view> &inputs,
+						  css_parse_error_cb err_cb) -> std::shared_ptr<css_style_sheet>
+{
+	std::shared_ptr<css_style_sheet> ret;
+
+	for (const auto &input: inputs) {
+		/* Keep the previous blocks if the current one cannot be parsed */
+		auto parse_res = rspamd::css::parse_css(pool, input,
+												std::shared_ptr<css_style_sheet>{ret});
+
+		if (parse_res.has_value()) {
+			ret = parse_res.value();
+		}
+		else {
+			err_cb(parse_res.error());
+		}
+	}
+
+	return ret;
+}
+
+auto css_parse_styles(rspamd_mempool_t *pool,
+					  const std::vector<std::string_view> &inputs,
+					  std::size_t cache_size,
+					  css_parse_error_cb err_cb) -> std::shared_ptr<css_style_sheet>
+{
+	if (inputs.empty()) {
+		return nullptr;
+	}
+
+	if (cache_size == 0) {
+		return css_parse_styles_uncached(pool, inputs, err_cb);
+	}
+
+	if (css_cache == nullptr) {
+		css_cache = rspamd_lru_hash_new_full(cache_size, nullptr,
+											 css_cache_entry_dtor,
+											 css_cache_digest_hash, css_cache_digest_equal);
+	}
+
+	guchar digest[rspamd_cryptobox_HASHBYTES];
+	rspamd_cryptobox_hash_state_t st;
+
+	rspamd_cryptobox_hash_init(&st, nullptr, 0);
+
+	for (const auto &input: inputs) {
+		/* Length is hashed to distinguish different splits of the same text */
+		guint64 len = input.size();
+		rspamd_cryptobox_hash_update(&st, (const guchar *) &len, sizeof(len));
+		rspamd_cryptobox_hash_update(&st, (const guchar *) input.data(), input.size());
+	}
+
+	rspamd_cryptobox_hash_final(&st, digest);
+
+	auto *found = reinterpret_cast<css_cache_entry *>(
+		rspamd_lru_hash_lookup(css_cache, digest, 0));
+
+	if (found) {
+		msg_debug_css("reuse cached stylesheet for %d style blocks", (int) inputs.size());
+		return found->sheet;
+	}
+
+	/* Parsed data must outlive the task, so we use a dedicated pool */
+	auto *sheet_pool = rspamd_mempool_new(rspamd_mempool_suggest_size(), "css", 0);
+	auto sheet = css_parse_styles_uncached(sheet_pool, inputs, err_cb);
+
+	if (!sheet) {
+		rspamd_mempool_delete(sheet_pool);
+
+		return nullptr;
+	}
+
+	auto *entry = new css_cache_entry;
+	memcpy(entry->digest, digest, sizeof(digest));
+	/* Pool is released with the last reference to the stylesheet */
+	entry->sheet = std::shared_ptr<css_style_sheet>(sheet.get(),
+													[sheet, sheet_pool](css_style_sheet *) mutable {
+														sheet.reset();
+														rspamd_mempool_delete(sheet_pool);
+													});
+	rspamd_lru_hash_insert(css_cache, entry->digest, entry, 0, 0);
+
+	return entry->sheet;
+}
+
+TEST_SUITE("css")
+{
+	TEST_CASE("css styles cache")
+	{
+		rspamd_mempool_t *pool = rspamd_mempool_new(rspamd_mempool_suggest_size(),
+													"css", 0);
+		const std::vector<std::string_view> split{"p { color: red }", "em { display: none }"};
+		const std::vector<std::string_view> joined{"p { color: red }em { display: none }"};
+		auto ignore_error = [](const css_parse_error &) {};
+
+		auto first = css_parse_styles(pool, split, 16, ignore_error);
+		auto second = css_parse_styles(pool, split, 16, ignore_error);
+
+		CHECK(first.get() != nullptr);
+		CHECK(first.get() == second.get());
+		CHECK(css_parse_styles(pool, joined, 16, ignore_error).get() != first.get());
+		CHECK(css_parse_styles(pool, split, 0, ignore_error).get() != first.get());
+
+		rspamd_mempool_delete(pool);
+	}
+}
+
 }// namespace rspamd::css
\ No newline at end of file
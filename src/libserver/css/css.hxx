@@ -20,7 +20,9 @@
 
 #include <string>
 #include <memory>
+#include <vector>
 #include "logger.h"
+#include "function2/function2.hpp"
 #include "css_rule.hxx"
 #include "css_selector.hxx"
 
@@ -50,7 +52,12 @@ public:
 	auto add_selector_rule(std::unique_ptr<css_selector> &&selector,
 						   css_declarations_block_ptr decls) -> void;
 
-	auto check_tag_block(const rspamd::html::html_tag *tag) -> rspamd::html::html_block *;
+	/*
+	 * Resulting block is allocated in the specified pool, as a stylesheet itself
+	 * could be shared between tasks
+	 */
+	auto check_tag_block(const rspamd::html::html_tag *tag,
+						 rspamd_mempool_t *pool) const -> rspamd::html::html_block *;
 
 private:
 	class impl;
@@ -63,6 +70,18 @@ auto css_parse_style(rspamd_mempool_t *pool,
 					 std::string_view input,
 					 std::shared_ptr<css_style_sheet> &&existing) -> css_return_pair;
 
+using css_parse_error_cb = fu2::function_view<void(const css_parse_error &)>;
+/*
+ * Parses all style blocks of a document into a single stylesheet.
+ * If cache_size is not zero, then the result is memoized in a per-process LRU
+ * keyed by the hash of the inputs: such a stylesheet owns its memory and must
+ * not be modified, as it is shared between tasks
+ */
+auto css_parse_styles(rspamd_mempool_t *pool,
+					  const std::vector<std::string_view> &inputs,
+					  std::size_t cache_size,
+					  css_parse_error_cb err_cb) -> std::shared_ptr<css_style_sheet>;
+
 }// namespace rspamd::css
 
 #endif//RSPAMD_CSS_H
\ No newline at end of file
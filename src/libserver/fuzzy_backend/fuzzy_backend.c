@@ -18,6 +18,7 @@
 #include "fuzzy_backend.h"
 #include "fuzzy_backend_sqlite.h"
 #include "fuzzy_backend_redis.h"
+#include "fuzzy_backend_memory.h"
 #include "cfg_file.h"
 #include "fuzzy_wire.h"
 
@@ -26,6 +27,7 @@
 enum rspamd_fuzzy_backend_type {
 	RSPAMD_FUZZY_BACKEND_SQLITE = 0,
 	RSPAMD_FUZZY_BACKEND_REDIS = 1,
+	RSPAMD_FUZZY_BACKEND_MEMORY = 2,
 };
 
 static void *rspamd_fuzzy_backend_init_sqlite(struct rspamd_fuzzy_backend *bk,
@@ -34,6 +36,11 @@ static void rspamd_fuzzy_backend_check_sqlite(struct rspamd_fuzzy_backend *bk,
 											  const struct rspamd_fuzzy_cmd *cmd,
 											  rspamd_fuzzy_check_cb cb, void *ud,
 											  void *subr_ud);
+static void rspamd_fuzzy_backend_check_batch_sqlite(struct rspamd_fuzzy_backend *bk,
+													const struct rspamd_fuzzy_cmd **cmds,
+													guint ncmds,
+													rspamd_fuzzy_check_cb cb, void **uds,
+													void *subr_ud);
 static void rspamd_fuzzy_backend_update_sqlite(struct rspamd_fuzzy_backend *bk,
 											   GArray *updates, const gchar *src,
 											   rspamd_fuzzy_update_cb cb, void *ud,
@@ -60,6 +67,12 @@ struct rspamd_fuzzy_backend_subr {
 				  const struct rspamd_fuzzy_cmd *cmd,
 				  rspamd_fuzzy_check_cb cb, void *ud,
 				  void *subr_ud);
+	/* Optional, if missing then commands are checked one by one */
+	void (*check_batch)(struct rspamd_fuzzy_backend *bk,
+						const struct rspamd_fuzzy_cmd **cmds,
+						guint ncmds,
+						rspamd_fuzzy_check_cb cb, void **uds,
+						void *subr_ud);
 	void (*update)(struct rspamd_fuzzy_backend *bk,
 				   GArray *updates, const gchar *src,
 				   rspamd_fuzzy_update_cb cb, void *ud,
@@ -80,6 +93,7 @@ static const struct rspamd_fuzzy_backend_subr fuzzy_subrs[] = {
 	[RSPAMD_FUZZY_BACKEND_SQLITE] = {
 		.init = rspamd_fuzzy_backend_init_sqlite,
 		.check = rspamd_fuzzy_backend_check_sqlite,
+		.check_batch = rspamd_fuzzy_backend_check_batch_sqlite,
 		.update = rspamd_fuzzy_backend_update_sqlite,
 		.count = rspamd_fuzzy_backend_count_sqlite,
 		.version = rspamd_fuzzy_backend_version_sqlite,
@@ -90,12 +104,23 @@ static const struct rspamd_fuzzy_backend_subr fuzzy_subrs[] = {
 	[RSPAMD_FUZZY_BACKEND_REDIS] = {
 		.init = rspamd_fuzzy_backend_init_redis,
 		.check = rspamd_fuzzy_backend_check_redis,
+		.check_batch = rspamd_fuzzy_backend_check_batch_redis,
 		.update = rspamd_fuzzy_backend_update_redis,
 		.count = rspamd_fuzzy_backend_count_redis,
 		.version = rspamd_fuzzy_backend_version_redis,
 		.id = rspamd_fuzzy_backend_id_redis,
 		.periodic = rspamd_fuzzy_backend_expire_redis,
 		.close = rspamd_fuzzy_backend_close_redis,
+	},
+	[RSPAMD_FUZZY_BACKEND_MEMORY] = {
+		.init = rspamd_fuzzy_backend_init_memory,
+		.check = rspamd_fuzzy_backend_check_memory,
+		.update = rspamd_fuzzy_backend_update_memory,
+		.count = rspamd_fuzzy_backend_count_memory,
+		.version = rspamd_fuzzy_backend_version_memory,
+		.id = rspamd_fuzzy_backend_id_memory,
+		.periodic = rspamd_fuzzy_backend_expire_memory,
+		.close = rspamd_fuzzy_backend_close_memory,
 	}};
 
 struct rspamd_fuzzy_backend {
@@ -151,6 +176,30 @@ rspamd_fuzzy_backend_check_sqlite(struct rspamd_fuzzy_backend *bk,
 	}
 }
 
+static void
+rspamd_fuzzy_backend_check_batch_sqlite(struct rspamd_fuzzy_backend *bk,
+										const struct rspamd_fuzzy_cmd **cmds,
+										guint ncmds,
+										rspamd_fuzzy_check_cb cb, void **uds,
+										void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_sqlite *sq = subr_ud;
+	struct rspamd_fuzzy_reply *reps;
+	guint i;
+
+	reps = g_malloc0(sizeof(*reps) * ncmds);
+	/* All lookups are done within a single transaction */
+	rspamd_fuzzy_backend_sqlite_check_batch(sq, cmds, ncmds, bk->expire, reps);
+
+	if (cb) {
+		for (i = 0; i < ncmds; i++) {
+			cb(&reps[i], uds[i]);
+		}
+	}
+
+	g_free(reps);
+}
+
 static void
 rspamd_fuzzy_backend_update_sqlite(struct rspamd_fuzzy_backend *bk,
 								   GArray *updates, const gchar *src,
@@ -288,6 +337,9 @@ rspamd_fuzzy_backend_create(struct ev_loop *ev_base,
 			else if (strcmp(ucl_object_tostring(elt), "redis") == 0) {
 				type = RSPAMD_FUZZY_BACKEND_REDIS;
 			}
+			else if (strcmp(ucl_object_tostring(elt), "memory") == 0) {
+				type = RSPAMD_FUZZY_BACKEND_MEMORY;
+			}
 			else {
 				g_set_error(err, rspamd_fuzzy_backend_quark(),
 							EINVAL, "invalid backend type: %s",
@@ -328,6 +380,29 @@ void rspamd_fuzzy_backend_check(struct rspamd_fuzzy_backend *bk,
 	bk->subr->check(bk, cmd, cb, ud, bk->subr_ud);
 }
 
+void rspamd_fuzzy_backend_check_batch(struct rspamd_fuzzy_backend *bk,
+									  const struct rspamd_fuzzy_cmd **cmds,
+									  guint ncmds,
+									  rspamd_fuzzy_check_cb cb, void **uds)
+{
+	guint i;
+
+	g_assert(bk != NULL);
+
+	if (ncmds == 0) {
+		return;
+	}
+
+	if (bk->subr->check_batch && ncmds > 1) {
+		bk->subr->check_batch(bk, cmds, ncmds, cb, uds, bk->subr_ud);
+	}
+	else {
+		for (i = 0; i < ncmds; i++) {
+			bk->subr->check(bk, cmds[i], cb, uds[i], bk->subr_ud);
+		}
+	}
+}
+
 static guint
 rspamd_fuzzy_digest_hash(gconstpointer key)
 {
@@ -68,6 +68,20 @@ void rspamd_fuzzy_backend_check(struct rspamd_fuzzy_backend *bk,
 								const struct rspamd_fuzzy_cmd *cmd,
 								rspamd_fuzzy_check_cb cb, void *ud);
 
+/**
+ * Check several hashes at once, the backend can resolve all digests and
+ * shingles of the batch in a single round trip. Callback is called once per
+ * command with the corresponding element of `uds`
+ * @param cmds array of commands
+ * @param ncmds number of commands
+ * @param cb
+ * @param uds array of `ncmds` user data pointers
+ */
+void rspamd_fuzzy_backend_check_batch(struct rspamd_fuzzy_backend *bk,
+									  const struct rspamd_fuzzy_cmd **cmds,
+									  guint ncmds,
+									  rspamd_fuzzy_check_cb cb, void **uds);
+
 /**
  * Process updates for a specific queue
  * @param bk
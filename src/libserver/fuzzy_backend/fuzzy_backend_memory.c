@@ -0,0 +1,1330 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "fuzzy_backend.h"
+#include "fuzzy_backend_memory.h"
+#include "cryptobox.h"
+#include "util.h"
+#include "unix-std.h"
+
+#include <sys/mman.h>
+
+#define msg_err_fuzzy_memory(...) rspamd_default_log_function(G_LOG_LEVEL_CRITICAL,     \
+															  "fuzzy_memory", bk->id, \
+															  G_STRFUNC,              \
+															  __VA_ARGS__)
+#define msg_warn_fuzzy_memory(...) rspamd_default_log_function(G_LOG_LEVEL_WARNING,      \
+															   "fuzzy_memory", bk->id, \
+															   G_STRFUNC,              \
+															   __VA_ARGS__)
+#define msg_info_fuzzy_memory(...) rspamd_default_log_function(G_LOG_LEVEL_INFO,         \
+															   "fuzzy_memory", bk->id, \
+															   G_STRFUNC,              \
+															   __VA_ARGS__)
+#define msg_debug_fuzzy_memory(...) rspamd_conditional_debug_fast(NULL, NULL,                                   \
+																  rspamd_fuzzy_memory_log_id, "fuzzy_memory", bk->id, \
+																  G_STRFUNC,                                    \
+																  __VA_ARGS__)
+
+INIT_LOG_MODULE(fuzzy_memory)
+
+#define FUZZY_MEMORY_DEFAULT_SLOTS 65536
+#define FUZZY_MEMORY_MAX_SOURCES 16
+#define FUZZY_MEMORY_WAL_SEED 0xdeadbabe
+/* A slot that stays locked for so many reads is treated as a miss */
+#define FUZZY_MEMORY_READ_RETRIES 1024
+
+static const guchar rspamd_fuzzy_memory_magic[8] = {'r', 's', 'f', 'z', 'm', 'e', 'm', '1'};
+
+enum rspamd_fuzzy_memory_slot_state {
+	FUZZY_MEMORY_SLOT_EMPTY = 0,
+	FUZZY_MEMORY_SLOT_LIVE,
+	FUZZY_MEMORY_SLOT_DELETED,
+};
+
+/*
+ * Digest slot, guarded by a sequence counter: the writer makes it odd while
+ * the slot is modified, readers retry if they have seen an odd or changed value
+ */
+struct rspamd_fuzzy_memory_slot {
+	guint32 seq;
+	guint32 gen; /* changed each time a slot gets a new digest */
+	guint32 state;
+	guint32 flag;
+	gint64 value;
+	gint64 ts;
+	gchar digest[rspamd_cryptobox_HASHBYTES];
+};
+
+/*
+ * Shingle entry: `ref` packs generation and index of the digest slot,
+ * zero means an empty entry
+ */
+struct rspamd_fuzzy_memory_shingle {
+	guint64 hash;
+	guint64 ref;
+};
+
+struct rspamd_fuzzy_memory_source {
+	gchar name[56];
+	guint64 version;
+};
+
+struct rspamd_fuzzy_memory_hdr {
+	guchar magic[8];
+	guint32 nslots;   /* power of two, the same for digests and each shingle table */
+	guint32 obsolete; /* the file has been replaced with a rebuilt one */
+	guint64 nhashes;
+	guint64 nused; /* live and deleted digest slots */
+	guint64 nshingles[RSPAMD_SHINGLE_SIZE];
+	guint64 wal_seq; /* the last record written to the write-ahead log */
+	struct rspamd_fuzzy_memory_source sources[FUZZY_MEMORY_MAX_SOURCES];
+};
+
+enum rspamd_fuzzy_memory_wal_op {
+	FUZZY_MEMORY_WAL_SET = 1,
+	FUZZY_MEMORY_WAL_DEL,
+	FUZZY_MEMORY_WAL_VERSION,
+};
+
+/*
+ * Log records store the resulting state and not a command, so replaying
+ * a record that is already in the snapshot is harmless. Records are
+ * written and synced before they are applied to the tables
+ */
+struct rspamd_fuzzy_memory_wal_rec {
+	guint64 seq;
+	guint32 op;
+	guint32 flag;
+	gint64 value;
+	gint64 ts;
+	gchar digest[rspamd_cryptobox_HASHBYTES]; /* source name for version records */
+	guint64 shingles[RSPAMD_SHINGLE_SIZE];
+	guint32 nshingles;
+	guint32 reserved;
+	guint64 checksum;
+};
+
+struct rspamd_fuzzy_memory_map {
+	gint fd;
+	gsize len;
+	struct rspamd_fuzzy_memory_hdr *hdr;
+	struct rspamd_fuzzy_memory_slot *slots;
+	struct rspamd_fuzzy_memory_shingle *shingles; /* RSPAMD_SHINGLE_SIZE tables */
+};
+
+struct rspamd_fuzzy_backend_memory {
+	gchar *path;
+	gchar *wal_path;
+	gint wal_fd;
+	struct rspamd_fuzzy_memory_map map;
+	guint32 min_slots;
+	gboolean written;
+	GArray *wal_buf;
+	gchar id[MEMPOOL_UID_LEN];
+};
+
+static GQuark
+rspamd_fuzzy_memory_quark(void)
+{
+	return g_quark_from_static_string("fuzzy-memory");
+}
+
+static inline gsize
+rspamd_fuzzy_memory_hdr_size(void)
+{
+	/* Keep slots aligned to a cache line */
+	return (sizeof(struct rspamd_fuzzy_memory_hdr) + 63) & ~((gsize) 63);
+}
+
+static inline gsize
+rspamd_fuzzy_memory_file_size(guint32 nslots)
+{
+	return rspamd_fuzzy_memory_hdr_size() +
+		   (gsize) nslots * sizeof(struct rspamd_fuzzy_memory_slot) +
+		   (gsize) nslots * RSPAMD_SHINGLE_SIZE * sizeof(struct rspamd_fuzzy_memory_shingle);
+}
+
+static inline struct rspamd_fuzzy_memory_shingle *
+rspamd_fuzzy_memory_shingle_table(struct rspamd_fuzzy_memory_map *map, guint i)
+{
+	return map->shingles + (gsize) i * map->hdr->nslots;
+}
+
+static inline guint64
+rspamd_fuzzy_memory_digest_hash(const gchar *digest)
+{
+	guint64 h;
+
+	/* Digests are distributed uniformly */
+	memcpy(&h, digest, sizeof(h));
+
+	return h;
+}
+
+static void
+rspamd_fuzzy_memory_unmap(struct rspamd_fuzzy_memory_map *map)
+{
+	if (map->hdr) {
+		munmap(map->hdr, map->len);
+		map->hdr = NULL;
+	}
+
+	if (map->fd != -1) {
+		close(map->fd);
+		map->fd = -1;
+	}
+}
+
+static gboolean
+rspamd_fuzzy_memory_map_fd(struct rspamd_fuzzy_memory_map *map, gint fd,
+						   const gchar *path, GError **err)
+{
+	struct stat st;
+	struct rspamd_fuzzy_memory_hdr *hdr;
+	gpointer p;
+
+	if (fstat(fd, &st) == -1) {
+		g_set_error(err, rspamd_fuzzy_memory_quark(), errno,
+					"cannot stat %s: %s", path, strerror(errno));
+		return FALSE;
+	}
+
+	if (st.st_size < rspamd_fuzzy_memory_hdr_size()) {
+		g_set_error(err, rspamd_fuzzy_memory_quark(), EINVAL,
+					"truncated fuzzy storage %s", path);
+		return FALSE;
+	}
+
+	p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (p == MAP_FAILED) {
+		g_set_error(err, rspamd_fuzzy_memory_quark(), errno,
+					"cannot mmap %s: %s", path, strerror(errno));
+		return FALSE;
+	}
+
+	hdr = (struct rspamd_fuzzy_memory_hdr *) p;
+
+	if (memcmp(hdr->magic, rspamd_fuzzy_memory_magic, sizeof(hdr->magic)) != 0 ||
+		hdr->nslots == 0 || (hdr->nslots & (hdr->nslots - 1)) != 0 ||
+		rspamd_fuzzy_memory_file_size(hdr->nslots) != (gsize) st.st_size) {
+		munmap(p, st.st_size);
+		g_set_error(err, rspamd_fuzzy_memory_quark(), EINVAL,
+					"invalid fuzzy storage %s", path);
+		return FALSE;
+	}
+
+	map->fd = fd;
+	map->len = st.st_size;
+	map->hdr = hdr;
+	map->slots = (struct rspamd_fuzzy_memory_slot *) (((guchar *) p) +
+													  rspamd_fuzzy_memory_hdr_size());
+	map->shingles = (struct rspamd_fuzzy_memory_shingle *) (map->slots + hdr->nslots);
+
+	return TRUE;
+}
+
+static gint
+rspamd_fuzzy_memory_create(const gchar *path, guint32 nslots, GError **err)
+{
+	struct rspamd_fuzzy_memory_hdr hdr;
+	gint fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 00644);
+
+	if (fd == -1) {
+		g_set_error(err, rspamd_fuzzy_memory_quark(), errno,
+					"cannot create %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, rspamd_fuzzy_memory_magic, sizeof(hdr.magic));
+	hdr.nslots = nslots;
+
+	/* Tables are sparse zeroes, which means empty slots */
+	if (ftruncate(fd, rspamd_fuzzy_memory_file_size(nslots)) == -1 ||
+		pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+		g_set_error(err, rspamd_fuzzy_memory_quark(), errno,
+					"cannot allocate %s: %s", path, strerror(errno));
+		close(fd);
+		unlink(path);
+
+		return -1;
+	}
+
+	return fd;
+}
+
+static gboolean
+rspamd_fuzzy_memory_open(struct rspamd_fuzzy_backend_memory *bk, GError **err)
+{
+	gint fd;
+
+	fd = open(bk->path, O_RDWR);
+
+	if (fd == -1 && errno == ENOENT) {
+		fd = rspamd_fuzzy_memory_create(bk->path, bk->min_slots, err);
+
+		if (fd == -1) {
+			return FALSE;
+		}
+
+		msg_info_fuzzy_memory("created fuzzy storage %s with %ud slots",
+							  bk->path, bk->min_slots);
+	}
+	else if (fd == -1) {
+		g_set_error(err, rspamd_fuzzy_memory_quark(), errno,
+					"cannot open %s: %s", bk->path, strerror(errno));
+		return FALSE;
+	}
+
+	if (!rspamd_fuzzy_memory_map_fd(&bk->map, fd, bk->path, err)) {
+		close(fd);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * The writer replaces the whole file when tables are rebuilt, so other
+ * processes must follow it
+ */
+static void
+rspamd_fuzzy_memory_maybe_reopen(struct rspamd_fuzzy_backend_memory *bk)
+{
+	struct rspamd_fuzzy_memory_map old;
+	GError *err = NULL;
+
+	if (!__atomic_load_n(&bk->map.hdr->obsolete, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+
+	old = bk->map;
+	bk->map.fd = -1;
+	bk->map.hdr = NULL;
+
+	if (!rspamd_fuzzy_memory_open(bk, &err)) {
+		msg_err_fuzzy_memory("cannot reopen rebuilt fuzzy storage: %e", err);
+		g_error_free(err);
+		bk->map = old;
+
+		return;
+	}
+
+	rspamd_fuzzy_memory_unmap(&old);
+}
+
+/*
+ * Returns FALSE if a consistent copy cannot be read, e.g. if a writer has
+ * died in the middle of the slot update
+ */
+static gboolean
+rspamd_fuzzy_memory_read_slot(const struct rspamd_fuzzy_memory_slot *slot,
+							  struct rspamd_fuzzy_memory_slot *copy)
+{
+	guint32 seq, i;
+
+	for (i = 0; i < FUZZY_MEMORY_READ_RETRIES; i++) {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+		if (seq & 1u) {
+			continue;
+		}
+
+		memcpy(copy, slot, sizeof(*copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static inline void
+rspamd_fuzzy_memory_write_begin(struct rspamd_fuzzy_memory_slot *slot)
+{
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void
+rspamd_fuzzy_memory_write_end(struct rspamd_fuzzy_memory_slot *slot)
+{
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Returns index of a live slot with the specified digest or -1
+ */
+static gint64
+rspamd_fuzzy_memory_find(struct rspamd_fuzzy_memory_map *map,
+						 const gchar *digest,
+						 struct rspamd_fuzzy_memory_slot *copy)
+{
+	guint32 mask = map->hdr->nslots - 1, i, n;
+
+	i = rspamd_fuzzy_memory_digest_hash(digest) & mask;
+
+	for (n = 0; n <= mask; n++, i = (i + 1) & mask) {
+		if (!rspamd_fuzzy_memory_read_slot(&map->slots[i], copy)) {
+			/* Unreadable slot is skipped as it is not a match */
+			continue;
+		}
+
+		if (copy->state == FUZZY_MEMORY_SLOT_EMPTY) {
+			break;
+		}
+
+		if (copy->state == FUZZY_MEMORY_SLOT_LIVE &&
+			memcmp(copy->digest, digest, sizeof(copy->digest)) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static gint64
+rspamd_fuzzy_memory_find_shingle(struct rspamd_fuzzy_memory_map *map,
+								 guint table, guint64 hash)
+{
+	struct rspamd_fuzzy_memory_shingle *sh =
+		rspamd_fuzzy_memory_shingle_table(map, table);
+	struct rspamd_fuzzy_memory_slot copy;
+	guint32 mask = map->hdr->nslots - 1, i, n, idx;
+	guint64 ref;
+
+	i = (hash ^ (hash >> 32)) & mask;
+
+	for (n = 0; n <= mask; n++, i = (i + 1) & mask) {
+		ref = __atomic_load_n(&sh[i].ref, __ATOMIC_ACQUIRE);
+
+		if (ref == 0) {
+			break;
+		}
+
+		if (sh[i].hash == hash) {
+			idx = ref & 0xffffffffu;
+
+			if (idx >= map->hdr->nslots) {
+				return -1;
+			}
+
+			/* Entries of deleted, reused or unreadable digests are ignored */
+			if (rspamd_fuzzy_memory_read_slot(&map->slots[idx], &copy) &&
+				copy.state == FUZZY_MEMORY_SLOT_LIVE && copy.gen == (ref >> 32)) {
+				return idx;
+			}
+
+			return -1;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Returns FALSE if the table is full, which is possible only if it could not
+ * be rebuilt
+ */
+static gboolean
+rspamd_fuzzy_memory_add_shingle(struct rspamd_fuzzy_memory_map *map,
+								guint table, guint64 hash, guint64 ref)
+{
+	struct rspamd_fuzzy_memory_shingle *sh =
+		rspamd_fuzzy_memory_shingle_table(map, table);
+	guint32 mask = map->hdr->nslots - 1, i, n;
+
+	i = (hash ^ (hash >> 32)) & mask;
+
+	for (n = 0; n <= mask; n++, i = (i + 1) & mask) {
+		if (sh[i].ref == 0) {
+			if (map->hdr->nshingles[table] + 1 >= map->hdr->nslots) {
+				/* Keep at least one empty entry to terminate lookups */
+				return FALSE;
+			}
+
+			sh[i].hash = hash;
+			__atomic_store_n(&sh[i].ref, ref, __ATOMIC_RELEASE);
+			map->hdr->nshingles[table]++;
+
+			return TRUE;
+		}
+
+		if (sh[i].hash == hash) {
+			/* The most recent digest wins */
+			__atomic_store_n(&sh[i].ref, ref, __ATOMIC_RELEASE);
+
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static gboolean
+rspamd_fuzzy_memory_needs_rebuild(struct rspamd_fuzzy_memory_map *map)
+{
+	guint i;
+
+	/* Keep load factor of all tables below 0.5 */
+	if ((map->hdr->nused + 1) * 2 > map->hdr->nslots) {
+		return TRUE;
+	}
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
+		if ((map->hdr->nshingles[i] + 1) * 2 > map->hdr->nslots) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/*
+ * Copies live digests and their shingles to a new file, drops deleted slots
+ * and stale shingles and atomically replaces the storage
+ */
+static gboolean
+rspamd_fuzzy_memory_rebuild(struct rspamd_fuzzy_backend_memory *bk)
+{
+	struct rspamd_fuzzy_memory_map *old = &bk->map, nmap;
+	struct rspamd_fuzzy_memory_shingle *sh;
+	struct rspamd_fuzzy_memory_slot *src, *dst;
+	guint32 nslots, nmask, i, j, k, idx, *remap;
+	guint64 ref, live_shingles = 0;
+	gchar *tmp_path;
+	GError *err = NULL;
+	gint fd;
+
+	nslots = old->hdr->nslots;
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
+		live_shingles = MAX(live_shingles, old->hdr->nshingles[i]);
+	}
+
+	/* Grow while live data fills more than a quarter of the tables */
+	while ((MAX(old->hdr->nhashes, live_shingles) + 1) * 4 > nslots) {
+		nslots *= 2;
+	}
+
+	tmp_path = g_strdup_printf("%s.new", bk->path);
+	fd = rspamd_fuzzy_memory_create(tmp_path, nslots, &err);
+
+	if (fd == -1 || !rspamd_fuzzy_memory_map_fd(&nmap, fd, tmp_path, &err)) {
+		msg_err_fuzzy_memory("cannot rebuild fuzzy storage: %e", err);
+		g_error_free(err);
+
+		if (fd != -1) {
+			close(fd);
+			unlink(tmp_path);
+		}
+
+		g_free(tmp_path);
+
+		return FALSE;
+	}
+
+	nmask = nslots - 1;
+	remap = g_malloc(sizeof(*remap) * old->hdr->nslots);
+	memcpy(nmap.hdr->sources, old->hdr->sources, sizeof(old->hdr->sources));
+	nmap.hdr->wal_seq = old->hdr->wal_seq;
+
+	for (i = 0; i < old->hdr->nslots; i++) {
+		src = &old->slots[i];
+		remap[i] = G_MAXUINT32;
+
+		if (src->state != FUZZY_MEMORY_SLOT_LIVE) {
+			continue;
+		}
+
+		for (j = rspamd_fuzzy_memory_digest_hash(src->digest) & nmask;
+			 nmap.slots[j].state != FUZZY_MEMORY_SLOT_EMPTY; j = (j + 1) & nmask) {}
+
+		dst = &nmap.slots[j];
+		memcpy(dst, src, sizeof(*dst));
+		dst->seq = 0;
+		dst->gen = 1;
+		remap[i] = j;
+		nmap.hdr->nhashes++;
+		nmap.hdr->nused++;
+	}
+
+	for (k = 0; k < RSPAMD_SHINGLE_SIZE; k++) {
+		sh = rspamd_fuzzy_memory_shingle_table(old, k);
+
+		for (i = 0; i < old->hdr->nslots; i++) {
+			ref = sh[i].ref;
+
+			if (ref == 0) {
+				continue;
+			}
+
+			idx = ref & 0xffffffffu;
+
+			if (idx < old->hdr->nslots && remap[idx] != G_MAXUINT32 &&
+				old->slots[idx].gen == (ref >> 32)) {
+				/* New tables have at least twice more entries than needed */
+				(void) rspamd_fuzzy_memory_add_shingle(&nmap, k, sh[i].hash,
+													   (1ULL << 32) | remap[idx]);
+			}
+		}
+	}
+
+	g_free(remap);
+
+	if (msync(nmap.hdr, nmap.len, MS_SYNC) == -1 ||
+		rename(tmp_path, bk->path) == -1) {
+		msg_err_fuzzy_memory("cannot replace fuzzy storage %s: %s",
+							 bk->path, strerror(errno));
+		rspamd_fuzzy_memory_unmap(&nmap);
+		unlink(tmp_path);
+		g_free(tmp_path);
+
+		return FALSE;
+	}
+
+	g_free(tmp_path);
+	msg_info_fuzzy_memory("rebuilt fuzzy storage: %ud -> %ud slots, %uL hashes",
+						  old->hdr->nslots, nslots, nmap.hdr->nhashes);
+	__atomic_store_n(&old->hdr->obsolete, 1, __ATOMIC_RELEASE);
+	rspamd_fuzzy_memory_unmap(old);
+	bk->map = nmap;
+
+	return TRUE;
+}
+
+/*
+ * Returns the entry of a source or a free entry for a new source, or NULL if
+ * there are already FUZZY_MEMORY_MAX_SOURCES other sources
+ */
+static struct rspamd_fuzzy_memory_source *
+rspamd_fuzzy_memory_source_entry(struct rspamd_fuzzy_memory_hdr *hdr,
+								 const gchar *src)
+{
+	guint i;
+
+	for (i = 0; i < FUZZY_MEMORY_MAX_SOURCES; i++) {
+		if (hdr->sources[i].name[0] == '\0' ||
+			strncmp(hdr->sources[i].name, src, sizeof(hdr->sources[i].name)) == 0) {
+			return &hdr->sources[i];
+		}
+	}
+
+	return NULL;
+}
+
+static gboolean
+rspamd_fuzzy_memory_set_version(struct rspamd_fuzzy_memory_hdr *hdr,
+								const gchar *src, guint64 version)
+{
+	struct rspamd_fuzzy_memory_source *entry;
+
+	entry = rspamd_fuzzy_memory_source_entry(hdr, src);
+
+	if (entry == NULL) {
+		return FALSE;
+	}
+
+	rspamd_strlcpy(entry->name, src, sizeof(entry->name));
+	entry->version = version;
+
+	return TRUE;
+}
+
+static guint64
+rspamd_fuzzy_memory_get_version(struct rspamd_fuzzy_memory_hdr *hdr,
+								const gchar *src)
+{
+	guint i;
+
+	for (i = 0; i < FUZZY_MEMORY_MAX_SOURCES; i++) {
+		if (hdr->sources[i].name[0] == '\0') {
+			break;
+		}
+
+		if (strncmp(hdr->sources[i].name, src, sizeof(hdr->sources[i].name)) == 0) {
+			return hdr->sources[i].version;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Applies a single record to the storage, must be called by a writer.
+ * Returns FALSE if the record cannot be stored completely
+ */
+static gboolean
+rspamd_fuzzy_memory_apply(struct rspamd_fuzzy_backend_memory *bk,
+						  const struct rspamd_fuzzy_memory_wal_rec *rec)
+{
+	struct rspamd_fuzzy_memory_map *map = &bk->map;
+	struct rspamd_fuzzy_memory_slot copy, *slot;
+	guint32 mask, i, tomb;
+	gint64 found;
+	guint k;
+
+	if (rec->op == FUZZY_MEMORY_WAL_VERSION) {
+		gchar src[sizeof(rec->digest)];
+
+		rspamd_strlcpy(src, rec->digest, sizeof(src));
+
+		if (!rspamd_fuzzy_memory_set_version(map->hdr, src, rec->value)) {
+			msg_err_fuzzy_memory("cannot store version of source %s: "
+								 "too many sources, %d is the maximum",
+								 src, FUZZY_MEMORY_MAX_SOURCES);
+			return FALSE;
+		}
+	}
+	else if (rec->op == FUZZY_MEMORY_WAL_DEL) {
+		found = rspamd_fuzzy_memory_find(map, rec->digest, &copy);
+
+		if (found >= 0) {
+			slot = &map->slots[found];
+			rspamd_fuzzy_memory_write_begin(slot);
+			slot->state = FUZZY_MEMORY_SLOT_DELETED;
+			rspamd_fuzzy_memory_write_end(slot);
+			map->hdr->nhashes--;
+		}
+	}
+	else if (rec->op == FUZZY_MEMORY_WAL_SET) {
+		found = rspamd_fuzzy_memory_find(map, rec->digest, &copy);
+
+		if (found >= 0) {
+			slot = &map->slots[found];
+			rspamd_fuzzy_memory_write_begin(slot);
+			slot->value = rec->value;
+			slot->flag = rec->flag;
+			slot->ts = rec->ts;
+			rspamd_fuzzy_memory_write_end(slot);
+
+			return TRUE;
+		}
+
+		if (rspamd_fuzzy_memory_needs_rebuild(map) &&
+			!rspamd_fuzzy_memory_rebuild(bk) &&
+			map->hdr->nused + 1 >= map->hdr->nslots) {
+			msg_err_fuzzy_memory("fuzzy storage is full, cannot add hash");
+			return FALSE;
+		}
+
+		/* Reuse the first deleted slot in the chain */
+		mask = map->hdr->nslots - 1;
+		tomb = G_MAXUINT32;
+
+		for (i = rspamd_fuzzy_memory_digest_hash(rec->digest) & mask;
+			 map->slots[i].state != FUZZY_MEMORY_SLOT_EMPTY; i = (i + 1) & mask) {
+			if (map->slots[i].state == FUZZY_MEMORY_SLOT_DELETED && tomb == G_MAXUINT32) {
+				tomb = i;
+			}
+		}
+
+		if (tomb != G_MAXUINT32) {
+			i = tomb;
+		}
+		else {
+			map->hdr->nused++;
+		}
+
+		slot = &map->slots[i];
+		rspamd_fuzzy_memory_write_begin(slot);
+		slot->gen++;
+		slot->value = rec->value;
+		slot->flag = rec->flag;
+		slot->ts = rec->ts;
+		memcpy(slot->digest, rec->digest, sizeof(slot->digest));
+		slot->state = FUZZY_MEMORY_SLOT_LIVE;
+		rspamd_fuzzy_memory_write_end(slot);
+		map->hdr->nhashes++;
+
+		for (k = 0; k < rec->nshingles && k < RSPAMD_SHINGLE_SIZE; k++) {
+			if (!rspamd_fuzzy_memory_add_shingle(map, k, rec->shingles[k],
+												 ((guint64) slot->gen << 32) | i)) {
+				msg_err_fuzzy_memory("shingles table %ud is full, cannot add "
+									 "shingles of hash",
+									 k);
+				return FALSE;
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+static inline guint64
+rspamd_fuzzy_memory_wal_checksum(const struct rspamd_fuzzy_memory_wal_rec *rec)
+{
+	return rspamd_cryptobox_fast_hash(rec,
+									  G_STRUCT_OFFSET(struct rspamd_fuzzy_memory_wal_rec, checksum),
+									  FUZZY_MEMORY_WAL_SEED);
+}
+
+/*
+ * Slots could be left locked by a writer that has been killed while
+ * updating them. Their content is restored by the log replay, so it is safe
+ * to unlock them; must be called with the log locked
+ */
+static void
+rspamd_fuzzy_memory_reset_slots(struct rspamd_fuzzy_backend_memory *bk)
+{
+	struct rspamd_fuzzy_memory_slot *slot;
+	guint32 i;
+	guint nreset = 0;
+
+	for (i = 0; i < bk->map.hdr->nslots; i++) {
+		slot = &bk->map.slots[i];
+
+		if (slot->seq & 1u) {
+			__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+			nreset++;
+		}
+	}
+
+	if (nreset > 0) {
+		msg_warn_fuzzy_memory("unlocked %ud slots left by an interrupted update",
+							  nreset);
+	}
+}
+
+/*
+ * Applies all records written since the last snapshot, must be called with
+ * the log locked
+ */
+static gboolean
+rspamd_fuzzy_memory_replay(struct rspamd_fuzzy_backend_memory *bk)
+{
+	struct rspamd_fuzzy_memory_wal_rec rec;
+	goffset off = 0;
+	guint nreplayed = 0;
+
+	for (;;) {
+		if (pread(bk->wal_fd, &rec, sizeof(rec), off) != sizeof(rec)) {
+			break;
+		}
+
+		if (rspamd_fuzzy_memory_wal_checksum(&rec) != rec.checksum) {
+			msg_warn_fuzzy_memory("broken record in %s at offset %O, "
+								  "truncate the log",
+								  bk->wal_path, off);
+			break;
+		}
+
+		/*
+		 * Header could reach the disk before the tables, so we cannot rely on
+		 * it to skip records: all of them are applied again
+		 */
+		rspamd_fuzzy_memory_apply(bk, &rec);
+		bk->map.hdr->wal_seq = MAX(bk->map.hdr->wal_seq, rec.seq);
+		nreplayed++;
+		off += sizeof(rec);
+	}
+
+	if (ftruncate(bk->wal_fd, off) == -1) {
+		msg_err_fuzzy_memory("cannot truncate %s: %s", bk->wal_path,
+							 strerror(errno));
+	}
+
+	if (nreplayed > 0) {
+		msg_info_fuzzy_memory("replayed %ud records from %s", nreplayed,
+							  bk->wal_path);
+		bk->written = TRUE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Queues a record for the log, it is applied when the log is flushed
+ */
+static void
+rspamd_fuzzy_memory_log(struct rspamd_fuzzy_backend_memory *bk,
+						struct rspamd_fuzzy_memory_wal_rec *rec)
+{
+	rec->seq = bk->map.hdr->wal_seq + bk->wal_buf->len + 1;
+	rec->checksum = rspamd_fuzzy_memory_wal_checksum(rec);
+	g_array_append_val(bk->wal_buf, *rec);
+}
+
+/*
+ * Finds the current state of a digest taking queued records into account
+ */
+static gboolean
+rspamd_fuzzy_memory_find_pending(struct rspamd_fuzzy_backend_memory *bk,
+								 const gchar *digest,
+								 struct rspamd_fuzzy_memory_slot *copy)
+{
+	const struct rspamd_fuzzy_memory_wal_rec *rec;
+	guint i;
+
+	for (i = bk->wal_buf->len; i > 0; i--) {
+		rec = &g_array_index(bk->wal_buf, struct rspamd_fuzzy_memory_wal_rec, i - 1);
+
+		if (rec->op == FUZZY_MEMORY_WAL_VERSION ||
+			memcmp(rec->digest, digest, sizeof(rec->digest)) != 0) {
+			continue;
+		}
+
+		if (rec->op == FUZZY_MEMORY_WAL_DEL) {
+			return FALSE;
+		}
+
+		copy->value = rec->value;
+		copy->flag = rec->flag;
+		copy->ts = rec->ts;
+
+		return TRUE;
+	}
+
+	return rspamd_fuzzy_memory_find(&bk->map, digest, copy) >= 0;
+}
+
+/*
+ * Writes queued records to the log and applies them to the tables after
+ * they are synced, so the tables never have changes the log does not have
+ */
+static gboolean
+rspamd_fuzzy_memory_flush_log(struct rspamd_fuzzy_backend_memory *bk)
+{
+	gsize len = bk->wal_buf->len * sizeof(struct rspamd_fuzzy_memory_wal_rec);
+	goffset off;
+	guint i;
+	gboolean ret = TRUE;
+
+	if (len == 0) {
+		return TRUE;
+	}
+
+	off = lseek(bk->wal_fd, 0, SEEK_END);
+
+	if (off == -1 ||
+		write(bk->wal_fd, bk->wal_buf->data, len) != (gssize) len ||
+		fsync(bk->wal_fd) == -1) {
+		msg_err_fuzzy_memory("cannot write %s: %s", bk->wal_path, strerror(errno));
+
+		/* Drop a partially written batch */
+		if (off != -1 && ftruncate(bk->wal_fd, off) == -1) {
+			msg_err_fuzzy_memory("cannot truncate %s: %s", bk->wal_path,
+								 strerror(errno));
+		}
+
+		g_array_set_size(bk->wal_buf, 0);
+
+		return FALSE;
+	}
+
+	for (i = 0; i < bk->wal_buf->len; i++) {
+		if (!rspamd_fuzzy_memory_apply(bk,
+									   &g_array_index(bk->wal_buf, struct rspamd_fuzzy_memory_wal_rec, i))) {
+			ret = FALSE;
+		}
+	}
+
+	bk->map.hdr->wal_seq += bk->wal_buf->len;
+	g_array_set_size(bk->wal_buf, 0);
+	bk->written = TRUE;
+
+	return ret;
+}
+
+void *
+rspamd_fuzzy_backend_init_memory(struct rspamd_fuzzy_backend *fbk,
+								 const ucl_object_t *obj,
+								 struct rspamd_config *cfg,
+								 GError **err)
+{
+	struct rspamd_fuzzy_backend_memory *bk;
+	const ucl_object_t *elt;
+	rspamd_cryptobox_hash_state_t st;
+	guchar hash_out[rspamd_cryptobox_HASHBYTES];
+	guint64 nslots = FUZZY_MEMORY_DEFAULT_SLOTS;
+	const gchar *path;
+
+	elt = ucl_object_lookup_any(obj, "hashfile", "hash_file", "file",
+								"database", NULL);
+
+	if (elt == NULL || ucl_object_type(elt) != UCL_STRING) {
+		g_set_error(err, rspamd_fuzzy_memory_quark(),
+					EINVAL, "missing fuzzy storage path");
+		return NULL;
+	}
+
+	path = ucl_object_tostring(elt);
+	elt = ucl_object_lookup(obj, "slots");
+
+	if (elt != NULL && ucl_object_toint(elt) > 0) {
+		nslots = ucl_object_toint(elt);
+	}
+
+	bk = g_malloc0(sizeof(*bk));
+	bk->path = g_strdup(path);
+	bk->wal_path = g_strdup_printf("%s.wal", path);
+	bk->map.fd = -1;
+	bk->min_slots = 1024;
+
+	while (bk->min_slots < nslots && bk->min_slots < (1u << 30)) {
+		bk->min_slots *= 2;
+	}
+
+	bk->wal_buf = g_array_new(FALSE, FALSE, sizeof(struct rspamd_fuzzy_memory_wal_rec));
+
+	rspamd_cryptobox_hash_init(&st, NULL, 0);
+	rspamd_cryptobox_hash_update(&st, path, strlen(path));
+	rspamd_cryptobox_hash_final(&st, hash_out);
+	rspamd_snprintf(bk->id, sizeof(bk->id), "%xs", hash_out);
+
+	bk->wal_fd = open(bk->wal_path, O_RDWR | O_CREAT, 00644);
+
+	if (bk->wal_fd == -1) {
+		g_set_error(err, rspamd_fuzzy_memory_quark(), errno,
+					"cannot open %s: %s", bk->wal_path, strerror(errno));
+		rspamd_fuzzy_backend_close_memory(fbk, bk);
+
+		return NULL;
+	}
+
+	/* Workers start concurrently, so creation and replay are done under the lock */
+	rspamd_file_lock(bk->wal_fd, FALSE);
+
+	if (!rspamd_fuzzy_memory_open(bk, err)) {
+		rspamd_file_unlock(bk->wal_fd, FALSE);
+		rspamd_fuzzy_backend_close_memory(fbk, bk);
+
+		return NULL;
+	}
+
+	rspamd_fuzzy_memory_reset_slots(bk);
+	rspamd_fuzzy_memory_replay(bk);
+	rspamd_file_unlock(bk->wal_fd, FALSE);
+
+	return bk;
+}
+
+void rspamd_fuzzy_backend_check_memory(struct rspamd_fuzzy_backend *fbk,
+									   const struct rspamd_fuzzy_cmd *cmd,
+									   rspamd_fuzzy_check_cb cb, void *ud,
+									   void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *bk = subr_ud;
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	struct rspamd_fuzzy_memory_slot copy;
+	struct rspamd_fuzzy_reply rep;
+	gint64 found, votes[RSPAMD_SHINGLE_SIZE], sel = -1;
+	gdouble expire = rspamd_fuzzy_backend_get_expire(fbk), now = rspamd_get_calendar_ticks();
+	guint i, j, cnt, max_cnt = 0;
+
+	memset(&rep, 0, sizeof(rep));
+	memcpy(rep.digest, cmd->digest, sizeof(rep.digest));
+	rspamd_fuzzy_memory_maybe_reopen(bk);
+
+	found = rspamd_fuzzy_memory_find(&bk->map, cmd->digest, &copy);
+
+	if (found >= 0) {
+		if (now - copy.ts > expire) {
+			msg_debug_fuzzy_memory("requested hash has been expired");
+		}
+		else {
+			rep.v1.value = copy.value;
+			rep.v1.flag = copy.flag;
+			rep.v1.prob = 1.0f;
+			rep.ts = copy.ts;
+		}
+	}
+	else if (cmd->shingles_count > 0) {
+		shcmd = (const struct rspamd_fuzzy_shingle_cmd *) cmd;
+
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
+			votes[i] = rspamd_fuzzy_memory_find_shingle(&bk->map, i,
+														shcmd->sgl.hashes[i]);
+		}
+
+		/* Select digest with the most shingles matched */
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
+			if (votes[i] == -1) {
+				continue;
+			}
+
+			for (j = i, cnt = 0; j < RSPAMD_SHINGLE_SIZE; j++) {
+				if (votes[j] == votes[i]) {
+					cnt++;
+				}
+			}
+
+			if (cnt > max_cnt) {
+				max_cnt = cnt;
+				sel = votes[i];
+			}
+		}
+
+		if (sel != -1) {
+			rep.v1.prob = (float) max_cnt / (float) RSPAMD_SHINGLE_SIZE;
+
+			if (rep.v1.prob > 0.5f) {
+				if (!rspamd_fuzzy_memory_read_slot(&bk->map.slots[sel], &copy) ||
+					copy.state != FUZZY_MEMORY_SLOT_LIVE || now - copy.ts > expire) {
+					msg_debug_fuzzy_memory("requested hash has been expired");
+					rep.v1.prob = 0.0f;
+				}
+				else {
+					msg_debug_fuzzy_memory("found fuzzy hash with probability %.2f",
+										   rep.v1.prob);
+					memcpy(rep.digest, copy.digest, sizeof(rep.digest));
+					rep.v1.value = copy.value;
+					rep.v1.flag = copy.flag;
+					rep.ts = copy.ts;
+				}
+			}
+			else {
+				rep.v1.value = 0;
+			}
+		}
+	}
+
+	if (cb) {
+		cb(&rep, ud);
+	}
+}
+
+void rspamd_fuzzy_backend_update_memory(struct rspamd_fuzzy_backend *fbk,
+										GArray *updates, const gchar *src,
+										rspamd_fuzzy_update_cb cb, void *ud,
+										void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *bk = subr_ud;
+	struct rspamd_fuzzy_memory_wal_rec rec;
+	struct rspamd_fuzzy_memory_slot copy;
+	struct fuzzy_peer_cmd *io_cmd;
+	struct rspamd_fuzzy_cmd *cmd;
+	gint64 now = rspamd_get_calendar_ticks();
+	guint i, nupdates = 0, nadded = 0, ndeleted = 0, nextended = 0, nignored = 0;
+	gboolean found, success;
+
+	rspamd_file_lock(bk->wal_fd, FALSE);
+	rspamd_fuzzy_memory_maybe_reopen(bk);
+
+	if (rspamd_fuzzy_memory_source_entry(bk->map.hdr, src) == NULL) {
+		/* Version of the source cannot be stored, so nothing is */
+		msg_err_fuzzy_memory("cannot apply updates from source %s: "
+							 "too many sources, %d is the maximum",
+							 src, FUZZY_MEMORY_MAX_SOURCES);
+		rspamd_file_unlock(bk->wal_fd, FALSE);
+
+		if (cb) {
+			cb(FALSE, 0, 0, 0, 0, ud);
+		}
+
+		return;
+	}
+
+	for (i = 0; i < updates->len; i++) {
+		io_cmd = &g_array_index(updates, struct fuzzy_peer_cmd, i);
+
+		if (io_cmd->is_shingle) {
+			cmd = &io_cmd->cmd.shingle.basic;
+		}
+		else {
+			cmd = &io_cmd->cmd.normal;
+		}
+
+		memset(&rec, 0, sizeof(rec));
+		memcpy(rec.digest, cmd->digest, sizeof(rec.digest));
+
+		if (cmd->cmd == FUZZY_WRITE) {
+			found = rspamd_fuzzy_memory_find_pending(bk, cmd->digest, &copy);
+			rec.op = FUZZY_MEMORY_WAL_SET;
+			rec.flag = cmd->flag;
+			rec.ts = now;
+
+			if (found && copy.flag == cmd->flag) {
+				/* Increase weight */
+				rec.value = copy.value + cmd->value;
+			}
+			else {
+				/* New hash or relearn */
+				rec.value = cmd->value;
+
+				if (!found && io_cmd->is_shingle) {
+					memcpy(rec.shingles, io_cmd->cmd.shingle.sgl.hashes,
+						   sizeof(rec.shingles));
+					rec.nshingles = RSPAMD_SHINGLE_SIZE;
+				}
+			}
+
+			rspamd_fuzzy_memory_log(bk, &rec);
+			nadded++;
+			nupdates++;
+		}
+		else if (cmd->cmd == FUZZY_DEL) {
+			rec.op = FUZZY_MEMORY_WAL_DEL;
+			rspamd_fuzzy_memory_log(bk, &rec);
+			ndeleted++;
+			nupdates++;
+		}
+		else if (cmd->cmd == FUZZY_REFRESH) {
+			found = rspamd_fuzzy_memory_find_pending(bk, cmd->digest, &copy);
+
+			if (found) {
+				rec.op = FUZZY_MEMORY_WAL_SET;
+				rec.flag = copy.flag;
+				rec.value = copy.value;
+				rec.ts = now;
+				rspamd_fuzzy_memory_log(bk, &rec);
+			}
+
+			nextended++;
+		}
+		else {
+			nignored++;
+		}
+	}
+
+	if (nupdates > 0) {
+		memset(&rec, 0, sizeof(rec));
+		rec.op = FUZZY_MEMORY_WAL_VERSION;
+		rspamd_strlcpy(rec.digest, src, sizeof(rec.digest));
+		rec.value = rspamd_fuzzy_memory_get_version(bk->map.hdr, src) + 1;
+		rspamd_fuzzy_memory_log(bk, &rec);
+	}
+
+	success = rspamd_fuzzy_memory_flush_log(bk);
+	rspamd_file_unlock(bk->wal_fd, FALSE);
+
+	if (cb) {
+		cb(success, nadded, ndeleted, nextended, nignored, ud);
+	}
+}
+
+void rspamd_fuzzy_backend_count_memory(struct rspamd_fuzzy_backend *fbk,
+									   rspamd_fuzzy_count_cb cb, void *ud,
+									   void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *bk = subr_ud;
+
+	rspamd_fuzzy_memory_maybe_reopen(bk);
+
+	if (cb) {
+		cb(bk->map.hdr->nhashes, ud);
+	}
+}
+
+void rspamd_fuzzy_backend_version_memory(struct rspamd_fuzzy_backend *fbk,
+										 const gchar *src,
+										 rspamd_fuzzy_version_cb cb, void *ud,
+										 void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *bk = subr_ud;
+
+	rspamd_fuzzy_memory_maybe_reopen(bk);
+
+	if (cb) {
+		cb(rspamd_fuzzy_memory_get_version(bk->map.hdr, src), ud);
+	}
+}
+
+const gchar *
+rspamd_fuzzy_backend_id_memory(struct rspamd_fuzzy_backend *fbk,
+							   void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *bk = subr_ud;
+
+	return bk->id;
+}
+
+/*
+ * Flushes the mapped tables to disk, after that the log is not needed anymore.
+ * Must be called with the log locked
+ */
+static void
+rspamd_fuzzy_memory_snapshot(struct rspamd_fuzzy_backend_memory *bk)
+{
+	if (msync(bk->map.hdr, bk->map.len, MS_SYNC) == -1) {
+		msg_err_fuzzy_memory("cannot sync %s: %s", bk->path, strerror(errno));
+		return;
+	}
+
+	if (ftruncate(bk->wal_fd, 0) == -1) {
+		msg_err_fuzzy_memory("cannot truncate %s: %s", bk->wal_path,
+							 strerror(errno));
+	}
+
+	bk->written = FALSE;
+}
+
+void rspamd_fuzzy_backend_expire_memory(struct rspamd_fuzzy_backend *fbk,
+										void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *bk = subr_ud;
+	struct rspamd_fuzzy_memory_slot *slot;
+	gdouble expire = rspamd_fuzzy_backend_get_expire(fbk), now = rspamd_get_calendar_ticks();
+	guint32 i;
+	guint nexpired = 0;
+
+	rspamd_file_lock(bk->wal_fd, FALSE);
+	rspamd_fuzzy_memory_maybe_reopen(bk);
+
+	/* Expiration is derived from timestamps, so it is not logged */
+	for (i = 0; i < bk->map.hdr->nslots; i++) {
+		slot = &bk->map.slots[i];
+
+		if (slot->state == FUZZY_MEMORY_SLOT_LIVE && now - slot->ts > expire) {
+			rspamd_fuzzy_memory_write_begin(slot);
+			slot->state = FUZZY_MEMORY_SLOT_DELETED;
+			rspamd_fuzzy_memory_write_end(slot);
+			bk->map.hdr->nhashes--;
+			nexpired++;
+		}
+	}
+
+	if (nexpired > 0) {
+		msg_info_fuzzy_memory("expired %ud hashes", nexpired);
+		bk->written = TRUE;
+	}
+
+	if (bk->written) {
+		rspamd_fuzzy_memory_snapshot(bk);
+	}
+
+	rspamd_file_unlock(bk->wal_fd, FALSE);
+}
+
+void rspamd_fuzzy_backend_close_memory(struct rspamd_fuzzy_backend *fbk,
+									   void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *bk = subr_ud;
+
+	if (bk->wal_fd != -1) {
+		if (bk->written && bk->map.hdr) {
+			rspamd_file_lock(bk->wal_fd, FALSE);
+			rspamd_fuzzy_memory_snapshot(bk);
+			rspamd_file_unlock(bk->wal_fd, FALSE);
+		}
+
+		close(bk->wal_fd);
+	}
+
+	rspamd_fuzzy_memory_unmap(&bk->map);
+	g_array_free(bk->wal_buf, TRUE);
+	g_free(bk->path);
+	g_free(bk->wal_path);
+	g_free(bk);
+}
@@ -341,16 +341,89 @@ rspamd_fuzzy_backend_redis_shingles_cmp(const void *a, const void *b)
 	return memcmp(sha->digest, shb->digest, sizeof(sha->digest));
 }
 
+/*
+ * Selects the digest referenced by the majority of shingles in MGET reply
+ */
+static gboolean
+rspamd_fuzzy_redis_select_shingle(redisReply *reply, guchar *digest, float *prob)
+{
+	redisReply *cur;
+	struct _rspamd_fuzzy_shingles_helper *shingles, *prev = NULL, *sel = NULL;
+	guint i, found = 0, max_found = 0, cur_found = 0;
+
+	if (reply->type != REDIS_REPLY_ARRAY ||
+		reply->elements != RSPAMD_SHINGLE_SIZE) {
+		return FALSE;
+	}
+
+	shingles = g_alloca(sizeof(struct _rspamd_fuzzy_shingles_helper) *
+						RSPAMD_SHINGLE_SIZE);
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
+		cur = reply->element[i];
+
+		if (cur->type == REDIS_REPLY_STRING) {
+			shingles[i].found = 1;
+			memset(shingles[i].digest, 0, sizeof(shingles[i].digest));
+			memcpy(shingles[i].digest, cur->str, MIN(64, cur->len));
+			found++;
+		}
+		else {
+			memset(shingles[i].digest, 0, sizeof(shingles[i].digest));
+			shingles[i].found = 0;
+		}
+	}
+
+	if (found <= RSPAMD_SHINGLE_SIZE / 2) {
+		return FALSE;
+	}
+
+	/* Now sort to find the most frequent element */
+	qsort(shingles, RSPAMD_SHINGLE_SIZE,
+		  sizeof(struct _rspamd_fuzzy_shingles_helper),
+		  rspamd_fuzzy_backend_redis_shingles_cmp);
+
+	prev = &shingles[0];
+
+	for (i = 1; i < RSPAMD_SHINGLE_SIZE; i++) {
+		if (!shingles[i].found) {
+			continue;
+		}
+
+		if (memcmp(shingles[i].digest, prev->digest, 64) == 0) {
+			cur_found++;
+
+			if (cur_found > max_found) {
+				max_found = cur_found;
+				sel = &shingles[i];
+			}
+		}
+		else {
+			cur_found = 1;
+			prev = &shingles[i];
+		}
+	}
+
+	if (max_found > RSPAMD_SHINGLE_SIZE / 2) {
+		g_assert(sel != NULL);
+		*prob = ((float) max_found) / RSPAMD_SHINGLE_SIZE;
+		memcpy(digest, sel->digest, sizeof(sel->digest));
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
 static void
 rspamd_fuzzy_redis_shingles_callback(redisAsyncContext *c, gpointer r,
 									 gpointer priv)
 {
 	struct rspamd_fuzzy_redis_session *session = priv;
-	redisReply *reply = r, *cur;
+	redisReply *reply = r;
 	struct rspamd_fuzzy_reply rep;
 	GString *key;
-	struct _rspamd_fuzzy_shingles_helper *shingles, *prev = NULL, *sel = NULL;
-	guint i, found = 0, max_found = 0, cur_found = 0;
+	guchar sel_digest[64];
 
 	ev_timer_stop(session->event_loop, &session->timeout);
 	memset(&rep, 0, sizeof(rep));
@@ -358,106 +431,58 @@ rspamd_fuzzy_redis_shingles_callback(redisAsyncContext *c, gpointer r,
 	if (c->err == 0 && reply != NULL) {
 		rspamd_upstream_ok(session->up);
 
-		if (reply->type == REDIS_REPLY_ARRAY &&
-			reply->elements == RSPAMD_SHINGLE_SIZE) {
-			shingles = g_alloca(sizeof(struct _rspamd_fuzzy_shingles_helper) *
-								RSPAMD_SHINGLE_SIZE);
+		if (reply->type == REDIS_REPLY_ARRAY) {
+			if (rspamd_fuzzy_redis_select_shingle(reply, sel_digest,
+												  &session->prob)) {
+				rep.v1.prob = session->prob;
 
-			for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
-				cur = reply->element[i];
+				/* Prepare new check command */
+				rspamd_fuzzy_redis_session_free_args(session);
+				session->nargs = 5;
+				session->argv = g_malloc(sizeof(gchar *) * session->nargs);
+				session->argv_lens = g_malloc(sizeof(gsize) * session->nargs);
+
+				key = g_string_new(session->backend->redis_object);
+				g_string_append_len(key, sel_digest, sizeof(sel_digest));
+				session->argv[0] = g_strdup("HMGET");
+				session->argv_lens[0] = 5;
+				session->argv[1] = key->str;
+				session->argv_lens[1] = key->len;
+				session->argv[2] = g_strdup("V");
+				session->argv_lens[2] = 1;
+				session->argv[3] = g_strdup("F");
+				session->argv_lens[3] = 1;
+				session->argv[4] = g_strdup("C");
+				session->argv_lens[4] = 1;
+				g_string_free(key, FALSE); /* Do not free underlying array */
+				memcpy(session->found_digest, sel_digest,
+					   sizeof(session->cmd->digest));
+
+				g_assert(session->ctx != NULL);
+				if (redisAsyncCommandArgv(session->ctx,
+										  rspamd_fuzzy_redis_check_callback,
+										  session, session->nargs,
+										  (const gchar **) session->argv,
+										  session->argv_lens) != REDIS_OK) {
+
+					if (session->callback.cb_check) {
+						memset(&rep, 0, sizeof(rep));
+						session->callback.cb_check(&rep, session->cbdata);
+					}
 
-				if (cur->type == REDIS_REPLY_STRING) {
-					shingles[i].found = 1;
-					memcpy(shingles[i].digest, cur->str, MIN(64, cur->len));
-					found++;
+					rspamd_fuzzy_redis_session_dtor(session, TRUE);
 				}
 				else {
-					memset(shingles[i].digest, 0, sizeof(shingles[i].digest));
-					shingles[i].found = 0;
-				}
-			}
-
-			if (found > RSPAMD_SHINGLE_SIZE / 2) {
-				/* Now sort to find the most frequent element */
-				qsort(shingles, RSPAMD_SHINGLE_SIZE,
-					  sizeof(struct _rspamd_fuzzy_shingles_helper),
-					  rspamd_fuzzy_backend_redis_shingles_cmp);
-
-				prev = &shingles[0];
-
-				for (i = 1; i < RSPAMD_SHINGLE_SIZE; i++) {
-					if (!shingles[i].found) {
-						continue;
-					}
-
-					if (memcmp(shingles[i].digest, prev->digest, 64) == 0) {
-						cur_found++;
-
-						if (cur_found > max_found) {
-							max_found = cur_found;
-							sel = &shingles[i];
-						}
-					}
-					else {
-						cur_found = 1;
-						prev = &shingles[i];
-					}
+					/* Add timeout */
+					session->timeout.data = session;
+					ev_now_update_if_cheap((struct ev_loop *) session->event_loop);
+					ev_timer_init(&session->timeout,
+								  rspamd_fuzzy_redis_timeout,
+								  session->backend->timeout, 0.0);
+					ev_timer_start(session->event_loop, &session->timeout);
 				}
 
-				if (max_found > RSPAMD_SHINGLE_SIZE / 2) {
-					session->prob = ((float) max_found) / RSPAMD_SHINGLE_SIZE;
-					rep.v1.prob = session->prob;
-
-					g_assert(sel != NULL);
-
-					/* Prepare new check command */
-					rspamd_fuzzy_redis_session_free_args(session);
-					session->nargs = 5;
-					session->argv = g_malloc(sizeof(gchar *) * session->nargs);
-					session->argv_lens = g_malloc(sizeof(gsize) * session->nargs);
-
-					key = g_string_new(session->backend->redis_object);
-					g_string_append_len(key, sel->digest, sizeof(sel->digest));
-					session->argv[0] = g_strdup("HMGET");
-					session->argv_lens[0] = 5;
-					session->argv[1] = key->str;
-					session->argv_lens[1] = key->len;
-					session->argv[2] = g_strdup("V");
-					session->argv_lens[2] = 1;
-					session->argv[3] = g_strdup("F");
-					session->argv_lens[3] = 1;
-					session->argv[4] = g_strdup("C");
-					session->argv_lens[4] = 1;
-					g_string_free(key, FALSE); /* Do not free underlying array */
-					memcpy(session->found_digest, sel->digest,
-						   sizeof(session->cmd->digest));
-
-					g_assert(session->ctx != NULL);
-					if (redisAsyncCommandArgv(session->ctx,
-											  rspamd_fuzzy_redis_check_callback,
-											  session, session->nargs,
-											  (const gchar **) session->argv,
-											  session->argv_lens) != REDIS_OK) {
-
-						if (session->callback.cb_check) {
-							memset(&rep, 0, sizeof(rep));
-							session->callback.cb_check(&rep, session->cbdata);
-						}
-
-						rspamd_fuzzy_redis_session_dtor(session, TRUE);
-					}
-					else {
-						/* Add timeout */
-						session->timeout.data = session;
-						ev_now_update_if_cheap((struct ev_loop *) session->event_loop);
-						ev_timer_init(&session->timeout,
-									  rspamd_fuzzy_redis_timeout,
-									  session->backend->timeout, 0.0);
-						ev_timer_start(session->event_loop, &session->timeout);
-					}
-
-					return;
-				}
+				return;
 			}
 		}
 		else if (reply->type == REDIS_REPLY_ERROR) {
@@ -732,6 +757,406 @@ void rspamd_fuzzy_backend_check_redis(struct rspamd_fuzzy_backend *bk,
 	}
 }
 
+/*
+ * Batched check: all commands are pipelined over a single connection. For each
+ * command we ask for the digest and, if it has shingles, for all shingles at
+ * once, so the whole batch costs one round trip. Another round trip is needed
+ * merely to fetch the data of digests found by shingles.
+ */
+struct rspamd_fuzzy_redis_batch_elt {
+	struct rspamd_fuzzy_redis_batch *batch;
+	const struct rspamd_fuzzy_cmd *cmd;
+	void *ud;
+	float prob;
+	gboolean matched;
+	gboolean shingle_matched;
+	struct rspamd_fuzzy_reply rep;
+	guchar found_digest[rspamd_cryptobox_HASHBYTES];
+};
+
+struct rspamd_fuzzy_redis_batch {
+	struct rspamd_fuzzy_backend_redis *backend;
+	redisAsyncContext *ctx;
+	ev_timer timeout;
+	struct ev_loop *event_loop;
+	struct upstream *up;
+	rspamd_fuzzy_check_cb cb;
+	guint ncmds;
+	guint npending;
+	gboolean failed;
+	gboolean shingles_checked;
+	struct rspamd_fuzzy_redis_batch_elt *elts;
+};
+
+static void
+rspamd_fuzzy_redis_batch_timeout(EV_P_ ev_timer *w, int revents)
+{
+	struct rspamd_fuzzy_redis_batch *session =
+		(struct rspamd_fuzzy_redis_batch *) w->data;
+	redisAsyncContext *ac;
+	static char errstr[128];
+
+	if (session->ctx) {
+		ac = session->ctx;
+		session->ctx = NULL;
+		session->failed = TRUE;
+		ac->err = REDIS_ERR_IO;
+		/* Should be safe as in hiredis it is char[128] */
+		rspamd_snprintf(errstr, sizeof(errstr), "%s", strerror(ETIMEDOUT));
+		ac->errstr = errstr;
+
+		/* This will call all pending callbacks and finish the batch */
+		rspamd_redis_pool_release_connection(session->backend->pool,
+											 ac, RSPAMD_REDIS_RELEASE_FATAL);
+	}
+}
+
+static void
+rspamd_fuzzy_redis_batch_fin(struct rspamd_fuzzy_redis_batch *session)
+{
+	redisAsyncContext *ac;
+	struct rspamd_fuzzy_redis_batch_elt *elt;
+	guint i;
+
+	ev_timer_stop(session->event_loop, &session->timeout);
+
+	if (session->up && !session->failed) {
+		rspamd_upstream_ok(session->up);
+	}
+
+	if (session->ctx) {
+		ac = session->ctx;
+		session->ctx = NULL;
+		rspamd_redis_pool_release_connection(session->backend->pool,
+											 ac,
+											 session->failed ? RSPAMD_REDIS_RELEASE_FATAL : RSPAMD_REDIS_RELEASE_DEFAULT);
+	}
+
+	for (i = 0; i < session->ncmds; i++) {
+		elt = &session->elts[i];
+
+		if (!elt->matched) {
+			memset(&elt->rep, 0, sizeof(elt->rep));
+		}
+
+		if (session->cb) {
+			session->cb(&elt->rep, elt->ud);
+		}
+	}
+
+	REF_RELEASE(session->backend);
+
+	if (session->up) {
+		rspamd_upstream_unref(session->up);
+	}
+
+	g_free(session->elts);
+	g_free(session);
+}
+
+static void rspamd_fuzzy_redis_batch_digest_callback(redisAsyncContext *c,
+													 gpointer r, gpointer priv);
+static void rspamd_fuzzy_redis_batch_shingles_callback(redisAsyncContext *c,
+													   gpointer r, gpointer priv);
+
+static void
+rspamd_fuzzy_redis_batch_send_digest(struct rspamd_fuzzy_redis_batch *session,
+									 struct rspamd_fuzzy_redis_batch_elt *elt,
+									 const gchar *digest)
+{
+	GString *key;
+	const gchar *argv[5];
+	gsize argv_lens[5];
+
+	key = g_string_new(session->backend->redis_object);
+	g_string_append_len(key, digest, sizeof(elt->cmd->digest));
+	argv[0] = "HMGET";
+	argv_lens[0] = 5;
+	argv[1] = key->str;
+	argv_lens[1] = key->len;
+	argv[2] = "V";
+	argv_lens[2] = 1;
+	argv[3] = "F";
+	argv_lens[3] = 1;
+	argv[4] = "C";
+	argv_lens[4] = 1;
+
+	/* Hiredis copies arguments to its output buffer */
+	if (redisAsyncCommandArgv(session->ctx,
+							  rspamd_fuzzy_redis_batch_digest_callback,
+							  elt, G_N_ELEMENTS(argv), argv, argv_lens) == REDIS_OK) {
+		session->npending++;
+	}
+	else {
+		session->failed = TRUE;
+	}
+
+	g_string_free(key, TRUE);
+}
+
+static void
+rspamd_fuzzy_redis_batch_send_shingles(struct rspamd_fuzzy_redis_batch *session,
+									   struct rspamd_fuzzy_redis_batch_elt *elt)
+{
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	const gchar *argv[RSPAMD_SHINGLE_SIZE + 1];
+	gsize argv_lens[RSPAMD_SHINGLE_SIZE + 1];
+	GString *keys[RSPAMD_SHINGLE_SIZE];
+	guint i;
+
+	shcmd = (const struct rspamd_fuzzy_shingle_cmd *) elt->cmd;
+	argv[0] = "MGET";
+	argv_lens[0] = 4;
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
+		keys[i] = g_string_sized_new(strlen(session->backend->redis_object) +
+									 2 + 2 + sizeof("18446744073709551616"));
+		rspamd_printf_gstring(keys[i], "%s_%d_%uL", session->backend->redis_object,
+							  i, shcmd->sgl.hashes[i]);
+		argv[i + 1] = keys[i]->str;
+		argv_lens[i + 1] = keys[i]->len;
+	}
+
+	if (redisAsyncCommandArgv(session->ctx,
+							  rspamd_fuzzy_redis_batch_shingles_callback,
+							  elt, G_N_ELEMENTS(argv), argv, argv_lens) == REDIS_OK) {
+		session->npending++;
+	}
+	else {
+		session->failed = TRUE;
+	}
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
+		g_string_free(keys[i], TRUE);
+	}
+}
+
+/*
+ * Called when all pending replies are received: either sends the second
+ * round of requests or finishes the batch
+ */
+static void
+rspamd_fuzzy_redis_batch_step(struct rspamd_fuzzy_redis_batch *session)
+{
+	struct rspamd_fuzzy_redis_batch_elt *elt;
+	redisAsyncContext *ac;
+	guint i;
+
+	if (!session->failed && !session->shingles_checked) {
+		session->shingles_checked = TRUE;
+
+		for (i = 0; i < session->ncmds && !session->failed; i++) {
+			elt = &session->elts[i];
+
+			if (!elt->matched && elt->shingle_matched) {
+				rspamd_fuzzy_redis_batch_send_digest(session, elt,
+													 (const gchar *) elt->found_digest);
+			}
+		}
+	}
+
+	if (session->npending == 0) {
+		rspamd_fuzzy_redis_batch_fin(session);
+	}
+	else if (session->failed) {
+		/* Pending callbacks are called on connection release */
+		ac = session->ctx;
+		session->ctx = NULL;
+		rspamd_redis_pool_release_connection(session->backend->pool,
+											 ac, RSPAMD_REDIS_RELEASE_FATAL);
+	}
+	else {
+		ev_timer_stop(session->event_loop, &session->timeout);
+		ev_now_update_if_cheap((struct ev_loop *) session->event_loop);
+		ev_timer_init(&session->timeout,
+					  rspamd_fuzzy_redis_batch_timeout,
+					  session->backend->timeout, 0.0);
+		ev_timer_start(session->event_loop, &session->timeout);
+	}
+}
+
+static gboolean
+rspamd_fuzzy_redis_batch_reply_ok(struct rspamd_fuzzy_redis_batch *session,
+								  redisAsyncContext *c, redisReply *reply)
+{
+	if (c->err == 0 && reply != NULL) {
+		if (reply->type == REDIS_REPLY_ERROR) {
+			msg_err_redis_session("fuzzy backend redis error: \"%s\"",
+								  reply->str);
+		}
+
+		return TRUE;
+	}
+
+	if (!session->failed && c->errstr) {
+		msg_err_redis_session("error getting hashes on %s: %s",
+							  rspamd_inet_address_to_string_pretty(rspamd_upstream_addr_cur(session->up)),
+							  c->errstr);
+		rspamd_upstream_fail(session->up, FALSE, c->errstr);
+	}
+
+	session->failed = TRUE;
+
+	return FALSE;
+}
+
+static void
+rspamd_fuzzy_redis_batch_digest_callback(redisAsyncContext *c, gpointer r,
+										 gpointer priv)
+{
+	struct rspamd_fuzzy_redis_batch_elt *elt = priv;
+	struct rspamd_fuzzy_redis_batch *session = elt->batch;
+	redisReply *reply = r, *cur;
+	guint found_elts = 0;
+
+	if (rspamd_fuzzy_redis_batch_reply_ok(session, c, reply) &&
+		reply->type == REDIS_REPLY_ARRAY && reply->elements >= 2 &&
+		!elt->matched) {
+		memset(&elt->rep, 0, sizeof(elt->rep));
+		cur = reply->element[0];
+
+		if (cur->type == REDIS_REPLY_STRING) {
+			elt->rep.v1.value = strtoul(cur->str, NULL, 10);
+			found_elts++;
+		}
+
+		cur = reply->element[1];
+
+		if (cur->type == REDIS_REPLY_STRING) {
+			elt->rep.v1.flag = strtoul(cur->str, NULL, 10);
+			found_elts++;
+		}
+
+		if (reply->elements > 2) {
+			cur = reply->element[2];
+
+			if (cur->type == REDIS_REPLY_STRING) {
+				elt->rep.ts = strtoul(cur->str, NULL, 10);
+			}
+		}
+
+		if (found_elts >= 2) {
+			elt->matched = TRUE;
+
+			if (session->shingles_checked) {
+				/* Data of a digest found by shingles */
+				elt->rep.v1.prob = elt->prob;
+				memcpy(elt->rep.digest, elt->found_digest, sizeof(elt->rep.digest));
+			}
+			else {
+				elt->rep.v1.prob = 1.0f;
+				memcpy(elt->rep.digest, elt->cmd->digest, sizeof(elt->rep.digest));
+			}
+		}
+	}
+
+	if (--session->npending == 0) {
+		rspamd_fuzzy_redis_batch_step(session);
+	}
+}
+
+static void
+rspamd_fuzzy_redis_batch_shingles_callback(redisAsyncContext *c, gpointer r,
+										   gpointer priv)
+{
+	struct rspamd_fuzzy_redis_batch_elt *elt = priv;
+	struct rspamd_fuzzy_redis_batch *session = elt->batch;
+	redisReply *reply = r;
+
+	if (rspamd_fuzzy_redis_batch_reply_ok(session, c, reply)) {
+		elt->shingle_matched = rspamd_fuzzy_redis_select_shingle(reply,
+																 elt->found_digest, &elt->prob);
+	}
+
+	if (--session->npending == 0) {
+		rspamd_fuzzy_redis_batch_step(session);
+	}
+}
+
+void rspamd_fuzzy_backend_check_batch_redis(struct rspamd_fuzzy_backend *bk,
+											const struct rspamd_fuzzy_cmd **cmds,
+											guint ncmds,
+											rspamd_fuzzy_check_cb cb, void **uds,
+											void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_redis *backend = subr_ud;
+	struct rspamd_fuzzy_redis_batch *session;
+	struct rspamd_fuzzy_redis_batch_elt *elt;
+	struct upstream *up;
+	struct upstream_list *ups;
+	rspamd_inet_addr_t *addr;
+	guint i;
+
+	g_assert(backend != NULL);
+
+	session = g_malloc0(sizeof(*session));
+	session->backend = backend;
+	REF_RETAIN(session->backend);
+	session->cb = cb;
+	session->ncmds = ncmds;
+	session->event_loop = rspamd_fuzzy_backend_event_base(bk);
+	session->timeout.data = session;
+	session->elts = g_malloc0(sizeof(*session->elts) * ncmds);
+
+	for (i = 0; i < ncmds; i++) {
+		elt = &session->elts[i];
+		elt->batch = session;
+		elt->cmd = cmds[i];
+		elt->ud = uds[i];
+	}
+
+	ups = rspamd_redis_get_servers(backend, "read_servers");
+
+	if (!ups) {
+		session->failed = TRUE;
+		rspamd_fuzzy_redis_batch_fin(session);
+
+		return;
+	}
+
+	up = rspamd_upstream_get(ups,
+							 RSPAMD_UPSTREAM_ROUND_ROBIN,
+							 NULL,
+							 0);
+
+	session->up = rspamd_upstream_ref(up);
+	addr = rspamd_upstream_addr_next(up);
+	g_assert(addr != NULL);
+	session->ctx = rspamd_redis_pool_connect(backend->pool,
+											 backend->dbname,
+											 backend->username, backend->password,
+											 rspamd_inet_address_to_string(addr),
+											 rspamd_inet_address_get_port(addr));
+
+	if (session->ctx == NULL) {
+		rspamd_upstream_fail(up, TRUE, strerror(errno));
+		session->failed = TRUE;
+		rspamd_fuzzy_redis_batch_fin(session);
+
+		return;
+	}
+
+	for (i = 0; i < ncmds && !session->failed; i++) {
+		elt = &session->elts[i];
+		rspamd_fuzzy_redis_batch_send_digest(session, elt, elt->cmd->digest);
+
+		if (elt->cmd->shingles_count > 0 && !session->failed) {
+			rspamd_fuzzy_redis_batch_send_shingles(session, elt);
+		}
+	}
+
+	if (session->failed) {
+		rspamd_fuzzy_redis_batch_step(session);
+	}
+	else {
+		ev_now_update_if_cheap((struct ev_loop *) session->event_loop);
+		ev_timer_init(&session->timeout,
+					  rspamd_fuzzy_redis_batch_timeout,
+					  session->backend->timeout, 0.0);
+		ev_timer_start(session->event_loop, &session->timeout);
+	}
+}
+
 static void
 rspamd_fuzzy_redis_count_callback(redisAsyncContext *c, gpointer r,
 								  gpointer priv)
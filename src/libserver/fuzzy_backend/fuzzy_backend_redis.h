@@ -37,6 +37,12 @@ void rspamd_fuzzy_backend_check_redis(struct rspamd_fuzzy_backend *bk,
 									  rspamd_fuzzy_check_cb cb, void *ud,
 									  void *subr_ud);
 
+void rspamd_fuzzy_backend_check_batch_redis(struct rspamd_fuzzy_backend *bk,
+											const struct rspamd_fuzzy_cmd **cmds,
+											guint ncmds,
+											rspamd_fuzzy_check_cb cb, void **uds,
+											void *subr_ud);
+
 void rspamd_fuzzy_backend_update_redis(struct rspamd_fuzzy_backend *bk,
 									   GArray *updates, const gchar *src,
 									   rspamd_fuzzy_update_cb cb, void *ud,
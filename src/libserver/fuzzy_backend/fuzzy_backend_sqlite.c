@@ -459,9 +459,12 @@ rspamd_fuzzy_backend_sqlite_int64_cmp(const void *a, const void *b)
 	return (ia - ib);
 }
 
-struct rspamd_fuzzy_reply
-rspamd_fuzzy_backend_sqlite_check(struct rspamd_fuzzy_backend_sqlite *backend,
-								  const struct rspamd_fuzzy_cmd *cmd, gint64 expire)
+/*
+ * Must be called within a transaction
+ */
+static struct rspamd_fuzzy_reply
+rspamd_fuzzy_backend_sqlite_check_single(struct rspamd_fuzzy_backend_sqlite *backend,
+										 const struct rspamd_fuzzy_cmd *cmd, gint64 expire)
 {
 	struct rspamd_fuzzy_reply rep;
 	const struct rspamd_fuzzy_shingle_cmd *shcmd;
@@ -473,13 +476,7 @@ rspamd_fuzzy_backend_sqlite_check(struct rspamd_fuzzy_backend_sqlite *backend,
 	memset(&rep, 0, sizeof(rep));
 	memcpy(rep.digest, cmd->digest, sizeof(rep.digest));
 
-	if (backend == NULL) {
-		return rep;
-	}
-
 	/* Try direct match first of all */
-	rspamd_fuzzy_backend_sqlite_run_stmt(backend, TRUE,
-										 RSPAMD_FUZZY_BACKEND_TRANSACTION_START);
 	rc = rspamd_fuzzy_backend_sqlite_run_stmt(backend, FALSE,
 											  RSPAMD_FUZZY_BACKEND_CHECK,
 											  cmd->digest);
@@ -597,12 +594,60 @@ rspamd_fuzzy_backend_sqlite_check(struct rspamd_fuzzy_backend_sqlite *backend,
 	}
 
 	rspamd_fuzzy_backend_sqlite_cleanup_stmt(backend, RSPAMD_FUZZY_BACKEND_CHECK);
+
+	return rep;
+}
+
+struct rspamd_fuzzy_reply
+rspamd_fuzzy_backend_sqlite_check(struct rspamd_fuzzy_backend_sqlite *backend,
+								  const struct rspamd_fuzzy_cmd *cmd, gint64 expire)
+{
+	struct rspamd_fuzzy_reply rep;
+
+	if (backend == NULL) {
+		memset(&rep, 0, sizeof(rep));
+		memcpy(rep.digest, cmd->digest, sizeof(rep.digest));
+
+		return rep;
+	}
+
+	rspamd_fuzzy_backend_sqlite_run_stmt(backend, TRUE,
+										 RSPAMD_FUZZY_BACKEND_TRANSACTION_START);
+	rep = rspamd_fuzzy_backend_sqlite_check_single(backend, cmd, expire);
 	rspamd_fuzzy_backend_sqlite_run_stmt(backend, TRUE,
 										 RSPAMD_FUZZY_BACKEND_TRANSACTION_COMMIT);
 
 	return rep;
 }
 
+void rspamd_fuzzy_backend_sqlite_check_batch(struct rspamd_fuzzy_backend_sqlite *backend,
+											 const struct rspamd_fuzzy_cmd **cmds,
+											 guint ncmds,
+											 gint64 expire,
+											 struct rspamd_fuzzy_reply *reps)
+{
+	guint i;
+
+	if (backend == NULL) {
+		for (i = 0; i < ncmds; i++) {
+			memset(&reps[i], 0, sizeof(reps[i]));
+			memcpy(reps[i].digest, cmds[i]->digest, sizeof(reps[i].digest));
+		}
+
+		return;
+	}
+
+	rspamd_fuzzy_backend_sqlite_run_stmt(backend, TRUE,
+										 RSPAMD_FUZZY_BACKEND_TRANSACTION_START);
+
+	for (i = 0; i < ncmds; i++) {
+		reps[i] = rspamd_fuzzy_backend_sqlite_check_single(backend, cmds[i], expire);
+	}
+
+	rspamd_fuzzy_backend_sqlite_run_stmt(backend, TRUE,
+										 RSPAMD_FUZZY_BACKEND_TRANSACTION_COMMIT);
+}
+
 gboolean
 rspamd_fuzzy_backend_sqlite_prepare_update(struct rspamd_fuzzy_backend_sqlite *backend,
 										   const gchar *source)
@@ -1339,6 +1339,8 @@ auto html_process_input(struct rspamd_task *task,
 	struct html_tag *cur_tag = nullptr, *parent_tag = nullptr, cur_closing_tag;
 	struct tag_content_parser_state content_parser_env;
 	auto process_size = in->len;
+	/* Style blocks are parsed all together when the whole document is processed */
+	std::vector<std::string_view> css_inputs;
 
 
 	enum {
@@ -2000,23 +2002,8 @@ auto html_process_input(struct rspamd_task *task,
 
 					if (opening_tag && opening_tag->id == Tag_STYLE &&
 						(int) opening_tag->content_offset < opening_tag->closing.start) {
-						auto ret_maybe = rspamd::css::parse_css(pool,
-																{start + opening_tag->content_offset,
-																 opening_tag->closing.start - opening_tag->content_offset},
-																std::move(hc->css_style));
-
-						if (!ret_maybe.has_value()) {
-							if (ret_maybe.error().is_fatal()) {
-								auto err_str = fmt::format(
-									"cannot parse css (error code: {}): {}",
-									static_cast<int>(ret_maybe.error().type),
-									ret_maybe.error().description.value_or("unknown error"));
-								msg_info_pool("%*s", (int) err_str.size(), err_str.data());
-							}
-						}
-						else {
-							hc->css_style = ret_maybe.value();
-						}
+						css_inputs.emplace_back(start + opening_tag->content_offset,
+												opening_tag->closing.start - opening_tag->content_offset);
 					}
 				}
 
@@ -2079,10 +2066,25 @@ auto html_process_input(struct rspamd_task *task,
 						   end - start, end - start);
 	}
 
+	if (!css_inputs.empty()) {
+		auto css_cache_size = task->cfg ? task->cfg->css_cache_size : 0;
+
+		hc->css_style = rspamd::css::css_parse_styles(pool, css_inputs, css_cache_size,
+													  [&](const css::css_parse_error &err) {
+														  if (err.is_fatal()) {
+															  auto err_str = fmt::format(
+																  "cannot parse css (error code: {}): {}",
+																  static_cast<int>(err.type),
+																  err.description.value_or("unknown error"));
+															  msg_info_pool("%*s", (int) err_str.size(), err_str.data());
+														  }
+													  });
+	}
+
 	/* Propagate styles */
 	hc->traverse_block_tags([&hc, &pool](const html_tag *tag) -> bool {
 		if (hc->css_style && tag->id > Tag_UNKNOWN && tag->id < Tag_MAX) {
-			auto *css_block = hc->css_style->check_tag_block(tag);
+			auto *css_block = hc->css_style->check_tag_block(tag, pool);
 
 			if (css_block) {
 				if (tag->block) {
@@ -199,6 +199,10 @@ TEST_SUITE("html")
 			/* Font-size propagation */
 			{"<p style=\"font-size: 11pt;line-height:22px\">goodbye <span style=\"font-size:0px\">cruel</span>world</p>",
 			 "goodbye world\n"},
+			/* Stylesheet selectors */
+			{"<style>.hidden { display: none }</style>"
+			 "<div>fi<span class=\"foo hidden\">le </span>sh</div>",
+			 "fish\n"},
 			/* Newline before tag -> must be space */
 			{"goodbye <span style=\"COLOR: rgb(64,64,64)\">cruel</span>\n"
 			 "<span>world</span>",
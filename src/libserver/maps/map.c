@@ -20,6 +20,7 @@
 #include "config.h"
 #include "map.h"
 #include "map_private.h"
+#include "map_helpers.h"
 #include "libserver/http/http_connection.h"
 #include "libserver/http/http_private.h"
 #include "rspamd.h"
@@ -404,6 +405,7 @@ http_map_finish(struct rspamd_http_connection *conn,
 
 		MAP_RETAIN(cbd->shmem_data, "shmem_data");
 		cbd->data->gen++;
+		cbd->periodic->fetched = TRUE;
 		/*
 		 * We know that a map is in the locked state
 		 */
@@ -989,6 +991,157 @@ read_map_static(struct rspamd_map *map, struct static_map_data *data,
 	return TRUE;
 }
 
+static void
+rspamd_map_unlink_shared_index(const gchar *shm_name)
+{
+#ifdef HAVE_SANE_SHMEM
+	shm_unlink(shm_name);
+#else
+	unlink(shm_name);
+#endif
+}
+
+/*
+ * Index fields of the cache point are updated by the cache owner only, other
+ * workers read them without the map lock, so they are published under
+ * a sequence counter
+ */
+static void
+rspamd_map_cachepoint_set_index(struct rspamd_map_cachepoint *cache,
+								const gchar *shm_name, const gchar *src,
+								gsize len)
+{
+	g_atomic_int_inc(&cache->index_gen);
+	cache->index_len = len;
+	rspamd_strlcpy(cache->index_shmem_name, shm_name,
+				   sizeof(cache->index_shmem_name));
+	rspamd_strlcpy(cache->index_src, src, sizeof(cache->index_src));
+	g_atomic_int_inc(&cache->index_gen);
+}
+
+/*
+ * Copies index fields of the cache point to `shm_name` and `src`, which must be
+ * of the same size as in the cache point; returns FALSE if there is no index or
+ * the fields are being updated
+ */
+static gboolean
+rspamd_map_cachepoint_get_index(struct rspamd_map_cachepoint *cache,
+								gchar *shm_name, gchar *src, gsize *len)
+{
+	gint gen, tries;
+
+	for (tries = 0; tries < 3; tries++) {
+		gen = g_atomic_int_get(&cache->index_gen);
+
+		if (gen & 1) {
+			continue;
+		}
+
+		*len = cache->index_len;
+		memcpy(shm_name, cache->index_shmem_name, sizeof(cache->index_shmem_name));
+		memcpy(src, cache->index_src, sizeof(cache->index_src));
+
+		if (g_atomic_int_get(&cache->index_gen) == gen) {
+			shm_name[sizeof(cache->index_shmem_name) - 1] = '\0';
+			src[sizeof(cache->index_src) - 1] = '\0';
+
+			return shm_name[0] != '\0';
+		}
+	}
+
+	return FALSE;
+}
+
+/*
+ * Builds an index for the freshly fetched map data and stores it in a shared
+ * memory segment, so other workers could use it instead of parsing the data
+ */
+static void
+rspamd_map_store_shared_index(struct rspamd_map *map)
+{
+	struct rspamd_map_backend *bk;
+	struct http_map_data *data;
+	gchar shm_name[256];
+	guchar *idx;
+	gsize len, written = 0;
+	gssize r;
+	gint fd;
+
+	if (map->index_build == NULL || map->backends->len != 1 ||
+		map->user_data == NULL || *map->user_data == NULL) {
+		return;
+	}
+
+	bk = g_ptr_array_index(map->backends, 0);
+
+	if (bk->protocol != MAP_PROTO_HTTP && bk->protocol != MAP_PROTO_HTTPS) {
+		return;
+	}
+
+	data = bk->data.hd;
+
+	if (g_atomic_int_get(&data->cache->available) != 1) {
+		return;
+	}
+
+	idx = map->index_build(*map->user_data, &len);
+
+	if (idx == NULL) {
+		return;
+	}
+
+#ifdef HAVE_SANE_SHMEM
+	rspamd_strlcpy(shm_name, "/rhi.XXXXXXXXXXXXXXXXXXXX", sizeof(shm_name));
+	fd = rspamd_shmem_mkstemp(shm_name);
+#else
+	rspamd_strlcpy(shm_name, "/tmp/rhi.XXXXXXXXXXXXXXXXXXXX", sizeof(shm_name));
+	fd = mkstemp(shm_name);
+#endif
+
+	if (fd == -1) {
+		msg_err_map("cannot create shared index for %s: %s", map->name,
+					strerror(errno));
+		g_free(idx);
+
+		return;
+	}
+
+	while (written < len) {
+		r = write(fd, idx + written, len - written);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			msg_err_map("cannot write shared index to %s: %s", shm_name,
+						strerror(errno));
+			close(fd);
+			rspamd_map_unlink_shared_index(shm_name);
+			g_free(idx);
+
+			return;
+		}
+
+		written += r;
+	}
+
+	close(fd);
+	g_free(idx);
+
+	if (data->index_shmem_name) {
+		rspamd_map_unlink_shared_index(data->index_shmem_name);
+		g_free(data->index_shmem_name);
+	}
+
+	data->index_shmem_name = g_strdup(shm_name);
+	/* We own the map lock here, so we are the only writer of the cache point */
+	rspamd_map_cachepoint_set_index(data->cache, shm_name,
+									data->cache->shmem_name, len);
+	msg_info_map("stored shared index for %s in %s, %z bytes", map->name,
+				 shm_name, len);
+}
+
 static void
 rspamd_map_periodic_dtor(struct map_periodic_cbdata *periodic)
 {
@@ -1001,6 +1154,10 @@ rspamd_map_periodic_dtor(struct map_periodic_cbdata *periodic)
 		/* Need to notify the real data structure */
 		periodic->map->fin_callback(&periodic->cbdata, periodic->map->user_data);
 
+		if (periodic->fetched && !periodic->cbdata.errored) {
+			rspamd_map_store_shared_index(map);
+		}
+
 		if (map->on_load_function) {
 			map->on_load_function(map, map->on_load_ud);
 		}
@@ -1330,12 +1487,32 @@ static gboolean
 rspamd_map_read_cached(struct rspamd_map *map, struct rspamd_map_backend *bk,
 					   struct map_periodic_cbdata *periodic, const gchar *host)
 {
-	gsize mmap_len, len;
+	gsize mmap_len, len, index_len;
 	gpointer in;
 	struct http_map_data *data;
+	gchar index_shmem_name[sizeof(data->cache->index_shmem_name)],
+		index_src[sizeof(data->cache->index_src)];
 
 	data = bk->data.hd;
 
+	if (map->index_load && map->backends->len == 1 &&
+		periodic->cbdata.cur_data == NULL &&
+		rspamd_map_cachepoint_get_index(data->cache, index_shmem_name,
+										index_src, &index_len) &&
+		strcmp(index_src, data->cache->shmem_name) == 0) {
+		/* Cache owner has already built the index for these data */
+		periodic->cbdata.cur_data = map->index_load(map,
+													index_shmem_name,
+													index_len);
+
+		if (periodic->cbdata.cur_data != NULL) {
+			msg_info_map("%s: use shared index %s of %z bytes", bk->uri,
+						 index_shmem_name, index_len);
+
+			return TRUE;
+		}
+	}
+
 	in = rspamd_shmem_xmap(data->cache->shmem_name, PROT_READ, &mmap_len);
 
 	if (in == NULL) {
@@ -2559,6 +2736,19 @@ rspamd_map_backend_dtor(struct rspamd_map_backend *bk)
 			 * as cur_cache_cbd is meaningful merely for active worker, who actually
 			 * owns the cache
 			 */
+			if (data->index_shmem_name) {
+				/* Index is owned by a worker that has built it */
+				rspamd_map_unlink_shared_index(data->index_shmem_name);
+
+				/* Do not let other workers try to load the unlinked index */
+				if (data->cache &&
+					strcmp(data->cache->index_shmem_name, data->index_shmem_name) == 0) {
+					rspamd_map_cachepoint_set_index(data->cache, "", "", 0);
+				}
+
+				g_free(data->index_shmem_name);
+			}
+
 			if (bk->map && bk->map->active_http) {
 				if (g_atomic_int_compare_and_exchange(&data->cache->available, 1, 0)) {
 					if (data->cur_cache_cbd) {
@@ -2839,6 +3029,16 @@ rspamd_map_add_static_string(struct rspamd_config *cfg,
 	return TRUE;
 }
 
+static void
+rspamd_map_setup_shared_index(struct rspamd_map *map)
+{
+	/* Merely kv maps support shared indexes for now */
+	if (map->cfg->maps_shared_index && map->read_callback == rspamd_kv_list_read) {
+		map->index_build = rspamd_map_helper_hash_index_build;
+		map->index_load = rspamd_map_helper_hash_index_load;
+	}
+}
+
 struct rspamd_map *
 rspamd_map_add(struct rspamd_config *cfg,
 			   const gchar *map_line,
@@ -2871,6 +3071,7 @@ rspamd_map_add(struct rspamd_config *cfg,
 	map->dtor = dtor;
 	map->user_data = user_data;
 	map->cfg = cfg;
+	rspamd_map_setup_shared_index(map);
 	map->id = rspamd_random_uint64_fast();
 	map->locked =
 		rspamd_mempool_alloc0_shared(cfg->cfg_pool, sizeof(gint));
@@ -2971,6 +3172,7 @@ rspamd_map_add_from_ucl(struct rspamd_config *cfg,
 	map->dtor = dtor;
 	map->user_data = user_data;
 	map->cfg = cfg;
+	rspamd_map_setup_shared_index(map);
 	map->id = rspamd_random_uint64_fast();
 	map->locked =
 		rspamd_mempool_alloc0_shared(cfg->cfg_pool, sizeof(gint));
@@ -44,6 +44,9 @@ typedef void (*rspamd_map_traverse_function)(void *data,
 											 rspamd_map_traverse_cb cb,
 											 gpointer cbdata, gboolean reset_hits);
 typedef void (*rspamd_map_on_load_function)(struct rspamd_map *map, gpointer ud);
+typedef gpointer (*rspamd_map_index_build_function)(gpointer data, gsize *plen);
+typedef gpointer (*rspamd_map_index_load_function)(struct rspamd_map *map,
+												   const gchar *shm_name, gsize len);
 
 /**
  * Callback data for async load
@@ -64,6 +64,30 @@ struct rspamd_hash_map_helper {
 	khash_t(rspamd_map_hash) * htb;
 	struct rspamd_map *map;
 	rspamd_cryptobox_fast_hash_state_t hst;
+	/* Immutable shared index used instead of htb if not NULL */
+	const guchar *index;
+	gsize index_len;
+};
+
+/*
+ * Shared kv index is a position independent open addressing table:
+ * header, nslots of slots, keys and values blob (values are zero terminated)
+ */
+static const gchar rspamd_map_hash_index_magic[] = {'r', 'm', 'h', 'i', 'd', 'x', '0', '1'};
+
+struct rspamd_map_hash_index_hdr {
+	gchar magic[sizeof(rspamd_map_hash_index_magic)];
+	guint64 digest;
+	guint32 nelts;
+	guint32 nslots; /* power of 2 */
+};
+
+struct rspamd_map_hash_index_slot {
+	guint64 hash;
+	guint32 key_off; /* zero for empty slots */
+	guint32 key_len;
+	guint32 value_off;
+	guint32 value_len;
 };
 
 struct rspamd_cdb_map_helper {
@@ -771,10 +795,147 @@ void rspamd_map_helper_destroy_hash(struct rspamd_hash_map_helper *r)
 
 	rspamd_mempool_t *pool = r->pool;
 	kh_destroy(rspamd_map_hash, r->htb);
+
+	if (r->index) {
+		munmap((gpointer) r->index, r->index_len);
+	}
+
 	memset(r, 0, sizeof(*r));
 	rspamd_mempool_delete(pool);
 }
 
+gpointer
+rspamd_map_helper_hash_index_build(gpointer data, gsize *plen)
+{
+	struct rspamd_hash_map_helper *ht = (struct rspamd_hash_map_helper *) data;
+	struct rspamd_map_hash_index_hdr *hdr;
+	struct rspamd_map_hash_index_slot *slots, *slot;
+	struct rspamd_map_helper_value *val;
+	rspamd_ftok_t tok;
+	guint32 nslots = 16, mask;
+	gsize total, blob_len = 0;
+	guchar *out, *blob;
+	guint64 h;
+
+	if (ht == NULL || ht->htb == NULL || ht->index != NULL) {
+		return NULL;
+	}
+
+	kh_foreach(ht->htb, tok, val, {
+		blob_len += tok.len + strlen(val->value) + 1;
+	});
+
+	/* Keep load factor below 0.5 to have short probe sequences */
+	while (nslots < kh_size(ht->htb) * 2) {
+		nslots <<= 1;
+	}
+
+	total = sizeof(*hdr) + sizeof(*slots) * nslots + blob_len;
+
+	if (total > G_MAXUINT32) {
+		/* Offsets are 32 bit */
+		return NULL;
+	}
+
+	out = g_malloc0(total);
+	hdr = (struct rspamd_map_hash_index_hdr *) out;
+	memcpy(hdr->magic, rspamd_map_hash_index_magic, sizeof(hdr->magic));
+	hdr->digest = ht->map ? ht->map->digest : 0;
+	hdr->nelts = kh_size(ht->htb);
+	hdr->nslots = nslots;
+	slots = (struct rspamd_map_hash_index_slot *) (out + sizeof(*hdr));
+	blob = out + sizeof(*hdr) + sizeof(*slots) * nslots;
+	mask = nslots - 1;
+
+	kh_foreach(ht->htb, tok, val, {
+		h = rspamd_icase_hash(tok.begin, tok.len, map_hash_seed);
+		slot = &slots[h & mask];
+
+		while (slot->key_off != 0) {
+			slot = &slots[(slot - slots + 1) & mask];
+		}
+
+		slot->hash = h;
+		slot->key_off = blob - out;
+		slot->key_len = tok.len;
+		memcpy(blob, tok.begin, tok.len);
+		blob += tok.len;
+		slot->value_off = blob - out;
+		slot->value_len = strlen(val->value);
+		memcpy(blob, val->value, slot->value_len + 1);
+		blob += slot->value_len + 1;
+	});
+
+	*plen = total;
+
+	return out;
+}
+
+gpointer
+rspamd_map_helper_hash_index_load(struct rspamd_map *map,
+								  const gchar *shm_name, gsize len)
+{
+	struct rspamd_hash_map_helper *ht;
+	const struct rspamd_map_hash_index_hdr *hdr;
+	guchar *in;
+	gsize mmap_len;
+
+	in = rspamd_shmem_xmap(shm_name, PROT_READ, &mmap_len);
+
+	if (in == NULL) {
+		msg_err_map("cannot map shared index from %s: %s", shm_name,
+					strerror(errno));
+
+		return NULL;
+	}
+
+	hdr = (const struct rspamd_map_hash_index_hdr *) in;
+
+	if (mmap_len < len || len < sizeof(*hdr) ||
+		memcmp(hdr->magic, rspamd_map_hash_index_magic, sizeof(hdr->magic)) != 0 ||
+		(hdr->nslots & (hdr->nslots - 1)) != 0 ||
+		sizeof(*hdr) + sizeof(struct rspamd_map_hash_index_slot) * (gsize) hdr->nslots > len) {
+		msg_err_map("cannot use shared index from %s: bad index of %z bytes",
+					shm_name, mmap_len);
+		munmap(in, mmap_len);
+
+		return NULL;
+	}
+
+	ht = rspamd_map_helper_new_hash(map);
+	ht->index = in;
+	ht->index_len = mmap_len;
+
+	return ht;
+}
+
+static const gchar *
+rspamd_map_helper_hash_index_find(struct rspamd_hash_map_helper *ht,
+								  const gchar *in, gsize len)
+{
+	const struct rspamd_map_hash_index_hdr *hdr;
+	const struct rspamd_map_hash_index_slot *slots, *slot;
+	guint32 mask;
+	guint64 h;
+
+	hdr = (const struct rspamd_map_hash_index_hdr *) ht->index;
+	slots = (const struct rspamd_map_hash_index_slot *) (ht->index + sizeof(*hdr));
+	mask = hdr->nslots - 1;
+	h = rspamd_icase_hash(in, len, map_hash_seed);
+	slot = &slots[h & mask];
+
+	while (slot->key_off != 0) {
+		if (slot->hash == h && slot->key_len == len &&
+			rspamd_lc_cmp((const gchar *) ht->index + slot->key_off, in, len) == 0) {
+			return (const gchar *) ht->index + slot->value_off;
+		}
+
+		slot = &slots[(slot - slots + 1) & mask];
+	}
+
+	return NULL;
+}
+
 static void
 rspamd_map_helper_traverse_hash(void *data,
 								rspamd_map_traverse_cb cb,
@@ -785,6 +946,31 @@ rspamd_map_helper_traverse_hash(void *data,
 	struct rspamd_map_helper_value *val;
 	struct rspamd_hash_map_helper *ht = data;
 
+	if (ht->index) {
+		const struct rspamd_map_hash_index_hdr *hdr =
+			(const struct rspamd_map_hash_index_hdr *) ht->index;
+		const struct rspamd_map_hash_index_slot *slots =
+			(const struct rspamd_map_hash_index_slot *) (ht->index + sizeof(*hdr));
+		gchar *key;
+		gboolean cont;
+
+		/* Shared index is read only, so there are no hits */
+		for (guint32 i = 0; i < hdr->nslots; i++) {
+			if (slots[i].key_off != 0) {
+				key = g_strndup((const gchar *) ht->index + slots[i].key_off,
+								slots[i].key_len);
+				cont = cb(key, ht->index + slots[i].value_off, 0, cbdata);
+				g_free(key);
+
+				if (!cont) {
+					break;
+				}
+			}
+		}
+
+		return;
+	}
+
 	kh_foreach(ht->htb, tok, val, {
 		if (!cb(tok.begin, val->value, val->hits, cbdata)) {
 			break;
@@ -962,11 +1148,24 @@ void rspamd_kv_list_fin(struct map_cb_data *data, void **target)
 	else {
 		if (data->cur_data) {
 			htb = (struct rspamd_hash_map_helper *) data->cur_data;
-			msg_info_map("read hash of %d elements from %s", kh_size(htb->htb),
-						 map->name);
+
+			if (htb->index) {
+				const struct rspamd_map_hash_index_hdr *hdr =
+					(const struct rspamd_map_hash_index_hdr *) htb->index;
+
+				msg_info_map("use shared index of %d elements for %s", (gint) hdr->nelts,
+							 map->name);
+				data->map->nelts = hdr->nelts;
+				data->map->digest = hdr->digest;
+			}
+			else {
+				msg_info_map("read hash of %d elements from %s", kh_size(htb->htb),
+							 map->name);
+				data->map->nelts = kh_size(htb->htb);
+				data->map->digest = rspamd_cryptobox_fast_hash_final(&htb->hst);
+			}
+
 			data->map->traverse_function = rspamd_map_helper_traverse_hash;
-			data->map->nelts = kh_size(htb->htb);
-			data->map->digest = rspamd_cryptobox_fast_hash_final(&htb->hst);
 		}
 
 		if (target) {
@@ -1605,6 +1804,10 @@ rspamd_match_hash_map(struct rspamd_hash_map_helper *map, const gchar *in,
 		return NULL;
 	}
 
+	if (map->index) {
+		return rspamd_map_helper_hash_index_find(map, in, len);
+	}
+
 	tok.begin = in;
 	tok.len = len;
 
@@ -239,6 +239,24 @@ void rspamd_map_helper_insert_hash(gpointer st, gconstpointer key, gconstpointer
  */
 void rspamd_map_helper_destroy_hash(struct rspamd_hash_map_helper *r);
 
+/**
+ * Builds an immutable position independent index from a kv map helper
+ * @param data hash map helper
+ * @param plen output length of the index
+ * @return g_malloc'ed index or NULL
+ */
+gpointer rspamd_map_helper_hash_index_build(gpointer data, gsize *plen);
+
+/**
+ * Creates a kv map helper that uses an index in the shared memory segment
+ * @param map map object
+ * @param shm_name name of the shared memory segment
+ * @param len length of the index
+ * @return new hash map helper or NULL
+ */
+gpointer rspamd_map_helper_hash_index_load(struct rspamd_map *map,
+										   const gchar *shm_name, gsize len);
+
 /**
  * Create new regexp map
  * @param map
@@ -81,6 +81,14 @@ struct rspamd_map_cachepoint {
 	gsize len;
 	time_t last_modified;
 	gchar shmem_name[256];
+	/*
+	 * Shared index built by the cache owner from the data in `index_src`,
+	 * `index_gen` is odd while the owner updates the index fields
+	 */
+	gint index_gen;
+	gsize index_len;
+	gchar index_src[256];
+	gchar index_shmem_name[256];
 };
 
 /**
@@ -96,6 +104,8 @@ struct http_map_data {
 	gchar *host;
 	gchar *rest;
 	rspamd_fstring_t *etag;
+	/* Non-shared for cache owner, used to cleanup the shared index */
+	gchar *index_shmem_name;
 	time_t last_modified;
 	time_t last_checked;
 	gboolean request_sent;
@@ -155,6 +165,9 @@ struct rspamd_map {
 	gpointer on_load_ud;
 	GDestroyNotify on_load_ud_dtor;
 	gpointer lua_map;
+	/* Optional immutable index shared between workers */
+	rspamd_map_index_build_function index_build;
+	rspamd_map_index_load_function index_load;
 	gsize nelts;
 	guint64 digest;
 	/* Should we check HTTP or just load cached data */
@@ -186,6 +199,7 @@ struct map_periodic_cbdata {
 	gboolean need_modify;
 	gboolean errored;
 	gboolean locked;
+	gboolean fetched; /* data has been fetched from the network */
 	guint cur_backend;
 	ref_entry_t ref;
 };
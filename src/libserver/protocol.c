@@ -386,6 +386,7 @@ rspamd_protocol_handle_flag(struct rspamd_task *task, const gchar *str,
 	CHECK_TASK_FLAG("no_stat", RSPAMD_TASK_FLAG_NO_STAT);
 	CHECK_TASK_FLAG("ssl", RSPAMD_TASK_FLAG_SSL);
 	CHECK_TASK_FLAG("profile", RSPAMD_TASK_FLAG_PROFILE);
+	CHECK_TASK_FLAG("trace", RSPAMD_TASK_FLAG_TRACE);
 
 	CHECK_PROTOCOL_FLAG("milter", RSPAMD_TASK_PROTOCOL_FLAG_MILTER);
 	CHECK_PROTOCOL_FLAG("zstd", RSPAMD_TASK_PROTOCOL_FLAG_COMPRESSED);
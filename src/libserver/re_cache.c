@@ -77,8 +77,16 @@ INIT_LOG_MODULE(re_cache)
 
 #ifdef WITH_HYPERSCAN
 #define RSPAMD_HS_MAGIC_LEN (sizeof(rspamd_hs_magic))
-static const guchar rspamd_hs_magic[] = {'r', 's', 'h', 's', 'r', 'e', '1', '1'},
-					rspamd_hs_magic_vector[] = {'r', 's', 'h', 's', 'r', 'v', '1', '1'};
+static const guchar rspamd_hs_magic[] = {'r', 's', 'h', 's', 'r', 'e', '1', '2'},
+					rspamd_hs_magic_vector[] = {'r', 's', 'h', 's', 'r', 'v', '1', '2'};
+
+/* Identity of a hyperscan file, atomic rename of a new file always changes it */
+struct rspamd_re_cache_file_id {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+};
 #endif
 
 
@@ -89,6 +97,7 @@ struct rspamd_re_class {
 	gpointer type_data;
 	gsize type_len;
 	GHashTable *re;
+	GPtrArray *re_list; /* stable order of regexps, hyperscan ids are indices here */
 	rspamd_cryptobox_hash_state_t *st;
 
 	gchar hash[rspamd_cryptobox_HASHBYTES + 1];
@@ -98,6 +107,9 @@ struct rspamd_re_class {
 	hs_scratch_t *hs_scratch;
 	gint *hs_ids;
 	guint nhs;
+	gboolean hs_stream; /* database is compiled in streaming mode */
+	struct rspamd_re_cache_file_id hs_checked; /* last file validated */
+	struct rspamd_re_cache_file_id hs_loaded;  /* file of hs_db */
 #endif
 };
 
@@ -128,6 +140,8 @@ struct rspamd_re_cache {
 #ifdef WITH_HYPERSCAN
 	enum rspamd_hyperscan_status hyperscan_loaded;
 	gboolean disable_hyperscan;
+	gboolean vectorized_hyperscan;
+	gboolean eager_hyperscan;
 	hs_platform_info_t plt;
 #endif
 };
@@ -190,6 +204,10 @@ rspamd_re_cache_destroy(struct rspamd_re_cache *cache)
 		g_hash_table_iter_steal(&it);
 		g_hash_table_unref(re_class->re);
 
+		if (re_class->re_list) {
+			g_ptr_array_free(re_class->re_list, TRUE);
+		}
+
 		if (re_class->type_data) {
 			g_free(re_class->type_data);
 		}
@@ -379,9 +397,48 @@ rspamd_re_cache_sort_func(gconstpointer a, gconstpointer b)
 							 rspamd_regexp_get_id((*re2)->re));
 }
 
+#ifdef WITH_HYPERSCAN
+/*
+ * Returns TRUE if a class usually has many small inputs (e.g. one per header
+ * or per url), so the per-scan overhead dominates over the scan itself
+ */
+static gboolean
+rspamd_re_cache_type_is_multi(enum rspamd_re_type type)
+{
+	switch (type) {
+	case RSPAMD_RE_HEADER:
+	case RSPAMD_RE_RAWHEADER:
+	case RSPAMD_RE_MIMEHEADER:
+	case RSPAMD_RE_URL:
+	case RSPAMD_RE_EMAIL:
+	case RSPAMD_RE_WORDS:
+	case RSPAMD_RE_RAWWORDS:
+	case RSPAMD_RE_STEMWORDS:
+	case RSPAMD_RE_SELECTOR:
+		return TRUE;
+	default:
+		break;
+	}
+
+	return FALSE;
+}
+
+static inline const guchar *
+rspamd_re_cache_class_magic(struct rspamd_re_class *re_class)
+{
+	return re_class->hs_stream ? rspamd_hs_magic_vector : rspamd_hs_magic;
+}
+
+static inline guint
+rspamd_re_cache_class_hs_mode(struct rspamd_re_class *re_class)
+{
+	return re_class->hs_stream ? (HS_MODE_STREAM | HS_MODE_SOM_HORIZON_LARGE) : HS_MODE_BLOCK;
+}
+#endif
+
 void rspamd_re_cache_init(struct rspamd_re_cache *cache, struct rspamd_config *cfg)
 {
-	guint i, fl;
+	guint i, fl, local_id;
 	GHashTableIter it;
 	gpointer k, v;
 	struct rspamd_re_class *re_class;
@@ -396,12 +453,28 @@ void rspamd_re_cache_init(struct rspamd_re_cache *cache, struct rspamd_config *c
 	/* Resort all regexps */
 	g_ptr_array_sort(cache->re, rspamd_re_cache_sort_func);
 
+	g_hash_table_iter_init(&it, cache->re_classes);
+
+	while (g_hash_table_iter_next(&it, &k, &v)) {
+		re_class = v;
+
+		if (re_class->re_list == NULL) {
+			re_class->re_list = g_ptr_array_sized_new(g_hash_table_size(re_class->re));
+		}
+		else {
+			g_ptr_array_set_size(re_class->re_list, 0);
+		}
+	}
+
 	for (i = 0; i < cache->re->len; i++) {
 		elt = g_ptr_array_index(cache->re, i);
 		re = elt->re;
 		re_class = rspamd_regexp_get_class(re);
 		g_assert(re_class != NULL);
 		rspamd_regexp_set_cache_id(re, i);
+		/* Position of re within its class, it does not depend on other classes */
+		local_id = re_class->re_list->len;
+		g_ptr_array_add(re_class->re_list, re);
 
 		if (re_class->st == NULL) {
 			(void) !posix_memalign((void **) &re_class->st, RSPAMD_ALIGNOF(rspamd_cryptobox_hash_state_t),
@@ -440,8 +513,8 @@ void rspamd_re_cache_init(struct rspamd_re_cache *cache, struct rspamd_config *c
 		rspamd_cryptobox_hash_update(&st_global, (const guchar *) &fl,
 									 sizeof(fl));
 		/* Numeric order */
-		rspamd_cryptobox_hash_update(re_class->st, (const guchar *) &i,
-									 sizeof(i));
+		rspamd_cryptobox_hash_update(re_class->st, (const guchar *) &local_id,
+									 sizeof(local_id));
 		rspamd_cryptobox_hash_update(&st_global, (const guchar *) &i,
 									 sizeof(i));
 	}
@@ -458,13 +531,25 @@ void rspamd_re_cache_init(struct rspamd_re_cache *cache, struct rspamd_config *c
 
 		if (re_class->st) {
 			/*
-			 * We finally update all classes with the number of expressions
-			 * in the cache to ensure that if even a single re has been changed
-			 * we won't be broken due to id mismatch
+			 * Class hash depends merely on the class content: hyperscan ids
+			 * are local to a class, so changes in other classes do not
+			 * require recompilation of this one
 			 */
-			rspamd_cryptobox_hash_update(re_class->st,
-										 (gpointer) &cache->re->len,
-										 sizeof(cache->re->len));
+#ifdef WITH_HYPERSCAN
+			/*
+			 * Classes with many small inputs are scanned as a single
+			 * hyperscan stream, so their database has a different mode
+			 * and must not be confused with the block mode one
+			 */
+			re_class->hs_stream = cfg->vectorized_hyperscan &&
+								  rspamd_re_cache_type_is_multi(re_class->type);
+
+			if (re_class->hs_stream) {
+				rspamd_cryptobox_hash_update(re_class->st,
+											 rspamd_hs_magic_vector,
+											 sizeof(rspamd_hs_magic_vector));
+			}
+#endif
 			rspamd_cryptobox_hash_final(re_class->st, hash_out);
 			rspamd_snprintf(re_class->hash, sizeof(re_class->hash), "%*xs",
 							(gint) rspamd_cryptobox_HASHBYTES, hash_out);
@@ -480,6 +565,8 @@ void rspamd_re_cache_init(struct rspamd_re_cache *cache, struct rspamd_config *c
 	rspamd_fstring_t *features = rspamd_fstring_new();
 
 	cache->disable_hyperscan = cfg->disable_hyperscan;
+	cache->vectorized_hyperscan = cfg->vectorized_hyperscan;
+	cache->eager_hyperscan = cfg->eager_hyperscan;
 
 	g_assert(hs_populate_platform(&cache->plt) == HS_SUCCESS);
 
@@ -659,6 +746,7 @@ rspamd_re_cache_process_pcre(struct rspamd_re_runtime *rt,
 #ifdef WITH_HYPERSCAN
 struct rspamd_re_hyperscan_cbdata {
 	struct rspamd_re_runtime *rt;
+	struct rspamd_re_class *re_class;
 	const guchar **ins;
 	const guint *lens;
 	guint count;
@@ -681,6 +769,9 @@ rspamd_re_cache_hyperscan_cb(unsigned int id,
 
 	rt = cbdata->rt;
 	task = cbdata->task;
+	/* Hyperscan ids are positions in the class */
+	g_assert(id < cbdata->re_class->re_list->len);
+	id = rspamd_regexp_get_cache_id(g_ptr_array_index(cbdata->re_class->re_list, id));
 	cache_elt = g_ptr_array_index(rt->cache->re, id);
 	maxhits = rspamd_regexp_get_maxhits(cache_elt->re);
 
@@ -724,6 +815,60 @@ rspamd_re_cache_hyperscan_cb(unsigned int id,
 
 	return 0;
 }
+
+/*
+ * Scans all inputs of a class using a single hyperscan stream: the stream is
+ * reset between inputs, so anchors and matches never cross input boundaries,
+ * whilst the callback data always points to the input being scanned
+ */
+static guint
+rspamd_re_cache_process_hs_stream(struct rspamd_re_runtime *rt,
+								  struct rspamd_re_class *re_class,
+								  guint64 re_id,
+								  const guchar **in, guint *lens,
+								  guint count,
+								  struct rspamd_re_hyperscan_cbdata *cbdata,
+								  gboolean *processed_hyperscan)
+{
+	hs_stream_t *hs_stream = NULL;
+	hs_error_t rc;
+	guint i;
+
+	if (hs_open_stream(rspamd_hyperscan_get_database(re_class->hs_db), 0,
+					   &hs_stream) != HS_SUCCESS) {
+		return 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		cbdata->ins = &in[i];
+		cbdata->lens = &lens[i];
+
+		rc = hs_scan_stream(hs_stream, in[i], lens[i], 0,
+							re_class->hs_scratch,
+							rspamd_re_cache_hyperscan_cb, cbdata);
+
+		if (rc == HS_SUCCESS && i != count - 1) {
+			/* Flush end of data matches for the current input */
+			rc = hs_reset_stream(hs_stream, 0, re_class->hs_scratch,
+								 rspamd_re_cache_hyperscan_cb, cbdata);
+		}
+
+		if (rc != HS_SUCCESS) {
+			hs_close_stream(hs_stream, re_class->hs_scratch, NULL, NULL);
+
+			return 0;
+		}
+	}
+
+	if (hs_close_stream(hs_stream, re_class->hs_scratch,
+						rspamd_re_cache_hyperscan_cb, cbdata) != HS_SUCCESS) {
+		return 0;
+	}
+
+	*processed_hyperscan = TRUE;
+
+	return rt->results[re_id];
+}
 #endif
 
 static guint
@@ -799,24 +944,32 @@ rspamd_re_cache_process_regexp_data(struct rspamd_re_runtime *rt,
 		g_assert(re_class->hs_scratch != NULL);
 		g_assert(re_class->hs_db != NULL);
 
-		/* Go through hyperscan API */
-		for (i = 0; i < count; i++) {
-			cbdata.ins = &in[i];
-			cbdata.re = re;
-			cbdata.rt = rt;
-			cbdata.lens = &lens[i];
-			cbdata.count = 1;
-			cbdata.task = task;
-
-			if ((hs_scan(rspamd_hyperscan_get_database(re_class->hs_db),
-						 in[i], lens[i], 0,
-						 re_class->hs_scratch,
-						 rspamd_re_cache_hyperscan_cb, &cbdata)) != HS_SUCCESS) {
-				ret = 0;
-			}
-			else {
-				ret = rt->results[re_id];
-				*processed_hyperscan = TRUE;
+		cbdata.re = re;
+		cbdata.re_class = re_class;
+		cbdata.rt = rt;
+		cbdata.count = 1;
+		cbdata.task = task;
+
+		if (re_class->hs_stream) {
+			ret = rspamd_re_cache_process_hs_stream(rt, re_class, re_id,
+													in, lens, count, &cbdata, processed_hyperscan);
+		}
+		else {
+			/* Go through hyperscan API */
+			for (i = 0; i < count; i++) {
+				cbdata.ins = &in[i];
+				cbdata.lens = &lens[i];
+
+				if ((hs_scan(rspamd_hyperscan_get_database(re_class->hs_db),
+							 in[i], lens[i], 0,
+							 re_class->hs_scratch,
+							 rspamd_re_cache_hyperscan_cb, &cbdata)) != HS_SUCCESS) {
+					ret = 0;
+				}
+				else {
+					ret = rt->results[re_id];
+					*processed_hyperscan = TRUE;
+				}
 			}
 		}
 	}
@@ -1537,6 +1690,18 @@ gint rspamd_re_cache_process(struct rspamd_task *task,
 			return 0;
 		}
 
+		if (G_UNLIKELY(task->flags & RSPAMD_TASK_FLAG_TRACE)) {
+			gdouble start = rspamd_get_ticks(FALSE);
+			guint ret = rspamd_re_cache_exec_re(task, rt, re, re_class,
+												is_strong);
+
+			rspamd_symcache_trace_add(task,
+									  rspamd_re_cache_type_to_string(re_class->type),
+									  start, rspamd_get_ticks(FALSE));
+
+			return ret;
+		}
+
 		return rspamd_re_cache_exec_re(task, rt, re, re_class,
 									   is_strong);
 	}
@@ -1544,6 +1709,67 @@ gint rspamd_re_cache_process(struct rspamd_task *task,
 	return 0;
 }
 
+void rspamd_re_cache_process_eager(struct rspamd_task *task)
+{
+#ifdef WITH_HYPERSCAN
+	struct rspamd_re_runtime *rt;
+	struct rspamd_re_cache *cache;
+	struct rspamd_re_class *re_class;
+	struct rspamd_re_cache_elt *elt;
+	GHashTableIter it;
+	gpointer k, v;
+	guint i, nclasses = 0;
+
+	g_assert(task != NULL);
+	rt = task->re_rt;
+
+	if (rt == NULL) {
+		return;
+	}
+
+	cache = rt->cache;
+
+	if (!cache->eager_hyperscan || cache->disable_hyperscan || !rt->has_hs) {
+		return;
+	}
+
+	g_hash_table_iter_init(&it, cache->re_classes);
+
+	while (g_hash_table_iter_next(&it, &k, &v)) {
+		re_class = v;
+
+		/*
+		 * Selectors might depend on the task state that is not yet available
+		 * after parsing, so they are still evaluated on demand
+		 */
+		if (re_class->hs_db == NULL || re_class->type == RSPAMD_RE_SELECTOR) {
+			continue;
+		}
+
+		/*
+		 * A single hyperscan regexp is enough to scan the whole class and to
+		 * set results for all hyperscan regexps in it
+		 */
+		for (i = 0; i < re_class->nhs; i++) {
+			elt = g_ptr_array_index(cache->re, re_class->hs_ids[i]);
+
+			if (elt->match_type == RSPAMD_RE_CACHE_PCRE) {
+				continue;
+			}
+
+			if (!isset(rt->checked, re_class->hs_ids[i])) {
+				rspamd_re_cache_exec_re(task, rt, elt->re, re_class, FALSE);
+				nclasses++;
+			}
+
+			break;
+		}
+	}
+
+	msg_debug_re_task("eagerly scanned %d hyperscan classes", nclasses);
+#endif
+}
+
 int rspamd_re_cache_process_ffi(void *ptask,
 								void *pre,
 								int type,
@@ -1760,7 +1986,7 @@ rspamd_re_cache_hs_pattern_from_pcre(rspamd_regexp_t *re)
 
 static gboolean
 rspamd_re_cache_is_finite(struct rspamd_re_cache *cache,
-						  rspamd_regexp_t *re, gint flags, gdouble max_time)
+						  rspamd_regexp_t *re, gint flags, guint mode, gdouble max_time)
 {
 	pid_t cld;
 	gint status;
@@ -1784,7 +2010,7 @@ rspamd_re_cache_is_finite(struct rspamd_re_cache *cache,
 
 		if (hs_compile(pat,
 					   flags | HS_FLAG_PREFILTER,
-					   HS_MODE_BLOCK,
+					   mode,
 					   &cache->plt,
 					   &test_db,
 					   &hs_errors) != HS_SUCCESS) {
@@ -1847,73 +2073,91 @@ rspamd_re_cache_is_finite(struct rspamd_re_cache *cache,
 #endif
 
 #ifdef WITH_HYPERSCAN
+enum rspamd_re_cache_hs_job_state {
+	RSPAMD_RE_CACHE_HS_JOB_NEW = 0,
+	RSPAMD_RE_CACHE_HS_JOB_NEED_CHECK, /* some patterns need prefilter approximation */
+	RSPAMD_RE_CACHE_HS_JOB_CHECKED,
+	RSPAMD_RE_CACHE_HS_JOB_DONE,
+};
+
+/*
+ * Compilation of a single class; everything but approximation checks (that
+ * fork) and logging could be done in a separate thread
+ */
+struct rspamd_re_cache_hs_compile_job {
+	struct rspamd_re_class *re_class;
+	struct rspamd_re_cache *cache;
+	const char *cache_dir;
+	enum rspamd_re_cache_hs_job_state state;
+	guint n;
+	guint norig;
+	gchar **hs_pats;
+	guint *hs_flags;
+	guint *hs_ids;
+	rspamd_regexp_t **hs_res;
+	gchar **test_errors;
+	gdouble compile_time;
+	GError *err;
+};
+
 struct rspamd_re_cache_hs_compile_cbdata {
 	GHashTableIter it;
 	struct rspamd_re_cache *cache;
 	const char *cache_dir;
 	gdouble max_time;
 	gboolean silent;
+	gboolean classes_done;
 	guint total;
+	guint pending;
+	guint running;
+	GThreadPool *pool;
+	GAsyncQueue *done;
+	GPtrArray *need_check;
 	void (*cb)(guint ncompiled, GError *err, void *cbd);
 	void *cbd;
 };
 
 static void
-rspamd_re_cache_compile_err(EV_P_ ev_timer *w, GError *err,
-							struct rspamd_re_cache_hs_compile_cbdata *cbdata, bool is_fatal)
+rspamd_re_cache_hs_job_free(struct rspamd_re_cache_hs_compile_job *job)
 {
-	cbdata->cb(cbdata->total, err, cbdata->cbd);
+	guint i;
 
-	if (is_fatal) {
-		ev_timer_stop(EV_A_ w);
-		g_free(w);
-		g_free(cbdata);
+	for (i = 0; i < job->n; i++) {
+		g_free(job->hs_pats[i]);
+
+		if (job->test_errors) {
+			g_free(job->test_errors[i]);
+		}
 	}
-	else {
-		/* Continue compilation */
-		ev_timer_again(EV_A_ w);
+
+	g_free(job->hs_pats);
+	g_free(job->hs_flags);
+	g_free(job->hs_ids);
+	g_free(job->hs_res);
+	g_free(job->test_errors);
+
+	if (job->err) {
+		g_error_free(job->err);
 	}
-	g_error_free(err);
+
+	g_free(job);
 }
 
-static void
-rspamd_re_cache_compile_timer_cb(EV_P_ ev_timer *w, int revents)
+/*
+ * Returns a new compile job for a class or NULL if the class has a valid
+ * file in the cache directory
+ */
+static struct rspamd_re_cache_hs_compile_job *
+rspamd_re_cache_hs_job_new(struct rspamd_re_cache_hs_compile_cbdata *cbdata,
+						   struct rspamd_re_class *re_class)
 {
-	struct rspamd_re_cache_hs_compile_cbdata *cbdata =
-		(struct rspamd_re_cache_hs_compile_cbdata *) w->data;
-	GHashTableIter cit;
-	gpointer k, v;
-	struct rspamd_re_class *re_class;
-	gchar path[PATH_MAX], npath[PATH_MAX];
-	hs_database_t *test_db;
-	gint fd, i, n, *hs_ids = NULL, pcre_flags, re_flags;
-	rspamd_cryptobox_fast_hash_state_t crc_st;
-	guint64 crc;
+	struct rspamd_re_cache *cache = cbdata->cache;
+	struct rspamd_re_cache_hs_compile_job *job;
+	gchar path[PATH_MAX];
 	rspamd_regexp_t *re;
-	hs_compile_error_t *hs_errors = NULL;
-	guint *hs_flags = NULL;
-	const hs_expr_ext_t **hs_exts = NULL;
-	gchar **hs_pats = NULL;
-	gchar *hs_serialized = NULL;
-	gsize serialized_len;
-	struct iovec iov[7];
-	struct rspamd_re_cache *cache;
-	GError *err;
-	pid_t our_pid = getpid();
-
-	cache = cbdata->cache;
-
-	if (!g_hash_table_iter_next(&cbdata->it, &k, &v)) {
-		/* All done */
-		ev_timer_stop(EV_A_ w);
-		cbdata->cb(cbdata->total, NULL, cbdata->cbd);
-		g_free(w);
-		g_free(cbdata);
+	gint fd, n, pcre_flags, re_flags;
+	guint i, local_id;
 
-		return;
-	}
-
-	re_class = v;
 	rspamd_snprintf(path, sizeof(path), "%s%c%s.hs", cbdata->cache_dir,
 					G_DIR_SEPARATOR, re_class->hash);
 
@@ -1948,32 +2192,23 @@ rspamd_re_cache_compile_timer_cb(EV_P_ ev_timer *w, int revents)
 			}
 		}
 
-		ev_timer_again(EV_A_ w);
-		return;
+		return NULL;
 	}
 
-	rspamd_snprintf(path, sizeof(path), "%s%c%s%P-XXXXXXXXXX", cbdata->cache_dir,
-					G_DIR_SEPARATOR, re_class->hash, our_pid);
-	fd = g_mkstemp_full(path, O_CREAT | O_TRUNC | O_EXCL | O_WRONLY, 00600);
-
-	if (fd == -1) {
-		err = g_error_new(rspamd_re_cache_quark(), errno,
-						  "cannot open file %s: %s", path, strerror(errno));
-		rspamd_re_cache_compile_err(EV_A_ w, err, cbdata, false);
-		return;
-	}
-
-	g_hash_table_iter_init(&cit, re_class->re);
-	n = g_hash_table_size(re_class->re);
-	hs_flags = g_new0(guint, n);
-	hs_ids = g_new0(guint, n);
-	hs_pats = g_new0(char *, n);
-	hs_exts = g_new0(const hs_expr_ext_t *, n);
+	job = g_malloc0(sizeof(*job));
+	job->re_class = re_class;
+	job->cache = cache;
+	job->cache_dir = cbdata->cache_dir;
+	job->state = RSPAMD_RE_CACHE_HS_JOB_NEW;
+	job->norig = g_hash_table_size(re_class->re);
+	job->hs_flags = g_new0(guint, job->norig);
+	job->hs_ids = g_new0(guint, job->norig);
+	job->hs_pats = g_new0(gchar *, job->norig);
+	job->hs_res = g_new0(rspamd_regexp_t *, job->norig);
 	i = 0;
 
-	while (g_hash_table_iter_next(&cit, &k, &v)) {
-		re = v;
-
+	PTR_ARRAY_FOREACH(re_class->re_list, local_id, re)
+	{
 		pcre_flags = rspamd_regexp_get_pcre_flags(re);
 		re_flags = rspamd_regexp_get_flags(re);
 
@@ -1985,223 +2220,427 @@ rspamd_re_cache_compile_timer_cb(EV_P_ ev_timer *w, int revents)
 			continue;
 		}
 
-		hs_flags[i] = 0;
-		hs_exts[i] = NULL;
+		job->hs_flags[i] = 0;
 #ifndef WITH_PCRE2
 		if (pcre_flags & PCRE_FLAG(UTF8)) {
-			hs_flags[i] |= HS_FLAG_UTF8;
+			job->hs_flags[i] |= HS_FLAG_UTF8;
 		}
 #else
 		if (pcre_flags & PCRE_FLAG(UTF)) {
-			hs_flags[i] |= HS_FLAG_UTF8;
+			job->hs_flags[i] |= HS_FLAG_UTF8;
 		}
 #endif
 		if (pcre_flags & PCRE_FLAG(CASELESS)) {
-			hs_flags[i] |= HS_FLAG_CASELESS;
+			job->hs_flags[i] |= HS_FLAG_CASELESS;
 		}
 		if (pcre_flags & PCRE_FLAG(MULTILINE)) {
-			hs_flags[i] |= HS_FLAG_MULTILINE;
+			job->hs_flags[i] |= HS_FLAG_MULTILINE;
 		}
 		if (pcre_flags & PCRE_FLAG(DOTALL)) {
-			hs_flags[i] |= HS_FLAG_DOTALL;
+			job->hs_flags[i] |= HS_FLAG_DOTALL;
 		}
 
 
 		if (re_flags & RSPAMD_REGEXP_FLAG_LEFTMOST) {
-			hs_flags[i] |= HS_FLAG_SOM_LEFTMOST;
+			job->hs_flags[i] |= HS_FLAG_SOM_LEFTMOST;
 		}
 		else if (rspamd_regexp_get_maxhits(re) == 1) {
-			hs_flags[i] |= HS_FLAG_SINGLEMATCH;
+			job->hs_flags[i] |= HS_FLAG_SINGLEMATCH;
 		}
 
-		gchar *pat = rspamd_re_cache_hs_pattern_from_pcre(re);
+		job->hs_pats[i] = rspamd_re_cache_hs_pattern_from_pcre(re);
+		job->hs_ids[i] = local_id;
+		job->hs_res[i] = re;
+		i++;
+	}
 
-		if (hs_compile(pat,
-					   hs_flags[i],
-					   HS_MODE_BLOCK,
-					   &cache->plt,
+	job->n = i;
+
+	return job;
+}
+
+/*
+ * Tries to compile each pattern on its own; patterns that cannot be compiled
+ * as is are marked for the prefilter approximation check.
+ * Thread safe: no logging here.
+ */
+static void
+rspamd_re_cache_hs_job_test(struct rspamd_re_cache_hs_compile_job *job)
+{
+	hs_database_t *test_db;
+	hs_compile_error_t *hs_errors;
+	guint i;
+
+	job->state = RSPAMD_RE_CACHE_HS_JOB_CHECKED;
+
+	for (i = 0; i < job->n; i++) {
+		hs_errors = NULL;
+
+		if (hs_compile(job->hs_pats[i],
+					   job->hs_flags[i],
+					   rspamd_re_cache_class_hs_mode(job->re_class),
+					   &job->cache->plt,
 					   &test_db,
 					   &hs_errors) != HS_SUCCESS) {
+			if (job->test_errors == NULL) {
+				job->test_errors = g_new0(gchar *, job->n);
+			}
+
+			job->test_errors[i] = g_strdup(hs_errors != NULL ? hs_errors->message : "unknown error");
+			job->state = RSPAMD_RE_CACHE_HS_JOB_NEED_CHECK;
+
+			if (hs_errors) {
+				hs_free_compile_error(hs_errors);
+			}
+		}
+		else {
+			hs_free_database(test_db);
+		}
+	}
+}
+
+/*
+ * Checks approximations for patterns that failed to compile; must be called
+ * from the main thread while no compile thread is running as it forks
+ */
+static void
+rspamd_re_cache_hs_job_check_finite(struct rspamd_re_cache_hs_compile_cbdata *cbdata,
+									struct rspamd_re_cache_hs_compile_job *job)
+{
+	struct rspamd_re_cache *cache = job->cache;
+	guint i, j = 0;
+
+	for (i = 0; i < job->n; i++) {
+		if (job->test_errors[i] != NULL) {
 			msg_info_re_cache("cannot compile '%s' to hyperscan: '%s', try prefilter match",
-							  pat,
-							  hs_errors != NULL ? hs_errors->message : "unknown error");
-			hs_free_compile_error(hs_errors);
+							  job->hs_pats[i],
+							  job->test_errors[i]);
+			g_free(job->test_errors[i]);
+			job->test_errors[i] = NULL;
 
 			/* The approximation operation might take a significant
 			 * amount of time, so we need to check if it's finite
 			 */
-			if (rspamd_re_cache_is_finite(cache, re, hs_flags[i], cbdata->max_time)) {
-				hs_flags[i] |= HS_FLAG_PREFILTER;
-				hs_ids[i] = rspamd_regexp_get_cache_id(re);
-				hs_pats[i] = pat;
-				i++;
+			if (rspamd_re_cache_is_finite(cache, job->hs_res[i], job->hs_flags[i],
+										  rspamd_re_cache_class_hs_mode(job->re_class),
+										  cbdata->max_time)) {
+				job->hs_flags[i] |= HS_FLAG_PREFILTER;
 			}
 			else {
-				g_free(pat); /* Avoid leak */
+				g_free(job->hs_pats[i]); /* Avoid leak */
+				continue;
 			}
 		}
-		else {
-			hs_ids[i] = rspamd_regexp_get_cache_id(re);
-			hs_pats[i] = pat;
-			i++;
-			hs_free_database(test_db);
-		}
+
+		job->hs_pats[j] = job->hs_pats[i];
+		job->hs_flags[j] = job->hs_flags[i];
+		job->hs_ids[j] = job->hs_ids[i];
+		job->hs_res[j] = job->hs_res[i];
+		j++;
 	}
-	/* Adjust real re number */
-	n = i;
-
-#define CLEANUP_ALLOCATED(is_err)                            \
-	do {                                                     \
-		g_free(hs_flags);                                    \
-		g_free(hs_ids);                                      \
-		for (guint j = 0; j < i; j++) {                      \
-			g_free(hs_pats[j]);                              \
-		}                                                    \
-		g_free(hs_pats);                                     \
-		g_free(hs_exts);                                     \
-		if (is_err) {                                        \
-			close(fd);                                       \
-			unlink(path);                                    \
-			if (hs_errors) hs_free_compile_error(hs_errors); \
-		}                                                    \
-	} while (0)
-
-	if (n > 0) {
-		/* Create the hs tree */
-		hs_errors = NULL;
-		if (hs_compile_ext_multi((const char **) hs_pats,
-								 hs_flags,
-								 hs_ids,
-								 hs_exts,
-								 n,
-								 HS_MODE_BLOCK,
-								 &cache->plt,
-								 &test_db,
-								 &hs_errors) != HS_SUCCESS) {
-
-			err = g_error_new(rspamd_re_cache_quark(), EINVAL,
-							  "cannot create tree of regexp when processing '%s': %s",
-							  hs_pats[hs_errors->expression], hs_errors->message);
-			CLEANUP_ALLOCATED(true);
-			rspamd_re_cache_compile_err(EV_A_ w, err, cbdata, false);
-
-			return;
-		}
-
-		if (hs_serialize_database(test_db, &hs_serialized,
-								  &serialized_len) != HS_SUCCESS) {
-			err = g_error_new(rspamd_re_cache_quark(),
-							  errno,
-							  "cannot serialize tree of regexp for %s",
-							  re_class->hash);
-
-			CLEANUP_ALLOCATED(true);
-			hs_free_database(test_db);
-			rspamd_re_cache_compile_err(EV_A_ w, err, cbdata, false);
-			return;
-		}
 
+	job->n = j;
+	job->state = RSPAMD_RE_CACHE_HS_JOB_CHECKED;
+}
+
+/*
+ * Compiles, serializes and atomically writes the class database.
+ * Thread safe: no logging here, errors are stored in the job.
+ */
+static void
+rspamd_re_cache_hs_job_compile(struct rspamd_re_cache_hs_compile_job *job)
+{
+	struct rspamd_re_class *re_class = job->re_class;
+	gchar path[PATH_MAX], npath[PATH_MAX];
+	hs_database_t *test_db;
+	hs_compile_error_t *hs_errors = NULL;
+	gchar *hs_serialized = NULL;
+	gsize serialized_len;
+	struct iovec iov[7];
+	rspamd_cryptobox_fast_hash_state_t crc_st;
+	guint64 crc;
+	gint fd, n = job->n;
+
+	if (n == 0) {
+		job->err = g_error_new(rspamd_re_cache_quark(), EINVAL,
+							   "no suitable regular expressions %s (%d original)",
+							   rspamd_re_cache_type_to_string(re_class->type),
+							   (gint) job->norig);
+		return;
+	}
+
+	/* Create the hs tree */
+	if (hs_compile_ext_multi((const char **) job->hs_pats,
+							 job->hs_flags,
+							 job->hs_ids,
+							 NULL,
+							 n,
+							 rspamd_re_cache_class_hs_mode(re_class),
+							 &job->cache->plt,
+							 &test_db,
+							 &hs_errors) != HS_SUCCESS) {
+
+		job->err = g_error_new(rspamd_re_cache_quark(), EINVAL,
+							   "cannot create tree of regexp when processing '%s': %s",
+							   hs_errors->expression >= 0 ? job->hs_pats[hs_errors->expression] : "",
+							   hs_errors->message);
+		hs_free_compile_error(hs_errors);
+
+		return;
+	}
+
+	if (hs_serialize_database(test_db, &hs_serialized,
+							  &serialized_len) != HS_SUCCESS) {
+		job->err = g_error_new(rspamd_re_cache_quark(),
+							   errno,
+							   "cannot serialize tree of regexp for %s",
+							   re_class->hash);
 		hs_free_database(test_db);
 
-		/*
-		 * Magic - 8 bytes
-		 * Platform - sizeof (platform)
-		 * n - number of regexps
-		 * n * <regexp ids>
-		 * n * <regexp flags>
-		 * crc - 8 bytes checksum
-		 * <hyperscan blob>
-		 */
-		rspamd_cryptobox_fast_hash_init(&crc_st, 0xdeadbabe);
-		/* IDs -> Flags -> Hs blob */
-		rspamd_cryptobox_fast_hash_update(&crc_st,
-										  hs_ids, sizeof(*hs_ids) * n);
-		rspamd_cryptobox_fast_hash_update(&crc_st,
-										  hs_flags, sizeof(*hs_flags) * n);
-		rspamd_cryptobox_fast_hash_update(&crc_st,
-										  hs_serialized, serialized_len);
-		crc = rspamd_cryptobox_fast_hash_final(&crc_st);
-
-
-		iov[0].iov_base = (void *) rspamd_hs_magic;
-		iov[0].iov_len = RSPAMD_HS_MAGIC_LEN;
-		iov[1].iov_base = &cache->plt;
-		iov[1].iov_len = sizeof(cache->plt);
-		iov[2].iov_base = &n;
-		iov[2].iov_len = sizeof(n);
-		iov[3].iov_base = hs_ids;
-		iov[3].iov_len = sizeof(*hs_ids) * n;
-		iov[4].iov_base = hs_flags;
-		iov[4].iov_len = sizeof(*hs_flags) * n;
-		iov[5].iov_base = &crc;
-		iov[5].iov_len = sizeof(crc);
-		iov[6].iov_base = hs_serialized;
-		iov[6].iov_len = serialized_len;
-
-		if (writev(fd, iov, G_N_ELEMENTS(iov)) == -1) {
-			err = g_error_new(rspamd_re_cache_quark(),
-							  errno,
-							  "cannot serialize tree of regexp to %s: %s",
-							  path, strerror(errno));
-
-			CLEANUP_ALLOCATED(true);
-			g_free(hs_serialized);
-
-			rspamd_re_cache_compile_err(EV_A_ w, err, cbdata, false);
-			return;
-		}
+		return;
+	}
+
+	hs_free_database(test_db);
+
+	/*
+	 * Magic - 8 bytes
+	 * Platform - sizeof (platform)
+	 * n - number of regexps
+	 * n * <regexp ids>
+	 * n * <regexp flags>
+	 * crc - 8 bytes checksum
+	 * <hyperscan blob>
+	 */
+	rspamd_cryptobox_fast_hash_init(&crc_st, 0xdeadbabe);
+	/* IDs -> Flags -> Hs blob */
+	rspamd_cryptobox_fast_hash_update(&crc_st,
+									  job->hs_ids, sizeof(*job->hs_ids) * n);
+	rspamd_cryptobox_fast_hash_update(&crc_st,
+									  job->hs_flags, sizeof(*job->hs_flags) * n);
+	rspamd_cryptobox_fast_hash_update(&crc_st,
+									  hs_serialized, serialized_len);
+	crc = rspamd_cryptobox_fast_hash_final(&crc_st);
+
+	rspamd_snprintf(path, sizeof(path), "%s%c%s%P-XXXXXXXXXX", job->cache_dir,
+					G_DIR_SEPARATOR, re_class->hash, getpid());
+	fd = g_mkstemp_full(path, O_CREAT | O_TRUNC | O_EXCL | O_WRONLY, 00600);
+
+	if (fd == -1) {
+		job->err = g_error_new(rspamd_re_cache_quark(), errno,
+							   "cannot open file %s: %s", path, strerror(errno));
+		g_free(hs_serialized);
+
+		return;
+	}
+
+	iov[0].iov_base = (void *) rspamd_re_cache_class_magic(re_class);
+	iov[0].iov_len = RSPAMD_HS_MAGIC_LEN;
+	iov[1].iov_base = &job->cache->plt;
+	iov[1].iov_len = sizeof(job->cache->plt);
+	iov[2].iov_base = &n;
+	iov[2].iov_len = sizeof(n);
+	iov[3].iov_base = job->hs_ids;
+	iov[3].iov_len = sizeof(*job->hs_ids) * n;
+	iov[4].iov_base = job->hs_flags;
+	iov[4].iov_len = sizeof(*job->hs_flags) * n;
+	iov[5].iov_base = &crc;
+	iov[5].iov_len = sizeof(crc);
+	iov[6].iov_base = hs_serialized;
+	iov[6].iov_len = serialized_len;
+
+	if (writev(fd, iov, G_N_ELEMENTS(iov)) == -1) {
+		job->err = g_error_new(rspamd_re_cache_quark(),
+							   errno,
+							   "cannot serialize tree of regexp to %s: %s",
+							   path, strerror(errno));
+		close(fd);
+		unlink(path);
+		g_free(hs_serialized);
+
+		return;
+	}
+
+	g_free(hs_serialized);
+
+	/* Now rename temporary file to the new .hs file */
+	rspamd_snprintf(npath, sizeof(npath), "%s%c%s.hs", job->cache_dir,
+					G_DIR_SEPARATOR, re_class->hash);
+
+	if (rename(path, npath) == -1) {
+		job->err = g_error_new(rspamd_re_cache_quark(),
+							   errno,
+							   "cannot rename %s to %s: %s",
+							   path, npath, strerror(errno));
+		unlink(path);
+	}
+
+	close(fd);
+}
+
+/*
+ * Runs all thread safe stages of a job: it either stops at the approximation
+ * check (that must be done in the main thread) or compiles the database
+ */
+static void
+rspamd_re_cache_hs_job_process(struct rspamd_re_cache_hs_compile_job *job)
+{
+	gdouble t1 = rspamd_get_ticks(FALSE);
+
+	if (job->state == RSPAMD_RE_CACHE_HS_JOB_NEW) {
+		rspamd_re_cache_hs_job_test(job);
+	}
+
+	if (job->state == RSPAMD_RE_CACHE_HS_JOB_CHECKED) {
+		rspamd_re_cache_hs_job_compile(job);
+		job->state = RSPAMD_RE_CACHE_HS_JOB_DONE;
+	}
+
+	job->compile_time += rspamd_get_ticks(FALSE) - t1;
+}
+
+static void
+rspamd_re_cache_hs_compile_thread(gpointer data, gpointer user_data)
+{
+	struct rspamd_re_cache_hs_compile_job *job =
+		(struct rspamd_re_cache_hs_compile_job *) data;
+	struct rspamd_re_cache_hs_compile_cbdata *cbdata =
+		(struct rspamd_re_cache_hs_compile_cbdata *) user_data;
+
+	rspamd_re_cache_hs_job_process(job);
+	g_async_queue_push(cbdata->done, job);
+}
+
+static void
+rspamd_re_cache_hs_job_finish(struct rspamd_re_cache_hs_compile_cbdata *cbdata,
+							  struct rspamd_re_cache_hs_compile_job *job)
+{
+	struct rspamd_re_cache *cache = cbdata->cache;
+	struct rspamd_re_class *re_class = job->re_class;
 
+	if (job->err) {
+		cbdata->cb(cbdata->total, job->err, cbdata->cbd);
+	}
+	else {
 		if (re_class->type_len > 0) {
 			msg_info_re_cache(
-				"compiled class %s(%*s) to cache %6s, %d/%d regexps",
+				"compiled class %s(%*s) to cache %6s, %d/%d regexps in %.2f ms",
 				rspamd_re_cache_type_to_string(re_class->type),
 				(gint) re_class->type_len - 1,
 				re_class->type_data,
 				re_class->hash,
-				n,
-				(gint) g_hash_table_size(re_class->re));
+				(gint) job->n,
+				(gint) job->norig,
+				job->compile_time * 1000.0);
 		}
 		else {
 			msg_info_re_cache(
-				"compiled class %s to cache %6s, %d/%d regexps",
+				"compiled class %s to cache %6s, %d/%d regexps in %.2f ms",
 				rspamd_re_cache_type_to_string(re_class->type),
 				re_class->hash,
-				n,
-				(gint) g_hash_table_size(re_class->re));
+				(gint) job->n,
+				(gint) job->norig,
+				job->compile_time * 1000.0);
 		}
 
-		cbdata->total += n;
-		CLEANUP_ALLOCATED(false);
+		cbdata->total += job->n;
+	}
 
-		/* Now rename temporary file to the new .hs file */
-		rspamd_snprintf(npath, sizeof(npath), "%s%c%s.hs", cbdata->cache_dir,
-						G_DIR_SEPARATOR, re_class->hash);
+	rspamd_re_cache_hs_job_free(job);
+}
 
-		if (rename(path, npath) == -1) {
-			err = g_error_new(rspamd_re_cache_quark(),
-							  errno,
-							  "cannot rename %s to %s: %s",
-							  path, npath, strerror(errno));
-			unlink(path);
-			close(fd);
+static void
+rspamd_re_cache_compile_timer_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct rspamd_re_cache_hs_compile_cbdata *cbdata =
+		(struct rspamd_re_cache_hs_compile_cbdata *) w->data;
+	struct rspamd_re_cache_hs_compile_job *job;
+	gpointer k, v;
+	guint i;
+
+	if (cbdata->pool) {
+		/* Collect jobs processed by threads */
+		while ((job = g_async_queue_try_pop(cbdata->done)) != NULL) {
+			cbdata->running--;
 
-			rspamd_re_cache_compile_err(EV_A_ w, err, cbdata, false);
-			return;
+			if (job->state == RSPAMD_RE_CACHE_HS_JOB_NEED_CHECK) {
+				g_ptr_array_add(cbdata->need_check, job);
+			}
+			else {
+				rspamd_re_cache_hs_job_finish(cbdata, job);
+				cbdata->pending--;
+			}
 		}
 
-		close(fd);
+		/*
+		 * Forking while other threads are inside hyperscan compiler could
+		 * leave the child with their locks held, so approximation checks
+		 * wait for all threads to finish their jobs
+		 */
+		if (cbdata->running == 0 && cbdata->need_check->len > 0) {
+			PTR_ARRAY_FOREACH(cbdata->need_check, i, job)
+			{
+				rspamd_re_cache_hs_job_check_finite(cbdata, job);
+			}
+
+			PTR_ARRAY_FOREACH(cbdata->need_check, i, job)
+			{
+				cbdata->running++;
+				g_thread_pool_push(cbdata->pool, job, NULL);
+			}
+
+			g_ptr_array_set_size(cbdata->need_check, 0);
+		}
+
+		/* Threads are fed with all classes at once */
+		while (!cbdata->classes_done) {
+			if (!g_hash_table_iter_next(&cbdata->it, &k, &v)) {
+				cbdata->classes_done = TRUE;
+				break;
+			}
+
+			job = rspamd_re_cache_hs_job_new(cbdata, (struct rspamd_re_class *) v);
+
+			if (job) {
+				cbdata->pending++;
+				cbdata->running++;
+				g_thread_pool_push(cbdata->pool, job, NULL);
+			}
+		}
 	}
-	else {
-		err = g_error_new(rspamd_re_cache_quark(),
-						  errno,
-						  "no suitable regular expressions %s (%d original): "
-						  "remove temporary file %s",
-						  rspamd_re_cache_type_to_string(re_class->type),
-						  (gint) g_hash_table_size(re_class->re),
-						  path);
+	else if (!cbdata->classes_done) {
+		/* Compile one class per timer tick */
+		if (!g_hash_table_iter_next(&cbdata->it, &k, &v)) {
+			cbdata->classes_done = TRUE;
+		}
+		else {
+			job = rspamd_re_cache_hs_job_new(cbdata, (struct rspamd_re_class *) v);
+
+			if (job) {
+				rspamd_re_cache_hs_job_process(job);
 
-		CLEANUP_ALLOCATED(true);
-		rspamd_re_cache_compile_err(EV_A_ w, err, cbdata, false);
+				if (job->state == RSPAMD_RE_CACHE_HS_JOB_NEED_CHECK) {
+					rspamd_re_cache_hs_job_check_finite(cbdata, job);
+					rspamd_re_cache_hs_job_process(job);
+				}
+
+				rspamd_re_cache_hs_job_finish(cbdata, job);
+			}
+		}
+	}
+
+	if (cbdata->classes_done && cbdata->pending == 0) {
+		/* All done */
+		ev_timer_stop(EV_A_ w);
+
+		if (cbdata->pool) {
+			g_thread_pool_free(cbdata->pool, FALSE, TRUE);
+			g_async_queue_unref(cbdata->done);
+			g_ptr_array_free(cbdata->need_check, TRUE);
+		}
+
+		cbdata->cb(cbdata->total, NULL, cbdata->cbd);
+		g_free(w);
+		g_free(cbdata);
 
 		return;
 	}
@@ -2216,6 +2655,7 @@ gint rspamd_re_cache_compile_hyperscan(struct rspamd_re_cache *cache,
 									   const char *cache_dir,
 									   gdouble max_time,
 									   gboolean silent,
+									   guint nthreads,
 									   struct ev_loop *event_loop,
 									   void (*cb)(guint ncompiled, GError *err, void *cbd),
 									   void *cbd)
@@ -2229,6 +2669,7 @@ gint rspamd_re_cache_compile_hyperscan(struct rspamd_re_cache *cache,
 	static ev_timer *timer;
 	static const ev_tstamp timer_interval = 0.1;
 	struct rspamd_re_cache_hs_compile_cbdata *cbdata;
+	GError *err = NULL;
 
 	cbdata = g_malloc0(sizeof(*cbdata));
 	g_hash_table_iter_init(&cbdata->it, cache->re_classes);
@@ -2239,6 +2680,27 @@ gint rspamd_re_cache_compile_hyperscan(struct rspamd_re_cache *cache,
 	cbdata->max_time = max_time;
 	cbdata->silent = silent;
 	cbdata->total = 0;
+
+	if (nthreads > 1) {
+		cbdata->done = g_async_queue_new();
+		cbdata->pool = g_thread_pool_new(rspamd_re_cache_hs_compile_thread,
+										 cbdata, nthreads, TRUE, &err);
+
+		if (cbdata->pool == NULL) {
+			msg_err_re_cache("cannot create %d hyperscan compile threads, "
+							 "fallback to a single thread: %e",
+							 (gint) nthreads, err);
+			g_error_free(err);
+			g_async_queue_unref(cbdata->done);
+			cbdata->done = NULL;
+		}
+		else {
+			cbdata->need_check = g_ptr_array_new();
+			msg_info_re_cache("compile hyperscan classes using %d threads",
+							  (gint) nthreads);
+		}
+	}
+
 	timer = g_malloc0(sizeof(*timer));
 	timer->data = (void *) cbdata; /* static */
 
@@ -2250,6 +2712,26 @@ gint rspamd_re_cache_compile_hyperscan(struct rspamd_re_cache *cache,
 #endif
 }
 
+#ifdef WITH_HYPERSCAN
+static void
+rspamd_re_cache_file_id_from_stat(const struct stat *st,
+								  struct rspamd_re_cache_file_id *fid)
+{
+	memset(fid, 0, sizeof(*fid));
+	fid->dev = st->st_dev;
+	fid->ino = st->st_ino;
+	fid->size = st->st_size;
+	fid->mtime = st->st_mtime;
+}
+
+static inline gboolean
+rspamd_re_cache_file_id_equal(const struct rspamd_re_cache_file_id *f1,
+							  const struct rspamd_re_cache_file_id *f2)
+{
+	return f1->ino != 0 && memcmp(f1, f2, sizeof(*f1)) == 0;
+}
+#endif
+
 gboolean
 rspamd_re_cache_is_valid_hyperscan_file(struct rspamd_re_cache *cache,
 										const char *path, gboolean silent, gboolean try_load, GError **err)
@@ -2273,6 +2755,8 @@ rspamd_re_cache_is_valid_hyperscan_file(struct rspamd_re_cache *cache,
 	guchar *map, *p, *end;
 	rspamd_cryptobox_fast_hash_state_t crc_st;
 	guint64 crc, valid_crc;
+	struct stat st;
+	struct rspamd_re_cache_file_id fid;
 
 	len = strlen(path);
 
@@ -2342,7 +2826,7 @@ rspamd_re_cache_is_valid_hyperscan_file(struct rspamd_re_cache *cache,
 				return FALSE;
 			}
 
-			mb = rspamd_hs_magic;
+			mb = rspamd_re_cache_class_magic(re_class);
 
 			if (memcmp(magicbuf, mb, sizeof(magicbuf)) != 0) {
 				msg_err_re_cache("cannot open hyperscan cache file %s: "
@@ -2385,6 +2869,20 @@ rspamd_re_cache_is_valid_hyperscan_file(struct rspamd_re_cache *cache,
 				return FALSE;
 			}
 
+			if (try_load && fstat(fd, &st) != -1) {
+				rspamd_re_cache_file_id_from_stat(&st, &fid);
+
+				if (rspamd_re_cache_file_id_equal(&fid, &re_class->hs_checked)) {
+					/* Exactly this file has been already checked */
+					close(fd);
+
+					return TRUE;
+				}
+			}
+			else {
+				memset(&fid, 0, sizeof(fid));
+			}
+
 			close(fd);
 
 			if (try_load) {
@@ -2462,8 +2960,8 @@ rspamd_re_cache_is_valid_hyperscan_file(struct rspamd_re_cache *cache,
 
 				hs_free_database(test_db);
 				munmap(map, len);
+				memcpy(&re_class->hs_checked, &fid, sizeof(fid));
 			}
-			/* XXX: add crc check */
 
 			return TRUE;
 		}
@@ -2499,6 +2997,7 @@ rspamd_re_cache_load_hyperscan(struct rspamd_re_cache *cache,
 	struct rspamd_re_class *re_class;
 	struct rspamd_re_cache_elt *elt;
 	struct stat st;
+	struct rspamd_re_cache_file_id fid;
 	gboolean has_valid = FALSE, all_valid = FALSE;
 
 	g_hash_table_iter_init(&it, cache->re_classes);
@@ -2517,6 +3016,23 @@ rspamd_re_cache_load_hyperscan(struct rspamd_re_cache *cache,
 			/* Read number of regexps */
 			g_assert(fd != -1);
 			fstat(fd, &st);
+			rspamd_re_cache_file_id_from_stat(&st, &fid);
+
+			if (re_class->hs_db != NULL &&
+				rspamd_re_cache_file_id_equal(&fid, &re_class->hs_loaded)) {
+				/* The same file is already loaded, no need to swap it */
+				msg_debug_re_cache("hyperscan database '%s' is not changed",
+								   re_class->hash);
+				close(fd);
+				total += re_class->nhs;
+
+				if (!has_valid) {
+					has_valid = TRUE;
+					all_valid = TRUE;
+				}
+
+				continue;
+			}
 
 			map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
 
@@ -2565,6 +3081,31 @@ rspamd_re_cache_load_hyperscan(struct rspamd_re_cache *cache,
 			hs_flags = g_malloc(n * sizeof(*hs_flags));
 			memcpy(hs_flags, p, n * sizeof(*hs_flags));
 
+			/* Convert ids local to the class to the global ones */
+			for (i = 0; i < n; i++) {
+				if (hs_ids[i] < 0 || hs_ids[i] >= (gint) re_class->re_list->len) {
+					break;
+				}
+
+				hs_ids[i] = rspamd_regexp_get_cache_id(
+					g_ptr_array_index(re_class->re_list, hs_ids[i]));
+			}
+
+			if (i != n) {
+				if (!try_load) {
+					msg_err_re_cache("bad expression id in %s: %d", path, hs_ids[i]);
+				}
+				else {
+					msg_debug_re_cache("bad expression id in %s: %d", path, hs_ids[i]);
+				}
+
+				g_free(hs_ids);
+				g_free(hs_flags);
+				munmap(map, st.st_size);
+				all_valid = FALSE;
+				continue;
+			}
+
 			/* Skip crc */
 			p += n * sizeof(*hs_ids) + sizeof(guint64);
 
@@ -2644,6 +3185,7 @@ rspamd_re_cache_load_hyperscan(struct rspamd_re_cache *cache,
 			re_class->hs_ids = hs_ids;
 			g_free(hs_flags);
 			re_class->nhs = n;
+			memcpy(&re_class->hs_loaded, &fid, sizeof(fid));
 
 			if (!has_valid) {
 				has_valid = TRUE;
@@ -135,6 +135,14 @@ gint rspamd_re_cache_process(struct rspamd_task *task,
 							 gsize datalen,
 							 gboolean is_strong);
 
+/**
+ * Scans all hyperscan classes (except selectors) in one pass filling results
+ * for all hyperscan regexps, so later checks are just lookups. Does nothing
+ * unless `eager_hyperscan` is enabled and hyperscan is loaded
+ * @param task task object
+ */
+void rspamd_re_cache_process_eager(struct rspamd_task *task);
+
 int rspamd_re_cache_process_ffi(void *ptask,
 								void *pre,
 								int type,
@@ -174,11 +182,14 @@ enum rspamd_re_type rspamd_re_cache_type_from_string(const char *str);
 struct ev_loop;
 /**
  * Compile expressions to the hyperscan tree and store in the `cache_dir`
+ * If `nthreads` is greater than 1, then classes are compiled in parallel
+ * using a pool of `nthreads` threads
  */
 gint rspamd_re_cache_compile_hyperscan(struct rspamd_re_cache *cache,
 									   const char *cache_dir,
 									   gdouble max_time,
 									   gboolean silent,
+									   guint nthreads,
 									   struct ev_loop *event_loop,
 									   void (*cb)(guint ncompiled, GError *err, void *cbd),
 									   void *cbd);
@@ -82,6 +82,11 @@ struct rspamd_symcache_item_stat {
 	struct rspamd_counter_data frequency_counter;
 	gdouble avg_frequency;
 	gdouble stddev_frequency;
+	/* Number of times a callback has been executed */
+	guint runs;
+	guint64 total_runs;
+	/* Expected score gain per ms of execution time, used to order filters */
+	gdouble order_score;
 };
 
 /**
@@ -542,6 +547,38 @@ rspamd_symcache_item_stat(struct rspamd_symcache_item *item);
  */
 void rspamd_symcache_enable_profile(struct rspamd_task *task);
 
+enum rspamd_symcache_trace_format {
+	RSPAMD_SYMCACHE_TRACE_CHROME = 0,
+	RSPAMD_SYMCACHE_TRACE_FOLDED,
+};
+
+/**
+ * Returns format of symcache traces by name (`chrome` or `folded`)
+ * @param str
+ * @return
+ */
+enum rspamd_symcache_trace_format rspamd_symcache_trace_format_from_string(const gchar *str);
+
+/**
+ * Adds a nested event (e.g. regexp class scan) to the trace of the currently
+ * executed symbol, does nothing if a task is not traced
+ * @param task
+ * @param name static string
+ * @param start ticks as returned by `rspamd_get_ticks(FALSE)`
+ * @param end
+ */
+void rspamd_symcache_trace_add(struct rspamd_task *task, const gchar *name,
+							   gdouble start, gdouble end);
+
+/**
+ * Exports symbols execution trace for a task
+ * @param task
+ * @param fmt
+ * @return new GString that should be freed by a caller or NULL if a task is not traced
+ */
+GString *rspamd_symcache_trace_export(struct rspamd_task *task,
+									  enum rspamd_symcache_trace_format fmt);
+
 struct rspamd_symcache_timeout_item {
 	double timeout;
 	const struct rspamd_symcache_item *item;
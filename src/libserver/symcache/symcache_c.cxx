@@ -18,6 +18,7 @@
 #include "symcache_periodic.hxx"
 #include "symcache_item.hxx"
 #include "symcache_runtime.hxx"
+#include "symcache_trace.hxx"
 
 /**
  * C API for symcache
@@ -589,6 +590,46 @@ void rspamd_symcache_enable_profile(struct rspamd_task *task)
 	cache_runtime->set_profile_mode(true);
 }
 
+enum rspamd_symcache_trace_format
+rspamd_symcache_trace_format_from_string(const gchar *str)
+{
+	if (str && g_ascii_strcasecmp(str, "folded") == 0) {
+		return RSPAMD_SYMCACHE_TRACE_FOLDED;
+	}
+
+	return RSPAMD_SYMCACHE_TRACE_CHROME;
+}
+
+void rspamd_symcache_trace_add(struct rspamd_task *task, const gchar *name,
+							   gdouble start, gdouble end)
+{
+	auto *cache_runtime = C_API_SYMCACHE_RUNTIME(task->symcache_runtime);
+
+	if (!cache_runtime || !cache_runtime->get_trace()) {
+		return;
+	}
+
+	auto *cur_item = cache_runtime->get_cur_item();
+	const auto *static_item = cur_item ? cache_runtime->get_item_by_dynamic_item(cur_item) : nullptr;
+	cache_runtime->get_trace()->add_nested(static_item, name, start, end);
+}
+
+GString *
+rspamd_symcache_trace_export(struct rspamd_task *task,
+							 enum rspamd_symcache_trace_format format)
+{
+	auto *cache_runtime = C_API_SYMCACHE_RUNTIME(task->symcache_runtime);
+
+	if (!cache_runtime || !cache_runtime->get_trace()) {
+		return nullptr;
+	}
+
+	auto *trace = cache_runtime->get_trace();
+	auto out = format == RSPAMD_SYMCACHE_TRACE_FOLDED ? trace->to_folded() : trace->to_chrome();
+
+	return g_string_new_len(out.data(), out.size());
+}
+
 guint rspamd_symcache_item_async_inc_full(struct rspamd_task *task,
 										  struct rspamd_symcache_dynamic_item *item,
 										  const gchar *subsystem,
@@ -603,6 +644,10 @@ guint rspamd_symcache_item_async_inc_full(struct rspamd_task *task,
 						 static_item->symbol.c_str(), static_item->id,
 						 real_dyn_item->async_events, subsystem, loc);
 
+	if (G_UNLIKELY(cache_runtime->get_trace())) {
+		cache_runtime->get_trace()->async_started(static_item, subsystem);
+	}
+
 	return ++real_dyn_item->async_events;
 }
 
@@ -629,6 +674,10 @@ guint rspamd_symcache_item_async_dec_full(struct rspamd_task *task,
 		g_assert_not_reached();
 	}
 
+	if (G_UNLIKELY(cache_runtime->get_trace())) {
+		cache_runtime->get_trace()->async_finished(static_item, subsystem);
+	}
+
 	return --real_dyn_item->async_events;
 }
 
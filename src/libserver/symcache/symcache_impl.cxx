@@ -220,9 +220,7 @@ auto symcache::init() -> bool
 	std::stable_sort(std::begin(postfilters), std::end(postfilters), postfilters_cmp);
 	std::stable_sort(std::begin(idempotent), std::end(idempotent), postfilters_cmp);
 
-	resort();
-
-	/* Connect metric symbols with symcache symbols */
+	/* Connect metric symbols with symcache symbols, weights are needed for ordering */
 	if (cfg->symbols) {
 		msg_debug_cache("connect metrics");
 		g_hash_table_foreach(cfg->symbols,
@@ -230,6 +228,9 @@ auto symcache::init() -> bool
 							 (void *) this);
 	}
 
+	update_order_scores();
+	resort();
+
 	return res;
 }
 
@@ -318,6 +319,11 @@ auto symcache::load_items() -> bool
 				item->last_count = item->st->total_hits;
 			}
 
+			elt = ucl_object_lookup(cur, "runs");
+			if (elt) {
+				item->st->total_runs = ucl_object_toint(elt);
+			}
+
 			elt = ucl_object_lookup(cur, "frequency");
 			if (elt && ucl_object_type(elt) == UCL_OBJECT) {
 				const ucl_object_t *freq_elt;
@@ -410,6 +416,8 @@ bool symcache::save_items() const
 							  "time", 0, false);
 		ucl_object_insert_key(elt, ucl_object_fromint(item->st->total_hits),
 							  "count", 0, false);
+		ucl_object_insert_key(elt, ucl_object_fromint(item->st->total_runs),
+							  "runs", 0, false);
 
 		auto *freq = ucl_object_typed_new(UCL_OBJECT);
 		ucl_object_insert_key(freq,
@@ -553,9 +561,69 @@ auto symcache::add_dependency(int id_from, std::string_view to, int virtual_id_f
 	}
 }
 
+auto symcache::update_order_scores() -> void
+{
+	/* Should be less than augmentations multiplier in the order comparator */
+	constexpr const auto max_score = 1e4;
+	constexpr const auto time_alpha = 0.1, weight_alpha = 0.1, freq_alpha = 0.01;
+
+	if (!cfg->cache_adaptive_order) {
+		/* Legacy static order: weight and frequency relative to the average ones */
+		auto nitems = std::max(filters.size(), std::size_t(1));
+		auto avg_freq = std::max((double) total_hits / nitems, 1.0);
+		auto avg_weight = std::max(total_weight / nitems, weight_alpha);
+		constexpr const auto legacy_time_alpha = 1.0;
+
+		for (auto *it: filters) {
+			auto w = std::fabs(it->st->weight) / avg_weight;
+			auto f = (double) it->st->total_hits / avg_freq;
+			auto t = it->st->avg_time;
+
+			it->st->order_score = std::min((w > 0.0 ? w : weight_alpha) * (f > 0.0 ? f : freq_alpha) /
+											   (t > legacy_time_alpha ? t : legacy_time_alpha),
+										   max_score);
+		}
+
+		return;
+	}
+
+	/*
+	 * Expected gain towards the reject threshold per millisecond of execution:
+	 * P(symbol fires | callback runs) * weight / avg_time, summed over all symbols
+	 * inserted by a callback. Cheap and predictive rules go first, so
+	 * `check_metric_limit` can stop processing before expensive ones are started.
+	 * Negative symbols never lead to passthrough, so their benefit is discounted
+	 */
+	for (auto *it: filters) {
+		auto runs = it->st->total_runs;
+		auto symbol_gain = [runs](const cache_item *sym) -> double {
+			auto w = sym->st->weight;
+			auto benefit = w > 0 ? w : -w * weight_alpha;
+			auto prob = runs > 0 ? std::min((double) sym->st->total_hits / runs, 1.0) : freq_alpha;
+
+			return prob * benefit;
+		};
+
+		auto gain = symbol_gain(it);
+		const auto *children = it->get_children();
+
+		if (children) {
+			for (const auto *cld: *children) {
+				gain += symbol_gain(cld);
+			}
+		}
+
+		/* Keep some order for symbols with no (known) score */
+		gain = std::max(gain, weight_alpha * freq_alpha);
+		auto t = it->st->avg_time;
+		it->st->order_score = std::min(gain / (t > time_alpha ? t : time_alpha), max_score);
+	}
+}
+
 auto symcache::resort() -> void
 {
 	auto log_func = RSPAMD_LOG_FUNC;
+	last_shared_order_gen = g_atomic_int_get(shared_order_gen);
 	auto ord = std::make_shared<order_generation>(filters.size() +
 													  prefilters.size() +
 													  composites.size() +
@@ -637,7 +705,6 @@ auto symcache::resort() -> void
 	 * Topological sort
 	 */
 	total_hits = 0;
-	auto used_items = ord->d.size();
 
 	for (const auto &it: ord->d) {
 		if (it->order == 0) {
@@ -647,13 +714,6 @@ auto symcache::resort() -> void
 
 
 	/* Main sorting comparator */
-	constexpr auto score_functor = [](auto w, auto f, auto t) -> auto {
-		auto time_alpha = 1.0, weight_alpha = 0.1, freq_alpha = 0.01;
-
-		return ((w > 0.0 ? w : weight_alpha) * (f > 0.0 ? f : freq_alpha) /
-				(t > time_alpha ? t : time_alpha));
-	};
-
 	auto cache_order_cmp = [&](const auto &it1, const auto &it2) -> auto {
 		constexpr const auto topology_mult = 1e7,
 							 priority_mult = 1e6,
@@ -665,17 +725,9 @@ auto symcache::resort() -> void
 		w2 += it2->priority * priority_mult;
 		w1 += it1->get_augmentation_weight() * augmentations1_mult;
 		w2 += it2->get_augmentation_weight() * augmentations1_mult;
-
-		auto avg_freq = ((double) total_hits / used_items);
-		auto avg_weight = (total_weight / used_items);
-		auto f1 = (double) it1->st->total_hits / avg_freq;
-		auto f2 = (double) it2->st->total_hits / avg_freq;
-		auto weight1 = std::fabs(it1->st->weight) / avg_weight;
-		auto weight2 = std::fabs(it2->st->weight) / avg_weight;
-		auto t1 = it1->st->avg_time;
-		auto t2 = it2->st->avg_time;
-		w1 += score_functor(weight1, f1, t1);
-		w2 += score_functor(weight2, f2, t2);
+		/* Scores are calculated by `update_order_scores` */
+		w1 += it1->st->order_score;
+		w2 += it2->st->order_score;
 
 		return w1 > w2;
 	};
@@ -1067,6 +1119,18 @@ auto symcache::periodic_resort(struct ev_loop *ev_loop, double cur_time, double
 			}
 		}
 	}
+
+	if (cfg->cache_adaptive_order) {
+		for (const auto &item: virtual_symbols) {
+			/* Hits of virtual symbols are used to estimate gain of their parents */
+			item->st->total_hits += item->st->hits;
+			g_atomic_int_set(&item->st->hits, 0);
+		}
+
+		/* Scores live in the shared memory, so other processes resort on the next task */
+		update_order_scores();
+		g_atomic_int_inc(shared_order_gen);
+	}
 }
 
 symcache::~symcache()
@@ -1090,6 +1154,13 @@ auto symcache::maybe_resort() -> bool
 		return true;
 	}
 
+	if (g_atomic_int_get(shared_order_gen) != last_shared_order_gen) {
+		msg_debug_cache("order scores have been updated, resort symbols cache");
+		resort();
+
+		return true;
+	}
+
 	return false;
 }
 
@@ -301,11 +301,15 @@ private:
 private:
 	int peak_cb;
 	int cache_id;
+	/* Bumped by the primary controller when order scores are recalculated */
+	int *shared_order_gen;
+	int last_shared_order_gen;
 
 private:
 	/* Internal methods */
 	auto load_items() -> bool;
 	auto resort() -> void;
+	auto update_order_scores() -> void;
 	auto get_item_specific_vector(const cache_item &) -> items_ptr_vec &;
 	/* Helper for g_hash_table_foreach */
 	static auto metric_connect_cb(void *k, void *v, void *ud) -> void;
@@ -322,6 +326,9 @@ public:
 		cksum = 0xdeadbabe;
 		peak_cb = -1;
 		cache_id = rspamd_random_uint64_fast();
+		/* Must be allocated before workers are forked to be shared between them */
+		shared_order_gen = rspamd_mempool_alloc0_shared_type(static_pool, int);
+		last_shared_order_gen = 0;
 		L = (lua_State *) cfg->lua_state;
 		delayed_conditions = std::make_unique<std::vector<delayed_cache_condition>>();
 		delayed_deps = std::make_unique<std::vector<delayed_cache_dependency>>();
@@ -225,6 +225,8 @@ auto cache_item::update_counters_check_peak(lua_State *L,
 
 	st->total_hits += st->hits;
 	g_atomic_int_set(&st->hits, 0);
+	st->total_runs += st->runs;
+	g_atomic_int_set(&st->runs, 0);
 
 	if (last_count > 0) {
 		auto cur_value = (st->total_hits - last_count) /
@@ -59,6 +59,16 @@ auto symcache_runtime::create(struct rspamd_task *task, symcache &cache) -> symc
 		cache.set_last_profile(now);
 	}
 
+	if ((task->flags & RSPAMD_TASK_FLAG_TRACE) ||
+		(task->cfg->cache_trace_probability > 0 &&
+		 rspamd_random_double_fast() < task->cfg->cache_trace_probability)) {
+		msg_debug_cache_task("enable tracing of symbols for task");
+		task->flags |= RSPAMD_TASK_FLAG_TRACE;
+		checkpoint->trace = new symcache_trace(task->task_pool->tag.uid,
+											   task->cfg->cache_trace_dir,
+											   rspamd_symcache_trace_format_from_string(task->cfg->cache_trace_format));
+	}
+
 	task->symcache_runtime = (void *) checkpoint;
 
 	return checkpoint;
@@ -164,6 +174,8 @@ auto symcache_runtime::disable_all_symbols(int skip_mask) -> void
 			dyn_item->started = true;
 		}
 	}
+
+	filters_scheduled = false;
 }
 
 auto symcache_runtime::disable_symbol(struct rspamd_task *task, const symcache &cache, std::string_view name) -> bool
@@ -177,6 +189,7 @@ auto symcache_runtime::disable_symbol(struct rspamd_task *task, const symcache &
 		if (dyn_item) {
 			dyn_item->finished = true;
 			dyn_item->started = true;
+			filters_scheduled = false;
 			msg_debug_cache_task("disable execution of %s", name.data());
 
 			return true;
@@ -203,6 +216,7 @@ auto symcache_runtime::enable_symbol(struct rspamd_task *task, const symcache &c
 		if (dyn_item) {
 			dyn_item->finished = false;
 			dyn_item->started = false;
+			filters_scheduled = false;
 			msg_debug_cache_task("enable execution of %s", name.data());
 
 			return true;
@@ -383,7 +397,158 @@ auto symcache_runtime::process_pre_postfilters(struct rspamd_task *task,
 	return all_done;
 }
 
+auto symcache_runtime::init_filters_schedule(struct rspamd_task *task) -> void
+{
+	auto nitems = order->size();
+
+	if (pending_deps == nullptr) {
+		pending_deps = rspamd_mempool_alloc_array_type(task->task_pool, nitems, std::uint32_t);
+		ready_queue = rspamd_mempool_alloc_array_type(task->task_pool, nitems, std::uint32_t);
+	}
+
+	memset(pending_deps, 0, sizeof(*pending_deps) * nitems);
+	nfilters = 0;
+	filters_cursor = 0;
+	filters_unstarted = 0;
+	ready_head = 0;
+	ready_tail = 0;
+
+	for (const auto [idx, item]: rspamd::enumerate(order->d)) {
+		auto *dyn_item = &dynamic_items[idx];
+
+		if (item->type == symcache_item_type::FILTER && nfilters == idx) {
+			/* Filters are placed at the beginning of the order */
+			nfilters = idx + 1;
+
+			if (!dyn_item->started) {
+				filters_unstarted++;
+			}
+		}
+
+		if (dyn_item->finished) {
+			continue;
+		}
+
+		/* Each unfinished item blocks its reverse dependencies */
+		for (const auto &rdep: item->rdeps) {
+			if (rdep.item && rdep.item->type == symcache_item_type::FILTER) {
+				auto *rdep_dyn_item = get_dynamic_item(rdep.item->id);
+
+				if (rdep_dyn_item) {
+					pending_deps[rdep_dyn_item - dynamic_items]++;
+				}
+			}
+		}
+	}
+
+	filters_scheduled = true;
+}
+
+auto symcache_runtime::mark_finished(cache_item *item, cache_dynamic_item *dyn_item) -> void
+{
+	auto was_finished = dyn_item->finished;
+
+	dyn_item->finished = true;
+
+	if (was_finished || !filters_scheduled) {
+		return;
+	}
+
+	for (const auto &rdep: item->rdeps) {
+		if (rdep.item && rdep.item->type == symcache_item_type::FILTER) {
+			auto *rdep_dyn_item = get_dynamic_item(rdep.item->id);
+
+			if (rdep_dyn_item) {
+				auto rdep_idx = rdep_dyn_item - dynamic_items;
+
+				if (pending_deps[rdep_idx] > 0 && --pending_deps[rdep_idx] == 0 &&
+					!rdep_dyn_item->started && ready_tail < order->size()) {
+					ready_queue[ready_tail++] = rdep_idx;
+				}
+			}
+		}
+	}
+}
+
 auto symcache_runtime::process_filters(struct rspamd_task *task, symcache &cache, int start_events) -> bool
+{
+	auto log_func = RSPAMD_LOG_FUNC;
+
+	if (!filters_scheduled) {
+		init_filters_schedule(task);
+	}
+
+	auto maybe_process = [&](unsigned idx) -> bool {
+		auto *item = order->d[idx].get();
+		auto *dyn_item = &dynamic_items[idx];
+
+		if (dyn_item->started) {
+			return true;
+		}
+
+		if (!(item->flags & (SYMBOL_TYPE_FINE | SYMBOL_TYPE_IGNORE_PASSTHROUGH)) &&
+			check_metric_limit(task)) {
+			/* Passthrough is handled by the full scan */
+			return false;
+		}
+
+		if (!check_item_deps(task, cache, item, dyn_item, false)) {
+			msg_debug_cache_task_lambda("blocked execution of %d(%s) unless deps are "
+										"resolved",
+										item->id, item->symbol.c_str());
+
+			return true;
+		}
+
+		process_symbol(task, cache, item, dyn_item);
+
+		return true;
+	};
+
+	/* The first pass over all filters in order, it is interrupted by slow rules */
+	while (filters_cursor < nfilters) {
+		if (!maybe_process(filters_cursor++)) {
+			return process_filters_scan(task, cache, start_events);
+		}
+
+		if (has_slow || !filters_scheduled) {
+			/* Delay */
+			has_slow = false;
+
+			return false;
+		}
+	}
+
+	/* Then we execute merely filters that have been unblocked since the last call */
+	while (ready_head < ready_tail) {
+		if (!maybe_process(ready_queue[ready_head++])) {
+			return process_filters_scan(task, cache, start_events);
+		}
+
+		if (has_slow || !filters_scheduled) {
+			/* Delay */
+			has_slow = false;
+
+			return false;
+		}
+	}
+
+	if (filters_unstarted == 0) {
+		return true;
+	}
+
+	if (rspamd_session_events_pending(task->s) == 0) {
+		/*
+		 * Nothing is in flight to unblock the remaining filters (e.g. they
+		 * depend on something that has not been started), so do the full scan
+		 */
+		return process_filters_scan(task, cache, start_events);
+	}
+
+	return false;
+}
+
+auto symcache_runtime::process_filters_scan(struct rspamd_task *task, symcache &cache, int start_events) -> bool
 {
 	auto all_done = true;
 	auto log_func = RSPAMD_LOG_FUNC;
@@ -464,6 +629,10 @@ auto symcache_runtime::process_symbol(struct rspamd_task *task, symcache &cache,
 	dyn_item->started = true;
 	auto check = true;
 
+	if (filters_scheduled && item->type == symcache_item_type::FILTER && filters_unstarted > 0) {
+		filters_unstarted--;
+	}
+
 	if (!item->is_allowed(task, true) || !item->check_conditions(task)) {
 		check = false;
 	}
@@ -478,6 +647,12 @@ auto symcache_runtime::process_symbol(struct rspamd_task *task, symcache &cache,
 									profile_start) *
 								   1e3;
 		}
+		g_atomic_int_inc(&item->st->runs);
+
+		if (G_UNLIKELY(trace)) {
+			trace->item_started(item);
+		}
+
 		dyn_item->async_events = 0;
 		cur_item = dyn_item;
 		items_inflight++;
@@ -499,7 +674,7 @@ auto symcache_runtime::process_symbol(struct rspamd_task *task, symcache &cache,
 		return false;
 	}
 	else {
-		dyn_item->finished = true;
+		mark_finished(item, dyn_item);
 	}
 
 	return true;
@@ -701,7 +876,12 @@ auto symcache_runtime::finalize_item(struct rspamd_task *task, cache_dynamic_ite
 	}
 
 	msg_debug_cache_task("process finalize for item %s(%d)", item->symbol.c_str(), item->id);
-	dyn_item->finished = true;
+
+	if (G_UNLIKELY(trace)) {
+		trace->item_finished(item);
+	}
+
+	mark_finished(item, dyn_item);
 	items_inflight--;
 	cur_item = nullptr;
 
@@ -793,7 +973,14 @@ auto symcache_runtime::process_item_rdeps(struct rspamd_task *task, cache_item *
 				msg_debug_cache_task("check item %d(%s) rdep of %s ",
 									 rdep.item->id, rdep.item->symbol.c_str(), item->symbol.c_str());
 
-				if (!check_item_deps(task, *cache_ptr, rdep.item, dyn_item, false)) {
+				if (filters_scheduled && rdep.item->type == symcache_item_type::FILTER &&
+					pending_deps[dyn_item - dynamic_items] > 0) {
+					/* Still has unfinished dependencies, it will be queued once they are done */
+					msg_debug_cache_task("blocked execution of %d(%s) rdep of %s "
+										 "unless deps are resolved",
+										 rdep.item->id, rdep.item->symbol.c_str(), item->symbol.c_str());
+				}
+				else if (!check_item_deps(task, *cache_ptr, rdep.item, dyn_item, false)) {
 					msg_debug_cache_task("blocked execution of %d(%s) rdep of %s "
 										 "unless deps are resolved",
 										 rdep.item->id, rdep.item->symbol.c_str(), item->symbol.c_str());
@@ -26,6 +26,7 @@
 #pragma once
 
 #include "symcache_internal.hxx"
+#include "symcache_trace.hxx"
 
 struct rspamd_scan_result;
 
@@ -54,7 +55,24 @@ class symcache_runtime {
 	double profile_start;
 	double lim;
 
+	/*
+	 * Filters scheduling: after the first pass over filters, only those
+	 * filters that have all their dependencies finished are examined
+	 */
+	bool filters_scheduled;
+	unsigned nfilters;
+	unsigned filters_cursor;
+	unsigned filters_unstarted;
+	unsigned ready_head;
+	unsigned ready_tail;
+	/* Number of unfinished dependencies for each item in the order */
+	std::uint32_t *pending_deps;
+	/* Filters that have been unblocked by finished dependencies */
+	std::uint32_t *ready_queue;
+
 	struct cache_dynamic_item *cur_item;
+	/* Not null if symbols execution is traced for this task */
+	symcache_trace *trace;
 	order_generation_ptr order;
 	/* Dynamically expanded as needed */
 	mutable struct cache_dynamic_item dynamic_items[];
@@ -66,6 +84,9 @@ class symcache_runtime {
 	/* Specific stages of the processing */
 	auto process_pre_postfilters(struct rspamd_task *task, symcache &cache, int start_events, unsigned int stage) -> bool;
 	auto process_filters(struct rspamd_task *task, symcache &cache, int start_events) -> bool;
+	auto process_filters_scan(struct rspamd_task *task, symcache &cache, int start_events) -> bool;
+	auto init_filters_schedule(struct rspamd_task *task) -> void;
+	auto mark_finished(cache_item *item, cache_dynamic_item *dyn_item) -> void;
 	auto check_metric_limit(struct rspamd_task *task) -> bool;
 	auto check_item_deps(struct rspamd_task *task, symcache &cache, cache_item *item,
 						 cache_dynamic_item *dyn_item, bool check_only) -> bool;
@@ -74,6 +95,11 @@ public:
 	/* Dropper for a shared ownership */
 	auto savepoint_dtor() -> void
 	{
+		if (trace) {
+			trace->save();
+			delete trace;
+			trace = nullptr;
+		}
 
 		/* Drop shared ownership */
 		order.reset();
@@ -149,6 +175,15 @@ public:
 		return item;
 	}
 
+	/**
+	 * Returns trace of symbols execution if it is enabled
+	 * @return
+	 */
+	auto get_trace() const -> symcache_trace *
+	{
+		return trace;
+	}
+
 	/**
 	 * Set profile mode for the runtime
 	 * @param enable
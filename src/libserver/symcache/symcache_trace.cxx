@@ -0,0 +1,183 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "symcache_trace.hxx"
+#include "symcache_item.hxx"
+#include "libutil/util.h"
+#include "logger.h"
+#include "ucl.h"
+#include "unix-std.h"
+#include "fmt/core.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+
+namespace rspamd::symcache {
+
+symcache_trace::symcache_trace(const char *_task_id, const char *_save_dir,
+							   enum rspamd_symcache_trace_format _save_format)
+	: start_ts(rspamd_get_ticks(FALSE)), task_id(_task_id),
+	  save_dir(_save_dir ? _save_dir : ""), save_format(_save_format)
+{
+	/* Usually enough to avoid reallocations for a typical configuration */
+	events.reserve(256);
+}
+
+auto symcache_trace::item_started(const cache_item *item) -> void
+{
+	started[item->id] = rspamd_get_ticks(FALSE) - start_ts;
+}
+
+auto symcache_trace::item_finished(const cache_item *item) -> void
+{
+	auto it = started.find(item->id);
+
+	if (it != started.end()) {
+		auto now = rspamd_get_ticks(FALSE) - start_ts;
+		events.push_back(trace_event{item->symbol.c_str(), "symbol",
+									 it->second, now - it->second, item->id});
+		started.erase(it);
+	}
+}
+
+auto symcache_trace::async_started(const cache_item *item, const char *subsystem) -> void
+{
+	pending.push_back(pending_async{item->id, subsystem,
+									rspamd_get_ticks(FALSE) - start_ts});
+}
+
+auto symcache_trace::async_finished(const cache_item *item, const char *subsystem) -> void
+{
+	/* Match the latest pending event of the same subsystem */
+	auto it = std::find_if(pending.rbegin(), pending.rend(), [&](const pending_async &p) {
+		return p.id == item->id &&
+			   (p.subsystem == subsystem ||
+				(p.subsystem && subsystem && strcmp(p.subsystem, subsystem) == 0));
+	});
+
+	if (it != pending.rend()) {
+		auto now = rspamd_get_ticks(FALSE) - start_ts;
+		events.push_back(trace_event{it->subsystem ? it->subsystem : "unknown", "async",
+									 it->ts, now - it->ts, item->id});
+		pending.erase(std::next(it).base());
+	}
+}
+
+auto symcache_trace::add_nested(const cache_item *item, const char *name, double start, double end) -> void
+{
+	events.push_back(trace_event{name, "scan",
+								 start - start_ts, end - start,
+								 item ? item->id : -1});
+}
+
+auto symcache_trace::to_chrome() const -> std::string
+{
+	auto *top = ucl_object_typed_new(UCL_OBJECT);
+	auto *ar = ucl_object_typed_new(UCL_ARRAY);
+	auto pid = (gint64) getpid();
+
+	for (const auto &ev: events) {
+		auto *obj = ucl_object_typed_new(UCL_OBJECT);
+
+		ucl_object_insert_key(obj, ucl_object_fromstring(ev.name), "name", 0, false);
+		ucl_object_insert_key(obj, ucl_object_fromstring(ev.cat), "cat", 0, false);
+		ucl_object_insert_key(obj, ucl_object_fromstring("X"), "ph", 0, false);
+		/* Chrome expects microseconds */
+		ucl_object_insert_key(obj, ucl_object_fromdouble(ev.ts * 1e6), "ts", 0, false);
+		ucl_object_insert_key(obj, ucl_object_fromdouble(ev.dur * 1e6), "dur", 0, false);
+		ucl_object_insert_key(obj, ucl_object_fromint(pid), "pid", 0, false);
+		ucl_object_insert_key(obj, ucl_object_fromint(ev.tid), "tid", 0, false);
+		ucl_array_append(ar, obj);
+	}
+
+	ucl_object_insert_key(top, ar, "traceEvents", 0, false);
+	ucl_object_insert_key(top, ucl_object_fromstring("ms"), "displayTimeUnit", 0, false);
+	ucl_object_insert_key(top, ucl_object_fromlstring(task_id.data(), task_id.size()),
+						  "task_id", 0, false);
+
+	std::size_t len;
+	auto *out = ucl_object_emit_len(top, UCL_EMIT_JSON_COMPACT, &len);
+	std::string ret{(const char *) out, len};
+	free(out);
+	ucl_object_unref(top);
+
+	return ret;
+}
+
+auto symcache_trace::to_folded() const -> std::string
+{
+	/* Sorted to have a stable output */
+	std::map<std::string, double> stacks;
+	ankerl::unordered_dense::map<int, const char *> symbols;
+	ankerl::unordered_dense::map<int, double> nested_time;
+
+	for (const auto &ev: events) {
+		if (ev.tid >= 0 && strcmp(ev.cat, "symbol") == 0) {
+			symbols[ev.tid] = ev.name;
+		}
+	}
+
+	for (const auto &ev: events) {
+		if (strcmp(ev.cat, "symbol") == 0) {
+			continue;
+		}
+
+		auto sym_it = symbols.find(ev.tid);
+		const auto *parent = sym_it != symbols.end() ? sym_it->second : "task";
+
+		stacks[fmt::format("{};{}:{}", parent, ev.cat, ev.name)] += ev.dur;
+		nested_time[ev.tid] += ev.dur;
+	}
+
+	for (const auto &ev: events) {
+		if (strcmp(ev.cat, "symbol") == 0) {
+			/* Async waits and scans may overlap, so self time is not precise */
+			stacks[ev.name] += std::max(ev.dur - nested_time[ev.tid], 0.0);
+		}
+	}
+
+	std::string ret;
+
+	for (const auto &[stack, dur]: stacks) {
+		ret += fmt::format("{} {}\n", stack, (std::uint64_t) (dur * 1e6));
+	}
+
+	return ret;
+}
+
+auto symcache_trace::save() const -> bool
+{
+	if (save_dir.empty()) {
+		return false;
+	}
+
+	auto is_folded = save_format == RSPAMD_SYMCACHE_TRACE_FOLDED;
+	auto fname = fmt::format("{}/{}.{}", save_dir, task_id, is_folded ? "folded" : "json");
+	auto data = is_folded ? to_folded() : to_chrome();
+	GError *err = nullptr;
+
+	if (!g_file_set_contents(fname.c_str(), data.data(), data.size(), &err)) {
+		msg_info("cannot save symcache trace to %s: %e", fname.c_str(), err);
+		g_error_free(err);
+
+		return false;
+	}
+
+	return true;
+}
+
+}// namespace rspamd::symcache
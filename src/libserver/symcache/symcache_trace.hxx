@@ -0,0 +1,108 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Symcache trace records timings of symbols executed for a single task:
+ * when each symbol has been started and finished, async events it has been
+ * waiting for and nested work (e.g. regexp classes scans) it has triggered.
+ * The result can be exported as Chrome trace events or as folded stacks
+ * suitable for flame graphs.
+ */
+
+#ifndef RSPAMD_SYMCACHE_TRACE_HXX
+#define RSPAMD_SYMCACHE_TRACE_HXX
+#pragma once
+
+#include "config.h"
+#include "rspamd_symcache.h"
+#include "contrib/ankerl/unordered_dense.h"
+
+#include <string>
+#include <vector>
+
+namespace rspamd::symcache {
+
+class cache_item;
+
+class symcache_trace {
+	struct trace_event {
+		/* All names are either static strings or owned by the cache */
+		const char *name;
+		const char *cat;
+		/* Relative to the trace start, in seconds */
+		double ts;
+		double dur;
+		/* Symbol id or -1 if an event is not bound to any symbol */
+		int tid;
+	};
+
+	struct pending_async {
+		int id;
+		const char *subsystem;
+		double ts;
+	};
+
+	double start_ts;
+	std::string task_id;
+	/* Where to save trace on task destruction, if not empty */
+	std::string save_dir;
+	enum rspamd_symcache_trace_format save_format;
+	std::vector<trace_event> events;
+	std::vector<pending_async> pending;
+	ankerl::unordered_dense::map<int, double> started;
+
+public:
+	explicit symcache_trace(const char *task_id, const char *save_dir = nullptr,
+							enum rspamd_symcache_trace_format save_format = RSPAMD_SYMCACHE_TRACE_CHROME);
+
+	auto item_started(const cache_item *item) -> void;
+	auto item_finished(const cache_item *item) -> void;
+	auto async_started(const cache_item *item, const char *subsystem) -> void;
+	auto async_finished(const cache_item *item, const char *subsystem) -> void;
+	/**
+	 * Adds a nested event to the specific item (or to the task if item is nullptr)
+	 * @param item
+	 * @param name
+	 * @param start absolute ticks
+	 * @param end absolute ticks
+	 */
+	auto add_nested(const cache_item *item, const char *name, double start, double end) -> void;
+
+	/**
+	 * Exports trace in Chrome trace-event JSON format
+	 * @return
+	 */
+	auto to_chrome() const -> std::string;
+	/**
+	 * Exports trace as folded stacks (self time in microseconds)
+	 * @return
+	 */
+	auto to_folded() const -> std::string;
+	/**
+	 * Writes trace to the save directory using task id as the file name
+	 * @return false if there is no save directory or a file cannot be written
+	 */
+	auto save() const -> bool;
+
+	auto get_task_id() const -> const std::string &
+	{
+		return task_id;
+	}
+};
+
+}// namespace rspamd::symcache
+
+#endif//RSPAMD_SYMCACHE_TRACE_HXX
@@ -83,6 +83,12 @@ rspamd_task_new(struct rspamd_worker *worker,
 	new_task = rspamd_mempool_alloc0(task_pool, sizeof(struct rspamd_task));
 	new_task->task_pool = task_pool;
 	new_task->flags = flags;
+
+	if (flags & RSPAMD_TASK_FLAG_OWN_POOL) {
+		/* Protocol parsing and the task itself are accounted as connect stage */
+		new_task->mem_stage = RSPAMD_TASK_STAGE_CONNECT;
+		new_task->mem_checkpoint = rspamd_mempool_get_used_size(task_pool);
+	}
 	new_task->worker = worker;
 	new_task->lang_det = lang_det;
 
@@ -166,6 +172,27 @@ rspamd_task_fin(void *arg)
 	return FALSE;
 }
 
+/*
+ * Accounts pool memory allocated during the current stage and starts next one
+ */
+static void
+rspamd_task_account_memory(struct rspamd_task *task, guint next_stage)
+{
+	gsize used;
+
+	if (task->mem_stage == 0) {
+		/* Pool is not owned by a task */
+		return;
+	}
+
+	used = rspamd_mempool_get_used_size(task->task_pool);
+	rspamd_mempool_account(RSPAMD_MEMPOOL_ACCOUNT_STAGE,
+						   rspamd_task_stage_name(task->mem_stage),
+						   used - task->mem_checkpoint);
+	task->mem_stage = next_stage;
+	task->mem_checkpoint = used;
+}
+
 /*
  * Free all structures of worker_task
  */
@@ -295,6 +322,7 @@ void rspamd_task_free(struct rspamd_task *task)
 				rspamd_symcache_runtime_destroy(task);
 			}
 
+			rspamd_task_account_memory(task, 0);
 			rspamd_mempool_delete(task->task_pool);
 		}
 		else if (task->symcache_runtime) {
@@ -715,6 +743,10 @@ rspamd_task_process(struct rspamd_task *task, guint stages)
 
 	st = rspamd_task_select_processing_stage(task, stages);
 
+	if (st != task->mem_stage) {
+		rspamd_task_account_memory(task, st);
+	}
+
 	switch (st) {
 	case RSPAMD_TASK_STAGE_CONNFILTERS:
 		all_done = rspamd_symcache_process_symbols(task, task->cfg->cache, st);
@@ -729,6 +761,10 @@ rspamd_task_process(struct rspamd_task *task, guint stages)
 	case RSPAMD_TASK_STAGE_PROCESS_MESSAGE:
 		if (!(task->flags & RSPAMD_TASK_FLAG_SKIP_PROCESS)) {
 			rspamd_message_process(task);
+
+			if (task->re_rt && !RSPAMD_TASK_IS_EMPTY(task)) {
+				rspamd_re_cache_process_eager(task);
+			}
 		}
 		break;
 
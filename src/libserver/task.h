@@ -112,7 +112,8 @@ enum rspamd_task_stage {
 #define RSPAMD_TASK_FLAG_SSL (1u << 22u)
 #define RSPAMD_TASK_FLAG_BAD_UNICODE (1u << 23u)
 #define RSPAMD_TASK_FLAG_MESSAGE_REWRITE (1u << 24u)
-#define RSPAMD_TASK_FLAG_MAX_SHIFT (24u)
+#define RSPAMD_TASK_FLAG_TRACE (1u << 25u)
+#define RSPAMD_TASK_FLAG_MAX_SHIFT (25u)
 
 
 /* Request has a JSON control block */
@@ -202,6 +203,8 @@ struct rspamd_task {
 	struct rspamd_config *cfg;       /**< pointer to config object						*/
 	GError *err;
 	rspamd_mempool_t *task_pool; /**< memory pool for task							*/
+	guint mem_stage;             /**< stage that is accounted for pool usage			*/
+	gsize mem_checkpoint;        /**< pool usage when mem_stage has been started		*/
 	double time_real_finish;
 	ev_tstamp task_timestamp;
 
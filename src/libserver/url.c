@@ -237,11 +237,38 @@ struct url_callback_data {
 	void *funcd;
 };
 
+#define RSPAMD_TLD_NODE_SUFFIX (1u << 0u)
+#define RSPAMD_TLD_NODE_STAR (1u << 1u)
+#define RSPAMD_TLD_NODE_EXCEPTION (1u << 2u)
+#define RSPAMD_TLD_LABEL_MAX 256
+
+/*
+ * Public suffixes are stored as a trie of reversed labels: "co.uk" is
+ * root -> "uk" -> "co". All edges live in a single open addressing table
+ * keyed by (parent node, label), so resolving a host costs one probe per label
+ */
+struct rspamd_tld_edge {
+	guint32 hash;
+	guint32 parent;
+	guint32 child; /* 0 marks an empty slot as the root is never a child */
+	guint32 label_off;
+	guint32 label_len;
+};
+
+struct rspamd_tld_trie {
+	struct rspamd_tld_edge *edges;
+	GByteArray *nodes; /* flags per node, node 0 is the root */
+	GString *labels;
+	guint32 nedges;
+	guint32 mask;
+};
+
 struct url_match_scanner {
 	GArray *matchers_full;
 	GArray *matchers_strict;
 	struct rspamd_multipattern *search_trie_full;
 	struct rspamd_multipattern *search_trie_strict;
+	struct rspamd_tld_trie *tld_trie;
 	bool has_tld_file;
 };
 
@@ -413,6 +440,289 @@ rspamd_url_strerror(int err)
 	return NULL;
 }
 
+static struct rspamd_tld_trie *
+rspamd_tld_trie_new(void)
+{
+	struct rspamd_tld_trie *trie;
+	guint8 root_flags = 0;
+
+	trie = g_malloc0(sizeof(*trie));
+	trie->mask = 16384 - 1;
+	trie->edges = g_malloc0(sizeof(struct rspamd_tld_edge) * (trie->mask + 1));
+	trie->nodes = g_byte_array_sized_new(16384);
+	trie->labels = g_string_sized_new(65536);
+	g_byte_array_append(trie->nodes, &root_flags, 1);
+
+	return trie;
+}
+
+static void
+rspamd_tld_trie_destroy(struct rspamd_tld_trie *trie)
+{
+	if (trie) {
+		g_free(trie->edges);
+		g_byte_array_free(trie->nodes, TRUE);
+		g_string_free(trie->labels, TRUE);
+		g_free(trie);
+	}
+}
+
+/*
+ * Copies a lowercased label to `out` (at least RSPAMD_TLD_LABEL_MAX bytes).
+ * Non ASCII labels are lowercased as UTF-8, as hosts are, so IDN suffixes
+ * match regardless of case. Returns 0 if a label is too long to be a suffix
+ */
+static gsize
+rspamd_tld_trie_fold_label(const gchar *label, gsize len, gchar *out)
+{
+	gsize i;
+	gboolean ascii = TRUE;
+
+	if (len >= RSPAMD_TLD_LABEL_MAX) {
+		return 0;
+	}
+
+	for (i = 0; i < len; i++) {
+		if ((guchar) label[i] & 0x80) {
+			ascii = FALSE;
+		}
+
+		out[i] = g_ascii_tolower(label[i]);
+	}
+
+	if (!ascii) {
+		len = rspamd_str_lc_utf8(out, len);
+	}
+
+	return len;
+}
+
+static inline guint32
+rspamd_tld_trie_hash(guint32 parent, const gchar *label, gsize len)
+{
+	return (guint32) rspamd_cryptobox_fast_hash(label, len, parent);
+}
+
+/* Label must be folded by rspamd_tld_trie_fold_label */
+static guint32
+rspamd_tld_trie_find_child(const struct rspamd_tld_trie *trie, guint32 parent,
+						   const gchar *label, gsize len)
+{
+	guint32 h = rspamd_tld_trie_hash(parent, label, len), i;
+	const struct rspamd_tld_edge *edge;
+
+	for (i = h & trie->mask;; i = (i + 1) & trie->mask) {
+		edge = &trie->edges[i];
+
+		if (edge->child == 0) {
+			return 0;
+		}
+
+		if (edge->hash == h && edge->parent == parent && edge->label_len == len &&
+			memcmp(trie->labels->str + edge->label_off, label, len) == 0) {
+			return edge->child;
+		}
+	}
+}
+
+static void
+rspamd_tld_trie_insert_edge(struct rspamd_tld_edge *edges, guint32 mask,
+							const struct rspamd_tld_edge *edge)
+{
+	guint32 i;
+
+	for (i = edge->hash & mask; edges[i].child != 0; i = (i + 1) & mask) {}
+
+	edges[i] = *edge;
+}
+
+static guint32
+rspamd_tld_trie_add_child(struct rspamd_tld_trie *trie, guint32 parent,
+						  const gchar *label, gsize len)
+{
+	struct rspamd_tld_edge edge;
+	guint8 flags = 0;
+
+	if ((trie->nedges + 1) * 2 > trie->mask + 1) {
+		/* Keep load factor below 0.5 */
+		guint32 nmask = (trie->mask + 1) * 2 - 1, i;
+		struct rspamd_tld_edge *nedges;
+
+		nedges = g_malloc0(sizeof(struct rspamd_tld_edge) * (nmask + 1));
+
+		for (i = 0; i <= trie->mask; i++) {
+			if (trie->edges[i].child != 0) {
+				rspamd_tld_trie_insert_edge(nedges, nmask, &trie->edges[i]);
+			}
+		}
+
+		g_free(trie->edges);
+		trie->edges = nedges;
+		trie->mask = nmask;
+	}
+
+	edge.hash = rspamd_tld_trie_hash(parent, label, len);
+	edge.parent = parent;
+	edge.child = trie->nodes->len;
+	edge.label_off = trie->labels->len;
+	edge.label_len = len;
+
+	g_string_append_len(trie->labels, label, len);
+	g_byte_array_append(trie->nodes, &flags, 1);
+	rspamd_tld_trie_insert_edge(trie->edges, trie->mask, &edge);
+	trie->nedges++;
+
+	return edge.child;
+}
+
+static gboolean
+rspamd_tld_trie_insert(struct rspamd_tld_trie *trie, const gchar *suffix,
+					   gsize len, guint8 flags)
+{
+	const gchar *end = suffix + len, *p;
+	gchar label[RSPAMD_TLD_LABEL_MAX];
+	gsize label_len;
+	guint32 node = 0, child;
+
+	if (len == 0) {
+		return FALSE;
+	}
+
+	while (end > suffix) {
+		p = end;
+
+		while (p > suffix && *(p - 1) != '.') {
+			p--;
+		}
+
+		if (p == end) {
+			/* Empty label */
+			return FALSE;
+		}
+
+		label_len = rspamd_tld_trie_fold_label(p, end - p, label);
+
+		if (label_len == 0) {
+			return FALSE;
+		}
+
+		child = rspamd_tld_trie_find_child(trie, node, label, label_len);
+
+		if (child == 0) {
+			child = rspamd_tld_trie_add_child(trie, node, label, label_len);
+		}
+
+		node = child;
+
+		if (p == suffix) {
+			break;
+		}
+
+		end = p - 1;
+
+		if (end == suffix) {
+			/* Leading dot */
+			return FALSE;
+		}
+	}
+
+	if (flags & RSPAMD_TLD_NODE_EXCEPTION) {
+		/* Exception is not a suffix itself, its parent is */
+		trie->nodes->data[node] |= flags;
+	}
+	else {
+		trie->nodes->data[node] |= RSPAMD_TLD_NODE_SUFFIX | flags;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Finds the effective second level domain of a host walking its labels
+ * from right to left. The host must contain a dot before a public suffix,
+ * one trailing dot is ignored. On success, `tld_start` is set to the offset
+ * of the eSLD and `host_len` to the host length without a trailing dot.
+ * Exception rules (e.g. `!www.ck` for `*.ck`) take precedence over others.
+ */
+static gboolean
+rspamd_tld_trie_lookup(const struct rspamd_tld_trie *trie,
+					   const gchar *host, gsize len,
+					   gsize *tld_start, gsize *host_len)
+{
+	gsize end, s, label_len;
+	gssize p, pos, best = -1;
+	gchar label[RSPAMD_TLD_LABEL_MAX];
+	guint32 node = 0;
+	gint ndots;
+
+	if (len > 1 && host[len - 1] == '.') {
+		len--;
+	}
+
+	end = len;
+
+	while (end > 0) {
+		s = end;
+
+		while (s > 0 && host[s - 1] != '.') {
+			s--;
+		}
+
+		if (s == end) {
+			break;
+		}
+
+		label_len = rspamd_tld_trie_fold_label(host + s, end - s, label);
+
+		if (label_len == 0) {
+			break;
+		}
+
+		node = rspamd_tld_trie_find_child(trie, node, label, label_len);
+
+		if (node == 0 || s == 0) {
+			break;
+		}
+
+		if (trie->nodes->data[node] & RSPAMD_TLD_NODE_EXCEPTION) {
+			/* The label itself is registrable */
+			best = s;
+			break;
+		}
+
+		if (trie->nodes->data[node] & RSPAMD_TLD_NODE_SUFFIX) {
+			/* Take one more label, or two for star suffixes */
+			ndots = (trie->nodes->data[node] & RSPAMD_TLD_NODE_STAR) ? 2 : 1;
+			pos = 0;
+
+			for (p = (gssize) s - 2; p >= 0 && ndots > 0; p--) {
+				if (host[p] == '.') {
+					ndots--;
+					pos = p + 1;
+				}
+				else {
+					pos = p;
+				}
+			}
+
+			if ((ndots == 0 || p == -1) && (best == -1 || pos < best)) {
+				best = pos;
+			}
+		}
+
+		end = s - 1;
+	}
+
+	if (best == -1) {
+		return FALSE;
+	}
+
+	*tld_start = best;
+	*host_len = len;
+
+	return TRUE;
+}
+
 static gboolean
 rspamd_url_parse_tld_file(const gchar *fname,
 						  struct url_match_scanner *scanner)
@@ -443,9 +753,14 @@ rspamd_url_parse_tld_file(const gchar *fname,
 
 		g_strchomp(linebuf);
 
-		/* TODO: add support for ! patterns */
 		if (linebuf[0] == '!') {
-			msg_debug("skip '!' patterns from parsing for now: %s", linebuf);
+			/* Exceptions are used for eSLD lookups only */
+			if (!rspamd_tld_trie_insert(scanner->tld_trie, linebuf + 1,
+										strlen(linebuf + 1),
+										RSPAMD_TLD_NODE_EXCEPTION)) {
+				msg_debug("cannot insert exception into tld trie: %s", linebuf);
+			}
+
 			continue;
 		}
 
@@ -466,6 +781,12 @@ rspamd_url_parse_tld_file(const gchar *fname,
 		}
 
 		m.flags = flags;
+
+		if (!rspamd_tld_trie_insert(scanner->tld_trie, p, strlen(p),
+									(flags & URL_MATCHER_FLAG_STAR_MATCH) ? RSPAMD_TLD_NODE_STAR : 0)) {
+			msg_debug("cannot insert suffix into tld trie: %s", linebuf);
+		}
+
 		rspamd_multipattern_add_pattern(url_scanner->search_trie_full, p,
 										RSPAMD_MULTIPATTERN_TLD | RSPAMD_MULTIPATTERN_ICASE | RSPAMD_MULTIPATTERN_UTF8);
 		m.pattern = rspamd_multipattern_get_pattern(url_scanner->search_trie_full,
@@ -527,6 +848,8 @@ void rspamd_url_deinit(void)
 			g_array_free(url_scanner->matchers_full, TRUE);
 		}
 
+		rspamd_tld_trie_destroy(url_scanner->tld_trie);
+
 		rspamd_multipattern_destroy(url_scanner->search_trie_strict);
 		g_array_free(url_scanner->matchers_strict, TRUE);
 		g_free(url_scanner);
@@ -559,11 +882,13 @@ void rspamd_url_init(const gchar *tld_file)
 													   sizeof(struct url_matcher), 13000);
 		url_scanner->search_trie_full = rspamd_multipattern_create_sized(13000,
 																		 RSPAMD_MULTIPATTERN_ICASE | RSPAMD_MULTIPATTERN_UTF8);
+		url_scanner->tld_trie = rspamd_tld_trie_new();
 		url_scanner->has_tld_file = true;
 	}
 	else {
 		url_scanner->matchers_full = NULL;
 		url_scanner->search_trie_full = NULL;
+		url_scanner->tld_trie = NULL;
 		url_scanner->has_tld_file = false;
 		mp_compile_flags |= RSPAMD_MULTIPATTERN_COMPILE_NO_FS;
 	}
@@ -1648,73 +1973,6 @@ out:
 
 #undef SET_U
 
-static gint
-rspamd_tld_trie_callback(struct rspamd_multipattern *mp,
-						 guint strnum,
-						 gint match_start,
-						 gint match_pos,
-						 const gchar *text,
-						 gsize len,
-						 void *context)
-{
-	struct url_matcher *matcher;
-	const gchar *start, *pos, *p;
-	struct rspamd_url *url = context;
-	gint ndots;
-
-	matcher = &g_array_index(url_scanner->matchers_full, struct url_matcher,
-							 strnum);
-	ndots = 1;
-
-	if (matcher->flags & URL_MATCHER_FLAG_STAR_MATCH) {
-		/* Skip one more tld component */
-		ndots++;
-	}
-
-	pos = text + match_start;
-	p = pos - 1;
-	start = rspamd_url_host_unsafe(url);
-
-	if (*pos != '.' || match_pos != (gint) url->hostlen) {
-		/* Something weird has been found */
-		if (match_pos == (gint) url->hostlen - 1) {
-			pos = rspamd_url_host_unsafe(url) + match_pos;
-			if (*pos == '.') {
-				/* This is dot at the end of domain */
-				url->hostlen--;
-			}
-			else {
-				return 0;
-			}
-		}
-		else {
-			return 0;
-		}
-	}
-
-	/* Now we need to find top level domain */
-	pos = start;
-	while (p >= start && ndots > 0) {
-		if (*p == '.') {
-			ndots--;
-			pos = p + 1;
-		}
-		else {
-			pos = p;
-		}
-
-		p--;
-	}
-
-	if ((ndots == 0 || p == start - 1) &&
-		url->tldlen < rspamd_url_host_unsafe(url) + url->hostlen - pos) {
-		url->tldshift = (pos - url->string);
-		url->tldlen = rspamd_url_host_unsafe(url) + url->hostlen - pos;
-	}
-
-	return 0;
-}
-
 static void
 rspamd_url_regen_from_inet_addr(struct rspamd_url *uri, const void *addr, int af,
 								rspamd_mempool_t *pool)
@@ -2449,10 +2707,17 @@ rspamd_url_parse(struct rspamd_url *uri,
 
 	if (uri->protocol & (PROTOCOL_HTTP | PROTOCOL_HTTPS | PROTOCOL_MAILTO | PROTOCOL_FTP | PROTOCOL_FILE)) {
 		/* Find TLD part */
-		if (url_scanner->search_trie_full) {
-			rspamd_multipattern_lookup(url_scanner->search_trie_full,
+		if (url_scanner->tld_trie) {
+			gsize tld_start, host_len;
+
+			if (rspamd_tld_trie_lookup(url_scanner->tld_trie,
 									   rspamd_url_host_unsafe(uri), uri->hostlen,
-									   rspamd_tld_trie_callback, uri, NULL);
+									   &tld_start, &host_len)) {
+				/* Trailing dot is not a part of the host */
+				uri->hostlen = host_len;
+				uri->tldshift = uri->hostshift + tld_start;
+				uri->tldlen = host_len - tld_start;
+			}
 		}
 
 		if (uri->tldlen == 0) {
@@ -2574,91 +2839,23 @@ rspamd_url_parse(struct rspamd_url *uri,
 	return URI_ERRNO_OK;
 }
 
-struct tld_trie_cbdata {
-	const gchar *begin;
-	gsize len;
-	rspamd_ftok_t *out;
-};
-
-static gint
-rspamd_tld_trie_find_callback(struct rspamd_multipattern *mp,
-							  guint strnum,
-							  gint match_start,
-							  gint match_pos,
-							  const gchar *text,
-							  gsize len,
-							  void *context)
-{
-	struct url_matcher *matcher;
-	const gchar *start, *pos, *p;
-	struct tld_trie_cbdata *cbdata = context;
-	gint ndots = 1;
-
-	matcher = &g_array_index(url_scanner->matchers_full, struct url_matcher,
-							 strnum);
-
-	if (matcher->flags & URL_MATCHER_FLAG_STAR_MATCH) {
-		/* Skip one more tld component */
-		ndots = 2;
-	}
-
-	pos = text + match_start;
-	p = pos - 1;
-	start = text;
-
-	if (*pos != '.' || match_pos != (gint) cbdata->len) {
-		/* Something weird has been found */
-		if (match_pos != (gint) cbdata->len - 1) {
-			/* Search more */
-			return 0;
-		}
-	}
-
-	/* Now we need to find top level domain */
-	pos = start;
-
-	while (p >= start && ndots > 0) {
-		if (*p == '.') {
-			ndots--;
-			pos = p + 1;
-		}
-		else {
-			pos = p;
-		}
-
-		p--;
-	}
-
-	if (ndots == 0 || p == start - 1) {
-		if (cbdata->begin + cbdata->len - pos > cbdata->out->len) {
-			cbdata->out->begin = pos;
-			cbdata->out->len = cbdata->begin + cbdata->len - pos;
-		}
-	}
-
-	return 0;
-}
-
 gboolean
 rspamd_url_find_tld(const gchar *in, gsize inlen, rspamd_ftok_t *out)
 {
-	struct tld_trie_cbdata cbdata;
+	gsize tld_start, host_len;
 
 	g_assert(in != NULL);
 	g_assert(out != NULL);
 	g_assert(url_scanner != NULL);
 
-	cbdata.begin = in;
-	cbdata.len = inlen;
-	cbdata.out = out;
 	out->len = 0;
 
-	if (url_scanner->search_trie_full) {
-		rspamd_multipattern_lookup(url_scanner->search_trie_full, in, inlen,
-								   rspamd_tld_trie_find_callback, &cbdata, NULL);
-	}
+	if (url_scanner->tld_trie &&
+		rspamd_tld_trie_lookup(url_scanner->tld_trie, in, inlen,
+							   &tld_start, &host_len)) {
+		out->begin = in + tld_start;
+		out->len = inlen - tld_start;
 
-	if (out->len > 0) {
 		return TRUE;
 	}
 
@@ -132,6 +132,11 @@ public:
 
 	auto load_cdb() -> tl::expected<bool, std::string>;
 	auto process_token(const rspamd_token_t *tok) const -> std::optional<float>;
+	/**
+	 * Looks up all tokens storing values for statfile `id`
+	 * @return true if any token has been found
+	 */
+	auto process_tokens(GPtrArray *tokens, int id) const -> bool;
 	constexpr auto is_spam() const -> bool
 	{
 		return st->stcf->is_spam;
@@ -270,6 +275,65 @@ auto ro_backend::process_token(const rspamd_token_t *tok) const -> std::optional
 	return std::nullopt;
 }
 
+/*
+ * Loads hash table slot for a key to the cache, so the following cdb_find
+ * does not wait for memory
+ */
+template<typename T>
+static inline auto
+cdb_prefetch_key(const struct cdb *cdb, T key) -> void
+{
+	auto hval = cdb_hash((const void *) &key, sizeof(key));
+	/* Table of contents is 256 pairs of (htab position, htab size) */
+	const auto *toc = cdb->cdb_mem + ((hval << 3) & 2047);
+	auto n = cdb_unpack(toc + 4);
+
+	if (n > 0) {
+		auto pos = cdb_unpack(toc) + (((hval >> 8) % n) << 3);
+
+		if (pos < cdb->cdb_fsize) {
+			__builtin_prefetch(cdb->cdb_mem + pos);
+		}
+	}
+}
+
+auto ro_backend::process_tokens(GPtrArray *tokens, int id) const -> bool
+{
+	/* How many tokens ahead hash table slots are prefetched */
+	constexpr auto prefetch_distance = 8u;
+	bool seen_values = false;
+
+	if (!loaded) {
+		for (auto i = 0u; i < tokens->len; i++) {
+			auto *tok = reinterpret_cast<rspamd_token_t *>(g_ptr_array_index(tokens, i));
+			tok->values[id] = 0;
+		}
+
+		return false;
+	}
+
+	for (auto i = 0u; i < tokens->len; i++) {
+		if (i + prefetch_distance < tokens->len) {
+			const auto *next = reinterpret_cast<rspamd_token_t *>(
+				g_ptr_array_index(tokens, i + prefetch_distance));
+			cdb_prefetch_key(db.get(), next->data);
+		}
+
+		auto *tok = reinterpret_cast<rspamd_token_t *>(g_ptr_array_index(tokens, i));
+		auto res = process_token(tok);
+
+		if (res) {
+			tok->values[id] = res.value();
+			seen_values = true;
+		}
+		else {
+			tok->values[id] = 0;
+		}
+	}
+
+	return seen_values;
+}
+
 auto open_cdb(struct rspamd_statfile *st) -> tl::expected<ro_backend, std::string>
 {
 	const char *path = nullptr;
@@ -393,24 +457,8 @@ rspamd_cdb_process_tokens(struct rspamd_task *task,
 						  gpointer runtime)
 {
 	auto *cdbp = CDB_FROM_RAW(runtime);
-	bool seen_values = false;
-
-	for (auto i = 0u; i < tokens->len; i++) {
-		rspamd_token_t *tok;
-		tok = reinterpret_cast<rspamd_token_t *>(g_ptr_array_index(tokens, i));
-
-		auto res = cdbp->process_token(tok);
-
-		if (res) {
-			tok->values[id] = res.value();
-			seen_values = true;
-		}
-		else {
-			tok->values[id] = 0;
-		}
-	}
 
-	if (seen_values) {
+	if (cdbp->process_tokens(tokens, id)) {
 		if (cdbp->is_spam()) {
 			task->flags |= RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS;
 		}
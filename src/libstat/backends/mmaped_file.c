@@ -17,7 +17,18 @@
 #include "stat_internal.h"
 #include "unix-std.h"
 
-#define CHAIN_LENGTH 128
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+/* Number of tokens in a single bucket */
+#define BUCKET_SLOTS 10
+/* Buckets are aligned to cache lines */
+#define BUCKET_ALIGN 64
+/* Number of buckets checked for a token: the primary one and the next one */
+#define BUCKET_PROBES 2
+/* How many tokens ahead statfile buckets are prefetched during lookups */
+#define PREFETCH_DISTANCE 8
 
 /* Section types */
 #define STATFILE_SECTION_COMMON 1
@@ -47,7 +58,7 @@ struct stat_file_section {
 };
 
 /**
- * Block of data in statfile
+ * Block of data in legacy (1.2) statfiles, used for conversion only
  */
 struct stat_file_block {
 	guint32 hash1; /**< hash1 (also acts as index)			*/
@@ -55,15 +66,32 @@ struct stat_file_block {
 	double value;  /**< double value                       */
 };
 
+/**
+ * Bucket of data in statfile, it occupies exactly one cache line. A token
+ * is placed to the bucket `hash1 % length` or to the next one if that
+ * bucket is full, so a lookup normally touches a single cache line.
+ * Tokens are identified by hash1 only, and their values are saturated to 16 bits
+ */
+struct stat_file_bucket {
+	guint32 fingerprints[BUCKET_SLOTS]; /**< hash1 of tokens, zero for free slots	*/
+	guint16 values[BUCKET_SLOTS];       /**< token values						*/
+	guint32 unused;
+};
+
+G_STATIC_ASSERT(sizeof(struct stat_file_bucket) == BUCKET_ALIGN);
+
 /**
  * Statistic file
  */
 struct stat_file {
 	struct stat_file_header header;   /**< header								*/
 	struct stat_file_section section; /**< first section						*/
-	struct stat_file_block blocks[1]; /**< first block of data				*/
 };
 
+/* Offset of the first bucket */
+#define STATFILE_DATA_OFFSET \
+	((sizeof(struct stat_file) + BUCKET_ALIGN - 1) & ~((gsize) BUCKET_ALIGN - 1))
+
 /**
  * Common view of statfile object
  */
@@ -76,8 +104,8 @@ typedef struct {
 	rspamd_mempool_t *pool;
 	gint fd;                              /**< descriptor							*/
 	void *map;                            /**< mmaped area						*/
-	off_t seek_pos;                       /**< current seek position				*/
-	struct stat_file_section cur_section; /**< current section					*/
+	off_t seek_pos;                       /**< offset of the first bucket			*/
+	struct stat_file_section cur_section; /**< current section (length in buckets)	*/
 	size_t len;                           /**< length of file(in bytes)			*/
 	struct rspamd_statfile_config *cf;
 } rspamd_mmaped_file_t;
@@ -85,13 +113,20 @@ typedef struct {
 
 #define RSPAMD_STATFILE_VERSION \
 	{                           \
-		'1', '2'                \
+		'1', '3'                \
 	}
+#define RSPAMD_STATFILE_LEGACY_VERSION \
+	{                                  \
+		'1', '2'                       \
+	}
+/* Legacy statfiles are kept with this suffix after conversion */
 #define BACKUP_SUFFIX ".old"
+/* Temporary copy of a statfile that is being resized */
+#define REINDEX_SUFFIX ".reindex"
 
 static void rspamd_mmaped_file_set_block_common(rspamd_mempool_t *pool,
 												rspamd_mmaped_file_t *file,
-												guint32 h1, guint32 h2, double value);
+												guint32 h1, double value);
 
 rspamd_mmaped_file_t *rspamd_mmaped_file_open(rspamd_mempool_t *pool,
 											  const gchar *filename, size_t size,
@@ -102,124 +137,151 @@ gint rspamd_mmaped_file_create(const gchar *filename, size_t size,
 gint rspamd_mmaped_file_close_file(rspamd_mempool_t *pool,
 								   rspamd_mmaped_file_t *file);
 
+static inline guint32
+rspamd_mmaped_file_fingerprint(guint32 h1)
+{
+	/* Zero is reserved for free slots */
+	return h1 != 0 ? h1 : 1;
+}
+
+static inline struct stat_file_bucket *
+rspamd_mmaped_file_bucket(rspamd_mmaped_file_t *file, guint64 n)
+{
+	return ((struct stat_file_bucket *) ((u_char *) file->map + file->seek_pos)) +
+		   (n % file->cur_section.length);
+}
+
+/*
+ * Returns bitmask of bucket slots that have the specified fingerprint
+ */
+static inline guint
+rspamd_mmaped_file_bucket_match(const struct stat_file_bucket *bucket, guint32 fp)
+{
+#if defined(__x86_64__)
+	const __m128i *p = (const __m128i *) bucket->fingerprints;
+	__m128i needle = _mm_set1_epi32((gint) fp);
+	guint mask;
+
+	/* The last load also reads values, they are masked out */
+	mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_load_si128(p), needle)));
+	mask |= _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_load_si128(p + 1), needle))) << 4;
+	mask |= _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_load_si128(p + 2), needle))) << 8;
+
+	return mask & ((1u << BUCKET_SLOTS) - 1);
+#else
+	guint i, mask = 0;
+
+	for (i = 0; i < BUCKET_SLOTS; i++) {
+		mask |= (guint) (bucket->fingerprints[i] == fp) << i;
+	}
+
+	return mask;
+#endif
+}
+
 double
 rspamd_mmaped_file_get_block(rspamd_mmaped_file_t *file,
-							 guint32 h1,
-							 guint32 h2)
+							 guint32 h1)
 {
-	struct stat_file_block *block;
-	guint i, blocknum;
-	u_char *c;
+	struct stat_file_bucket *bucket;
+	guint32 fp;
+	guint i, mask;
 
 	if (!file->map) {
 		return 0;
 	}
 
-	blocknum = h1 % file->cur_section.length;
-	c = (u_char *) file->map + file->seek_pos + blocknum * sizeof(struct stat_file_block);
-	block = (struct stat_file_block *) c;
+	fp = rspamd_mmaped_file_fingerprint(h1);
 
-	for (i = 0; i < CHAIN_LENGTH; i++) {
-		if (i + blocknum >= file->cur_section.length) {
-			break;
+	for (i = 0; i < BUCKET_PROBES; i++) {
+		bucket = rspamd_mmaped_file_bucket(file, (guint64) fp + i);
+		mask = rspamd_mmaped_file_bucket_match(bucket, fp);
+
+		if (mask) {
+			return bucket->values[__builtin_ctz(mask)];
 		}
-		if (block->hash1 == h1 && block->hash2 == h2) {
-			return block->value;
+
+		if (rspamd_mmaped_file_bucket_match(bucket, 0)) {
+			/* Slots are never freed, so a token cannot be in the next bucket */
+			break;
 		}
-		c += sizeof(struct stat_file_block);
-		block = (struct stat_file_block *) c;
 	}
 
-
 	return 0;
 }
 
 static void
 rspamd_mmaped_file_set_block_common(rspamd_mempool_t *pool,
 									rspamd_mmaped_file_t *file,
-									guint32 h1, guint32 h2, double value)
+									guint32 h1, double value)
 {
-	struct stat_file_block *block, *to_expire = NULL;
+	struct stat_file_bucket *bucket, *to_expire = NULL;
 	struct stat_file_header *header;
-	guint i, blocknum;
-	u_char *c;
-	double min = G_MAXDOUBLE;
+	guint i, j, mask, expire_slot = 0;
+	guint32 fp;
+	guint16 v, min = G_MAXUINT16;
 
 	if (!file->map) {
 		return;
 	}
 
-	blocknum = h1 % file->cur_section.length;
 	header = (struct stat_file_header *) file->map;
-	c = (u_char *) file->map + file->seek_pos + blocknum * sizeof(struct stat_file_block);
-	block = (struct stat_file_block *) c;
-
-	for (i = 0; i < CHAIN_LENGTH; i++) {
-		if (i + blocknum >= file->cur_section.length) {
-			/* Need to expire some block in chain */
-			msg_info_pool("chain %ud is full in statfile %s, starting expire",
-						  blocknum,
-						  file->filename);
-			break;
-		}
-		/* First try to find block in chain */
-		if (block->hash1 == h1 && block->hash2 == h2) {
-			msg_debug_pool("%s found existing block %ud in chain %ud, value %.2f",
-						   file->filename,
-						   i,
-						   blocknum,
-						   value);
-			block->value = value;
+	fp = rspamd_mmaped_file_fingerprint(h1);
+
+	if (value <= 0) {
+		v = 0;
+	}
+	else if (value >= G_MAXUINT16) {
+		v = G_MAXUINT16;
+	}
+	else {
+		v = (guint16) (value + 0.5);
+	}
+
+	for (i = 0; i < BUCKET_PROBES; i++) {
+		bucket = rspamd_mmaped_file_bucket(file, (guint64) fp + i);
+		/* First try to find token in a bucket */
+		mask = rspamd_mmaped_file_bucket_match(bucket, fp);
+
+		if (mask) {
+			bucket->values[__builtin_ctz(mask)] = v;
 			return;
 		}
-		/* Check whether we have a free block in chain */
-		if (block->hash1 == 0 && block->hash2 == 0) {
-			/* Write new block here */
-			msg_debug_pool("%s found free block %ud in chain %ud, set h1=%ud, h2=%ud",
-						   file->filename,
-						   i,
-						   blocknum,
-						   h1,
-						   h2);
-			block->hash1 = h1;
-			block->hash2 = h2;
-			block->value = value;
+
+		/* Check whether we have a free slot in a bucket */
+		mask = rspamd_mmaped_file_bucket_match(bucket, 0);
+
+		if (mask) {
+			j = __builtin_ctz(mask);
+			bucket->fingerprints[j] = fp;
+			bucket->values[j] = v;
 			header->used_blocks++;
 
 			return;
 		}
 
-		/* Expire block with minimum value otherwise */
-		if (block->value < min) {
-			to_expire = block;
-			min = block->value;
+		/* Expire slot with minimum value otherwise */
+		for (j = 0; j < BUCKET_SLOTS; j++) {
+			if (to_expire == NULL || bucket->values[j] < min) {
+				to_expire = bucket;
+				expire_slot = j;
+				min = bucket->values[j];
+			}
 		}
-		c += sizeof(struct stat_file_block);
-		block = (struct stat_file_block *) c;
 	}
 
-	/* Try expire some block */
-	if (to_expire) {
-		block = to_expire;
-	}
-	else {
-		/* Expire first block in chain */
-		c = (u_char *) file->map + file->seek_pos + blocknum * sizeof(struct stat_file_block);
-		block = (struct stat_file_block *) c;
-	}
-
-	block->hash1 = h1;
-	block->hash2 = h2;
-	block->value = value;
+	msg_debug_pool("buckets for %ud are full in statfile %s, expire value %ud",
+				   fp, file->filename, (guint) min);
+	to_expire->fingerprints[expire_slot] = fp;
+	to_expire->values[expire_slot] = v;
 }
 
 void rspamd_mmaped_file_set_block(rspamd_mempool_t *pool,
 								  rspamd_mmaped_file_t *file,
 								  guint32 h1,
-								  guint32 h2,
 								  double value)
 {
-	rspamd_mmaped_file_set_block_common(pool, file, h1, h2, value);
+	rspamd_mmaped_file_set_block_common(pool, file, h1, value);
 }
 
 gboolean
@@ -320,19 +382,23 @@ rspamd_mmaped_file_get_total(rspamd_mmaped_file_t *file)
 
 	/* If total blocks is 0 we have old version of header, so set total blocks correctly */
 	if (header->total_blocks == 0) {
-		header->total_blocks = file->cur_section.length;
+		header->total_blocks = file->cur_section.length * BUCKET_SLOTS;
 	}
 
 	return header->total_blocks;
 }
 
-/* Check whether specified file is statistic file and calculate its len in blocks */
+/*
+ * Check whether specified file is statistic file and calculate its len in buckets
+ * Returns 1 if the file has a legacy format and should be converted
+ */
 static gint
 rspamd_mmaped_file_check(rspamd_mempool_t *pool, rspamd_mmaped_file_t *file)
 {
 	struct stat_file *f;
 	gchar *c;
-	static gchar valid_version[] = RSPAMD_STATFILE_VERSION;
+	static gchar valid_version[] = RSPAMD_STATFILE_VERSION,
+				 legacy_version[] = RSPAMD_STATFILE_LEGACY_VERSION;
 
 
 	if (!file || !file->map) {
@@ -359,6 +425,11 @@ rspamd_mmaped_file_check(rspamd_mempool_t *pool, rspamd_mmaped_file_t *file)
 	if (*c == 1 && *(c + 1) == 0) {
 		return -1;
 	}
+	else if (memcmp(c, legacy_version, sizeof(legacy_version)) == 0) {
+		msg_info_pool("file %s has legacy format %c.%c and should be converted",
+					  file->filename, *c, *(c + 1));
+		return 1;
+	}
 	else if (memcmp(c, valid_version, sizeof(valid_version)) != 0) {
 		/* Unknown version */
 		msg_info_pool("file %s has invalid version %c.%c",
@@ -371,21 +442,79 @@ rspamd_mmaped_file_check(rspamd_mempool_t *pool, rspamd_mmaped_file_t *file)
 	/* Check first section and set new offset */
 	file->cur_section.code = f->section.code;
 	file->cur_section.length = f->section.length;
-	if (file->cur_section.length * sizeof(struct stat_file_block) >
-		file->len) {
+	if (file->cur_section.length == 0 ||
+		STATFILE_DATA_OFFSET + file->cur_section.length * sizeof(struct stat_file_bucket) >
+			file->len) {
 		msg_info_pool("file %s is truncated: %z, must be %z",
 					  file->filename,
 					  file->len,
-					  file->cur_section.length * sizeof(struct stat_file_block));
+					  STATFILE_DATA_OFFSET + file->cur_section.length * sizeof(struct stat_file_bucket));
 		return -1;
 	}
-	file->seek_pos = sizeof(struct stat_file) -
-					 sizeof(struct stat_file_block);
+	file->seek_pos = STATFILE_DATA_OFFSET;
 
 	return 0;
 }
 
+/*
+ * Copies tokens from a mapped statfile of the current or the legacy format
+ */
+static gboolean
+rspamd_mmaped_file_copy_tokens(rspamd_mempool_t *pool,
+							   rspamd_mmaped_file_t *dest,
+							   const u_char *map, gsize len)
+{
+	const struct stat_file *f = (const struct stat_file *) map;
+	const struct stat_file_block *block;
+	const struct stat_file_bucket *bucket;
+	static gchar valid_version[] = RSPAMD_STATFILE_VERSION,
+				 legacy_version[] = RSPAMD_STATFILE_LEGACY_VERSION;
+	gsize i, j, nelts;
+
+	if (len < sizeof(struct stat_file) || memcmp(f->header.magic, "rsd", 3) != 0) {
+		return FALSE;
+	}
+
+	if (memcmp(f->header.version, legacy_version, sizeof(legacy_version)) == 0) {
+		block = (const struct stat_file_block *) (map + sizeof(struct stat_file));
+		nelts = (len - sizeof(struct stat_file)) / sizeof(*block);
 
+		for (i = 0; i < nelts; i++) {
+			if (block[i].hash1 != 0 && block[i].value > 0) {
+				rspamd_mmaped_file_set_block_common(pool, dest, block[i].hash1,
+													block[i].value);
+			}
+		}
+	}
+	else if (memcmp(f->header.version, valid_version, sizeof(valid_version)) == 0 &&
+			 len > STATFILE_DATA_OFFSET) {
+		bucket = (const struct stat_file_bucket *) (map + STATFILE_DATA_OFFSET);
+		nelts = MIN(f->section.length, (len - STATFILE_DATA_OFFSET) / sizeof(*bucket));
+
+		for (i = 0; i < nelts; i++) {
+			for (j = 0; j < BUCKET_SLOTS; j++) {
+				if (bucket[i].fingerprints[j] != 0 && bucket[i].values[j] > 0) {
+					rspamd_mmaped_file_set_block_common(pool, dest,
+														bucket[i].fingerprints[j],
+														bucket[i].values[j]);
+				}
+			}
+		}
+	}
+	else {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+/*
+ * Moves file to a backup, creates a new file of the specified size in the
+ * current format and copies tokens from the backup (used for both resizing
+ * and conversion of legacy statfiles). Conversion drops hash2 and saturates
+ * values, so the backup of a legacy file is kept.
+ */
 static rspamd_mmaped_file_t *
 rspamd_mmaped_file_reindex(rspamd_mempool_t *pool,
 						   const gchar *filename,
@@ -393,19 +522,18 @@ rspamd_mmaped_file_reindex(rspamd_mempool_t *pool,
 						   size_t size,
 						   struct rspamd_statfile_config *stcf)
 {
-	gchar *backup, *lock;
+	gchar *backup, *old, *lock;
 	gint fd, lock_fd;
-	rspamd_mmaped_file_t *new, *old = NULL;
-	u_char *map, *pos;
-	struct stat_file_block *block;
+	rspamd_mmaped_file_t *new;
+	u_char *map;
 	struct stat_file_header *header, *nh;
+	static gchar legacy_version[] = RSPAMD_STATFILE_LEGACY_VERSION;
+	gboolean legacy;
 	struct timespec sleep_ts = {
 		.tv_sec = 0,
 		.tv_nsec = 1000000};
 
-	if (size <
-		sizeof(struct stat_file_header) + sizeof(struct stat_file_section) +
-			sizeof(block)) {
+	if (size < STATFILE_DATA_OFFSET + sizeof(struct stat_file_bucket)) {
 		msg_err_pool("file %s is too small to carry any statistic: %z",
 					 filename,
 					 size);
@@ -430,7 +558,7 @@ rspamd_mmaped_file_reindex(rspamd_mempool_t *pool,
 		}
 	}
 
-	backup = g_strconcat(filename, ".old", NULL);
+	backup = g_strconcat(filename, REINDEX_SUFFIX, NULL);
 	if (rename(filename, backup) == -1) {
 		msg_err_pool("cannot rename %s to %s: %s", filename, backup, strerror(errno));
 		g_free(backup);
@@ -441,13 +569,6 @@ rspamd_mmaped_file_reindex(rspamd_mempool_t *pool,
 		return NULL;
 	}
 
-	old = rspamd_mmaped_file_open(pool, backup, old_size, stcf);
-
-	if (old == NULL) {
-		msg_warn_pool("old file %s is invalid mmapped file, just move it",
-					  backup);
-	}
-
 	/* We need to release our lock here */
 	unlink(lock);
 	close(lock_fd);
@@ -456,66 +577,72 @@ rspamd_mmaped_file_reindex(rspamd_mempool_t *pool,
 	/* Now create new file with required size */
 	if (rspamd_mmaped_file_create(filename, size, stcf, pool) != 0) {
 		msg_err_pool("cannot create new file");
-		rspamd_mmaped_file_close(old);
 		g_free(backup);
 
 		return NULL;
 	}
 
 	new = rspamd_mmaped_file_open(pool, filename, size, stcf);
+	fd = open(backup, O_RDONLY);
 
-	if (old) {
-		/* Now open new file and start copying */
-		fd = open(backup, O_RDONLY);
-		if (fd == -1 || new == NULL) {
-			if (fd != -1) {
-				close(fd);
-			}
-
-			msg_err_pool("cannot open file: %s", strerror(errno));
-			rspamd_mmaped_file_close(old);
-			g_free(backup);
-			return NULL;
+	if (fd == -1 || new == NULL) {
+		if (fd != -1) {
+			close(fd);
 		}
 
+		msg_err_pool("cannot open file: %s", strerror(errno));
+		g_free(backup);
 
-		/* Now start reading blocks from old statfile */
-		if ((map =
-				 mmap(NULL, old_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
-			msg_err_pool("cannot mmap file: %s", strerror(errno));
-			close(fd);
-			rspamd_mmaped_file_close(old);
-			g_free(backup);
-			return NULL;
-		}
+		return new;
+	}
 
-		pos = map + (sizeof(struct stat_file) - sizeof(struct stat_file_block));
+	/* Now start reading tokens from old statfile */
+	if ((map =
+			 mmap(NULL, old_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		msg_err_pool("cannot mmap file: %s", strerror(errno));
+		close(fd);
+		g_free(backup);
 
-		if (pos - map < (gssize) old_size) {
-			while ((gssize) old_size - (pos - map) >= (gssize) sizeof(struct stat_file_block)) {
-				block = (struct stat_file_block *) pos;
-				if (block->hash1 != 0 && block->value != 0) {
-					rspamd_mmaped_file_set_block_common(pool,
-														new, block->hash1,
-														block->hash2, block->value);
-				}
-				pos += sizeof(block);
-			}
-		}
+		return new;
+	}
 
+	if (rspamd_mmaped_file_copy_tokens(pool, new, map, old_size)) {
 		header = (struct stat_file_header *) map;
 		rspamd_mmaped_file_set_revision(new, header->revision, header->rev_time);
 		nh = new->map;
 		/* Copy tokenizer configuration */
 		memcpy(nh->unused, header->unused, sizeof(header->unused));
 		nh->tokenizer_conf_len = header->tokenizer_conf_len;
+		msg_info_pool("copied %L tokens from %s to %s", (gint64) nh->used_blocks,
+					  backup, filename);
+	}
+	else {
+		msg_warn_pool("old file %s is invalid mmapped file, just move it",
+					  backup);
+	}
 
-		munmap(map, old_size);
-		close(fd);
-		rspamd_mmaped_file_close_file(pool, old);
+	legacy = old_size >= sizeof(struct stat_file_header) &&
+			 memcmp(((struct stat_file_header *) map)->version, legacy_version,
+					sizeof(legacy_version)) == 0;
+	munmap(map, old_size);
+	close(fd);
+
+	if (legacy) {
+		old = g_strconcat(filename, BACKUP_SUFFIX, NULL);
+
+		if (rename(backup, old) == -1) {
+			msg_err_pool("cannot rename %s to %s: %s", backup, old, strerror(errno));
+		}
+		else {
+			msg_info_pool("legacy statfile %s is kept in %s", filename, old);
+		}
+
+		g_free(old);
+	}
+	else {
+		unlink(backup);
 	}
 
-	unlink(backup);
 	g_free(backup);
 
 	return new;
@@ -560,7 +687,7 @@ rspamd_mmaped_file_open(rspamd_mempool_t *pool,
 	struct stat st;
 	rspamd_mmaped_file_t *new_file;
 	gchar *lock;
-	gint lock_fd;
+	gint lock_fd, ret;
 
 	lock = g_strconcat(filename, ".lock", NULL);
 	lock_fd = open(lock, O_WRONLY | O_CREAT | O_EXCL, 00600);
@@ -581,12 +708,12 @@ rspamd_mmaped_file_open(rspamd_mempool_t *pool,
 		return NULL;
 	}
 
-	if (labs((glong) size - st.st_size) > (long) sizeof(struct stat_file) * 2 && size > sizeof(struct stat_file)) {
+	if (labs((glong) size - st.st_size) > (long) STATFILE_DATA_OFFSET * 2 && size > STATFILE_DATA_OFFSET) {
 		msg_warn_pool("need to reindex statfile old size: %Hz, new size: %Hz",
 					  (size_t) st.st_size, size);
 		return rspamd_mmaped_file_reindex(pool, filename, st.st_size, size, stcf);
 	}
-	else if (size < sizeof(struct stat_file)) {
+	else if (size < STATFILE_DATA_OFFSET) {
 		msg_err_pool("requested to shrink statfile to %Hz but it is too small",
 					 size);
 	}
@@ -629,11 +756,19 @@ rspamd_mmaped_file_open(rspamd_mempool_t *pool,
 		return NULL;
 	}
 
-	if (rspamd_mmaped_file_check(pool, new_file) == -1) {
+	ret = rspamd_mmaped_file_check(pool, new_file);
+
+	if (ret != 0) {
 		close(new_file->fd);
 		rspamd_file_unlock(new_file->fd, FALSE);
 		munmap(new_file->map, st.st_size);
 		g_free(new_file);
+
+		if (ret == 1) {
+			/* Convert legacy file keeping its size */
+			return rspamd_mmaped_file_reindex(pool, filename, st.st_size, size, stcf);
+		}
+
 		return NULL;
 	}
 
@@ -681,7 +816,7 @@ gint rspamd_mmaped_file_create(const gchar *filename,
 	struct stat_file_section section = {
 		.code = STATFILE_SECTION_COMMON,
 	};
-	struct stat_file_block block = {0, 0, 0};
+	struct stat_file_bucket bucket;
 	struct rspamd_stat_tokenizer *tokenizer;
 	gint fd, lock_fd;
 	guint buflen = 0, nblocks;
@@ -693,15 +828,15 @@ gint rspamd_mmaped_file_create(const gchar *filename,
 		.tv_sec = 0,
 		.tv_nsec = 1000000};
 
-	if (size <
-		sizeof(struct stat_file_header) + sizeof(struct stat_file_section) +
-			sizeof(block)) {
+	if (size < STATFILE_DATA_OFFSET + sizeof(bucket)) {
 		msg_err_pool("file %s is too small to carry any statistic: %z",
 					 filename,
 					 size);
 		return -1;
 	}
 
+	memset(&bucket, 0, sizeof(bucket));
+
 	lock = g_strconcat(filename, ".lock", NULL);
 	lock_fd = open(lock, O_WRONLY | O_CREAT | O_EXCL, 00600);
 
@@ -729,11 +864,8 @@ gint rspamd_mmaped_file_create(const gchar *filename,
 create:
 
 	msg_debug_pool("create statfile %s of size %l", filename, (long) size);
-	nblocks =
-		(size - sizeof(struct stat_file_header) -
-		 sizeof(struct stat_file_section)) /
-		sizeof(struct stat_file_block);
-	header.total_blocks = nblocks;
+	nblocks = (size - STATFILE_DATA_OFFSET) / sizeof(struct stat_file_bucket);
+	header.total_blocks = (guint64) nblocks * BUCKET_SLOTS;
 
 	if ((fd =
 			 open(filename, O_RDWR | O_TRUNC | O_CREAT, S_IWUSR | S_IRUSR)) == -1) {
@@ -750,7 +882,7 @@ create:
 
 	rspamd_fallocate(fd,
 					 0,
-					 sizeof(header) + sizeof(section) + sizeof(block) * nblocks);
+					 STATFILE_DATA_OFFSET + sizeof(bucket) * nblocks);
 
 	header.create_time = (guint64) time(NULL);
 	g_assert(stcf->clcf != NULL);
@@ -776,7 +908,9 @@ create:
 	}
 
 	section.length = (guint64) nblocks;
-	if (write(fd, &section, sizeof(section)) == -1) {
+	if (write(fd, &section, sizeof(section)) == -1 ||
+		/* Align buckets to cache lines */
+		write(fd, &bucket, STATFILE_DATA_OFFSET - sizeof(header) - sizeof(section)) == -1) {
 		msg_info_pool("cannot write section header to file %s, error %d, %s",
 					  filename,
 					  errno,
@@ -789,9 +923,9 @@ create:
 		return -1;
 	}
 
-	/* Buffer for write 256 blocks at once */
+	/* Buffer for write 256 buckets at once */
 	if (nblocks > 256) {
-		buflen = sizeof(block) * 256;
+		buflen = sizeof(bucket) * 256;
 		buf = g_malloc0(buflen);
 	}
 
@@ -814,7 +948,7 @@ create:
 			nblocks -= 256;
 		}
 		else {
-			if (write(fd, &block, sizeof(block)) == -1) {
+			if (write(fd, &bucket, sizeof(bucket)) == -1) {
 				msg_info_pool("cannot write block to file %s, error %d, %s",
 							  filename,
 							  errno,
@@ -944,7 +1078,7 @@ rspamd_mmaped_file_process_tokens(struct rspamd_task *task, GPtrArray *tokens,
 								  gpointer p)
 {
 	rspamd_mmaped_file_t *mf = p;
-	guint32 h1, h2;
+	guint32 h1;
 	rspamd_token_t *tok;
 	guint i;
 
@@ -952,10 +1086,20 @@ rspamd_mmaped_file_process_tokens(struct rspamd_task *task, GPtrArray *tokens,
 	g_assert(p != NULL);
 
 	for (i = 0; i < tokens->len; i++) {
+		/*
+		 * Lookups are random accesses to a large map, so we start loading
+		 * blocks for the next tokens while processing the current one
+		 */
+		if (mf->map && i + PREFETCH_DISTANCE < tokens->len) {
+			tok = g_ptr_array_index(tokens, i + PREFETCH_DISTANCE);
+			memcpy(&h1, (guchar *) &tok->data, sizeof(h1));
+			__builtin_prefetch(rspamd_mmaped_file_bucket(mf,
+														 rspamd_mmaped_file_fingerprint(h1)));
+		}
+
 		tok = g_ptr_array_index(tokens, i);
 		memcpy(&h1, (guchar *) &tok->data, sizeof(h1));
-		memcpy(&h2, ((guchar *) &tok->data) + sizeof(h1), sizeof(h2));
-		tok->values[id] = rspamd_mmaped_file_get_block(mf, h1, h2);
+		tok->values[id] = rspamd_mmaped_file_get_block(mf, h1);
 	}
 
 	if (mf->cf->is_spam) {
@@ -974,7 +1118,7 @@ rspamd_mmaped_file_learn_tokens(struct rspamd_task *task, GPtrArray *tokens,
 								gpointer p)
 {
 	rspamd_mmaped_file_t *mf = p;
-	guint32 h1, h2;
+	guint32 h1;
 	rspamd_token_t *tok;
 	guint i;
 
@@ -984,9 +1128,7 @@ rspamd_mmaped_file_learn_tokens(struct rspamd_task *task, GPtrArray *tokens,
 	for (i = 0; i < tokens->len; i++) {
 		tok = g_ptr_array_index(tokens, i);
 		memcpy(&h1, (guchar *) &tok->data, sizeof(h1));
-		memcpy(&h2, ((guchar *) &tok->data) + sizeof(h1), sizeof(h2));
-		rspamd_mmaped_file_set_block(task->task_pool, mf, h1, h2,
-									 tok->values[id]);
+		rspamd_mmaped_file_set_block(task->task_pool, mf, h1, tok->values[id]);
 	}
 
 	return TRUE;
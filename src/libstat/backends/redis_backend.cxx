@@ -50,6 +50,8 @@ struct redis_stat_ctx {
 	bool enable_users = false;
 	bool store_tokens = false;
 	bool enable_signatures = false;
+	/* Maximum tokens per classify request, 0 means no splitting */
+	unsigned token_batch = 0;
 	int cbref_user = -1;
 
 	int cbref_classify = -1;
@@ -151,6 +153,10 @@ public:
 		}
 
 		for (auto [idx, val]: *results) {
+			if (idx < 1 || idx > tokens->len) {
+				continue;
+			}
+
 			tok = (rspamd_token_t *) g_ptr_array_index(tokens, idx - 1);
 			tok->values[id] = val;
 		}
@@ -510,6 +516,14 @@ rspamd_redis_parse_classifier_opts(struct redis_stat_ctx *backend,
 	else {
 		backend->enable_signatures = FALSE;
 	}
+
+	elt = ucl_object_lookup(classifier_obj, "token_batch");
+	if (elt && ucl_object_type(elt) == UCL_INT && ucl_object_toint(elt) > 0) {
+		backend->token_batch = ucl_object_toint(elt);
+	}
+	else {
+		backend->token_batch = 0;
+	}
 }
 
 gpointer
@@ -705,10 +719,11 @@ msgpack_str_len(std::size_t len) -> std::size_t
 }
 
 /*
- * Serialise stat tokens to message pack
+ * Serialise stat tokens in range [start, start + count) to message pack
  */
 static char *
-rspamd_redis_serialize_tokens(struct rspamd_task *task, const gchar *prefix, GPtrArray *tokens, gsize *ser_len)
+rspamd_redis_serialize_tokens(struct rspamd_task *task, const gchar *prefix, GPtrArray *tokens,
+							  guint start, guint count, gsize *ser_len)
 {
 	/* Each token is int64_t that requires 10 bytes (2 int32_t) + 4 bytes array len + 1 byte array magic */
 	char max_int64_str[] = "18446744073709551615";
@@ -717,7 +732,7 @@ rspamd_redis_serialize_tokens(struct rspamd_task *task, const gchar *prefix, GPt
 	rspamd_token_t *tok;
 
 	/* Calculate required length */
-	req_len += tokens->len * (msgpack_str_len(sizeof(max_int64_str) + prefix_len) + 1);
+	req_len += count * (msgpack_str_len(sizeof(max_int64_str) + prefix_len) + 1);
 
 	auto *buf = (gchar *) rspamd_mempool_alloc(task->task_pool, req_len);
 	auto *p = buf;
@@ -725,18 +740,17 @@ rspamd_redis_serialize_tokens(struct rspamd_task *task, const gchar *prefix, GPt
 	/* Array */
 	*p++ = (gchar) 0xdd;
 	/* Length in big-endian (4 bytes) */
-	*p++ = (gchar) ((tokens->len >> 24) & 0xff);
-	*p++ = (gchar) ((tokens->len >> 16) & 0xff);
-	*p++ = (gchar) ((tokens->len >> 8) & 0xff);
-	*p++ = (gchar) (tokens->len & 0xff);
+	*p++ = (gchar) ((count >> 24) & 0xff);
+	*p++ = (gchar) ((count >> 16) & 0xff);
+	*p++ = (gchar) ((count >> 8) & 0xff);
+	*p++ = (gchar) (count & 0xff);
 
 
-	int i;
 	auto numbuf_len = sizeof(max_int64_str) + prefix_len + 1;
 	auto *numbuf = (char *) g_alloca(numbuf_len);
 
-	PTR_ARRAY_FOREACH(tokens, i, tok)
-	{
+	for (auto i = start; i < start + count; i++) {
+		tok = (rspamd_token_t *) g_ptr_array_index(tokens, i);
 		std::size_t r = rspamd_snprintf(numbuf, numbuf_len, "%s_%uL", prefix, tok->data);
 		auto shift = msgpack_emit_str({numbuf, r}, p);
 		p += shift;
@@ -826,8 +840,8 @@ rspamd_redis_classified(lua_State *L)
 		/* Indexes:
 		 * 3 - learned_ham (int)
 		 * 4 - learned_spam (int)
-		 * 5 - ham_tokens (pair<int, int>)
-		 * 6 - spam_tokens (pair<int, int>)
+		 * 5 - ham_tokens (flat array of index, value)
+		 * 6 - spam_tokens (flat array of index, value)
 		 */
 
 		/*
@@ -839,16 +853,19 @@ rspamd_redis_classified(lua_State *L)
 
 			res = new redis_stat_runtime<float>::result_type();
 
-			for (lua_pushnil(L); lua_next(L, tokens_pos); lua_pop(L, 1)) {
-				lua_rawgeti(L, -1, 1);
-				auto idx = lua_tointeger(L, -1);
-				lua_pop(L, 1);
+			if (lua_type(L, tokens_pos) == LUA_TTABLE) {
+				auto nelts = rspamd_lua_table_size(L, tokens_pos);
+				res->reserve(nelts / 2);
 
-				lua_rawgeti(L, -1, 2);
-				auto value = lua_tonumber(L, -1);
-				lua_pop(L, 1);
+				for (guint i = 1; i < nelts; i += 2) {
+					lua_rawgeti(L, tokens_pos, i);
+					auto idx = lua_tointeger(L, -1);
+					lua_rawgeti(L, tokens_pos, i + 1);
+					auto value = lua_tonumber(L, -1);
+					lua_pop(L, 2);
 
-				res->emplace_back(idx, value);
+					res->emplace_back(idx, value);
+				}
 			}
 
 			rt->set_results(res);
@@ -918,7 +935,7 @@ rspamd_redis_process_tokens(struct rspamd_task *task,
 	}
 
 	gsize tokens_len;
-	gchar *tokens_buf = rspamd_redis_serialize_tokens(task, rt->redis_object_expanded, tokens, &tokens_len);
+	gchar *tokens_buf;
 	rt->id = id;
 
 	lua_pushcfunction(L, &rspamd_lua_traceback);
@@ -930,7 +947,31 @@ rspamd_redis_process_tokens(struct rspamd_task *task,
 	lua_pushstring(L, rt->redis_object_expanded);
 	lua_pushinteger(L, id);
 	lua_pushboolean(L, rt->stcf->is_spam);
-	lua_new_text(L, tokens_buf, tokens_len, false);
+
+	auto batch = rt->ctx->token_batch;
+
+	if (batch == 0 || tokens->len <= batch) {
+		tokens_buf = rspamd_redis_serialize_tokens(task, rt->redis_object_expanded, tokens,
+												   0, tokens->len, &tokens_len);
+		lua_new_text(L, tokens_buf, tokens_len, false);
+	}
+	else {
+		/*
+		 * Split tokens into batches that are sent in parallel, the script
+		 * indexes are local to a batch, so Lua code adjusts them on merge
+		 */
+		lua_createtable(L, (tokens->len + batch - 1) / batch, 0);
+
+		for (guint start = 0, nbatch = 1; start < tokens->len; start += batch, nbatch++) {
+			auto count = MIN(batch, tokens->len - start);
+			tokens_buf = rspamd_redis_serialize_tokens(task, rt->redis_object_expanded, tokens,
+													   start, count, &tokens_len);
+			lua_new_text(L, tokens_buf, tokens_len, false);
+			lua_rawseti(L, -2, nbatch);
+		}
+
+		msg_debug_bayes("split %d tokens into batches of %d", tokens->len, batch);
+	}
 
 	/* Store rt in random cookie */
 	char *cookie = (char *) rspamd_mempool_alloc(task->task_pool, 16);
@@ -1008,7 +1049,8 @@ rspamd_redis_learn_tokens(struct rspamd_task *task,
 	}
 
 	gsize tokens_len;
-	gchar *tokens_buf = rspamd_redis_serialize_tokens(task, rt->redis_object_expanded, tokens, &tokens_len);
+	gchar *tokens_buf = rspamd_redis_serialize_tokens(task, rt->redis_object_expanded, tokens,
+													  0, tokens->len, &tokens_len);
 
 	rt->id = id;
 
@@ -98,11 +98,27 @@ struct bayes_task_closure {
 	double spam_prob;
 	gdouble meta_skip_prob;
 	guint64 processed_tokens;
-	guint64 total_hits;
 	guint64 text_tokens;
 	struct rspamd_task *task;
 };
 
+/*
+ * Tokens are scored in a columnar layout: counts from all statfiles are
+ * gathered into plain arrays first, so probabilities are computed by
+ * branchless loops that could be vectorized by a compiler
+ */
+struct bayes_token_columns {
+	rspamd_token_t **tokens;
+	gdouble *spam_counts;
+	gdouble *ham_counts;
+	gdouble *feature_weights;
+	guint8 *is_text;
+	/* Combined probabilities, 1.0 for ignored tokens */
+	gdouble *spam_probs;
+	gdouble *ham_probs;
+	guint len;
+};
+
 /*
  * Mathematically we use pow(complexity, complexity), where complexity is the
  * window index
@@ -110,144 +126,209 @@ struct bayes_task_closure {
 static const double feature_weight[] = {0, 3125, 256, 27, 1, 0, 0, 0};
 
 #define PROB_COMBINE(prob, cnt, weight, assumed) (((weight) * (assumed) + (cnt) * (prob)) / ((weight) + (cnt)))
+/* Number of probabilities multiplied before taking a logarithm */
+#define BAYES_LOG_BLOCK 16
+
+static void
+bayes_columns_init(struct bayes_token_columns *cols, guint ntokens)
+{
+	cols->tokens = g_new(rspamd_token_t *, ntokens);
+	cols->spam_counts = g_new(gdouble, ntokens);
+	cols->ham_counts = g_new(gdouble, ntokens);
+	cols->feature_weights = g_new(gdouble, ntokens);
+	cols->is_text = g_new(guint8, ntokens);
+	cols->spam_probs = g_new(gdouble, ntokens);
+	cols->ham_probs = g_new(gdouble, ntokens);
+	cols->len = 0;
+}
+
+static void
+bayes_columns_free(struct bayes_token_columns *cols)
+{
+	g_free(cols->tokens);
+	g_free(cols->spam_counts);
+	g_free(cols->ham_counts);
+	g_free(cols->feature_weights);
+	g_free(cols->is_text);
+	g_free(cols->spam_probs);
+	g_free(cols->ham_probs);
+}
+
 /*
- * In this callback we calculate local probabilities for tokens
+ * Collects counts of tokens that are not skipped into columns
  */
 static void
-bayes_classify_token(struct rspamd_classifier *ctx,
-					 rspamd_token_t *tok, struct bayes_task_closure *cl)
+bayes_columns_gather(struct rspamd_classifier *ctx, GPtrArray *tokens,
+					 struct bayes_task_closure *cl,
+					 struct bayes_token_columns *cols)
 {
-	guint i;
-	gint id;
-	guint spam_count = 0, ham_count = 0, total_count = 0;
+	struct rspamd_task *task = cl->task;
 	struct rspamd_statfile *st;
-	struct rspamd_task *task;
-	const gchar *token_type = "txt";
-	double spam_prob, spam_freq, ham_freq, bayes_spam_prob, bayes_ham_prob,
-		ham_prob, fw, w, val;
-
-	task = cl->task;
-
-#if 0
-	if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_LUA_META) {
-		/* Ignore lua metatokens for now */
-		return;
-	}
-#endif
-
-	if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_META && cl->meta_skip_prob > 0) {
-		val = rspamd_random_double_fast();
-
-		if (val <= cl->meta_skip_prob) {
-			if (tok->t1 && tok->t2) {
-				msg_debug_bayes(
-					"token(meta) %uL <%*s:%*s> probabilistically skipped",
-					tok->data,
-					(int) tok->t1->original.len, tok->t1->original.begin,
-					(int) tok->t2->original.len, tok->t2->original.begin);
-			}
+	rspamd_token_t *tok;
+	guint i, j, n, nst = ctx->statfiles_ids->len;
+	gint *ids;
+	gboolean *is_spam;
+	gdouble val, spam_count, ham_count;
 
-			return;
-		}
-	}
+	ids = g_alloca(sizeof(*ids) * nst);
+	is_spam = g_alloca(sizeof(*is_spam) * nst);
 
-	for (i = 0; i < ctx->statfiles_ids->len; i++) {
-		id = g_array_index(ctx->statfiles_ids, gint, i);
-		st = g_ptr_array_index(ctx->ctx->statfiles, id);
+	for (j = 0; j < nst; j++) {
+		ids[j] = g_array_index(ctx->statfiles_ids, gint, j);
+		st = g_ptr_array_index(ctx->ctx->statfiles, ids[j]);
 		g_assert(st != NULL);
-		val = tok->values[id];
-
-		if (val > 0) {
-			if (st->stcf->is_spam) {
-				spam_count += val;
-			}
-			else {
-				ham_count += val;
-			}
-
-			total_count += val;
-			cl->total_hits += val;
-		}
+		is_spam[j] = st->stcf->is_spam;
 	}
 
-	/* Probability for this token */
-	if (total_count >= ctx->cfg->min_token_hits) {
-		spam_freq = ((double) spam_count / MAX(1., (double) ctx->spam_learns));
-		ham_freq = ((double) ham_count / MAX(1., (double) ctx->ham_learns));
-		spam_prob = spam_freq / (spam_freq + ham_freq);
-		ham_prob = ham_freq / (spam_freq + ham_freq);
+	for (i = 0; i < tokens->len; i++) {
+		tok = g_ptr_array_index(tokens, i);
 
-		if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_UNIGRAM) {
-			fw = 1.0;
-		}
-		else {
-			fw = feature_weight[tok->window_idx %
-								G_N_ELEMENTS(feature_weight)];
-		}
+		if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_META && cl->meta_skip_prob > 0) {
+			val = rspamd_random_double_fast();
 
+			if (val <= cl->meta_skip_prob) {
+				if (tok->t1 && tok->t2) {
+					msg_debug_bayes(
+						"token(meta) %uL <%*s:%*s> probabilistically skipped",
+						tok->data,
+						(int) tok->t1->original.len, tok->t1->original.begin,
+						(int) tok->t2->original.len, tok->t2->original.begin);
+				}
 
-		w = (fw * total_count) / (1.0 + fw * total_count);
+				continue;
+			}
+		}
 
-		bayes_spam_prob = PROB_COMBINE(spam_prob, total_count, w, 0.5);
+		spam_count = 0;
+		ham_count = 0;
 
-		if ((bayes_spam_prob > 0.5 && bayes_spam_prob < 0.5 + ctx->cfg->min_prob_strength) ||
-			(bayes_spam_prob < 0.5 && bayes_spam_prob > 0.5 - ctx->cfg->min_prob_strength)) {
-			msg_debug_bayes(
-				"token %uL <%*s:%*s> skipped, probability not in range: %f",
-				tok->data,
-				(int) tok->t1->stemmed.len, tok->t1->stemmed.begin,
-				(int) tok->t2->stemmed.len, tok->t2->stemmed.begin,
-				bayes_spam_prob);
+		for (j = 0; j < nst; j++) {
+			val = tok->values[ids[j]];
 
-			return;
+			if (val > 0) {
+				if (is_spam[j]) {
+					spam_count += val;
+				}
+				else {
+					ham_count += val;
+				}
+			}
 		}
 
-		bayes_ham_prob = PROB_COMBINE(ham_prob, total_count, w, 0.5);
-
-		cl->spam_prob += log(bayes_spam_prob);
-		cl->ham_prob += log(bayes_ham_prob);
-		cl->processed_tokens++;
+		n = cols->len++;
+		cols->tokens[n] = tok;
+		cols->spam_counts[n] = spam_count;
+		cols->ham_counts[n] = ham_count;
+		cols->is_text[n] = !(tok->flags & RSPAMD_STAT_TOKEN_FLAG_META);
 
-		if (!(tok->flags & RSPAMD_STAT_TOKEN_FLAG_META)) {
-			cl->text_tokens++;
+		if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_UNIGRAM) {
+			cols->feature_weights[n] = 1.0;
 		}
 		else {
-			token_type = "meta";
+			cols->feature_weights[n] = feature_weight[tok->window_idx %
+													  G_N_ELEMENTS(feature_weight)];
 		}
+	}
+}
+
+static void
+bayes_columns_debug(struct bayes_token_columns *cols, struct bayes_task_closure *cl)
+{
+	struct rspamd_task *task = cl->task;
+	rspamd_token_t *tok;
+	guint i;
+
+	for (i = 0; i < cols->len; i++) {
+		tok = cols->tokens[i];
 
 		if (tok->t1 && tok->t2) {
-			msg_debug_bayes("token(%s) %uL <%*s:%*s>: weight: %f, cf: %f, "
-							"total_count: %ud, "
-							"spam_count: %ud, ham_count: %ud,"
-							"spam_prob: %.3f, ham_prob: %.3f, "
-							"bayes_spam_prob: %.3f, bayes_ham_prob: %.3f, "
-							"current spam probability: %.3f, current ham probability: %.3f",
-							token_type,
+			msg_debug_bayes("token(%s) %uL <%*s:%*s>: weight: %f, "
+							"spam_count: %.0f, ham_count: %.0f, "
+							"bayes_spam_prob: %.3f, bayes_ham_prob: %.3f%s",
+							cols->is_text[i] ? "txt" : "meta",
 							tok->data,
 							(int) tok->t1->stemmed.len, tok->t1->stemmed.begin,
 							(int) tok->t2->stemmed.len, tok->t2->stemmed.begin,
-							fw, w, total_count, spam_count, ham_count,
-							spam_prob, ham_prob,
-							bayes_spam_prob, bayes_ham_prob,
-							cl->spam_prob, cl->ham_prob);
+							cols->feature_weights[i],
+							cols->spam_counts[i], cols->ham_counts[i],
+							cols->spam_probs[i], cols->ham_probs[i],
+							cols->spam_probs[i] == 1.0 ? " (skipped)" : "");
 		}
 		else {
-			msg_debug_bayes("token(%s) %uL <?:?>: weight: %f, cf: %f, "
-							"total_count: %ud, "
-							"spam_count: %ud, ham_count: %ud,"
-							"spam_prob: %.3f, ham_prob: %.3f, "
-							"bayes_spam_prob: %.3f, bayes_ham_prob: %.3f, "
-							"current spam probability: %.3f, current ham probability: %.3f",
-							token_type,
+			msg_debug_bayes("token(%s) %uL <?:?>: weight: %f, "
+							"spam_count: %.0f, ham_count: %.0f, "
+							"bayes_spam_prob: %.3f, bayes_ham_prob: %.3f%s",
+							cols->is_text[i] ? "txt" : "meta",
 							tok->data,
-							fw, w, total_count, spam_count, ham_count,
-							spam_prob, ham_prob,
-							bayes_spam_prob, bayes_ham_prob,
-							cl->spam_prob, cl->ham_prob);
+							cols->feature_weights[i],
+							cols->spam_counts[i], cols->ham_counts[i],
+							cols->spam_probs[i], cols->ham_probs[i],
+							cols->spam_probs[i] == 1.0 ? " (skipped)" : "");
 		}
 	}
 }
 
+/*
+ * Calculates local probabilities for tokens and accumulates their logarithms
+ */
+static void
+bayes_columns_score(struct rspamd_classifier *ctx,
+					struct bayes_token_columns *cols,
+					struct bayes_task_closure *cl)
+{
+	const gdouble min_hits = ctx->cfg->min_token_hits,
+				  min_strength = ctx->cfg->min_prob_strength,
+				  spam_norm = 1.0 / MAX(1., (gdouble) ctx->spam_learns),
+				  ham_norm = 1.0 / MAX(1., (gdouble) ctx->ham_learns);
+	const gdouble *spam_counts = cols->spam_counts, *ham_counts = cols->ham_counts,
+				  *weights = cols->feature_weights;
+	const guint8 *is_text = cols->is_text;
+	gdouble *spam_probs = cols->spam_probs, *ham_probs = cols->ham_probs;
+	gdouble spam_block, ham_block;
+	guint i, j, processed = 0, text = 0;
+
+	for (i = 0; i < cols->len; i++) {
+		gdouble total = spam_counts[i] + ham_counts[i];
+		gdouble spam_freq = spam_counts[i] * spam_norm;
+		gdouble ham_freq = ham_counts[i] * ham_norm;
+		gdouble freq_sum = spam_freq + ham_freq > 0 ? spam_freq + ham_freq : 1.0;
+		gdouble fw = weights[i] * total;
+		gdouble w = fw / (1.0 + fw);
+		gdouble bayes_spam_prob = PROB_COMBINE(spam_freq / freq_sum, total, w, 0.5);
+		gdouble bayes_ham_prob = PROB_COMBINE(ham_freq / freq_sum, total, w, 0.5);
+		gdouble dist = fabs(bayes_spam_prob - 0.5);
+		/* Tokens with a probability too close to 0.5 are ignored */
+		gint ok = (total > 0) & (total >= min_hits) &
+				  ((dist == 0) | (dist >= min_strength));
+
+		spam_probs[i] = ok ? bayes_spam_prob : 1.0;
+		ham_probs[i] = ok ? bayes_ham_prob : 1.0;
+		processed += ok;
+		text += ok & is_text[i];
+	}
+
+	/*
+	 * Multiply probabilities in blocks to call log once per block: combined
+	 * probabilities are either zero or far above 1e-19 for any realistic
+	 * counts, so a product of a block cannot underflow
+	 */
+	for (i = 0; i < cols->len; i += BAYES_LOG_BLOCK) {
+		spam_block = 1.0;
+		ham_block = 1.0;
+
+		for (j = i; j < MIN(i + BAYES_LOG_BLOCK, cols->len); j++) {
+			spam_block *= spam_probs[j];
+			ham_block *= ham_probs[j];
+		}
+
+		cl->spam_prob += log(spam_block);
+		cl->ham_prob += log(ham_block);
+	}
+
+	cl->processed_tokens += processed;
+	cl->text_tokens += text;
+}
+
 
 gboolean
 bayes_init(struct rspamd_config *cfg,
@@ -272,6 +353,7 @@ bayes_classify(struct rspamd_classifier *ctx,
 	gchar sumbuf[32];
 	struct rspamd_statfile *st = NULL;
 	struct bayes_task_closure cl;
+	struct bayes_token_columns cols;
 	rspamd_token_t *tok;
 	guint i, text_tokens = 0;
 	gint id;
@@ -325,12 +407,17 @@ bayes_classify(struct rspamd_classifier *ctx,
 		cl.meta_skip_prob = 1.0 - text_tokens / tokens->len;
 	}
 
-	for (i = 0; i < tokens->len; i++) {
-		tok = g_ptr_array_index(tokens, i);
+	bayes_columns_init(&cols, tokens->len);
+	bayes_columns_gather(ctx, tokens, &cl, &cols);
+	bayes_columns_score(ctx, &cols, &cl);
 
-		bayes_classify_token(ctx, tok, &cl);
+	if (rspamd_logger_need_log(rspamd_log_default_logger(), G_LOG_LEVEL_DEBUG,
+							   rspamd_bayes_log_id)) {
+		bayes_columns_debug(&cols, &cl);
 	}
 
+	bayes_columns_free(&cols);
+
 	if (cl.processed_tokens == 0) {
 		msg_info_bayes("no tokens found in bayes database "
 					   "(%ud total tokens, %ud text tokens), ignore stats",
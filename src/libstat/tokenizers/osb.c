@@ -261,11 +261,42 @@ rspamd_tokenizer_osb_is_compat (struct rspamd_tokenizer_runtime *rt)
 }
 #endif
 
+/* Tokens start with guint64 and pointers */
+#define OSB_TOKEN_ALIGN(sz) (((sz) + sizeof(guint64) - 1) & ~(sizeof(guint64) - 1))
+
 struct token_pipe_entry {
 	guint64 h;
 	rspamd_stat_token_t *t;
 };
 
+/*
+ * Returns the upper bound of tokens produced for the specific words array
+ */
+static guint
+rspamd_tokenizer_osb_max_tokens(GArray *words, guint window_size)
+{
+	rspamd_stat_token_t *token;
+	guint w, nwords = 0, nunigrams = 0;
+
+	for (w = 0; w < words->len; w++) {
+		token = &g_array_index(words, rspamd_stat_token_t, w);
+
+		if (token->flags &
+			(RSPAMD_STAT_TOKEN_FLAG_STOP_WORD | RSPAMD_STAT_TOKEN_FLAG_SKIPPED)) {
+			continue;
+		}
+
+		if (token->flags & RSPAMD_STAT_TOKEN_FLAG_UNIGRAM) {
+			nunigrams++;
+		}
+		else {
+			nwords++;
+		}
+	}
+
+	return nunigrams + nwords * (window_size > 1 ? window_size - 1 : 1);
+}
+
 gint rspamd_tokenizer_osb(struct rspamd_stat_ctx *ctx,
 						  struct rspamd_task *task,
 						  GArray *words,
@@ -280,7 +311,8 @@ gint rspamd_tokenizer_osb(struct rspamd_stat_ctx *ctx,
 	struct token_pipe_entry *hashpipe;
 	guint32 h1, h2;
 	gsize token_size;
-	guint processed = 0, i, w, window_size, token_flags = 0;
+	guchar *tokens_buf, *tokens_end;
+	guint processed = 0, i, w, window_size, token_flags = 0, max_tokens, old_len;
 
 	if (words == NULL) {
 		return FALSE;
@@ -302,10 +334,35 @@ gint rspamd_tokenizer_osb(struct rspamd_stat_ctx *ctx,
 		hashpipe[i].h = 0xfe;
 		hashpipe[i].t = NULL;
 	}
+	/* Keep tokens aligned as they are stored in a single buffer */
 	token_size = sizeof(rspamd_token_t) +
 				 sizeof(RSPAMD_TOKEN_VALUE_TYPE) * ctx->statfiles->len;
+	token_size = OSB_TOKEN_ALIGN(token_size);
 	g_assert(token_size > 0);
 
+	max_tokens = rspamd_tokenizer_osb_max_tokens(words, window_size);
+
+	if (max_tokens == 0) {
+		return TRUE;
+	}
+
+	/*
+	 * All tokens are allocated at once, and the result array is grown once
+	 * to avoid reallocations while adding tokens
+	 */
+	tokens_buf = rspamd_mempool_alloc0(task->task_pool, token_size * max_tokens);
+	tokens_end = tokens_buf + token_size * max_tokens;
+	old_len = result->len;
+	g_ptr_array_set_size(result, old_len + max_tokens);
+	g_ptr_array_set_size(result, old_len);
+
+#define NEW_TOKEN                                        \
+	do {                                                 \
+		g_assert(tokens_buf + token_size <= tokens_end); \
+		new_tok = (rspamd_token_t *) tokens_buf;         \
+		tokens_buf += token_size;                        \
+	} while (0)
+
 	for (w = 0; w < words->len; w++) {
 		token = &g_array_index(words, rspamd_stat_token_t, w);
 		token_flags = token->flags;
@@ -351,7 +408,7 @@ gint rspamd_tokenizer_osb(struct rspamd_stat_ctx *ctx,
 		}
 
 		if (token_flags & RSPAMD_STAT_TOKEN_FLAG_UNIGRAM) {
-			new_tok = rspamd_mempool_alloc0(task->task_pool, token_size);
+			NEW_TOKEN;
 			new_tok->flags = token_flags;
 			new_tok->t1 = token;
 			new_tok->t2 = token;
@@ -364,7 +421,7 @@ gint rspamd_tokenizer_osb(struct rspamd_stat_ctx *ctx,
 
 #define ADD_TOKEN                                                                       \
 	do {                                                                                \
-		new_tok = rspamd_mempool_alloc0(task->task_pool, token_size);                   \
+		NEW_TOKEN;                                                                      \
 		new_tok->flags = token_flags;                                                   \
 		new_tok->t1 = hashpipe[0].t;                                                    \
 		new_tok->t2 = hashpipe[i].t;                                                    \
@@ -418,6 +475,7 @@ gint rspamd_tokenizer_osb(struct rspamd_stat_ctx *ctx,
 	}
 
 #undef ADD_TOKEN
+#undef NEW_TOKEN
 
 	return TRUE;
 }
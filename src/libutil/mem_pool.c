@@ -87,6 +87,44 @@ static rspamd_mempool_stat_t *mem_pool_stat = NULL;
 static gboolean env_checked = FALSE;
 static gboolean always_malloc = FALSE;
 
+/*
+ * Memory usage accounting: samples (e.g. size of a pool when it is deleted)
+ * are kept in a table shared between all processes, so the controller could
+ * show which pools and task stages consume memory
+ */
+#define MEMPOOL_ACCOUNTING_SLOTS 1024
+#define MEMPOOL_ACCOUNTING_BUCKETS 32
+#define MEMPOOL_ACCOUNTING_SEED 0xdeadbabeULL
+
+struct rspamd_mempool_accounting_slot {
+	guint64 hash; /* zero for empty slots */
+	gint ready;
+	gint type;
+	gchar name[ENTRY_LEN];
+	guint64 count;
+	guint64 bytes;
+	/* Samples histogram, bucket i holds samples in [2^i, 2^(i+1)) */
+	guint32 hist[MEMPOOL_ACCOUNTING_BUCKETS];
+};
+
+static struct rspamd_mempool_accounting_slot *mem_pool_accounting = NULL;
+
+/*
+ * Memory of deleted pools is kept in a small per-thread cache and reused by
+ * the next pools: task pools are created and destroyed for each message,
+ * so it saves most of malloc/free calls and page faults for fresh chunks
+ */
+struct rspamd_mempool_cached_chunk {
+	struct rspamd_mempool_cached_chunk *next;
+	gsize size;
+};
+
+static _Thread_local struct rspamd_mempool_cached_chunk *cached_chunks = NULL;
+static _Thread_local guint cached_chunks_count = 0;
+static _Thread_local gsize cached_chunks_bytes = 0;
+static guint cache_max_chunks = 32;
+static gsize cache_max_bytes = 32 * 1024 * 1024;
+
 /**
  * Function that return free space in pool page
  * @param x pool page struct
@@ -102,6 +140,229 @@ pool_chain_free(struct _pool_chain *chain)
 /* By default allocate 4Kb chunks of memory */
 #define FIXED_POOL_SIZE 4096
 
+static struct rspamd_mempool_accounting_slot *
+rspamd_mempool_accounting_find(enum rspamd_mempool_accounting_type type,
+							   const gchar *name)
+{
+	struct rspamd_mempool_accounting_slot *slot;
+	guint64 h, cur;
+	guint i;
+
+	if (mem_pool_accounting == NULL) {
+		return NULL;
+	}
+
+	/* Must not depend on a per process seed */
+	h = rspamd_cryptobox_fast_hash(name, strlen(name), MEMPOOL_ACCOUNTING_SEED + type) | 1;
+
+	for (i = 0; i < MEMPOOL_ACCOUNTING_SLOTS; i++) {
+		slot = &mem_pool_accounting[(h + i) % MEMPOOL_ACCOUNTING_SLOTS];
+		cur = __atomic_load_n(&slot->hash, __ATOMIC_ACQUIRE);
+
+		if (cur == 0) {
+			if (__atomic_compare_exchange_n(&slot->hash, &cur, h, FALSE,
+											__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				slot->type = type;
+				rspamd_strlcpy(slot->name, name, sizeof(slot->name));
+				__atomic_store_n(&slot->ready, 1, __ATOMIC_RELEASE);
+
+				return slot;
+			}
+			/* Another process has claimed this slot, cur is updated */
+		}
+
+		if (cur == h) {
+			return slot;
+		}
+	}
+
+	/* Table is full */
+	return NULL;
+}
+
+static void
+rspamd_mempool_accounting_add(struct rspamd_mempool_accounting_slot *slot, gsize bytes)
+{
+	guint bucket = 0;
+
+	if (bytes > 1) {
+		bucket = MIN(sizeof(unsigned long long) * NBBY - 1 - __builtin_clzll(bytes),
+					 MEMPOOL_ACCOUNTING_BUCKETS - 1);
+	}
+
+	__atomic_fetch_add(&slot->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&slot->bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&slot->hist[bucket], 1, __ATOMIC_RELAXED);
+}
+
+void rspamd_mempool_account(enum rspamd_mempool_accounting_type type,
+							const gchar *name, gsize bytes)
+{
+	struct rspamd_mempool_accounting_slot *slot;
+
+	if (name == NULL) {
+		return;
+	}
+
+	slot = rspamd_mempool_accounting_find(type, name);
+
+	if (slot) {
+		rspamd_mempool_accounting_add(slot, bytes);
+	}
+}
+
+static gsize
+rspamd_mempool_accounting_quantile(const guint32 *hist, guint64 total, gdouble q)
+{
+	gdouble target = q * total, cum = 0, lo, hi;
+	guint i;
+
+	for (i = 0; i < MEMPOOL_ACCOUNTING_BUCKETS; i++) {
+		if (hist[i] > 0 && cum + hist[i] >= target) {
+			/* Linear interpolation within a bucket */
+			lo = i > 0 ? (gdouble) (1ULL << i) : 0.0;
+			hi = (gdouble) (1ULL << (i + 1));
+
+			return lo + (hi - lo) * ((target - cum) / hist[i]);
+		}
+
+		cum += hist[i];
+	}
+
+	return 0;
+}
+
+void rspamd_mempool_accounting_foreach(rspamd_mempool_accounting_cb cb, gpointer ud)
+{
+	struct rspamd_mempool_accounting_slot *slot;
+	struct rspamd_mempool_accounting_stat st;
+	guint32 hist[MEMPOOL_ACCOUNTING_BUCKETS];
+	guint64 total;
+	guint i, j;
+
+	if (mem_pool_accounting == NULL) {
+		return;
+	}
+
+	for (i = 0; i < MEMPOOL_ACCOUNTING_SLOTS; i++) {
+		slot = &mem_pool_accounting[i];
+
+		if (!__atomic_load_n(&slot->ready, __ATOMIC_ACQUIRE)) {
+			continue;
+		}
+
+		total = 0;
+
+		for (j = 0; j < MEMPOOL_ACCOUNTING_BUCKETS; j++) {
+			hist[j] = __atomic_load_n(&slot->hist[j], __ATOMIC_RELAXED);
+			total += hist[j];
+		}
+
+		st.type = slot->type;
+		st.name = slot->name;
+		st.count = __atomic_load_n(&slot->count, __ATOMIC_RELAXED);
+		st.bytes = __atomic_load_n(&slot->bytes, __ATOMIC_RELAXED);
+		st.p50 = rspamd_mempool_accounting_quantile(hist, total, 0.5);
+		st.p99 = rspamd_mempool_accounting_quantile(hist, total, 0.99);
+
+		cb(&st, ud);
+	}
+}
+
+const gchar *
+rspamd_mempool_accounting_type_str(enum rspamd_mempool_accounting_type type)
+{
+	switch (type) {
+	case RSPAMD_MEMPOOL_ACCOUNT_POOL:
+		return "pool";
+	case RSPAMD_MEMPOOL_ACCOUNT_STAGE:
+		return "stage";
+	case RSPAMD_MEMPOOL_ACCOUNT_ALLOC:
+		return "alloc";
+	}
+
+	return "unknown";
+}
+
+/**
+ * Finds the smallest cached chunk that can hold `size` bytes, chunks that are
+ * more than twice larger are not used to avoid wasting memory on small pools
+ * @param size minimum size
+ * @param real_size output size of the chunk
+ * @return chunk or NULL
+ */
+static gpointer
+rspamd_mempool_cache_get(gsize size, gsize *real_size)
+{
+	struct rspamd_mempool_cached_chunk *cur, **prev, **best = NULL;
+
+	for (prev = &cached_chunks, cur = cached_chunks; cur != NULL;
+		 prev = &cur->next, cur = cur->next) {
+		if (cur->size >= size && cur->size <= size * 2 &&
+			(best == NULL || cur->size < (*best)->size)) {
+			best = prev;
+
+			if (cur->size == size) {
+				break;
+			}
+		}
+	}
+
+	if (best == NULL) {
+		return NULL;
+	}
+
+	cur = *best;
+	*best = cur->next;
+	cached_chunks_count--;
+	cached_chunks_bytes -= cur->size;
+	*real_size = cur->size;
+
+	if (mem_pool_stat) {
+		g_atomic_int_inc(&mem_pool_stat->chunks_reused);
+	}
+
+	return cur;
+}
+
+static void
+rspamd_mempool_cache_put(gpointer ptr, gsize size)
+{
+	struct rspamd_mempool_cached_chunk *chunk = ptr;
+
+	if (always_malloc || size < sizeof(*chunk) ||
+		cached_chunks_count >= cache_max_chunks ||
+		cached_chunks_bytes + size > cache_max_bytes) {
+		free(ptr); /* Not g_free as we use system allocator */
+
+		return;
+	}
+
+	chunk->size = size;
+	chunk->next = cached_chunks;
+	cached_chunks = chunk;
+	cached_chunks_count++;
+	cached_chunks_bytes += size;
+}
+
+void rspamd_mempool_cache_limit(guint max_chunks, gsize max_bytes)
+{
+	struct rspamd_mempool_cached_chunk *cur;
+
+	cache_max_chunks = max_chunks;
+	cache_max_bytes = max_bytes;
+
+	while (cached_chunks != NULL &&
+		   (cached_chunks_count > cache_max_chunks ||
+			cached_chunks_bytes > cache_max_bytes)) {
+		cur = cached_chunks;
+		cached_chunks = cur->next;
+		cached_chunks_count--;
+		cached_chunks_bytes -= cur->size;
+		free(cur);
+	}
+}
+
 static inline struct rspamd_mempool_entry_point *
 rspamd_mempool_entry_new(const gchar *loc)
 {
@@ -226,12 +487,17 @@ rspamd_mempool_chain_new(gsize size, gsize alignment, enum rspamd_mempool_chain_
 		optimal_size = sys_alloc_size(total_size);
 #endif
 		total_size = MAX(total_size, optimal_size);
-		gint ret = posix_memalign(&map, alignment, total_size);
+		/* Chain is aligned by `align_ptr` below, so any cached chunk would fit */
+		map = rspamd_mempool_cache_get(total_size, &total_size);
 
-		if (ret != 0 || map == NULL) {
-			g_error("%s: failed to allocate %" G_GSIZE_FORMAT " bytes: %d - %s",
-					G_STRLOC, total_size, ret, strerror(errno));
-			abort();
+		if (map == NULL) {
+			gint ret = posix_memalign(&map, MAX(alignment, MIN_MEM_ALIGNMENT), total_size);
+
+			if (ret != 0 || map == NULL) {
+				g_error("%s: failed to allocate %" G_GSIZE_FORMAT " bytes: %d - %s",
+						G_STRLOC, total_size, ret, strerror(errno));
+				abort();
+			}
 		}
 
 		chain = map;
@@ -321,6 +587,20 @@ rspamd_mempool_new_(gsize size, const gchar *tag, gint flags, const gchar *loc)
 #error No mmap methods are defined
 #endif
 		memset(map, 0, sizeof(rspamd_mempool_stat_t));
+
+#if defined(HAVE_MMAP_ANON)
+		/* Accounting is optional, so just skip it if we cannot map memory */
+		map = mmap(NULL,
+				   sizeof(struct rspamd_mempool_accounting_slot) * MEMPOOL_ACCOUNTING_SLOTS,
+				   PROT_READ | PROT_WRITE,
+				   MAP_ANON | MAP_SHARED,
+				   -1,
+				   0);
+
+		if (map != MAP_FAILED) {
+			mem_pool_accounting = (struct rspamd_mempool_accounting_slot *) map;
+		}
+#endif
 	}
 
 	if (!env_checked) {
@@ -359,15 +639,28 @@ rspamd_mempool_new_(gsize size, const gchar *tag, gint flags, const gchar *loc)
 	 * alignment (if needed)
 	 * memory chunk
 	 */
-	guchar *mem_chunk;
-	gint ret = posix_memalign((void **) &mem_chunk, MIN_MEM_ALIGNMENT,
-							  total_size);
-	gsize priv_offset;
+	guchar *mem_chunk = NULL;
+	gsize priv_offset, cached_size, initial_size = size;
 
-	if (ret != 0 || mem_chunk == NULL) {
-		g_error("%s: failed to allocate %" G_GSIZE_FORMAT " bytes: %d - %s",
-				G_STRLOC, total_size, ret, strerror(errno));
-		abort();
+	if (!(flags & RSPAMD_MEMPOOL_DEBUG)) {
+		mem_chunk = rspamd_mempool_cache_get(total_size, &cached_size);
+
+		if (mem_chunk) {
+			/* Use the whole cached chunk for the initial chain */
+			initial_size += cached_size - total_size;
+			total_size = cached_size;
+		}
+	}
+
+	if (mem_chunk == NULL) {
+		gint ret = posix_memalign((void **) &mem_chunk, MIN_MEM_ALIGNMENT,
+								  total_size);
+
+		if (ret != 0 || mem_chunk == NULL) {
+			g_error("%s: failed to allocate %" G_GSIZE_FORMAT " bytes: %d - %s",
+					G_STRLOC, total_size, ret, strerror(errno));
+			abort();
+		}
 	}
 
 	/* Set memory layout */
@@ -392,6 +685,7 @@ rspamd_mempool_new_(gsize size, const gchar *tag, gint flags, const gchar *loc)
 
 	new_pool->priv->entry = entry;
 	new_pool->priv->elt_len = size;
+	new_pool->priv->chunk_size = total_size;
 	new_pool->priv->flags = flags;
 
 	if (tag) {
@@ -421,9 +715,8 @@ rspamd_mempool_new_(gsize size, const gchar *tag, gint flags, const gchar *loc)
 						sizeof(struct rspamd_mempool_specific) +
 						sizeof(struct _pool_chain);
 
-	nchain->slice_size = size;
+	nchain->slice_size = initial_size;
 	nchain->begin = unaligned;
-	nchain->slice_size = size;
 	nchain->pos = align_ptr(unaligned, MIN_MEM_ALIGNMENT);
 	new_pool->priv->pools[RSPAMD_MEMPOOL_NORMAL] = nchain;
 	new_pool->priv->used_memory = size;
@@ -862,12 +1155,25 @@ void rspamd_mempool_delete(rspamd_mempool_t *pool)
 
 			e = &g_array_index(sorted_debug_size, struct mempool_debug_elt, _i);
 			msg_info_pool("allocated %Hz from %s", e->sz, e->loc);
+			rspamd_mempool_account(RSPAMD_MEMPOOL_ACCOUNT_ALLOC, e->loc, e->sz);
 		}
 
 		g_array_free(sorted_debug_size, TRUE);
 		g_hash_table_unref(debug_tbl);
 	}
 
+	if (pool->priv->entry && mem_pool_accounting) {
+		if (pool->priv->entry->acct == NULL) {
+			pool->priv->entry->acct = rspamd_mempool_accounting_find(
+				RSPAMD_MEMPOOL_ACCOUNT_POOL, pool->priv->entry->src);
+		}
+
+		if (pool->priv->entry->acct) {
+			rspamd_mempool_accounting_add(pool->priv->entry->acct,
+										  pool->priv->used_memory);
+		}
+	}
+
 	if (cur && mempool_entries) {
 		pool->priv->entry->elts[pool->priv->entry->cur_elts].leftover =
 			pool_chain_free(cur);
@@ -916,7 +1222,7 @@ void rspamd_mempool_delete(rspamd_mempool_t *pool)
 				else {
 					/* The last pool is special, it is a part of the initial chunk */
 					if (cur->next != NULL) {
-						free(cur); /* Not g_free as we use system allocator */
+						rspamd_mempool_cache_put(cur, len);
 					}
 				}
 			}
@@ -925,7 +1231,13 @@ void rspamd_mempool_delete(rspamd_mempool_t *pool)
 
 	g_atomic_int_inc(&mem_pool_stat->pools_freed);
 	POOL_MTX_UNLOCK();
-	free(pool); /* allocated by posix_memalign */
+
+	if (G_UNLIKELY(pool->priv->flags & RSPAMD_MEMPOOL_DEBUG)) {
+		free(pool); /* allocated by posix_memalign */
+	}
+	else {
+		rspamd_mempool_cache_put(pool, pool->priv->chunk_size);
+	}
 }
 
 void rspamd_mempool_stat(rspamd_mempool_stat_t *st)
@@ -938,6 +1250,7 @@ void rspamd_mempool_stat(rspamd_mempool_stat_t *st)
 		st->chunks_allocated = mem_pool_stat->chunks_allocated;
 		st->chunks_freed = mem_pool_stat->chunks_freed;
 		st->oversized_chunks = mem_pool_stat->oversized_chunks;
+		st->chunks_reused = mem_pool_stat->chunks_reused;
 	}
 }
 
@@ -946,6 +1259,17 @@ void rspamd_mempool_stat_reset(void)
 	if (mem_pool_stat != NULL) {
 		memset(mem_pool_stat, 0, sizeof(rspamd_mempool_stat_t));
 	}
+
+	if (mem_pool_accounting != NULL) {
+		/* Keep names as other processes might have cached slots */
+		for (guint i = 0; i < MEMPOOL_ACCOUNTING_SLOTS; i++) {
+			struct rspamd_mempool_accounting_slot *slot = &mem_pool_accounting[i];
+
+			__atomic_store_n(&slot->count, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&slot->bytes, 0, __ATOMIC_RELAXED);
+			memset(slot->hist, 0, sizeof(slot->hist));
+		}
+	}
 }
 
 gsize rspamd_mempool_suggest_size_(const char *loc)
@@ -136,6 +136,7 @@ typedef struct memory_pool_stat_s {
 	guint chunks_freed;            /**< chunks freed										*/
 	guint oversized_chunks;        /**< oversized chunks									*/
 	guint fragmented_size;         /**< fragmentation size								*/
+	guint chunks_reused;           /**< chunks reused from the cache of freed chunks		*/
 } rspamd_mempool_stat_t;
 
 
@@ -358,6 +359,55 @@ void rspamd_mempool_stat(rspamd_mempool_stat_t *st);
  */
 void rspamd_mempool_stat_reset(void);
 
+enum rspamd_mempool_accounting_type {
+	RSPAMD_MEMPOOL_ACCOUNT_POOL = 0, /**< size of pools by the place of creation */
+	RSPAMD_MEMPOOL_ACCOUNT_STAGE,    /**< memory allocated in a task pool during a stage */
+	RSPAMD_MEMPOOL_ACCOUNT_ALLOC,    /**< memory allocated by a call site (debug pools only) */
+};
+
+struct rspamd_mempool_accounting_stat {
+	enum rspamd_mempool_accounting_type type;
+	const gchar *name;
+	guint64 count; /**< number of samples */
+	guint64 bytes; /**< total bytes */
+	gsize p50;     /**< median sample */
+	gsize p99;     /**< 99th percentile of samples */
+};
+
+typedef void (*rspamd_mempool_accounting_cb)(const struct rspamd_mempool_accounting_stat *st,
+											 gpointer ud);
+
+/**
+ * Adds a sample of memory usage to the statistics shared between all processes
+ * @param type
+ * @param name static string
+ * @param bytes
+ */
+void rspamd_mempool_account(enum rspamd_mempool_accounting_type type,
+							const gchar *name, gsize bytes);
+
+/**
+ * Calls `cb` for each accounted name
+ * @param cb
+ * @param ud
+ */
+void rspamd_mempool_accounting_foreach(rspamd_mempool_accounting_cb cb, gpointer ud);
+
+/**
+ * Returns string representation of an accounting type
+ * @param type
+ * @return
+ */
+const gchar *rspamd_mempool_accounting_type_str(enum rspamd_mempool_accounting_type type);
+
+/**
+ * Set limits for the per-thread cache of memory released by deleted pools,
+ * setting `max_chunks` to zero disables the cache and frees all cached memory
+ * @param max_chunks maximum number of cached chunks
+ * @param max_bytes maximum size of cached memory
+ */
+void rspamd_mempool_cache_limit(guint max_chunks, gsize max_bytes);
+
 /**
  * Get optimal pool size based on page size for this system
  * @return size of memory page in system
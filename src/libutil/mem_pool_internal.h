@@ -37,8 +37,11 @@ struct entry_elt {
 	guint32 leftover;
 };
 
+struct rspamd_mempool_accounting_slot;
+
 struct rspamd_mempool_entry_point {
 	gchar src[ENTRY_LEN];
+	struct rspamd_mempool_accounting_slot *acct;
 	guint32 cur_suggestion;
 	guint32 cur_elts;
 	guint32 cur_vars;
@@ -72,7 +75,8 @@ struct rspamd_mempool_specific {
 	GPtrArray *trash_stack;
 	khash_t(rspamd_mempool_vars_hash) * variables;
 	struct rspamd_mempool_entry_point *entry;
-	gsize elt_len; /**< size of an element						*/
+	gsize elt_len;    /**< size of an element						*/
+	gsize chunk_size; /**< size of the initial chunk with the pool	*/
 	gsize used_memory;
 	guint wasted_memory;
 	gint flags;
@@ -35,39 +35,32 @@ rspamd_shingles_keys_equal(gconstpointer k1, gconstpointer k2)
 	return (memcmp(k1, k2, SHINGLES_KEY_SIZE) == 0);
 }
 
-static void
-rspamd_shingles_keys_free(gpointer p)
+/*
+ * Keys are stored one after another, so they can be passed to
+ * rspamd_cryptobox_siphash_multi as is
+ */
+static guchar *
+rspamd_shingles_keys_new(void)
 {
-	guchar **k = p;
-	guint i;
-
-	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
-		g_free(k[i]);
-	}
-
-	g_free(k);
+	return g_malloc0(SHINGLES_KEY_SIZE * RSPAMD_SHINGLE_SIZE);
 }
 
-static guchar **
-rspamd_shingles_keys_new(void)
+/*
+ * Scratch space for RSPAMD_SHINGLE_SIZE pipes of hashes, hashes of pipe `i`
+ * start at offset `i * hlen`. It is not needed after shingles are selected,
+ * so it is never allocated from the caller's pool
+ */
+static guint64 *
+rspamd_shingles_hashes_new(gsize hlen)
 {
-	guchar **k;
-	guint i;
-
-	k = g_malloc0(sizeof(guchar *) * RSPAMD_SHINGLE_SIZE);
-
-	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
-		k[i] = g_malloc0(sizeof(guchar) * SHINGLES_KEY_SIZE);
-	}
-
-	return k;
+	return g_malloc(sizeof(guint64) * hlen * RSPAMD_SHINGLE_SIZE);
 }
 
-static guchar **
+static const guchar *
 rspamd_shingles_get_keys_cached(const guchar key[SHINGLES_KEY_SIZE])
 {
 	static GHashTable *ht = NULL;
-	guchar **keys = NULL, *key_cpy;
+	guchar *keys = NULL, *key_cpy;
 	rspamd_cryptobox_hash_state_t bs;
 	const guchar *cur_key;
 	guchar shabuf[rspamd_cryptobox_HASHBYTES], *out_key;
@@ -75,7 +68,7 @@ rspamd_shingles_get_keys_cached(const guchar key[SHINGLES_KEY_SIZE])
 
 	if (ht == NULL) {
 		ht = g_hash_table_new_full(rspamd_shingles_keys_hash,
-								   rspamd_shingles_keys_equal, g_free, rspamd_shingles_keys_free);
+								   rspamd_shingles_keys_equal, g_free, g_free);
 	}
 	else {
 		keys = g_hash_table_lookup(ht, key);
@@ -96,7 +89,7 @@ rspamd_shingles_get_keys_cached(const guchar key[SHINGLES_KEY_SIZE])
 			 * initial key as many times as many hashes are required and
 			 * xor left and right parts of sha256 to get a single 16 bytes SIP key.
 			 */
-			out_key = keys[i];
+			out_key = keys + i * SHINGLES_KEY_SIZE;
 			rspamd_cryptobox_hash_update(&bs, cur_key, 16);
 			rspamd_cryptobox_hash_final(&bs, shabuf);
 
@@ -120,11 +113,11 @@ struct rspamd_shingle *RSPAMD_OPTIMIZE("unroll-loops")
 							  enum rspamd_shingle_alg alg)
 {
 	struct rspamd_shingle *res;
-	guint64 **hashes;
-	guchar **keys;
+	guint64 *hashes;
+	const guchar *keys;
 	rspamd_fstring_t *row;
 	rspamd_stat_token_t *word;
-	guint64 val;
+	guint64 val, row_hashes[RSPAMD_SHINGLE_SIZE];
 	gint i, j, k;
 	gsize hlen, ilen = 0, beg = 0, widx = 0;
 	enum rspamd_cryptobox_fast_hash_type ht;
@@ -147,14 +140,10 @@ struct rspamd_shingle *RSPAMD_OPTIMIZE("unroll-loops")
 	}
 
 	/* Init hashes pipes and keys */
-	hashes = g_malloc(sizeof(*hashes) * RSPAMD_SHINGLE_SIZE);
 	hlen = ilen > SHINGLES_WINDOW ? (ilen - SHINGLES_WINDOW + 1) : 1;
+	hashes = rspamd_shingles_hashes_new(hlen);
 	keys = rspamd_shingles_get_keys_cached(key);
 
-	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
-		hashes[i] = g_malloc(hlen * sizeof(guint64));
-	}
-
 	/* Now parse input words into a vector of hashes using rolling window */
 	if (alg == RSPAMD_SHINGLES_OLD) {
 		for (i = 0; i <= (gint) ilen; i++) {
@@ -175,10 +164,6 @@ struct rspamd_shingle *RSPAMD_OPTIMIZE("unroll-loops")
 
 					if (word == NULL) {
 						/* Nothing but exceptions */
-						for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
-							g_free(hashes[i]);
-						}
-
 						g_free(hashes);
 
 						if (pool == NULL) {
@@ -194,12 +179,13 @@ struct rspamd_shingle *RSPAMD_OPTIMIZE("unroll-loops")
 												word->stemmed.len);
 				}
 
-				/* Now we need to create a new row here */
+				/* Now we need to create a new row here, hashing it with all keys at once */
+				rspamd_cryptobox_siphash_multi(row_hashes, row->str, row->len,
+											   keys, RSPAMD_SHINGLE_SIZE);
+				g_assert(hlen > beg);
+
 				for (j = 0; j < RSPAMD_SHINGLE_SIZE; j++) {
-					rspamd_cryptobox_siphash((guchar *) &val, row->str, row->len,
-											 keys[j]);
-					g_assert(hlen > beg);
-					hashes[j][beg] = val;
+					hashes[j * hlen + beg] = row_hashes[j];
 				}
 
 				beg++;
@@ -250,22 +236,19 @@ struct rspamd_shingle *RSPAMD_OPTIMIZE("unroll-loops")
 
 					if (word == NULL) {
 						/* Nothing but exceptions */
-						for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
-							g_free(hashes[i]);
-						}
+						g_free(hashes);
 
 						if (pool == NULL) {
 							g_free(res);
 						}
 
-						g_free(hashes);
 						rspamd_fstring_free(row);
 
 						return NULL;
 					}
 
 					/* Insert the last element to the pipe */
-					memcpy(&seed, keys[j], sizeof(seed));
+					memcpy(&seed, keys + j * SHINGLES_KEY_SIZE, sizeof(seed));
 					window[j * SHINGLES_WINDOW + SHINGLES_WINDOW - 1] =
 						rspamd_cryptobox_fast_hash_specific(ht,
 															word->stemmed.begin, word->stemmed.len,
@@ -277,7 +260,7 @@ struct rspamd_shingle *RSPAMD_OPTIMIZE("unroll-loops")
 					}
 
 					g_assert(hlen > beg);
-					hashes[j][beg] = val;
+					hashes[j * hlen + beg] = val;
 				}
 
 				beg++;
@@ -288,13 +271,11 @@ struct rspamd_shingle *RSPAMD_OPTIMIZE("unroll-loops")
 
 	/* Now we need to filter all hashes and make a shingles result */
 	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
-		res->hashes[i] = filter(hashes[i], hlen,
+		res->hashes[i] = filter(hashes + i * hlen, hlen,
 								i, key, filterd);
-		g_free(hashes[i]);
 	}
 
 	g_free(hashes);
-
 	rspamd_fstring_free(row);
 
 	return res;
@@ -309,8 +290,8 @@ struct rspamd_shingle *RSPAMD_OPTIMIZE("unroll-loops")
 							   enum rspamd_shingle_alg alg)
 {
 	struct rspamd_shingle *shingle;
-	guint64 **hashes;
-	guchar **keys;
+	guint64 *hashes;
+	const guchar *keys;
 	guint64 d;
 	guint64 val;
 	gint i, j;
@@ -326,14 +307,10 @@ struct rspamd_shingle *RSPAMD_OPTIMIZE("unroll-loops")
 	}
 
 	/* Init hashes pipes and keys */
-	hashes = g_malloc(sizeof(*hashes) * RSPAMD_SHINGLE_SIZE);
 	hlen = RSPAMD_DCT_LEN / NBBY + 1;
+	hashes = rspamd_shingles_hashes_new(hlen);
 	keys = rspamd_shingles_get_keys_cached(key);
 
-	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
-		hashes[i] = g_malloc(hlen * sizeof(guint64));
-	}
-
 	switch (alg) {
 	case RSPAMD_SHINGLES_OLD:
 		ht = RSPAMD_CRYPTOBOX_MUMHASH;
@@ -350,14 +327,14 @@ struct rspamd_shingle *RSPAMD_OPTIMIZE("unroll-loops")
 	}
 
 	memset(res, 0, sizeof(res));
-#define INNER_CYCLE_SHINGLES(s, e)                               \
-	for (j = (s); j < (e); j++) {                                \
-		d = dct[beg];                                            \
-		memcpy(&seed, keys[j], sizeof(seed));                    \
-		val = rspamd_cryptobox_fast_hash_specific(ht,            \
-												  &d, sizeof(d), \
-												  seed);         \
-		hashes[j][beg] = val;                                    \
+#define INNER_CYCLE_SHINGLES(s, e)                                 \
+	for (j = (s); j < (e); j++) {                                  \
+		d = dct[beg];                                              \
+		memcpy(&seed, keys + j * SHINGLES_KEY_SIZE, sizeof(seed)); \
+		val = rspamd_cryptobox_fast_hash_specific(ht,              \
+												  &d, sizeof(d),   \
+												  seed);           \
+		hashes[j * hlen + beg] = val;                              \
 	}
 	for (i = 0; i < RSPAMD_DCT_LEN / NBBY; i++) {
 		INNER_CYCLE_SHINGLES(0, RSPAMD_SHINGLE_SIZE / 4);
@@ -370,9 +347,8 @@ struct rspamd_shingle *RSPAMD_OPTIMIZE("unroll-loops")
 #undef INNER_CYCLE_SHINGLES
 	/* Now we need to filter all hashes and make a shingles result */
 	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
-		shingle->hashes[i] = filter(hashes[i], hlen,
+		shingle->hashes[i] = filter(hashes + i * hlen, hlen,
 									i, key, filterd);
-		g_free(hashes[i]);
 	}
 
 	g_free(hashes);
@@ -17,6 +17,7 @@
 #include "lua_common.h"
 #include "lua_url.h"
 #include "libmime/message.h"
+#include "libmime/mime_parser.h"
 #include "libmime/lang_detection.h"
 #include "libstat/stat_api.h"
 #include "libcryptobox/cryptobox.h"
@@ -1409,6 +1410,7 @@ lua_mimepart_get_content(lua_State *L)
 		return 1;
 	}
 
+	rspamd_mime_part_maybe_decode(part);
 	t = lua_newuserdata(L, sizeof(*t));
 	rspamd_lua_setclass(L, "rspamd{text}", -1);
 	t->start = part->parsed_data.begin;
@@ -1454,6 +1456,7 @@ lua_mimepart_get_length(lua_State *L)
 		return 1;
 	}
 
+	rspamd_mime_part_maybe_decode(part);
 	lua_pushinteger(L, part->parsed_data.len);
 
 	return 1;
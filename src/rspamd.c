@@ -1542,8 +1542,10 @@ gint main(gint argc, gchar **argv, gchar **env)
 	msg_info_main("cpu features: %s",
 				  rspamd_main->cfg->libs_ctx->crypto_ctx->cpu_extensions);
 	msg_info_main("cryptobox configuration: curve25519(libsodium), "
-				  "chacha20(%s), poly1305(libsodium), siphash(libsodium), blake2(libsodium), base64(%s)",
+				  "chacha20(%s), poly1305(libsodium), siphash(libsodium), siphash_multi(%s), "
+				  "blake2(libsodium), base64(%s)",
 				  rspamd_main->cfg->libs_ctx->crypto_ctx->chacha20_impl,
+				  rspamd_main->cfg->libs_ctx->crypto_ctx->siphash_impl,
 				  rspamd_main->cfg->libs_ctx->crypto_ctx->base64_impl);
 	msg_info_main("libottery prf: %s", ottery_get_impl_name());
 
@@ -0,0 +1,120 @@
+-- Filters are started when all their dependencies are finished, including
+-- the asynchronous ones. Messages from 8.8.8.8 get a passthrough result, so
+-- filters are started by the full scan of filters instead of the ready queue
+
+local function record(task, name)
+  local order = task:cache_get('sched_order') or {}
+  table.insert(order, name)
+  task:cache_set('sched_order', order)
+  task:insert_result(name, 1.0)
+end
+
+rspamd_config:register_symbol({
+  type = 'prefilter',
+  name = 'SCHED_PASSTHROUGH',
+  callback = function(task)
+    if tostring(task:get_from_ip()) == '8.8.8.8' then
+      task:set_pre_result('reject', 'passthrough', 'scheduler')
+    end
+  end
+})
+
+rspamd_config:register_symbol({
+  type = 'normal',
+  name = 'SCHED_ASYNC',
+  flags = 'ignore_passthrough',
+  callback = function(task)
+    local function dns_cb()
+      record(task, 'SCHED_ASYNC')
+    end
+    local r = task:get_resolver()
+    r:resolve_a({ task = task, name = 'example.com', callback = dns_cb })
+  end
+})
+
+for i = 1, 3 do
+  local name = string.format('SCHED_CHAIN%d', i)
+  local dep_name = i == 1 and 'SCHED_ASYNC' or string.format('SCHED_CHAIN%d', i - 1)
+
+  rspamd_config:register_symbol({
+    type = 'normal',
+    name = name,
+    flags = 'ignore_passthrough',
+    callback = function(task)
+      if task:has_symbol(dep_name) then
+        record(task, name)
+      end
+    end
+  })
+  rspamd_config:register_dependency(name, dep_name)
+end
+
+-- Dependency on a virtual symbol waits for its parent
+local id = rspamd_config:register_symbol({
+  type = 'callback',
+  name = 'SCHED_VIRTUAL_PARENT',
+  flags = 'ignore_passthrough',
+  callback = function(task)
+    local function dns_cb()
+      record(task, 'SCHED_VIRTUAL')
+    end
+    local r = task:get_resolver()
+    r:resolve_a({ task = task, name = 'site.resolveme', callback = dns_cb })
+  end
+})
+rspamd_config:register_symbol({
+  type = 'virtual',
+  name = 'SCHED_VIRTUAL',
+  parent = id,
+})
+rspamd_config:register_symbol({
+  type = 'normal',
+  name = 'SCHED_VIRTUAL_DEP',
+  flags = 'ignore_passthrough',
+  callback = function(task)
+    if task:has_symbol('SCHED_VIRTUAL') then
+      record(task, 'SCHED_VIRTUAL_DEP')
+    end
+  end
+})
+rspamd_config:register_dependency('SCHED_VIRTUAL_DEP', 'SCHED_VIRTUAL')
+
+-- Must be skipped when there is a passthrough result
+rspamd_config:register_symbol({
+  type = 'normal',
+  name = 'SCHED_SKIPPED',
+  callback = function(task)
+    task:insert_result('SCHED_SKIPPED', 1.0)
+  end
+})
+rspamd_config:register_dependency('SCHED_SKIPPED', 'SCHED_ASYNC')
+
+rspamd_config:register_symbol({
+  type = 'postfilter',
+  name = 'SCHED_ORDER',
+  flags = 'ignore_passthrough',
+  callback = function(task)
+    local order = task:cache_get('sched_order') or {}
+    local chain, virtual = {}, {}
+
+    for _, name in ipairs(order) do
+      if name:find('^SCHED_VIRTUAL') then
+        table.insert(virtual, name)
+      else
+        table.insert(chain, name)
+      end
+    end
+
+    task:insert_result('SCHED_ORDER', 1.0, table.concat(chain, ','),
+        table.concat(virtual, ','))
+  end
+})
+
+for _, name in ipairs({ 'SCHED_ASYNC', 'SCHED_CHAIN1', 'SCHED_CHAIN2',
+                        'SCHED_CHAIN3', 'SCHED_VIRTUAL', 'SCHED_VIRTUAL_DEP',
+                        'SCHED_SKIPPED', 'SCHED_ORDER' }) do
+  rspamd_config:set_metric_symbol({
+    name = name,
+    score = 1.0
+  })
+end
@@ -159,4 +159,73 @@ Thank you,
 
     task:destroy()
   end)
-end)
\ No newline at end of file
+
+  local function delayed_parts_msg(...)
+    local parts = {}
+
+    for _, p in ipairs({ ... }) do
+      parts[#parts + 1] = table.concat{
+        '--XXX\n',
+        'Content-Type: application/octet-stream\n',
+        'Content-Transfer-Encoding: ', p[1], '\n', '\n',
+        p[2], '\n',
+      }
+    end
+
+    return table.concat{ hdrs, mpart, '\n', table.concat(parts), '--XXX--\n' }
+  end
+
+  test("Process large parts with delayed decoding", function()
+    local rspamd_util = require "rspamd_util"
+    local test_helper = require "rspamd_test_helper"
+    local config = test_helper.default_config()
+    config.options.max_decode = 64
+    test_helper.init_url_parser()
+    local cfg = rspamd_util.config_from_ucl(config, "INIT_URL,INIT_LIBS")
+    local zip = [[
+UEsDBBQAAAAAAAAAIVjWuGCsFQAAABUAAAAIAAAAdGVzdC50eHRUZXN0IGFyY2hpdmUgY29udGVu
+dApQSwECFAMUAAAAAAAAACFY1rhgrBUAAAAVAAAACAAAAAAAAAAAAAAAgAEAAAAAdGVzdC50eHRQ
+SwUGAAAAAAEAAQA2AAAAOwAAAAAA]]
+    -- Large enough to be decoded by several chunks
+    local data = {}
+    for i = 1, 100000 do
+      data[i] = string.char((i * 7919) % 256)
+    end
+    data = table.concat(data)
+    local text = {}
+    for i = 1, 5000 do
+      text[i] = string.format('line %d: caf\xc3\xa9 = %d\n', i, i * i)
+    end
+    text = table.concat(text)
+    local msg = delayed_parts_msg({ 'base64', zip },
+        { 'base64', tostring(rspamd_util.encode_base64(data, 76, 'lf')) },
+        { 'quoted-printable', tostring(rspamd_util.encode_qp(text, 76, 'lf')) })
+
+    local function process(c)
+      local res, task = rspamd_task.load_from_string(msg, c)
+      assert_true(res, "failed to load message")
+      task:process_message()
+      local parts = fun.totable(fun.map(function(part)
+        return {
+          digest = part:get_digest(),
+          ext = part:get_detected_ext(),
+          files = part:is_archive() and part:get_archive():get_files() or {},
+          content = tostring(part:get_content()),
+        }
+      end, fun.filter(function(part)
+        return not part:is_multipart()
+      end, task:get_parts())))
+      task:destroy()
+
+      return parts
+    end
+
+    local delayed, decoded = process(cfg), process(rspamd_config)
+    assert_equal(#delayed, 3)
+    assert_equal(delayed[1].ext, 'zip')
+    assert_rspamd_table_eq({ actual = delayed[1].files, expect = { 'test.txt' } })
+    assert_equal(delayed[2].content, data)
+    assert_equal(delayed[3].content, text)
+    assert_rspamd_table_eq({ actual = delayed, expect = decoded })
+  end)
+end)
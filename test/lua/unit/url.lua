@@ -5,6 +5,7 @@ context("URL check functions", function()
   local lua_urls_compose = require "lua_urls_compose"
   local url = require("rspamd_url")
   local lua_util = require("lua_util")
+  local rspamd_util = require("rspamd_util")
   local logger = require("rspamd_logger")
   local test_helper = require("rspamd_test_helper")
   local ffi = require("ffi")
@@ -250,4 +251,34 @@ context("URL check functions", function()
       assert_equal(v[2], res, 'expected ' .. v[2] .. ' but got ' .. res .. ' in url ' .. v[1])
     end)
   end
+
+  cases = {
+    { 'example.com', 'example.com' },
+    { 'www.example.com', 'example.com' },
+    -- Multi-level suffixes
+    { 'co.uk', 'co.uk' },
+    { 'example.co.uk', 'example.co.uk' },
+    { 'www.example.co.uk', 'example.co.uk' },
+    { 'www.example.uk', 'example.uk' },
+    { 'WWW.Example.CO.UK', 'Example.CO.UK' },
+    -- Wildcard and exception rules
+    { 'foo.bar.ck', 'foo.bar.ck' },
+    { 'www.foo.bar.ck', 'foo.bar.ck' },
+    { 'www.ck', 'www.ck' },
+    { 'a.www.ck', 'www.ck' },
+    { 'a.b.WWW.CK', 'WWW.CK' },
+    -- IDN suffixes
+    { 'www.тест.рф', 'тест.рф' },
+    { 'WWW.ТЕСТ.РФ', 'ТЕСТ.РФ' },
+    { 'www.test.XN--P1AI', 'test.XN--P1AI' },
+    { 'www.example.公司.cn', 'example.公司.cn' },
+    { 'www.example.cn', 'example.cn' },
+  }
+
+  for _, v in ipairs(cases) do
+    test("Get TLD " .. v[1], function()
+      local res = rspamd_util.get_tld(v[1])
+      assert_equal(v[2], res, 'expected ' .. v[2] .. ' but got ' .. res .. ' for host ' .. v[1])
+    end)
+  end
 end)
@@ -0,0 +1,110 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Detached unit tests for the symbols cache order */
+
+#ifndef RSPAMD_RSPAMD_CXX_UNIT_SYMCACHE_HXX
+#define RSPAMD_RSPAMD_CXX_UNIT_SYMCACHE_HXX
+
+#define DOCTEST_CONFIG_IMPLEMENTATION_IN_DLL
+#include "doctest/doctest.h"
+#include "libserver/symcache/symcache_internal.hxx"
+#include "libserver/symcache/symcache_item.hxx"
+
+#include <memory>
+#include <string_view>
+
+TEST_SUITE("rspamd_symcache")
+{
+
+	static void symcache_test_cb(struct rspamd_task *task,
+								 struct rspamd_symcache_dynamic_item *item,
+								 gpointer user_data)
+	{
+	}
+
+	/* Sets the stats as if they have been loaded from the cache file */
+	static auto symcache_test_add(rspamd::symcache::symcache &cache, std::string_view name,
+								  int priority, double weight, double avg_time,
+								  unsigned hits, unsigned runs) -> int
+	{
+		auto id = cache.add_symbol_with_callback(name, priority, symcache_test_cb,
+												 nullptr, SYMBOL_TYPE_NORMAL);
+		REQUIRE(id >= 0);
+		auto *item = cache.get_item_by_id_mut(id, false);
+		item->st->weight = weight;
+		item->st->avg_time = avg_time;
+		item->st->total_hits = hits;
+		item->st->total_runs = runs;
+
+		return id;
+	}
+
+	static auto symcache_test_pos(const rspamd::symcache::symcache &cache, std::string_view name) -> unsigned
+	{
+		auto ord = cache.get_cache_order();
+		auto it = ord->by_symbol.find(name);
+		REQUIRE(it != ord->by_symbol.end());
+
+		return it->second;
+	}
+
+	TEST_CASE("adaptive order respects dependencies and priorities")
+	{
+		auto *cfg = rspamd_config_new(RSPAMD_CONFIG_INIT_SKIP_LUA);
+		REQUIRE(cfg->cache_adaptive_order);
+		auto cache = std::make_unique<rspamd::symcache::symcache>(cfg);
+
+		/* Cheap and predictive rule */
+		symcache_test_add(*cache, "FAST", 0, 10.0, 0.1, 50, 100);
+		/* The same gain, but slow */
+		symcache_test_add(*cache, "SLOW", 0, 10.0, 50.0, 50, 100);
+		/* Cheap and predictive, but depends on a slow and useless rule */
+		auto dep_user = symcache_test_add(*cache, "DEP_USER", 0, 10.0, 0.1, 100, 100);
+		symcache_test_add(*cache, "DEP_TARGET", 0, 0.0, 50.0, 0, 100);
+		cache->add_dependency(dep_user, "DEP_TARGET", -1);
+		/* Slow and useless, but has a higher priority */
+		symcache_test_add(*cache, "PRIO", 1, 0.0, 50.0, 0, 100);
+
+		REQUIRE(cache->init());
+
+		CHECK(symcache_test_pos(*cache, "FAST") < symcache_test_pos(*cache, "SLOW"));
+		CHECK(symcache_test_pos(*cache, "DEP_TARGET") < symcache_test_pos(*cache, "DEP_USER"));
+		CHECK(symcache_test_pos(*cache, "PRIO") < symcache_test_pos(*cache, "FAST"));
+		CHECK(symcache_test_pos(*cache, "PRIO") < symcache_test_pos(*cache, "DEP_USER"));
+
+		/*
+		 * Counters folded by the periodic resort change the order of the
+		 * unconstrained rules only
+		 */
+		auto *fast = cache->get_item_by_name_mut("FAST", false);
+		auto *slow = cache->get_item_by_name_mut("SLOW", false);
+		fast->st->runs = 100000;
+		slow->st->hits = 50;
+		slow->st->runs = 50;
+		slow->st->avg_time = 0.1;
+		cache->get_item_by_name_mut("DEP_USER", false)->st->avg_time = 0.01;
+		cache->periodic_resort(nullptr, 1.0, 0.0);
+		REQUIRE(cache->maybe_resort());
+
+		CHECK(symcache_test_pos(*cache, "SLOW") < symcache_test_pos(*cache, "FAST"));
+		CHECK(symcache_test_pos(*cache, "DEP_TARGET") < symcache_test_pos(*cache, "DEP_USER"));
+		CHECK(symcache_test_pos(*cache, "PRIO") < symcache_test_pos(*cache, "SLOW"));
+		CHECK(symcache_test_pos(*cache, "PRIO") < symcache_test_pos(*cache, "DEP_USER"));
+	}
+}
+
+#endif
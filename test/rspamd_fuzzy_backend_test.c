@@ -0,0 +1,277 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamd.h"
+#include "tests.h"
+#include "ottery.h"
+#include "fuzzy_wire.h"
+#include "libserver/fuzzy_backend/fuzzy_backend.h"
+
+#define TEST_SOURCE "test"
+#define TEST_HASHES 16
+
+extern struct ev_loop *event_loop;
+extern struct rspamd_main *rspamd_main;
+
+/* Redis backend is checked by the functional fuzzy tests */
+static const gchar *test_backends[] = {
+	"sqlite",
+	"memory",
+};
+
+enum fuzzy_backend_test_query {
+	FUZZY_BACKEND_TEST_DIGEST = 0,
+	FUZZY_BACKEND_TEST_SHINGLES,
+	FUZZY_BACKEND_TEST_PARTIAL_SHINGLES,
+	FUZZY_BACKEND_TEST_DELETED,
+	FUZZY_BACKEND_TEST_UNKNOWN,
+	FUZZY_BACKEND_TEST_MAX,
+};
+
+struct fuzzy_backend_test_hash {
+	gchar digest[rspamd_cryptobox_HASHBYTES];
+	struct rspamd_shingle sgl;
+};
+
+struct fuzzy_backend_test_result {
+	gboolean done;
+	struct rspamd_fuzzy_reply rep;
+};
+
+static void
+fuzzy_backend_test_update_cb(gboolean success, guint nadded, guint ndeleted,
+							 guint nextended, guint nignored, void *ud)
+{
+	gboolean *res = ud;
+
+	*res = success;
+}
+
+static void
+fuzzy_backend_test_check_cb(struct rspamd_fuzzy_reply *rep, void *ud)
+{
+	struct fuzzy_backend_test_result *res = ud;
+
+	g_assert(!res->done);
+	res->done = TRUE;
+	memcpy(&res->rep, rep, sizeof(*rep));
+}
+
+static void
+fuzzy_backend_test_add_cmd(GArray *updates, guint8 cmd,
+						   const struct fuzzy_backend_test_hash *h,
+						   guint8 flag, gint32 value)
+{
+	struct fuzzy_peer_cmd io_cmd;
+	struct rspamd_fuzzy_cmd *basic;
+
+	memset(&io_cmd, 0, sizeof(io_cmd));
+	io_cmd.is_shingle = TRUE;
+	basic = &io_cmd.cmd.shingle.basic;
+	basic->version = RSPAMD_FUZZY_VERSION;
+	basic->cmd = cmd;
+	basic->flag = flag;
+	basic->value = value;
+	basic->shingles_count = RSPAMD_SHINGLE_SIZE;
+	memcpy(basic->digest, h->digest, sizeof(basic->digest));
+	memcpy(&io_cmd.cmd.shingle.sgl, &h->sgl, sizeof(h->sgl));
+	g_array_append_val(updates, io_cmd);
+}
+
+static void
+fuzzy_backend_test_make_query(struct rspamd_fuzzy_shingle_cmd *cmd,
+							  enum fuzzy_backend_test_query type,
+							  const struct fuzzy_backend_test_hash *h,
+							  const struct fuzzy_backend_test_hash *deleted)
+{
+	guint i;
+
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->basic.version = RSPAMD_FUZZY_VERSION;
+	cmd->basic.cmd = FUZZY_CHECK;
+	cmd->basic.shingles_count = RSPAMD_SHINGLE_SIZE;
+
+	switch (type) {
+	case FUZZY_BACKEND_TEST_DIGEST:
+		memcpy(cmd->basic.digest, h->digest, sizeof(cmd->basic.digest));
+		memcpy(&cmd->sgl, &h->sgl, sizeof(cmd->sgl));
+		break;
+	case FUZZY_BACKEND_TEST_SHINGLES:
+		/* Unknown digest found by shingles only */
+		ottery_rand_bytes(cmd->basic.digest, sizeof(cmd->basic.digest));
+		memcpy(&cmd->sgl, &h->sgl, sizeof(cmd->sgl));
+		break;
+	case FUZZY_BACKEND_TEST_PARTIAL_SHINGLES:
+		/* Too few shingles match */
+		ottery_rand_bytes(cmd->basic.digest, sizeof(cmd->basic.digest));
+		ottery_rand_bytes(&cmd->sgl, sizeof(cmd->sgl));
+
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE / 4; i++) {
+			cmd->sgl.hashes[i] = h->sgl.hashes[i];
+		}
+		break;
+	case FUZZY_BACKEND_TEST_DELETED:
+		memcpy(cmd->basic.digest, deleted->digest, sizeof(cmd->basic.digest));
+		memcpy(&cmd->sgl, &deleted->sgl, sizeof(cmd->sgl));
+		break;
+	default:
+		ottery_rand_bytes(cmd->basic.digest, sizeof(cmd->basic.digest));
+		ottery_rand_bytes(&cmd->sgl, sizeof(cmd->sgl));
+		break;
+	}
+}
+
+static struct rspamd_fuzzy_backend *
+fuzzy_backend_test_open(const gchar *type, const gchar *path)
+{
+	struct rspamd_fuzzy_backend *bk;
+	ucl_object_t *obj;
+	GError *err = NULL;
+
+	obj = ucl_object_typed_new(UCL_OBJECT);
+	ucl_object_insert_key(obj, ucl_object_fromstring(type), "backend", 0, false);
+	ucl_object_insert_key(obj, ucl_object_fromstring(path), "hashfile", 0, false);
+
+	bk = rspamd_fuzzy_backend_create(event_loop, obj, rspamd_main->cfg, &err);
+	ucl_object_unref(obj);
+
+	if (bk == NULL) {
+		g_error("cannot open %s fuzzy storage: %s", type, err->message);
+	}
+
+	return bk;
+}
+
+static void
+fuzzy_backend_test_cleanup(const gchar *dir)
+{
+	GDir *d;
+	const gchar *name;
+	gchar *path;
+
+	d = g_dir_open(dir, 0, NULL);
+
+	if (d) {
+		while ((name = g_dir_read_name(d)) != NULL) {
+			path = g_build_filename(dir, name, NULL);
+			unlink(path);
+			g_free(path);
+		}
+
+		g_dir_close(d);
+	}
+
+	rmdir(dir);
+}
+
+static void
+fuzzy_backend_test_batch(const gchar *type)
+{
+	struct rspamd_fuzzy_backend *bk;
+	struct fuzzy_backend_test_hash hashes[TEST_HASHES], deleted;
+	struct rspamd_fuzzy_shingle_cmd queries[TEST_HASHES * FUZZY_BACKEND_TEST_MAX + 1];
+	struct fuzzy_backend_test_result single[G_N_ELEMENTS(queries)],
+		batched[G_N_ELEMENTS(queries)];
+	const struct rspamd_fuzzy_cmd *cmds[G_N_ELEMENTS(queries)];
+	void *uds[G_N_ELEMENTS(queries)];
+	gchar *dir, *path;
+	GArray *updates;
+	GError *err = NULL;
+	gboolean success = FALSE;
+	guint i, nqueries = 0, nfound = 0;
+
+	dir = g_dir_make_tmp("rspamd_fuzzy_backend_XXXXXX", &err);
+	g_assert_no_error(err);
+	path = g_build_filename(dir, "fuzzy.db", NULL);
+	bk = fuzzy_backend_test_open(type, path);
+	updates = g_array_new(FALSE, FALSE, sizeof(struct fuzzy_peer_cmd));
+
+	for (i = 0; i < TEST_HASHES; i++) {
+		ottery_rand_bytes(&hashes[i], sizeof(hashes[i]));
+		fuzzy_backend_test_add_cmd(updates, FUZZY_WRITE, &hashes[i],
+								   i % 2 + 1, i + 1);
+	}
+
+	ottery_rand_bytes(&deleted, sizeof(deleted));
+	fuzzy_backend_test_add_cmd(updates, FUZZY_WRITE, &deleted, 1, 10);
+	rspamd_fuzzy_backend_process_updates(bk, updates, TEST_SOURCE,
+										 fuzzy_backend_test_update_cb, &success);
+	g_assert(success);
+
+	g_array_set_size(updates, 0);
+	fuzzy_backend_test_add_cmd(updates, FUZZY_DEL, &deleted, 1, 0);
+	success = FALSE;
+	rspamd_fuzzy_backend_process_updates(bk, updates, TEST_SOURCE,
+										 fuzzy_backend_test_update_cb, &success);
+	g_assert(success);
+
+	/* Hits and misses of all kinds interleaved, the same digest twice */
+	for (i = 0; i < TEST_HASHES * FUZZY_BACKEND_TEST_MAX; i++) {
+		fuzzy_backend_test_make_query(&queries[nqueries++],
+									  i % FUZZY_BACKEND_TEST_MAX,
+									  &hashes[i / FUZZY_BACKEND_TEST_MAX],
+									  &deleted);
+	}
+
+	fuzzy_backend_test_make_query(&queries[nqueries++],
+								  FUZZY_BACKEND_TEST_DIGEST, &hashes[0], &deleted);
+
+	memset(single, 0, sizeof(single));
+	memset(batched, 0, sizeof(batched));
+
+	for (i = 0; i < nqueries; i++) {
+		rspamd_fuzzy_backend_check(bk, &queries[i].basic,
+								   fuzzy_backend_test_check_cb, &single[i]);
+		cmds[i] = &queries[i].basic;
+		uds[i] = &batched[i];
+	}
+
+	rspamd_fuzzy_backend_check_batch(bk, cmds, nqueries,
+									 fuzzy_backend_test_check_cb, uds);
+
+	for (i = 0; i < nqueries; i++) {
+		g_assert(single[i].done);
+		g_assert(batched[i].done);
+		g_assert_cmpint(batched[i].rep.v1.value, ==, single[i].rep.v1.value);
+		g_assert_cmpint(batched[i].rep.v1.flag, ==, single[i].rep.v1.flag);
+		g_assert_cmpfloat(batched[i].rep.v1.prob, ==, single[i].rep.v1.prob);
+		g_assert_cmpint(batched[i].rep.ts, ==, single[i].rep.ts);
+
+		if (single[i].rep.v1.value != 0) {
+			g_assert(memcmp(batched[i].rep.digest, single[i].rep.digest,
+							sizeof(single[i].rep.digest)) == 0);
+			nfound++;
+		}
+	}
+
+	/* Digest and shingles queries of every hash plus the duplicate */
+	g_assert_cmpint(nfound, >=, TEST_HASHES * 2 + 1);
+
+	rspamd_fuzzy_backend_close(bk);
+	g_array_free(updates, TRUE);
+	fuzzy_backend_test_cleanup(dir);
+	g_free(path);
+	g_free(dir);
+}
+
+void rspamd_fuzzy_backend_test_func(void)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS(test_backends); i++) {
+		fuzzy_backend_test_batch(test_backends[i]);
+	}
+}
@@ -0,0 +1,313 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamd.h"
+#include "tests.h"
+#include "ottery.h"
+#include "fuzzy_wire.h"
+#include "libserver/fuzzy_backend/fuzzy_backend.h"
+
+#define TEST_SOURCE "test"
+#define TEST_MAX_SOURCES 16
+
+extern struct ev_loop *event_loop;
+extern struct rspamd_main *rspamd_main;
+
+struct fuzzy_memory_test_result {
+	gboolean success;
+	guint nadded;
+	guint ndeleted;
+	struct rspamd_fuzzy_reply rep;
+	guint64 val;
+};
+
+static void
+fuzzy_memory_update_cb(gboolean success, guint nadded, guint ndeleted,
+					   guint nextended, guint nignored, void *ud)
+{
+	struct fuzzy_memory_test_result *res = ud;
+
+	res->success = success;
+	res->nadded = nadded;
+	res->ndeleted = ndeleted;
+}
+
+static void
+fuzzy_memory_check_cb(struct rspamd_fuzzy_reply *rep, void *ud)
+{
+	struct fuzzy_memory_test_result *res = ud;
+
+	memcpy(&res->rep, rep, sizeof(*rep));
+}
+
+static void
+fuzzy_memory_val_cb(guint64 val, void *ud)
+{
+	struct fuzzy_memory_test_result *res = ud;
+
+	res->val = val;
+}
+
+static struct rspamd_fuzzy_backend *
+fuzzy_memory_open(const gchar *path, gdouble expire)
+{
+	struct rspamd_fuzzy_backend *bk;
+	ucl_object_t *obj;
+	GError *err = NULL;
+
+	obj = ucl_object_typed_new(UCL_OBJECT);
+	ucl_object_insert_key(obj, ucl_object_fromstring("memory"), "backend", 0, false);
+	ucl_object_insert_key(obj, ucl_object_fromstring(path), "hashfile", 0, false);
+	ucl_object_insert_key(obj, ucl_object_fromdouble(expire), "expire", 0, false);
+
+	bk = rspamd_fuzzy_backend_create(event_loop, obj, rspamd_main->cfg, &err);
+	ucl_object_unref(obj);
+
+	if (bk == NULL) {
+		g_error("cannot open fuzzy storage: %s", err->message);
+	}
+
+	return bk;
+}
+
+static void
+fuzzy_memory_cleanup(const gchar *path, const gchar *wal_path)
+{
+	unlink(path);
+	unlink(wal_path);
+}
+
+static void
+fuzzy_memory_add_cmd(GArray *updates, guint8 cmd, const gchar *digest,
+					 guint8 flag, gint32 value, const struct rspamd_shingle *sgl)
+{
+	struct fuzzy_peer_cmd io_cmd;
+	struct rspamd_fuzzy_cmd *basic;
+
+	memset(&io_cmd, 0, sizeof(io_cmd));
+
+	if (sgl) {
+		io_cmd.is_shingle = TRUE;
+		basic = &io_cmd.cmd.shingle.basic;
+		basic->shingles_count = RSPAMD_SHINGLE_SIZE;
+		memcpy(&io_cmd.cmd.shingle.sgl, sgl, sizeof(*sgl));
+	}
+	else {
+		basic = &io_cmd.cmd.normal;
+	}
+
+	basic->version = RSPAMD_FUZZY_VERSION;
+	basic->cmd = cmd;
+	basic->flag = flag;
+	basic->value = value;
+	memcpy(basic->digest, digest, sizeof(basic->digest));
+	g_array_append_val(updates, io_cmd);
+}
+
+static void
+fuzzy_memory_update_source(struct rspamd_fuzzy_backend *bk, GArray *updates,
+						   const gchar *src,
+						   struct fuzzy_memory_test_result *res)
+{
+	memset(res, 0, sizeof(*res));
+	rspamd_fuzzy_backend_process_updates(bk, updates, src,
+										 fuzzy_memory_update_cb, res);
+	g_array_set_size(updates, 0);
+}
+
+static void
+fuzzy_memory_update(struct rspamd_fuzzy_backend *bk, GArray *updates,
+					struct fuzzy_memory_test_result *res)
+{
+	fuzzy_memory_update_source(bk, updates, TEST_SOURCE, res);
+	g_assert(res->success);
+}
+
+static void
+fuzzy_memory_check(struct rspamd_fuzzy_backend *bk, const gchar *digest,
+				   const struct rspamd_shingle *sgl,
+				   struct fuzzy_memory_test_result *res)
+{
+	struct rspamd_fuzzy_shingle_cmd cmd;
+
+	memset(&cmd, 0, sizeof(cmd));
+	memset(res, 0, sizeof(*res));
+	cmd.basic.version = RSPAMD_FUZZY_VERSION;
+	cmd.basic.cmd = FUZZY_CHECK;
+	memcpy(cmd.basic.digest, digest, sizeof(cmd.basic.digest));
+
+	if (sgl) {
+		cmd.basic.shingles_count = RSPAMD_SHINGLE_SIZE;
+		memcpy(&cmd.sgl, sgl, sizeof(*sgl));
+	}
+
+	rspamd_fuzzy_backend_check(bk, &cmd.basic, fuzzy_memory_check_cb, res);
+}
+
+static void
+fuzzy_memory_check_state(struct rspamd_fuzzy_backend *bk,
+						 const gchar *d1, const gchar *d2, const gchar *d3,
+						 const struct rspamd_shingle *sgl)
+{
+	struct fuzzy_memory_test_result res;
+
+	/* Weight of the same flag is increased */
+	fuzzy_memory_check(bk, d1, NULL, &res);
+	g_assert_cmpint(res.rep.v1.value, ==, 15);
+	g_assert_cmpint(res.rep.v1.flag, ==, 1);
+	g_assert(res.rep.v1.prob > 0.99f);
+
+	/* Deleted hash */
+	fuzzy_memory_check(bk, d2, NULL, &res);
+	g_assert_cmpint(res.rep.v1.value, ==, 0);
+
+	/* Unknown digest with the same shingles */
+	fuzzy_memory_check(bk, d3, sgl, &res);
+	g_assert(res.rep.v1.prob > 0.99f);
+	g_assert_cmpint(res.rep.v1.value, ==, 15);
+	g_assert(memcmp(res.rep.digest, d1, sizeof(res.rep.digest)) == 0);
+
+	rspamd_fuzzy_backend_count(bk, fuzzy_memory_val_cb, &res);
+	g_assert_cmpint(res.val, ==, 1);
+	rspamd_fuzzy_backend_version(bk, TEST_SOURCE, fuzzy_memory_val_cb, &res);
+	g_assert_cmpint(res.val, ==, 2);
+}
+
+void rspamd_fuzzy_memory_test_func(void)
+{
+	struct rspamd_fuzzy_backend *bk;
+	struct fuzzy_memory_test_result res;
+	struct rspamd_shingle sgl;
+	gchar d1[rspamd_cryptobox_HASHBYTES], d2[rspamd_cryptobox_HASHBYTES],
+		d3[rspamd_cryptobox_HASHBYTES];
+	gchar *dir, *path, *wal_path, *wal_content, src[32];
+	gsize wal_len;
+	GArray *updates;
+	GError *err = NULL;
+	guint i;
+
+	ottery_rand_bytes(d1, sizeof(d1));
+	ottery_rand_bytes(d2, sizeof(d2));
+	ottery_rand_bytes(d3, sizeof(d3));
+	ottery_rand_bytes(&sgl, sizeof(sgl));
+	updates = g_array_new(FALSE, FALSE, sizeof(struct fuzzy_peer_cmd));
+
+	dir = g_dir_make_tmp("rspamd_fuzzy_memory_XXXXXX", &err);
+	g_assert_no_error(err);
+	path = g_build_filename(dir, "fuzzy.db", NULL);
+	wal_path = g_strconcat(path, ".wal", NULL);
+
+	/* Check and update */
+	bk = fuzzy_memory_open(path, 3600.0);
+
+	fuzzy_memory_add_cmd(updates, FUZZY_WRITE, d1, 1, 10, &sgl);
+	fuzzy_memory_add_cmd(updates, FUZZY_WRITE, d2, 2, 5, NULL);
+	fuzzy_memory_update(bk, updates, &res);
+	g_assert_cmpint(res.nadded, ==, 2);
+
+	fuzzy_memory_check(bk, d2, NULL, &res);
+	g_assert_cmpint(res.rep.v1.value, ==, 5);
+	g_assert_cmpint(res.rep.v1.flag, ==, 2);
+
+	fuzzy_memory_add_cmd(updates, FUZZY_WRITE, d1, 1, 5, NULL);
+	fuzzy_memory_add_cmd(updates, FUZZY_DEL, d2, 0, 0, NULL);
+	fuzzy_memory_update(bk, updates, &res);
+	g_assert_cmpint(res.ndeleted, ==, 1);
+
+	fuzzy_memory_check_state(bk, d1, d2, d3, &sgl);
+
+	/*
+	 * Replay: the log written since the last snapshot must restore the
+	 * storage from scratch
+	 */
+	g_assert(g_file_get_contents(wal_path, &wal_content, &wal_len, NULL));
+	g_assert_cmpint(wal_len, >, 0);
+	rspamd_fuzzy_backend_close(bk);
+	fuzzy_memory_cleanup(path, wal_path);
+	g_assert(g_file_set_contents(wal_path, wal_content, wal_len, NULL));
+	g_free(wal_content);
+
+	bk = fuzzy_memory_open(path, 3600.0);
+	fuzzy_memory_check_state(bk, d1, d2, d3, &sgl);
+	rspamd_fuzzy_backend_close(bk);
+
+	/* Snapshot on close and reopen */
+	bk = fuzzy_memory_open(path, 3600.0);
+	fuzzy_memory_check_state(bk, d1, d2, d3, &sgl);
+
+	/*
+	 * Versions table is limited, so an update from one source too many
+	 * must fail and leave the storage intact
+	 */
+	for (i = 1; i < TEST_MAX_SOURCES; i++) {
+		rspamd_snprintf(src, sizeof(src), "source%ud", i);
+		fuzzy_memory_add_cmd(updates, FUZZY_WRITE, d2, 2, 5, NULL);
+		fuzzy_memory_update_source(bk, updates, src, &res);
+		g_assert(res.success);
+	}
+
+	fuzzy_memory_add_cmd(updates, FUZZY_WRITE, d3, 3, 5, NULL);
+	fuzzy_memory_update_source(bk, updates, "overflow", &res);
+	g_assert(!res.success);
+	fuzzy_memory_check(bk, d3, NULL, &res);
+	g_assert_cmpint(res.rep.v1.value, ==, 0);
+
+	/* Known sources are still updated */
+	fuzzy_memory_add_cmd(updates, FUZZY_DEL, d2, 0, 0, NULL);
+	fuzzy_memory_update(bk, updates, &res);
+	g_assert_cmpint(res.ndeleted, ==, 1);
+	rspamd_fuzzy_backend_count(bk, fuzzy_memory_val_cb, &res);
+	g_assert_cmpint(res.val, ==, 1);
+	rspamd_fuzzy_backend_version(bk, TEST_SOURCE, fuzzy_memory_val_cb, &res);
+	g_assert_cmpint(res.val, ==, 3);
+	rspamd_fuzzy_backend_close(bk);
+
+	/*
+	 * Expire: with the negative expire time every stored hash is already
+	 * expired, so no wall clock waiting is needed
+	 */
+	fuzzy_memory_cleanup(path, wal_path);
+	bk = fuzzy_memory_open(path, 3600.0);
+	fuzzy_memory_add_cmd(updates, FUZZY_WRITE, d1, 1, 10, &sgl);
+	fuzzy_memory_update(bk, updates, &res);
+
+	fuzzy_memory_check(bk, d1, NULL, &res);
+	g_assert_cmpint(res.rep.v1.value, ==, 10);
+	rspamd_fuzzy_backend_close(bk);
+
+	bk = fuzzy_memory_open(path, -1.0);
+	fuzzy_memory_check(bk, d1, NULL, &res);
+	g_assert_cmpint(res.rep.v1.value, ==, 0);
+	fuzzy_memory_check(bk, d3, &sgl, &res);
+	g_assert_cmpint(res.rep.v1.value, ==, 0);
+
+	/* Expired hashes are still stored until the periodic callback */
+	rspamd_fuzzy_backend_count(bk, fuzzy_memory_val_cb, &res);
+	g_assert_cmpint(res.val, ==, 1);
+
+	/* Periodic callback is called immediately */
+	rspamd_fuzzy_backend_start_update(bk, 3600.0, NULL, NULL);
+	rspamd_fuzzy_backend_count(bk, fuzzy_memory_val_cb, &res);
+	g_assert_cmpint(res.val, ==, 0);
+
+	rspamd_fuzzy_backend_close(bk);
+	fuzzy_memory_cleanup(path, wal_path);
+	rmdir(dir);
+	g_free(wal_path);
+	g_free(path);
+	g_free(dir);
+	g_array_free(updates, TRUE);
+}
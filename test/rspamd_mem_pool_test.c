@@ -1,5 +1,7 @@
 #include "config.h"
 #include "mem_pool.h"
+#include "util.h"
+#include "logger.h"
 #include "tests.h"
 #include "unix-std.h"
 #include <math.h>
@@ -11,11 +13,46 @@
 #define TEST_BUF "test buffer"
 #define TEST2_BUF "test buffertest buffer"
 
+static void
+rspamd_mem_pool_accounting_cb(const struct rspamd_mempool_accounting_stat *st,
+							  gpointer ud)
+{
+	if (st->type == RSPAMD_MEMPOOL_ACCOUNT_STAGE && strcmp(st->name, "test") == 0) {
+		memcpy(ud, st, sizeof(*st));
+	}
+}
+
+static gdouble
+rspamd_mem_pool_bench(guint iters)
+{
+	rspamd_mempool_t *pool;
+	gdouble t1, t2;
+	guint i, j;
+
+	t1 = rspamd_get_ticks(TRUE);
+
+	for (i = 0; i < iters; i++) {
+		pool = rspamd_mempool_new(4096, NULL, 0);
+
+		/* Force several extra chains as a typical task pool does */
+		for (j = 0; j < 16; j++) {
+			memset(rspamd_mempool_alloc(pool, 2048), 0, 2048);
+		}
+
+		rspamd_mempool_delete(pool);
+	}
+
+	t2 = rspamd_get_ticks(TRUE);
+
+	return t2 - t1;
+}
+
 void rspamd_mem_pool_test_func(void)
 {
 	rspamd_mempool_t *pool;
 	rspamd_mempool_stat_t st;
 	char *tmp, *tmp2, *tmp3;
+	guint reused;
 
 	pool = rspamd_mempool_new(sizeof(TEST_BUF), NULL, 0);
 	tmp = rspamd_mempool_alloc(pool, sizeof(TEST_BUF));
@@ -32,4 +69,36 @@ void rspamd_mem_pool_test_func(void)
 
 	rspamd_mempool_delete(pool);
 	rspamd_mempool_stat(&st);
+
+	/* Chains of a deleted pool must be reused by the next one */
+	reused = st.chunks_reused;
+	pool = rspamd_mempool_new(sizeof(TEST_BUF), NULL, 0);
+	tmp = rspamd_mempool_alloc(pool, sizeof(TEST_BUF) * 2);
+	snprintf(tmp, sizeof(TEST_BUF) * 2, "%s", TEST2_BUF);
+	g_assert(strncmp(tmp, TEST2_BUF, sizeof(TEST2_BUF)) == 0);
+	rspamd_mempool_delete(pool);
+	rspamd_mempool_stat(&st);
+
+	if (getenv("VALGRIND") == NULL) {
+		g_assert(st.chunks_reused > reused);
+	}
+
+	struct rspamd_mempool_accounting_stat acct;
+
+	memset(&acct, 0, sizeof(acct));
+
+	for (guint i = 0; i < 100; i++) {
+		rspamd_mempool_account(RSPAMD_MEMPOOL_ACCOUNT_STAGE, "test", i < 98 ? 1000 : 100000);
+	}
+
+	rspamd_mempool_accounting_foreach(rspamd_mem_pool_accounting_cb, &acct);
+	g_assert(acct.count == 100);
+	g_assert(acct.bytes == 98 * 1000 + 2 * 100000);
+	g_assert(acct.p50 >= 512 && acct.p50 <= 1024);
+	g_assert(acct.p99 >= 65536 && acct.p99 <= 131072);
+
+	rspamd_mempool_cache_limit(0, 0);
+	msg_info("pools without cache: %.0f", rspamd_mem_pool_bench(10000));
+	rspamd_mempool_cache_limit(32, 32 * 1024 * 1024);
+	msg_info("pools with cache: %.0f", rspamd_mem_pool_bench(10000));
 }
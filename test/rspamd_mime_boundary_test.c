@@ -0,0 +1,164 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamd.h"
+#include "tests.h"
+#include "ottery.h"
+#include "multipattern.h"
+#include "libmime/mime_parser.h"
+
+#define TEST_RANDOM_ITERATIONS 10000
+#define TEST_RANDOM_MAX_LEN 100
+#define TEST_MAX_SHIFT 40
+
+/* Boundaries and fragments that look like them */
+static const gchar *test_patterns[] = {
+	"\n--",
+	"\r--",
+	"\r\n--",
+	"\n--boundary\r\n",
+	"\r\n--boundary--\r\n",
+	"\n----",
+	"\n--\n--\r--",
+	"\n-\n--",
+	"--",
+	"-\n-",
+	"a--",
+};
+
+static gint
+mime_boundary_test_mp_cb(struct rspamd_multipattern *mp,
+						 guint strnum,
+						 gint match_start,
+						 gint match_pos,
+						 const gchar *text,
+						 gsize len,
+						 void *context)
+{
+	GArray *matches = context;
+	gsize pos = match_pos;
+
+	g_array_append_val(matches, pos);
+
+	return 0;
+}
+
+static void
+mime_boundary_test_scan_cb(const gchar *text, gsize len, gsize match_pos,
+						   void *ud)
+{
+	GArray *matches = ud;
+
+	g_assert_cmpint(match_pos, <=, len);
+	g_array_append_val(matches, match_pos);
+}
+
+static void
+mime_boundary_test_check(struct rspamd_multipattern *mp,
+						 const gchar *in, gsize len)
+{
+	GArray *expected, *found;
+	gchar *text;
+	guint i;
+
+	/* Exact size copy, so reads after the end are caught by sanitizers */
+	text = g_malloc(MAX(len, 1));
+	memcpy(text, in, len);
+	expected = g_array_new(FALSE, FALSE, sizeof(gsize));
+	found = g_array_new(FALSE, FALSE, sizeof(gsize));
+
+	rspamd_multipattern_lookup(mp, text, len, mime_boundary_test_mp_cb,
+							   expected, NULL);
+	rspamd_mime_scan_boundaries(text, len, mime_boundary_test_scan_cb, found);
+
+	g_assert_cmpint(found->len, ==, expected->len);
+
+	for (i = 0; i < found->len; i++) {
+		g_assert_cmpint(g_array_index(found, gsize, i), ==,
+						g_array_index(expected, gsize, i));
+	}
+
+	g_array_free(expected, TRUE);
+	g_array_free(found, TRUE);
+	g_free(text);
+}
+
+/* Places a pattern at all offsets of a buffer to cross the 16 bytes blocks */
+static void
+mime_boundary_test_shifted(struct rspamd_multipattern *mp,
+						   const gchar *pattern, gchar filler)
+{
+	gchar buf[TEST_MAX_SHIFT + 64];
+	gsize plen = strlen(pattern), shift, tail;
+
+	for (shift = 0; shift <= TEST_MAX_SHIFT; shift++) {
+		for (tail = 0; tail <= 17; tail++) {
+			memset(buf, filler, sizeof(buf));
+			memcpy(buf + shift, pattern, plen);
+			mime_boundary_test_check(mp, buf, shift + plen + tail);
+		}
+	}
+}
+
+void rspamd_mime_boundary_test_func(void)
+{
+	static const gchar alphabet[] = "-\r\na";
+	struct rspamd_multipattern *mp;
+	gchar buf[TEST_RANDOM_MAX_LEN + 1];
+	GError *err = NULL;
+	gsize len, j;
+	guint i;
+
+	/* The same patterns as the mime parser used before the scanner */
+	mp = rspamd_multipattern_create(RSPAMD_MULTIPATTERN_DEFAULT);
+	rspamd_multipattern_add_pattern(mp, "\r--", 0);
+	rspamd_multipattern_add_pattern(mp, "\n--", 0);
+	g_assert(rspamd_multipattern_compile(mp, RSPAMD_MULTIPATTERN_COMPILE_NO_FS,
+										 &err));
+	g_assert_no_error(err);
+
+	/* Short inputs are handled by the scalar part only */
+	mime_boundary_test_check(mp, "", 0);
+	mime_boundary_test_check(mp, "\n-", 2);
+	mime_boundary_test_check(mp, "\n--", 3);
+	mime_boundary_test_check(mp, "\r\n--", 4);
+	mime_boundary_test_check(mp, "\n--b\r\n--b--\r\n", 13);
+	/* Match at offset 1 is the first position checked by the vector loop */
+	mime_boundary_test_check(mp, "\n--boundary\r\n--boundary--\r\n", 27);
+	/* Dashes straddle the edge of the first 16 bytes block */
+	mime_boundary_test_check(mp, "aaaaaaaaaaaaaaa\n--aaaaaaaaaaaaaaaaa", 35);
+	mime_boundary_test_check(mp, "aaaaaaaaaaaaaa\r\n--aaaaaaaaaaaaaaaaa", 35);
+	mime_boundary_test_check(mp, "aaaaaaaaaaaaaaaa\n--aaaaaaaaaaaaaaaa", 35);
+
+	for (i = 0; i < G_N_ELEMENTS(test_patterns); i++) {
+		mime_boundary_test_shifted(mp, test_patterns[i], 'a');
+		mime_boundary_test_shifted(mp, test_patterns[i], '-');
+		mime_boundary_test_shifted(mp, test_patterns[i], '\n');
+	}
+
+	/* Dense random texts have matches everywhere */
+	for (i = 0; i < TEST_RANDOM_ITERATIONS; i++) {
+		len = ottery_rand_range(TEST_RANDOM_MAX_LEN);
+
+		for (j = 0; j < len; j++) {
+			buf[j] = alphabet[ottery_rand_range(sizeof(alphabet) - 2)];
+		}
+
+		mime_boundary_test_check(mp, buf, len);
+	}
+
+	rspamd_multipattern_destroy(mp);
+}
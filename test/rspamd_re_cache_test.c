@@ -0,0 +1,250 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamd.h"
+#include "tests.h"
+#include "libserver/re_cache.h"
+#include "contrib/libev/ev.h"
+
+#define TEST_COMPILE_THREADS 4
+
+extern struct ev_loop *event_loop;
+extern struct rspamd_main *rspamd_main;
+
+#ifdef WITH_HYPERSCAN
+struct re_cache_test_re {
+	enum rspamd_re_type type;
+	const gchar *type_data;
+	const gchar *pattern;
+};
+
+static const struct re_cache_test_re test_regexps[] = {
+	{RSPAMD_RE_HEADER, "Subject", "/viagra/i"},
+	{RSPAMD_RE_HEADER, "Subject", "/^re: .+ offer$/i"},
+	{RSPAMD_RE_HEADER, "From", "/@example\\.com>?$/i"},
+	{RSPAMD_RE_MIMEHEADER, "Content-Type", "/multipart\\/mixed/i"},
+	{RSPAMD_RE_BODY, NULL, "/hello\\s+world/"},
+	{RSPAMD_RE_BODY, NULL, "/(?:buy|sell)\\s+now/i"},
+	{RSPAMD_RE_SABODY, NULL, "/\\bunsubscribe\\b/i"},
+	{RSPAMD_RE_URL, NULL, "/^https?:\\/\\/[^\\/]+\\.example\\.org/i"},
+	{RSPAMD_RE_RAWMIME, NULL, "/X-Mailer: spammer/"},
+};
+
+/* The same regexps in the reversed order and a new one in the body class */
+static const struct re_cache_test_re test_regexps_changed[] = {
+	{RSPAMD_RE_RAWMIME, NULL, "/X-Mailer: spammer/"},
+	{RSPAMD_RE_URL, NULL, "/^https?:\\/\\/[^\\/]+\\.example\\.org/i"},
+	{RSPAMD_RE_SABODY, NULL, "/\\bunsubscribe\\b/i"},
+	{RSPAMD_RE_BODY, NULL, "/(?:buy|sell)\\s+now/i"},
+	{RSPAMD_RE_BODY, NULL, "/hello\\s+world/"},
+	{RSPAMD_RE_MIMEHEADER, "Content-Type", "/multipart\\/mixed/i"},
+	{RSPAMD_RE_HEADER, "From", "/@example\\.com>?$/i"},
+	{RSPAMD_RE_HEADER, "Subject", "/^re: .+ offer$/i"},
+	{RSPAMD_RE_HEADER, "Subject", "/viagra/i"},
+	{RSPAMD_RE_BODY, NULL, "/free\\s+money/i"},
+};
+
+struct re_cache_test_result {
+	gboolean done;
+	guint ncompiled;
+	gboolean failed;
+};
+
+static void
+re_cache_test_compile_cb(guint ncompiled, GError *err, void *cbd)
+{
+	struct re_cache_test_result *res = cbd;
+
+	if (err) {
+		g_print("cannot compile hyperscan: %s\n", err->message);
+		res->failed = TRUE;
+		return;
+	}
+
+	res->done = TRUE;
+	res->ncompiled = ncompiled;
+	ev_break(event_loop, EVBREAK_ONE);
+}
+
+static struct rspamd_re_cache *
+re_cache_test_new(const struct re_cache_test_re *regexps, guint nregexps)
+{
+	struct rspamd_re_cache *cache;
+	rspamd_regexp_t *re;
+	GError *err = NULL;
+	guint i;
+
+	cache = rspamd_re_cache_new();
+
+	for (i = 0; i < nregexps; i++) {
+		re = rspamd_regexp_new(regexps[i].pattern, NULL, &err);
+		g_assert_no_error(err);
+		rspamd_re_cache_add(cache, re, regexps[i].type,
+							regexps[i].type_data,
+							regexps[i].type_data ? strlen(regexps[i].type_data) + 1 : 0,
+							-1);
+		rspamd_regexp_unref(re);
+	}
+
+	rspamd_re_cache_init(cache, rspamd_main->cfg);
+
+	return cache;
+}
+
+static guint
+re_cache_test_compile(struct rspamd_re_cache *cache, const gchar *dir,
+					  guint nthreads)
+{
+	struct re_cache_test_result res;
+
+	memset(&res, 0, sizeof(res));
+	g_assert_cmpint(rspamd_re_cache_compile_hyperscan(cache, dir, 1.0, FALSE,
+													  nthreads, event_loop,
+													  re_cache_test_compile_cb, &res),
+					==, 0);
+	ev_run(event_loop, 0);
+
+	g_assert(res.done);
+	g_assert(!res.failed);
+
+	return res.ncompiled;
+}
+
+/*
+ * Checks all files in the directory that belong to the cache and returns
+ * their names
+ */
+static GHashTable *
+re_cache_test_check_files(struct rspamd_re_cache *cache, const gchar *dir)
+{
+	GDir *d;
+	GHashTable *files;
+	const gchar *name;
+	gchar *path;
+	GError *err = NULL;
+
+	files = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	d = g_dir_open(dir, 0, &err);
+	g_assert_no_error(err);
+
+	while ((name = g_dir_read_name(d)) != NULL) {
+		path = g_build_filename(dir, name, NULL);
+		g_assert(g_str_has_suffix(name, ".hs"));
+
+		if (rspamd_re_cache_is_valid_hyperscan_file(cache, path,
+													TRUE, TRUE, NULL)) {
+			g_hash_table_add(files, g_strdup(name));
+		}
+
+		g_free(path);
+	}
+
+	g_dir_close(d);
+
+	return files;
+}
+
+static void
+re_cache_test_cleanup(const gchar *dir)
+{
+	GDir *d;
+	const gchar *name;
+	gchar *path;
+
+	d = g_dir_open(dir, 0, NULL);
+
+	if (d) {
+		while ((name = g_dir_read_name(d)) != NULL) {
+			path = g_build_filename(dir, name, NULL);
+			unlink(path);
+			g_free(path);
+		}
+
+		g_dir_close(d);
+	}
+
+	rmdir(dir);
+}
+#endif
+
+void rspamd_re_cache_test_func(void)
+{
+#ifndef WITH_HYPERSCAN
+	g_test_skip("hyperscan is not supported");
+#else
+	struct rspamd_re_cache *cache;
+	GHashTable *files, *new_files;
+	GHashTableIter it;
+	gpointer k;
+	gchar *dir;
+	GError *err = NULL;
+	guint nreused = 0;
+
+	if (rspamd_main->cfg->disable_hyperscan) {
+		g_test_skip("hyperscan is disabled");
+		return;
+	}
+
+	dir = g_dir_make_tmp("rspamd_re_cache_XXXXXX", &err);
+	g_assert_no_error(err);
+
+	/* Compile all classes through the threads pool */
+	cache = re_cache_test_new(test_regexps, G_N_ELEMENTS(test_regexps));
+	g_assert_cmpint(re_cache_test_compile(cache, dir, TEST_COMPILE_THREADS),
+					==, G_N_ELEMENTS(test_regexps));
+
+	/* Subject, From, Content-Type, body, sabody, url and rawmime classes */
+	files = re_cache_test_check_files(cache, dir);
+	g_assert_cmpint(g_hash_table_size(files), ==, 7);
+	g_assert_cmpint(rspamd_re_cache_load_hyperscan(cache, dir, false),
+					==, RSPAMD_HYPERSCAN_LOADED_FULL);
+	rspamd_re_cache_unref(cache);
+
+	/* The same regexps in another order need no compilation */
+	cache = re_cache_test_new(test_regexps_changed,
+							  G_N_ELEMENTS(test_regexps_changed) - 1);
+	g_assert_cmpint(re_cache_test_compile(cache, dir, 1), ==, 0);
+	rspamd_re_cache_unref(cache);
+
+	/*
+	 * File names depend on the class content only, so a new regexp
+	 * recompiles its class and all other files are reused
+	 */
+	cache = re_cache_test_new(test_regexps_changed,
+							  G_N_ELEMENTS(test_regexps_changed));
+	g_assert_cmpint(re_cache_test_compile(cache, dir, TEST_COMPILE_THREADS),
+					==, 3);
+	new_files = re_cache_test_check_files(cache, dir);
+	g_assert_cmpint(g_hash_table_size(new_files), ==, 7);
+	g_hash_table_iter_init(&it, new_files);
+
+	while (g_hash_table_iter_next(&it, &k, NULL)) {
+		if (g_hash_table_contains(files, k)) {
+			nreused++;
+		}
+	}
+
+	g_assert_cmpint(nreused, ==, 6);
+	g_assert_cmpint(rspamd_re_cache_load_hyperscan(cache, dir, false),
+					==, RSPAMD_HYPERSCAN_LOADED_FULL);
+	rspamd_re_cache_unref(cache);
+	g_hash_table_unref(files);
+	g_hash_table_unref(new_files);
+
+	re_cache_test_cleanup(dir);
+	g_free(dir);
+#endif
+}
@@ -16,6 +16,7 @@
 #include "config.h"
 #include "rspamd.h"
 #include "shingles.h"
+#include "cryptobox.h"
 #include "ottery.h"
 #include <math.h>
 
@@ -276,6 +277,43 @@ static const guint64 expected_fasthash[RSPAMD_SHINGLE_SIZE] = {
 	0x954cda70edf6591f,
 };
 
+/* Portable implementation has no public header */
+void siphash_multi_ref(guint64 *out, const unsigned char *in, gsize inlen,
+					   const unsigned char *keys, gsize nkeys);
+
+/*
+ * Multi-key siphash must produce exactly the same hashes as siphash called
+ * for each key, as shingles are stored in fuzzy storages. Both the portable
+ * implementation and the one selected for this CPU are checked
+ */
+static void
+test_siphash_multi(void)
+{
+	guchar keys[RSPAMD_SHINGLE_SIZE + 5][rspamd_cryptobox_SIPKEYBYTES];
+	guchar input[256];
+	guint64 multi[RSPAMD_SHINGLE_SIZE + 5], ref[RSPAMD_SHINGLE_SIZE + 5],
+		single;
+	gsize len, nkeys, i;
+
+	ottery_rand_bytes(keys, sizeof(keys));
+	ottery_rand_bytes(input, sizeof(input));
+
+	for (len = 0; len < sizeof(input); len++) {
+		for (nkeys = 1; nkeys <= G_N_ELEMENTS(keys); nkeys++) {
+			siphash_multi_ref(ref, input, len, (const guchar *) keys, nkeys);
+			rspamd_cryptobox_siphash_multi(multi, input, len,
+										   (const guchar *) keys, nkeys);
+
+			for (i = 0; i < nkeys; i++) {
+				rspamd_cryptobox_siphash((guchar *) &single, input, len,
+										 keys[i]);
+				g_assert(ref[i] == single);
+				g_assert(multi[i] == single);
+			}
+		}
+	}
+}
+
 void rspamd_shingles_test_func(void)
 {
 	enum rspamd_shingle_alg alg = RSPAMD_SHINGLES_OLD;
@@ -285,6 +323,8 @@ void rspamd_shingles_test_func(void)
 	rspamd_ftok_t tok;
 	int i;
 
+	test_siphash_multi();
+
 	memset(key, 0, sizeof(key));
 	input = g_array_sized_new(FALSE, FALSE, sizeof(rspamd_ftok_t), 5);
 
@@ -3,45 +3,223 @@
 #include "tests.h"
 #include "ottery.h"
 
-#define TEST_FILENAME "/tmp/rspamd_test.stat"
 #define HASHES_NUM 256
+#define TEST_BUCKET_SIZE 64
+#define TEST_BUCKET_SLOTS 10
+#define TEST_BUCKETS 64
+
+/* Mmaped file backend has no public header */
+gpointer rspamd_mmaped_file_open(rspamd_mempool_t *pool,
+								 const gchar *filename, size_t size,
+								 struct rspamd_statfile_config *stcf);
+gint rspamd_mmaped_file_create(const gchar *filename, size_t size,
+							   struct rspamd_statfile_config *stcf,
+							   rspamd_mempool_t *pool);
+gint rspamd_mmaped_file_close_file(rspamd_mempool_t *pool, gpointer file);
+double rspamd_mmaped_file_get_block(gpointer file, guint32 h1);
+void rspamd_mmaped_file_set_block(rspamd_mempool_t *pool, gpointer file,
+								  guint32 h1, double value);
+gboolean rspamd_mmaped_file_get_revision(gpointer file, guint64 *rev, time_t *time);
+
+/* Statfile header and the first section, the same for 1.2 and 1.3 formats */
+struct test_stat_file_header {
+	u_char magic[3];
+	u_char version[2];
+	u_char padding[3];
+	guint64 create_time;
+	guint64 revision;
+	guint64 rev_time;
+	guint64 used_blocks;
+	guint64 total_blocks;
+	guint64 tokenizer_conf_len;
+	u_char unused[231];
+};
+
+struct test_stat_file_section {
+	guint64 code;
+	guint64 length;
+};
+
+struct test_stat_file {
+	struct test_stat_file_header header;
+	struct test_stat_file_section section;
+};
+
+/* Buckets start after the header aligned to the bucket size */
+#define TEST_DATA_OFFSET \
+	((sizeof(struct test_stat_file) + TEST_BUCKET_SIZE - 1) & ~((gsize) TEST_BUCKET_SIZE - 1))
+#define TEST_SIZE (TEST_DATA_OFFSET + TEST_BUCKET_SIZE * TEST_BUCKETS)
+
+/* Block of 1.2 format */
+
+struct legacy_stat_block {
+	guint32 hash1;
+	guint32 hash2;
+	double value;
+};
+
+static void
+rspamd_statfile_test_cleanup(const gchar *dir)
+{
+	GDir *d;
+	const gchar *name;
+	gchar *path;
+
+	d = g_dir_open(dir, 0, NULL);
+
+	if (d) {
+		while ((name = g_dir_read_name(d)) != NULL) {
+			path = g_build_filename(dir, name, NULL);
+			unlink(path);
+			g_free(path);
+		}
+
+		g_dir_close(d);
+	}
+}
+
+static void
+rspamd_statfile_test_legacy(rspamd_mempool_t *p,
+							struct rspamd_statfile_config *stcf,
+							const gchar *path)
+{
+	struct test_stat_file header;
+	struct legacy_stat_block blocks[HASHES_NUM];
+	gpointer st;
+	gchar *backup_path;
+	guint64 rev;
+	time_t rev_time;
+	guint i;
+	gint fd;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.header.magic, "rsd", sizeof(header.header.magic));
+	header.header.version[0] = '1';
+	header.header.version[1] = '2';
+	header.header.revision = 42;
+	header.header.rev_time = 100500;
+	header.header.used_blocks = HASHES_NUM;
+	header.header.total_blocks = HASHES_NUM;
+	header.section.code = 1;
+	header.section.length = HASHES_NUM;
+
+	for (i = 0; i < HASHES_NUM; i++) {
+		blocks[i].hash1 = i + 1;
+		blocks[i].hash2 = ottery_rand_uint32();
+		blocks[i].value = i + 1;
+	}
+
+	/* Saturated to 16 bits */
+	blocks[0].value = 100500.0;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 00600);
+	g_assert(fd != -1);
+	g_assert(write(fd, &header, sizeof(header)) == sizeof(header));
+	g_assert(write(fd, blocks, sizeof(blocks)) == sizeof(blocks));
+	close(fd);
+
+	st = rspamd_mmaped_file_open(p, path, TEST_SIZE, stcf);
+	g_assert(st != NULL);
+
+	/* Legacy file must be kept as conversion loses data */
+	backup_path = g_strconcat(path, ".old", NULL);
+	g_assert(g_file_test(backup_path, G_FILE_TEST_IS_REGULAR));
+	g_free(backup_path);
+
+	g_assert(rspamd_mmaped_file_get_revision(st, &rev, &rev_time));
+	g_assert_cmpint(rev, ==, 42);
+	g_assert_cmpint(rev_time, ==, 100500);
+
+	g_assert(rspamd_mmaped_file_get_block(st, 1) == G_MAXUINT16);
+
+	for (i = 1; i < HASHES_NUM; i++) {
+		g_assert(rspamd_mmaped_file_get_block(st, i + 1) == i + 1);
+	}
+
+	rspamd_mmaped_file_close_file(p, st);
+}
 
 void rspamd_statfile_test_func(void)
 {
-	/*
-	 * XXX: broken, old, need to be rewritten
-	 */
-#if 0
-	statfile_pool_t *pool;
+	struct rspamd_statfile_config stcf;
+	struct rspamd_classifier_config clcf;
+	struct rspamd_tokenizer_config tkcf;
 	rspamd_mempool_t *p;
-	stat_file_t *st;
-	uint32_t random_hashes[HASHES_NUM], i, v;
-	time_t now = time (NULL);
-	
-	p = rspamd_mempool_new (rspamd_mempool_suggest_size ());
-	umask (S_IWGRP | S_IWOTH);
-	pool = statfile_pool_new (p, TRUE);
+	gpointer st;
+	gchar *dir, *path;
+	GError *err = NULL;
+	guint32 random_hashes[HASHES_NUM], h;
+	guint i;
+
+	p = rspamd_mempool_new(rspamd_mempool_suggest_size(), "statfile", 0);
+	memset(&stcf, 0, sizeof(stcf));
+	memset(&clcf, 0, sizeof(clcf));
+	memset(&tkcf, 0, sizeof(tkcf));
+	tkcf.name = "osb";
+	clcf.tokenizer = &tkcf;
+	stcf.clcf = &clcf;
 
-	for (i = 0; i < HASHES_NUM; i ++) {
-		random_hashes[i] = ottery_rand_uint32 ();
+	for (i = 0; i < HASHES_NUM; i++) {
+		/* Spread over buckets 10..59, so no bucket is overflowed */
+		random_hashes[i] = ottery_rand_uint32() / TEST_BUCKETS * TEST_BUCKETS +
+						   10 + i % 50;
 	}
 
+	dir = g_dir_make_tmp("rspamd_statfile_XXXXXX", &err);
+	g_assert_no_error(err);
+	path = g_build_filename(dir, "test.stat", NULL);
+
 	/* Create new file */
-	g_assert (rspamd_mmaped_file_create (pool, TEST_FILENAME, 65535) != -1);
-	g_assert ((st = rspamd_mmaped_file_open (pool, TEST_FILENAME, 65535, FALSE)) != NULL);
-	
-	/* Get and set random blocks */
-	rspamd_mmaped_file_lock_file (pool, st);
-	for (i = 0; i < HASHES_NUM; i ++) {
-		rspamd_mmaped_file_set_block (pool, st, random_hashes[i], random_hashes[i], now, 1.0);
+	g_assert(rspamd_mmaped_file_create(path, TEST_SIZE, &stcf, p) != -1);
+	g_assert((st = rspamd_mmaped_file_open(p, path, TEST_SIZE, &stcf)) != NULL);
+
+	/*
+	 * Two buckets full of tokens of the same bucket: the second half
+	 * is placed to the next bucket
+	 */
+	for (i = 1; i <= TEST_BUCKET_SLOTS * 2; i++) {
+		h = i * TEST_BUCKETS + 5;
+		rspamd_mmaped_file_set_block(p, st, h, i);
+	}
+
+	for (i = 1; i <= TEST_BUCKET_SLOTS * 2; i++) {
+		h = i * TEST_BUCKETS + 5;
+		g_assert(rspamd_mmaped_file_get_block(st, h) == i);
 	}
-	rspamd_mmaped_file_unlock_file (pool, st);
 
-	for (i = 0; i < HASHES_NUM; i ++) {
-		v = rspamd_mmaped_file_get_block (pool, st, random_hashes[i], random_hashes[i], now);
-		g_assert(v == 1.0);
+	/* Update of an existing token */
+	h = (TEST_BUCKET_SLOTS + 1) * TEST_BUCKETS + 5;
+	rspamd_mmaped_file_set_block(p, st, h, 100500.0);
+	g_assert(rspamd_mmaped_file_get_block(st, h) == G_MAXUINT16);
+
+	/* Both buckets are full, so the token with the minimum value is expired */
+	h = (TEST_BUCKET_SLOTS * 2 + 1) * TEST_BUCKETS + 5;
+	rspamd_mmaped_file_set_block(p, st, h, 100);
+	g_assert(rspamd_mmaped_file_get_block(st, h) == 100);
+	g_assert(rspamd_mmaped_file_get_block(st, TEST_BUCKETS + 5) == 0);
+
+	for (i = 2; i <= TEST_BUCKET_SLOTS; i++) {
+		g_assert(rspamd_mmaped_file_get_block(st, i * TEST_BUCKETS + 5) == i);
 	}
 
-	rspamd_mmaped_file_destroy (pool);
-#endif
+	/* Random tokens */
+	for (i = 0; i < HASHES_NUM; i++) {
+		rspamd_mmaped_file_set_block(p, st, random_hashes[i], 1.0);
+	}
+
+	for (i = 0; i < HASHES_NUM; i++) {
+		g_assert(rspamd_mmaped_file_get_block(st, random_hashes[i]) == 1.0);
+	}
+
+	rspamd_mmaped_file_close_file(p, st);
+
+	/* Conversion of legacy files */
+	rspamd_statfile_test_cleanup(dir);
+	rspamd_statfile_test_legacy(p, &stcf, path);
+
+	rspamd_statfile_test_cleanup(dir);
+	rmdir(dir);
+	g_free(path);
+	g_free(dir);
+	rspamd_mempool_delete(p);
 }
@@ -81,12 +81,16 @@ int main(int argc, char **argv)
 	g_test_add_func("/rspamd/lua", rspamd_lua_test_func);
 	g_test_add_func("/rspamd/cryptobox", rspamd_cryptobox_test_func);
 	g_test_add_func("/rspamd/heap", rspamd_heap_test_func);
+	g_test_add_func("/rspamd/fuzzy_memory", rspamd_fuzzy_memory_test_func);
+	g_test_add_func("/rspamd/fuzzy_backend", rspamd_fuzzy_backend_test_func);
+	g_test_add_func("/rspamd/statfile", rspamd_statfile_test_func);
+	g_test_add_func("/rspamd/re_cache", rspamd_re_cache_test_func);
+	g_test_add_func("/rspamd/mime_boundary", rspamd_mime_boundary_test_func);
 	g_test_add_func("/rspamd/lua_pcall", rspamd_lua_lua_pcall_vs_resume_test_func);
 
 #if 0
 	g_test_add_func ("/rspamd/http", rspamd_http_test_func);
 	g_test_add_func ("/rspamd/url", rspamd_url_test_func);
-	g_test_add_func ("/rspamd/statfile", rspamd_statfile_test_func);
 	g_test_add_func ("/rspamd/aio", rspamd_async_test_func);
 #endif
 	g_test_run();
@@ -42,6 +42,14 @@ void rspamd_cryptobox_test_func(void);
 
 void rspamd_heap_test_func(void);
 
+void rspamd_fuzzy_memory_test_func(void);
+
+void rspamd_fuzzy_backend_test_func(void);
+
+void rspamd_re_cache_test_func(void);
+
+void rspamd_mime_boundary_test_func(void);
+
 void rspamd_lua_lua_pcall_vs_resume_test_func(void);
 
 #ifdef __cplusplus